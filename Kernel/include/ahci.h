@@ -283,6 +283,8 @@ typedef struct tagHBA_PRDT_ENTRY
 	uint32_t i:1;		// Interrupt on completion
 } __attribute__((packed)) hba_prdt_entry_t;
 
+#define AHCI_PRDT_ENTRIES 248 // Fills the rest of the page holding the command table
+
 typedef struct tagHBA_CMD_TBL
 {
 	// 0x00
@@ -295,10 +297,15 @@ typedef struct tagHBA_CMD_TBL
 	uint8_t  rsv[48];	// Reserved
  
 	// 0x80
-	hba_prdt_entry_t	prdt_entry[1];	// Physical region descriptor table entries, 0 ~ 65535
+	hba_prdt_entry_t	prdt_entry[AHCI_PRDT_ENTRIES];	// Physical region descriptor table entries, 0 ~ 65535
 } __attribute__((packed)) hba_cmd_tbl_t;
 
 #define AHCI_GHC_ENABLE (1 << 31)
+#define AHCI_GHC_IE (1 << 1) // Interrupt Enable
+
+#define AHCI_MAX_SLOTS 32
+#define AHCI_MAX_TRANSFER_PAGES 128 // Most pages transferred by one command (512KB)
+#define AHCI_BOUNCE_PAGES 8 // Bounce buffer of each command slot, for buffers that cannot be transferred to directly
 
 #define AHCI_CAP_S64A (1 << 31) // 64-bit addressing
 #define AHCI_CAP_NCQ (1 << 30) // Support for Native Command Queueing?
@@ -323,12 +330,24 @@ typedef struct tagHBA_CMD_TBL
 #define HBA_PxCMD_SUD	0x0002
 #define HBA_PxCMD_POD	0x0004
 #define HBA_PxCMD_FRE   0x0010
+#define HBA_PxCMD_CCS   (0x1f << 8) // Current Command Slot, the command that failed on an error
 #define HBA_PxCMD_FR    0x4000
 #define HBA_PxCMD_CR    0x8000
 #define HBA_PxCMD_ASP	0x4000000 // Aggressive Slumber/Partial
 #define HBA_PxCMD_ICC 	(0xf << 28)
 #define HBA_PxCMD_ICC_ACTIVE (1 << 28)
 
+#define HBA_PxIS_DHRS (1 << 0) // Device to Host Register FIS
+#define HBA_PxIS_PSS (1 << 1) // PIO Setup FIS
+#define HBA_PxIS_DSS (1 << 2) // DMA Setup FIS
+#define HBA_PxIS_SDBS (1 << 3) // Set Device Bits FIS, sent when queued commands complete
+#define HBA_PxIS_DPS (1 << 5) // Descriptor Processed
+#define HBA_PxIS_IFS (1 << 27) // Interface Fatal Error
+#define HBA_PxIS_HBDS (1 << 28) // Host Bus Data Error
+#define HBA_PxIS_HBFS (1 << 29) // Host Bus Fatal Error
+#define HBA_PxIS_TFES (1 << 30) // Task File Error
+#define HBA_PxIS_ERROR (HBA_PxIS_IFS | HBA_PxIS_HBDS | HBA_PxIS_HBFS | HBA_PxIS_TFES)
+
 #define HBA_PORT_IPM_ACTIVE 1
 
 #define HBA_PxSSTS_DET 0xfULL
@@ -351,26 +370,63 @@ namespace AHCI{
 		int ReadDiskBlock(uint64_t lba, uint32_t count, void* buffer);
 		int WriteDiskBlock(uint64_t lba, uint32_t count, void* buffer);
 
+		// Complete finished commands, called from the controller interrupt handler
+		// Interrupts must be disabled
+		void HandleInterrupt();
+
         int blocksize = 512;
 		AHCIStatus status = AHCIStatus::Uninitialized;
 	private:
-		int FindCmdSlot();
-		int Access(uint64_t lba, uint32_t count, int write);
-		void Identify();
+		// A command issued on a slot, lives on the stack of the thread waiting for it
+		struct Request : public Scheduler::ThreadBlocker {
+			thread_t* thread = nullptr;
+			volatile bool done = false;
+			int status = 0;
+
+			// The port lock is held whenever these are called
+			void Block(thread_t* th) final { thread = th; }
+			void Remove(thread_t*) final {} // DMA may still be in progress, the thread has to wait for completion regardless
+		};
+
+		// Split a transfer into commands, going through the bounce buffer of the slot if the buffer cannot be DMAed into
+		int Transfer(uint64_t lba, uint32_t size, uint8_t* buffer, bool write);
+		// Issue a command for size bytes on a free slot and wait for it to complete
+		int Issue(uint64_t lba, uint32_t size, uint8_t* buffer, bool write, bool bounce);
+		// Fill the PRDT of a slot, returns the amount of entries used
+		int BuildPRDT(hba_cmd_tbl_t* commandTable, uint8_t* buffer, uint32_t size);
+		// Fill in the command header, table and FIS of a slot
+		void SetupCommand(int slot, uint8_t command, uint64_t lba, uint16_t count, uint8_t* buffer, uint32_t size, bool write);
+		// Issue the command in a slot and spin until it completes, for when interrupts cannot be used
+		// Gives up after a while, a slot that fails is cleared by restarting the command engine
+		int IssuePolled(int slot);
+		void Complete(int slot, int status);
+		// Read the NCQ error log so the device accepts commands again, the port lock must be held
+		// Returns the slot of the command that failed, or -1 if it is not known
+		int RecoverQueue();
+		void Identify(bool hbaNCQ);
 
 		hba_port_t* registers;
 
 		hba_cmd_header_t* commandList; // Address Mapping of the Command List
 		hba_fis_t* fis; // Address Mapping of the FIS
 
-		hba_cmd_tbl_t* commandTables[8];
+		hba_cmd_tbl_t* commandTables[AHCI_MAX_SLOTS];
+		uint8_t* bounceBuffers[AHCI_MAX_SLOTS];
+		Request* requests[AHCI_MAX_SLOTS] = {nullptr}; // Request issued on each slot
 
-		uint64_t bufPhys;
-		void* bufVirt;
+		int slotCount = 1;
+		bool ncq = false; // Commands are queued with READ/WRITE FPDMA QUEUED
+		int recoverySlot = -1; // Never handed out with NCQ, the error log is read through it
+		uint32_t freeSlots = 0;
+		uint32_t activeSlots = 0; // Issued and not yet completed
 
-		Semaphore portLock = Semaphore(1); // Binary semaphore for the port
+		lock_t portLock = 0; // Only ever held with interrupts disabled
+		Semaphore slotSemaphore = Semaphore(0); // Counts free slots
 	};
 
+	extern Port* ports[32];
+	extern bool pollCompletions; // No interrupt vector, waiters poll the port instead
+
 	int Init();
 
 	inline void startCMD(hba_port_t *port)
@@ -2,9 +2,17 @@
 
 #include <device.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <tss.h>
 #include <scheduler.h>
 #include <list.h>
+#include <runqueue.h>
+#include <timerqueue.h>
+#include <physicalallocator.h>
+#include <slab.h>
+
+#define CPU_LOAD_SHIFT 10
+#define CPU_LOAD_SCALE (1U << CPU_LOAD_SHIFT) // Load of one runnable thread
 
 typedef struct {
 	uint16_t limit;
@@ -18,8 +26,26 @@ struct CPU{
 	gdt_ptr_t gdtPtr;
 	thread_t* currentThread = nullptr;
 	process_t* idleProcess = nullptr;
-	volatile int runQueueLock = 0;
-	FastList<thread_t*>* runQueue;
+	volatile int runQueueLock = 0; // Only ever held with interrupts disabled
+	RunQueue* runQueue;
+
+	uint64_t lastTick = 0; // Tick count the load averages were last updated at
+	uint64_t lastBalance = 0; // Tick count of the last load balancing pass
+	unsigned load = 0; // Decaying average of runnable threads (CPU_LOAD_SCALE per thread)
+	unsigned utilisation = 0; // Decaying average of time spent busy (CPU_LOAD_SCALE when always busy)
+
+	volatile int timerLock = 0; // Only ever held with interrupts disabled
+	TimerQueue* timers;
+	uint64_t nextTick = 0; // Uptime in ns of the next scheduler tick, 0 when the CPU is not ticking
+	uint64_t timerDeadline = 0; // Uptime in ns the local APIC timer is programmed for, 0 when stopped
+
+	uint64_t pageCache[PHYSALLOC_CPU_CACHE_SIZE]; // Free physical blocks, only touched by this CPU with interrupts disabled
+	unsigned pageCacheCount = 0;
+	volatile uint64_t pageCacheDrainGeneration = 0; // Last request to give back pageCache this CPU has answered
+
+	volatile uint64_t tlbGeneration = 0; // Last TLB shootdown this CPU has flushed for
+
+	SlabMagazine slabMagazines[SLAB_MAX_CACHES]; // Free objects of each slab cache, only touched by this CPU with interrupts disabled
     tss_t tss __attribute__((aligned(16))); 
 };
 
@@ -46,6 +72,7 @@ enum {
 	CPUID_ECX_x2APIC = 1 << 21,
 	CPUID_ECX_MOVBE = 1 << 22,
 	CPUID_ECX_POPCNT = 1 << 23,
+	CPUID_ECX_TSC_DEADLINE = 1 << 24,
 	CPUID_ECX_AES = 1 << 25,
 	CPUID_ECX_XSAVE = 1 << 26,
 	CPUID_ECX_OSXSAVE = 1 << 27,
@@ -105,6 +132,14 @@ static inline CPU* GetCPULocal(){
 	return ret;
 }
 
+// Threads can migrate between CPUs when preempted,
+// so read the current thread with a single GS relative load rather than through GetCPULocal()
+static inline thread_t* GetCurrentThread(){
+	thread_t* ret;
+	asm volatile("swapgs; movq %%gs:%c1, %0; swapgs;" : "=r"(ret) : "i"(offsetof(CPU, currentThread)));
+	return ret;
+}
+
 static inline int CheckInterrupts()
 {
     unsigned long flags;
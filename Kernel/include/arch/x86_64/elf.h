@@ -48,6 +48,8 @@ typedef struct {
 #define PT_PHDR 6
 
 typedef struct process process_t;
+class FsNode;
 
 int VerifyELF(void* elf);
-elf_info_t LoadELFSegments(process_t* proc, void* elf, uintptr_t base);
\ No newline at end of file
+// Map the loadable segments of an ELF file into a process, most pages are mapped from the file and read in on first access
+elf_info_t LoadELFSegments(process_t* proc, FsNode* node, uintptr_t base);
\ No newline at end of file
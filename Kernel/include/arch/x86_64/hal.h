@@ -12,6 +12,7 @@ namespace HAL{
     extern bool debugMode;
     extern bool disableSMP;
     extern bool useKCon;
+    extern bool runBenchmarks;
 
     void InitCore(multiboot2_info_header_t* mb_info);
 
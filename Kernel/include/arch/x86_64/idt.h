@@ -7,6 +7,9 @@
 
 #define IPI_HALT 0xFE
 #define IPI_SCHEDULE 0xFD
+#define LAPIC_TIMER 0xFC // Local APIC timer
+#define IPI_TLB_FLUSH 0xFB
+#define IPI_PAGE_CACHE_DRAIN 0xFA
 
 typedef struct {
 	uint16_t base_low;
@@ -7,4 +7,5 @@
 typedef struct {
     uint64_t base;
     uint64_t pageCount;
+    uint64_t key; // Shared memory mapped here, 0 if none
 } mem_region_t;
\ No newline at end of file
@@ -33,8 +33,16 @@
 #define PAGE_USER (1 << 2)
 #define PAGE_WRITETHROUGH (1 << 3)
 #define PAGE_CACHE_DISABLED (1 << 4)
+#define PAGE_DIRTY (1 << 6)
 #define PAGE_FRAME 0xFFFFFFFFFF000
 
+// Bits 9-11 are ignored by the CPU and used by the kernel
+#define PAGE_LAZY (1 << 9) // Not present yet, a zeroed block gets allocated on first access
+#define PAGE_COW (1 << 10) // Read only copy of a block shared with another address space, copied on the first write
+#define PAGE_SHARED (1 << 11) // Memory owned elsewhere (shared memory, MMIO), never copied or freed with the address space
+// Bits 52-62 are ignored by the CPU as well
+#define PAGE_FILE (1ULL << 52) // Belongs to a file mapping, read in from the page cache on first access while also lazy
+
 #define PAGE_SIZE_4K 4096
 #define PAGE_SIZE_2M 0x200000
 #define PAGE_SIZE_1G 0x40000000ULL
@@ -61,6 +69,19 @@ using page_dir_t = pd_entry_t[TABLES_PER_DIR];
 using pdpt_t = pdpt_entry_t[DIRS_PER_PDPT];
 using pml4_t = pml4_entry_t[PDPTS_PER_PML4];
 
+class FsNode;
+struct fs_fd;
+
+// Pages of a file mapped into an address space
+struct FileMapping{
+    uintptr_t base;
+    uint64_t pageCount;
+    uint64_t offset; // Page aligned offset into the file
+    struct fs_fd* handle; // Keeps the file open for as long as it is mapped
+    bool shared; // Changes are written back to the file, otherwise pages are copied on write
+    FileMapping* next;
+};
+
 typedef struct{ // Each process will have a maximum of 96GB of virtual memory.
     pdpt_entry_t* pdpt; // 512GB is more than ample
     pd_entry_t** pageDirs;//[64]; // 64 GB is enough
@@ -69,6 +90,8 @@ typedef struct{ // Each process will have a maximum of 96GB of virtual memory.
     pml4_entry_t* pml4;
     uint64_t pdptPhys;
     uint64_t pml4Phys;
+    volatile int lock; // Held whilst resolving page faults, only ever held with interrupts disabled
+    FileMapping* fileMappings; // Protected by lock
 } __attribute__((packed)) address_space_t;
 
 namespace Memory{
@@ -76,6 +99,10 @@ namespace Memory{
     
     void DestroyAddressSpace(address_space_t* addressSpace);
 
+    // Create a copy of an address space, private pages are shared copy on write between both address spaces
+    // and pages marked PAGE_SHARED stay shared. Interrupts must be enabled.
+    address_space_t* CloneAddressSpace(address_space_t* addressSpace);
+
     void InitializeVirtualMemory();
 
     void* AllocateVirtualMemory(uint64_t size);
@@ -103,6 +130,31 @@ namespace Memory{
     void KernelMapVirtualMemory4K(uint64_t phys, uint64_t virt, uint64_t amount);
     void KernelMapVirtualMemory4K(uint64_t phys, uint64_t virt, uint64_t amount, uint64_t flags);
     void MapVirtualMemory4K(uint64_t phys, uint64_t virt, uint64_t amount, address_space_t* addressSpace);
+    void MapVirtualMemory4K(uint64_t phys, uint64_t virt, uint64_t amount, uint64_t flags, address_space_t* addressSpace);
+
+    // Reserve pages to be allocated on first access, pages that are already mapped are left alone
+    void MapLazyVirtualMemory4K(uint64_t virt, uint64_t amount, address_space_t* addressSpace);
+
+    // Map amount pages of a file at offset (page aligned) to virt, each page is taken from the page cache on first access
+    // Shared mappings map the cached page itself, private mappings copy it on the first write
+    void MapFile(FsNode* node, uint64_t offset, uint64_t virt, uint64_t amount, bool writable, bool shared, address_space_t* addressSpace);
+    // Unmap the pages of file mappings within a range, changes to shared mappings are handed to the page cache to be written back
+    // Returns false if no file mapping was in the range. Interrupts must be enabled.
+    bool UnmapFile(uint64_t virt, uint64_t amount, address_space_t* addressSpace);
+    // Unmap every file mapping of an address space that is about to be destroyed
+    void ReleaseFileMappings(address_space_t* addressSpace);
+
+    // Take a reference to the block behind each of amount pages at virt so they can be handed to another address space,
+    // writable pages become copy on write. Only present, private, anonymous pages can be lent,
+    // returns false without taking any reference otherwise. Interrupts must be enabled.
+    bool LendPages(uint64_t virt, uint64_t amount, uint64_t* blocks, address_space_t* addressSpace);
+    // Map lent blocks copy on write over amount pages at virt, taking a reference to each and freeing whatever was mapped there
+    // The pages must be writable private memory, returns false without changing anything otherwise. Interrupts must be enabled.
+    bool MapLentPages(uint64_t virt, uint64_t amount, const uint64_t* blocks, address_space_t* addressSpace);
+
+    // Flush the TLB of every other CPU, if wait is set do not return until they all have
+    // Interrupts must be enabled to wait
+    void FlushOtherTLBs(bool wait);
 
     uintptr_t GetIOMapping(uintptr_t addr);
 
@@ -112,6 +164,8 @@ namespace Memory{
 	bool CheckUsermodePointer(uintptr_t addr, uint64_t len, address_space_t* addressSpace);
     uint64_t VirtualToPhysicalAddress(uint64_t addr);
     uint64_t VirtualToPhysicalAddress(uint64_t addr, address_space_t* addressSpace);
+    // Page table entry of a user address, 0 if there is no page table for it
+    uint64_t GetPageEntry(uint64_t addr, address_space_t* addressSpace);
 
     void SwitchPageDirectory(uint64_t phys);
     
@@ -64,6 +64,14 @@
 #define PCI_CAP_MSI_CONTROL_MMC(x) ((x >> 1) & 0x7) // Multiple Message Capable
 #define PCI_CAP_MSI_CONTROL_ENABLE (1 << 0) // MSI Enable
 
+#define PCI_CAP_MSIX_CONTROL_TABLE_SIZE(x) ((x & 0x7FF) + 1) // Number of table entries
+#define PCI_CAP_MSIX_CONTROL_FUNCTION_MASK (1 << 14) // Mask all vectors
+#define PCI_CAP_MSIX_CONTROL_ENABLE (1 << 15) // MSI-X Enable
+#define PCI_CAP_MSIX_BIR(x) (x & 0x7) // BAR containing the table
+#define PCI_CAP_MSIX_OFFSET(x) (x & ~0x7U) // Offset of the table into the BAR
+
+#define PCI_MSIX_ENTRY_MASKED (1 << 0) // Vector control
+
 enum PCIConfigRegisters{
 	PCIDeviceID = 0x2,
 	PCIVendorID = 0x0,
@@ -96,6 +104,7 @@ enum PCIConfigRegisters{
 
 enum PCICapabilityIDs{
 	PCICapMSI = 0x5,
+	PCICapMSIX = 0x11,
 };
 
 enum PCIVectors{
@@ -145,10 +154,17 @@ struct PCIMSICapability{
 	}
 
 	inline void SetAddress(int cpu){
-		addressLow = 0xFEE00000 | static_cast<uint32_t>(cpu);
+		addressLow = 0xFEE00000 | (static_cast<uint32_t>(cpu) << 12); // Destination APIC ID
 	}
 };
 
+struct PCIMSIXEntry{
+	uint32_t addressLow;
+	uint32_t addressHigh;
+	uint32_t data;
+	uint32_t vectorControl;
+} __attribute__((packed));
+
 class PCIDevice;
 namespace PCI{
 	enum PCIConfigurationAccessMode {
@@ -161,6 +177,7 @@ namespace PCI{
 	uint32_t ConfigReadDword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
 
 	uint16_t ConfigReadWord(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
+	void ConfigWriteDword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t data);
 	void ConfigWriteWord(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint16_t data);
 
 	uint8_t ConfigReadByte(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
@@ -194,12 +211,15 @@ public:
 	PCIMSICapability msiCap;
 	bool msiCapable = false;
 
+	uint8_t msixPtr;
+	bool msixCapable = false;
+
 	inline uintptr_t GetBaseAddressRegister(uint8_t idx){
 		assert(idx >= 0 && idx <= 5);
 
 		uintptr_t bar = PCI::ConfigReadDword(bus, slot, func, PCIBAR0 + (idx * sizeof(uint32_t)));
 		if(!(bar & 0x1) /* Not MMIO */ && bar & 0x4 /* 64-bit */ && idx < 5){
-			bar |= static_cast<uintptr_t>(PCI::ConfigReadDword(bus, slot, func, PCIBAR0 + ((bar + 1) * sizeof(uint32_t)))) << 32;
+			bar |= static_cast<uintptr_t>(PCI::ConfigReadDword(bus, slot, func, PCIBAR0 + ((idx + 1) * sizeof(uint32_t)))) << 32;
 		}
 
 		return (bar & 0x1) ? (bar & 0xFFFFFFFFFFFFFFFC) : (bar & 0xFFFFFFFFFFFFFFF0);
@@ -247,4 +267,10 @@ public:
 	}
 
 	uint8_t AllocateVector(PCIVectors type);
+
+	// Number of MSI-X vectors the device supports, 0 if not MSI-X capable
+	unsigned MSIXVectorCount();
+	// Reserve an interrupt and route MSI-X table entry to the local APIC of cpu, enabling MSI-X
+	// Returns 0xFF on failure
+	uint8_t AllocateMSIXVector(unsigned entry, uint8_t cpu);
 };
\ No newline at end of file
@@ -13,13 +13,38 @@
 // The size of the memory bitmap in dwords
 #define PHYSALLOC_BITMAP_SIZE_DWORDS 524488 // 64GB
 
+// Blocks are handed out by a buddy allocator, the largest buddy is 2^PHYSALLOC_MAX_ORDER blocks (2MB)
+#define PHYSALLOC_MAX_ORDER 9
+#define PHYSALLOC_LARGE_BLOCK_COUNT (1 << PHYSALLOC_MAX_ORDER)
+// Amount of blocks tracked, rounded down so every buddy below the largest order has its pair
+#define PHYSALLOC_MAX_BLOCKS ((PHYSALLOC_BITMAP_SIZE_DWORDS * 32ULL) & ~(PHYSALLOC_LARGE_BLOCK_COUNT - 1ULL))
+
+// Free blocks cached by each CPU in front of the buddy allocator
+#define PHYSALLOC_CPU_CACHE_SIZE 64
+// Blocks moved between a CPU cache and the buddy allocator at once
+#define PHYSALLOC_CPU_CACHE_BATCH 32
+
+// Share counts are kept in pages allocated the first time a block in their range is shared
+#define PHYSALLOC_SHARE_COUNTS_PER_PAGE (PHYSALLOC_BLOCK_SIZE / sizeof(uint16_t))
+
+// Caches that can give memory back when the allocator runs out
+#define PHYSALLOC_MAX_RECLAIMERS 4
+// Blocks asked of each reclaimer at once
+#define PHYSALLOC_RECLAIM_BATCH 64
+
 extern void* kernel_end;
 
 namespace Memory{
+    // Frees up to count blocks that are only being used as a cache, returns the amount freed
+    // Called from whichever allocation ran out of memory (possibly with locks held), so it must not block or spin on locks
+    typedef size_t (*reclaimer_t)(size_t count);
 
     // Initialize the physical page allocator
     void InitializePhysicalAllocator(memory_info_t* mem_info);
 
+    // Start using the per-CPU block caches, CPU local data must be set up on every CPU that allocates from here on
+    void EnableCPUPageCaches();
+
     // Finds the first free block in physical memory
     uint64_t GetFirstFreeMemoryBlock();
 
@@ -32,13 +57,39 @@ namespace Memory{
     // Allocates a block of physical memory
     uint64_t AllocatePhysicalMemoryBlock();
 
-    // Allocates a 2MB block of physical memory
+    // Allocates a 2MB aligned, 2MB block of physical memory
+    // Returns 0 if there is no free 2MB block
     uint64_t AllocateLargePhysicalMemoryBlock();
 
+    // Allocates count physically contiguous blocks, count must not exceed PHYSALLOC_LARGE_BLOCK_COUNT
+    // Returns 0 if there is no large enough free region
+    uint64_t AllocateContiguousPhysicalMemory(size_t count);
+
     // Frees a block of physical memory
+    // If the block has been shared, drops one reference instead
     void FreePhysicalMemoryBlock(uint64_t addr);
 
+    // Take another reference to a block, the block is only freed once FreePhysicalMemoryBlock has been called for every reference
+    void SharePhysicalMemoryBlock(uint64_t addr);
+
+    // Whether more than one reference to a block is held
+    bool IsPhysicalMemoryBlockShared(uint64_t addr);
+
+    // Frees count contiguous blocks of physical memory
+    void FreeContiguousPhysicalMemory(uint64_t addr, size_t count);
+
+    // Frees a 2MB block of physical memory
+    void FreeLargePhysicalMemoryBlock(uint64_t addr);
+
+    // Register a cache to be shrunk before giving up on an allocation
+    void RegisterReclaimer(reclaimer_t reclaimer);
+
     // Used Blocks of Memory
     extern uint64_t usedPhysicalBlocks;
     extern uint64_t maxPhysicalBlocks;
+
+    // Blocks that are not allocated
+    inline uint64_t FreePhysicalBlocks(){
+        return maxPhysicalBlocks - usedPhysicalBlocks;
+    }
 }
\ No newline at end of file
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <stdint.h>
+#include <list.h>
+#include <thread.h>
+
+#define SCHEDULER_PRIORITY_LEVELS 32 // One bit in the run queue bitmap per priority level
+
+// Per-CPU queue of runnable threads, one FIFO for each priority level.
+// Priority 0 is the most urgent, threads above the last level share the last level.
+// Blocked threads are never kept here, they are placed back on a run queue by Scheduler::UnblockThread
+class RunQueue {
+	uint32_t bitmap = 0; // Bit n is set when queues[n] is not empty
+	unsigned count = 0;
+
+	FastList<thread_t*> queues[SCHEDULER_PRIORITY_LEVELS];
+public:
+	static inline unsigned PriorityLevel(thread_t* thread){
+		return (thread->priority < SCHEDULER_PRIORITY_LEVELS) ? thread->priority : (SCHEDULER_PRIORITY_LEVELS - 1);
+	}
+
+	void Enqueue(thread_t* thread){
+		unsigned level = PriorityLevel(thread);
+
+		queues[level].add_back(thread);
+		bitmap |= (1U << level);
+		count++;
+	}
+
+	// Remove and return the most urgent thread, nullptr if the queue is empty
+	thread_t* Dequeue(){
+		if(!bitmap){
+			return nullptr;
+		}
+
+		unsigned level = __builtin_ctz(bitmap);
+		thread_t* thread = queues[level].remove_at(0);
+
+		if(!queues[level].get_length()){
+			bitmap &= ~(1U << level);
+		}
+
+		count--;
+		return thread;
+	}
+
+	// Remove the queued thread with the highest score, nullptr if the queue is empty
+	template<typename F>
+	thread_t* RemoveBest(F score){
+		thread_t* best = nullptr;
+		uint64_t bestScore = 0;
+
+		for(unsigned i = 0; i < SCHEDULER_PRIORITY_LEVELS; i++){
+			thread_t* thread = queues[i].get_front();
+			for(unsigned j = 0; j < queues[i].get_length(); j++, thread = thread->next){
+				uint64_t s = score(thread);
+				if(!best || s > bestScore){
+					best = thread;
+					bestScore = s;
+				}
+			}
+		}
+
+		if(best){
+			Remove(best);
+		}
+
+		return best;
+	}
+
+	void Remove(thread_t* thread){
+		unsigned level = PriorityLevel(thread);
+
+		queues[level].remove(thread);
+		thread->next = thread->prev = nullptr;
+
+		if(!queues[level].get_length()){
+			bitmap &= ~(1U << level);
+		}
+
+		count--;
+	}
+
+	// Priority level of the most urgent queued thread, SCHEDULER_PRIORITY_LEVELS if the queue is empty
+	inline unsigned HighestPriority() const {
+		return bitmap ? __builtin_ctz(bitmap) : SCHEDULER_PRIORITY_LEVELS;
+	}
+
+	inline unsigned get_length() const {
+		return count;
+	}
+
+	void clear(){
+		for(unsigned i = 0; i < SCHEDULER_PRIORITY_LEVELS; i++){
+			queues[i].clear();
+		}
+
+		bitmap = 0;
+		count = 0;
+	}
+};
@@ -9,7 +9,6 @@
 #include <fs/filesystem.h>
 #include <lock.h>
 #include <timer.h>
-#include <hash.h>
 
 #include <thread.h>
 
@@ -51,7 +50,6 @@ typedef struct process {
 	Vector<fs_fd_t*> fileDescriptors;
 	List<message_t> messageQueue;
 	List<thread_t*> blocking; // Threads blocking awaiting a state change
-	HashMap<uintptr_t, Scheduler::FutexThreadBlocker*> futexWaitQueue;
 } process_t;
 
 typedef struct {
@@ -74,7 +72,7 @@ namespace Scheduler{
     pid_t CreateChildThread(process_t* process, uintptr_t entry, uintptr_t stack);
 
     process_t* CreateProcess(void* entry);
-	process_t* CreateELFProcess(void* elf, int argc = 0, char** argv = nullptr, int envc = 0, char** envp = nullptr);
+	process_t* CreateELFProcess(FsNode* node, int argc = 0, char** argv = nullptr, int envc = 0, char** envp = nullptr);
 
 	process_t* GetCurrentProcess();
 
@@ -94,6 +92,7 @@ namespace Scheduler{
 
     void Initialize();
     void Tick(regs64_t* r);
+    unsigned DecayIdleAverage(CPU* cpu, unsigned average);
 
 	void EndProcess(process_t* process);
 }
\ No newline at end of file
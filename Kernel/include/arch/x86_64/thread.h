@@ -10,10 +10,12 @@ enum {
 	ThreadStateRunning,
 	ThreadStateBlocked,
 	ThreadStateZombie,
+	ThreadStateDying, // Process has been torn down, never schedule again
 };
 
 struct process;
 struct thread;
+struct CPU;
 
 typedef struct thread {
 	lock_t lock = 0; // Thread lock
@@ -30,8 +32,13 @@ typedef struct thread {
 
 	thread* next; // Next thread in queue
 	thread* prev; // Previous thread in queue
+	CPU* cpu = nullptr; // CPU the thread is running or queued on, nullptr when blocked and switched out
+	CPU* lastCPU = nullptr; // CPU the thread last ran on
+
+	uint32_t recentTicks = 0; // Ticks spent running recently, halved every SCHEDULER_DECAY_TICKS
+	uint64_t recentTicksStamp = 0; // Tick count recentTicks was last decayed at
 	
-	uint8_t priority = 0; // Thread priority
+	uint8_t priority = 0; // Thread priority, lower is more urgent
 	uint8_t state; // Thread state
 
 	uint64_t fsBase = 0;
@@ -66,11 +73,12 @@ namespace Scheduler{
 		}
 	};
 
-	using FutexThreadBlocker = GenericThreadBlocker;
-
 	void BlockCurrentThread(ThreadBlocker& blocker);
 	void BlockCurrentThread(List<thread_t*>& list);
 	void BlockCurrentThread(ThreadBlocker& blocker, lock_t& lock);
 	void BlockCurrentThread(List<thread_t*>& list, lock_t& lock);
+	// lock must already be held with interrupts disabled so the caller can check its wake condition
+	// without missing a wake up, releases lock and enables interrupts before switching away
+	void BlockCurrentThreadLocked(ThreadBlocker& blocker, lock_t& lock);
 	void UnblockThread(thread_t* thread);
 }
\ No newline at end of file
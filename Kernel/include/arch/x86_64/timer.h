@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <spin.h>
 #include <bits/ansi/time_t.h>
 
 typedef struct {
@@ -18,6 +19,11 @@ typedef struct timespec {
 } timespec_t;
 
 struct thread;
+struct CPU;
+
+namespace Scheduler{
+    class ThreadBlocker;
+}
 
 namespace Timer{
 
@@ -25,13 +31,30 @@ namespace Timer{
     int TimeDifference(timeval_t newTime, timeval_t oldTime);
 
     uint64_t GetSystemUptime();
+    uint64_t GetSystemUptimeNs();
     uint32_t GetTicks();
+    uint64_t GetTicksSinceBoot();
     uint32_t GetFrequency();
 
     void Wait(long ms);
 
     void SleepCurrentThread(timeval_t& time);
     void SleepCurrentThread(long ticks);
+    void SleepCurrentThreadUntil(uint64_t deadline);
+
+    // Block on blocker until woken or until the deadline (system uptime in nanoseconds) passes
+    // Returns true if the deadline passed, in which case the thread is left for the caller to remove from blocker
+    bool BlockCurrentThreadUntil(uint64_t deadline, Scheduler::ThreadBlocker& blocker, lock_t& lock);
+    // Same as above but lock must already be held with interrupts disabled, see Scheduler::BlockCurrentThreadLocked
+    bool BlockCurrentThreadUntilLocked(uint64_t deadline, Scheduler::ThreadBlocker& blocker, lock_t& lock);
+
+    // Program the local APIC timer of this CPU for its next timer,
+    // and for its next scheduler tick if it has threads to time slice
+    // Interrupts must be disabled
+    void UpdateTimerInterrupt(bool tick);
+
+    // Start the local APIC timer of this CPU
+    void InitializeLocalTimer();
 
     // Initialize
     void Initialize(uint32_t freq);
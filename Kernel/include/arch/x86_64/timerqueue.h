@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stdint.h>
+#include <memory.h>
+
+struct thread;
+struct CPU;
+
+// A one shot timer that unblocks a thread once its deadline passes
+struct TimerEvent {
+	uint64_t deadline = 0; // System uptime in nanoseconds
+	struct thread* thread = nullptr; // Thread to unblock
+	CPU* volatile cpu = nullptr; // CPU the timer is queued on, nullptr once fired or cancelled
+	unsigned index = 0; // Position in the timer queue
+	volatile bool firing = false; // Taken off the queue by the handler, cpu is cleared once the thread has been woken
+	TimerEvent* next = nullptr; // Fired timers the handler is yet to wake
+};
+
+// Per-CPU binary min heap of timers, the earliest deadline is always at the root
+class TimerQueue {
+	TimerEvent** events = nullptr;
+	unsigned count = 0;
+	unsigned capacity = 0;
+
+	inline void Swap(unsigned a, unsigned b){
+		TimerEvent* temp = events[a];
+		events[a] = events[b];
+		events[b] = temp;
+
+		events[a]->index = a;
+		events[b]->index = b;
+	}
+
+	void SiftUp(unsigned i){
+		while(i > 0 && events[i]->deadline < events[(i - 1) / 2]->deadline){
+			Swap(i, (i - 1) / 2);
+			i = (i - 1) / 2;
+		}
+	}
+
+	void SiftDown(unsigned i){
+		for(;;){
+			unsigned smallest = i;
+			unsigned left = i * 2 + 1;
+			unsigned right = i * 2 + 2;
+
+			if(left < count && events[left]->deadline < events[smallest]->deadline){
+				smallest = left;
+			}
+			if(right < count && events[right]->deadline < events[smallest]->deadline){
+				smallest = right;
+			}
+
+			if(smallest == i){
+				return;
+			}
+
+			Swap(i, smallest);
+			i = smallest;
+		}
+	}
+public:
+	void Insert(TimerEvent* event){
+		if(count >= capacity){
+			capacity = capacity ? capacity * 2 : 16;
+
+			TimerEvent** oldEvents = events;
+			events = new TimerEvent*[capacity];
+			if(oldEvents){
+				memcpy(events, oldEvents, count * sizeof(TimerEvent*));
+				delete[] oldEvents;
+			}
+		}
+
+		event->index = count;
+		events[count++] = event;
+		SiftUp(event->index);
+	}
+
+	void Remove(TimerEvent* event){
+		unsigned i = event->index;
+		if(i != --count){
+			Swap(i, count);
+
+			SiftDown(i);
+			SiftUp(i);
+		}
+	}
+
+	// Timer with the earliest deadline, nullptr if the queue is empty
+	inline TimerEvent* Earliest() const {
+		return count ? events[0] : nullptr;
+	}
+
+	inline unsigned get_length() const {
+		return count;
+	}
+};
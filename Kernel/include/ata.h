@@ -36,6 +36,13 @@
 #define ATA_CMD_READ_DMA_EX     0x25
 #define ATA_CMD_WRITE_DMA_EX    0x35
 #define ATA_CMD_IDENTIFY        0xec
+#define ATA_CMD_READ_LOG_EX     0x2f
+#define ATA_CMD_READ_FPDMA_QUEUED 0x60 // Native Command Queueing
+#define ATA_CMD_WRITE_FPDMA_QUEUED 0x61
+
+#define ATA_LOG_NCQ_ERROR 0x10 // Reading the log clears the error state of the device after a queued command fails
+#define ATA_LOG_NCQ_ERROR_NQ 0x80 // Set in the first byte of the log if the failed command was not queued, otherwise it holds the tag
+#define ATA_LOG_NCQ_ERROR_TAG 0x1f
 
 #define ATA_PRD_BUFFER(x) (x & 0xFFFFFFFF)
 #define ATA_PRD_TRANSFER_SIZE(x) ((x & 0xFFFFULL) << 32)
@@ -0,0 +1,19 @@
+#pragma once
+
+// Kernel micro-benchmarks, run at boot when the kernel command line contains "bench".
+// Results are written to the kernel log.
+namespace Benchmark{
+    void RunAll();
+
+    // Compares HashMap against the chained hash map it replaced
+    void HashMapBenchmark();
+
+    // Sequential reads from the first disk, one block per request (as ext2 used to read files) against coalesced requests
+    void SequentialReadBenchmark();
+
+    // Random block reads from the first disk, bypassing the page cache, reporting IOPS and latency percentiles
+    void RandomReadBenchmark();
+
+    // Throughput and round trip latency of a pair of connected UNIX stream sockets, with a kernel thread on the other end
+    void SocketPairBenchmark();
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <lock.h>
+
+#define BLOCK_MAX_MERGE_SIZE (512 * 1024) // Largest driver request made out of adjacent requests
+#define BLOCK_READ_EXPIRE 50000000ULL // Reads waiting this long (ns) are dispatched ahead of the elevator
+#define BLOCK_WRITE_EXPIRE 500000000ULL
+
+class DiskDevice;
+class BlockQueue;
+
+// A read or write of a disk, owned by whoever submitted it until it completes
+struct BlockRequest {
+    uint64_t lba;
+    uint32_t size; // In bytes
+    uint8_t* buffer;
+    bool write;
+
+    BlockQueue* queue = nullptr;
+    uint64_t submitted = 0; // Uptime in ns
+    uint64_t deadline = 0;
+
+    volatile bool done = false;
+    int status = 0;
+
+    BlockRequest* next = nullptr; // Pending list or plug
+
+    BlockRequest() = default;
+    BlockRequest(uint64_t lba, uint32_t size, void* buffer, bool write) : lba(lba), size(size), buffer(reinterpret_cast<uint8_t*>(buffer)), write(write) {}
+
+    // Wait for the request to complete, returns 0 on success
+    int Wait();
+};
+
+// Requests submitted with a plug are held back and queued all at once on Unplug,
+// so that a batch from one caller is sorted and merged before any of it is dispatched
+struct BlockPlug {
+    BlockRequest* requests = nullptr;
+
+    void Unplug();
+
+    ~BlockPlug(){
+        Unplug();
+    }
+};
+
+// Request queue of a disk, sitting between filesystems and the driver.
+// Pending requests are kept sorted by LBA and dispatched in one direction across the disk (C-SCAN),
+// unless one has waited past its deadline. Runs of adjacent requests in the same direction are merged
+// into one driver request. There is no dispatch thread, threads waiting for a request dispatch
+// pending ones themselves whilst the disk has fewer than queueDepth requests in flight.
+class BlockQueue {
+    friend struct BlockPlug;
+public:
+    struct Statistics {
+        uint64_t requests;
+        uint64_t completed;
+        uint64_t merged; // Requests dispatched as part of another
+        uint64_t dispatched; // Driver requests
+        uint64_t expired; // Dispatched because their deadline passed
+        uint64_t totalLatency; // Submission to completion in ns
+        uint64_t maxLatency;
+        uint64_t depthSum; // Requests queued or in flight at each submission
+        unsigned maxDepth;
+        unsigned pending;
+        unsigned inFlight;
+    };
+
+    BlockQueue(DiskDevice* disk);
+
+    // Queue a request, held in plug if given
+    void Submit(BlockRequest* request, BlockPlug* plug = nullptr);
+    // Dispatch pending requests until request is complete
+    int Wait(BlockRequest* request);
+
+    int Read(uint64_t lba, uint32_t size, void* buffer);
+    int Write(uint64_t lba, uint32_t size, void* buffer);
+
+    Statistics GetStatistics();
+
+    inline DiskDevice* GetDisk() { return disk; }
+
+    BlockQueue* nextQueue = nullptr; // List of every queue for /dev/blockstat
+private:
+    // Add a request to the pending list, the queue lock must be held
+    void Insert(BlockRequest* request);
+    // Take the next request to dispatch and any adjacent requests that can be merged with it off the pending list,
+    // returned linked through next. The queue lock must be held.
+    BlockRequest* NextBatch();
+    // Carry out a batch as one driver request, called without the queue lock and returns with it held
+    void Dispatch(BlockRequest* batch);
+    void WakeWaiters();
+
+    DiskDevice* disk;
+
+    lock_t queueLock = 0; // Only ever held with interrupts disabled
+    BlockRequest* pending = nullptr; // Sorted by LBA
+    unsigned pendingCount = 0;
+    unsigned inFlight = 0; // Driver requests being carried out
+    uint64_t headPosition = 0; // LBA after the last dispatched request
+
+    Scheduler::GenericThreadBlocker waiters; // Woken whenever a dispatch completes
+
+    Statistics stats;
+};
+
+namespace BlockLayer{
+    // Register /dev/blockstat
+    void Initialize();
+}
@@ -29,6 +29,10 @@ public:
     const char* GetName() const{
         return name;
     }
+
+    DeviceType GetDeviceType() const{
+        return type;
+    }
 protected:
     void SetName(const char* name){
         this->name = strdup(name);
@@ -39,6 +43,9 @@ protected:
 };
 
 class PartitionDevice;
+class BlockQueue;
+struct BlockRequest;
+struct BlockPlug;
 
 class DiskDevice : public Device{
     friend class PartitionDevice;
@@ -59,6 +66,9 @@ public:
     
     List<PartitionDevice*> partitions;
     int blocksize = 512;
+
+    BlockQueue* queue; // Requests from filesystems go through here rather than straight to ReadDiskBlock/WriteDiskBlock
+    unsigned queueDepth = 1; // Most requests the driver can carry out at once
 private:
 };
 
@@ -69,10 +79,20 @@ public:
     virtual int ReadAbsolute(uint64_t off, uint32_t count, void* buffer);
     virtual int Read(uint64_t lba, uint32_t count, void* buffer);
     virtual int Write(uint64_t lba, uint32_t count, void* buffer);
+    // Queue a request without waiting for it, lba is relative to the start of the partition
+    // The request is held in plug until it is unplugged if given, returns non-zero if it is out of bounds
+    int Submit(BlockRequest* request, BlockPlug* plug = nullptr);
     
     virtual ~PartitionDevice();
 
+    // Size of the partition in bytes
+    inline uint64_t GetSize() const { return (endLBA - startLBA) * parentDisk->blocksize; }
+
     DiskDevice* parentDisk;
+
+    // Page cache readahead state
+    uint64_t nextReadaheadPage = 0; // Page a sequential reader is expected to miss on next
+    unsigned readaheadPages = 0; // Pages read ahead on the last miss
 private:
 
     uint64_t startLBA;
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <fs/filesystem.h>
+
+#define DENTRYCACHE_MAX_ENTRIES 4096
+#define DENTRYCACHE_NAME_MAX 63 // Longer names are never cached
+
+// Results of directory lookups by (directory, name), including names that were not found.
+// Only directories with cacheLookups set are cached, fs:: drops the entry of a name whenever it is created, linked or unlinked.
+// The least recently used entry is evicted once the cache is full.
+namespace DentryCache{
+    struct Statistics{
+        uint64_t hits;
+        uint64_t negativeHits; // Hits on names that do not exist
+        uint64_t misses;
+        uint64_t evictions;
+        uint64_t invalidations;
+        unsigned long entries;
+    };
+
+    // Set up the cache and register /dev/dentrystat
+    void Initialize();
+
+    // Returns true if the lookup of name in dir is cached and sets node, which is nullptr if the name does not exist
+    // Otherwise generation is set to be passed to Insert
+    bool Lookup(FsNode* dir, const char* name, FsNode*& node, uint64_t& generation);
+    // Cache the result of a lookup that missed, node is nullptr if the name does not exist
+    // Nothing is cached if anything was invalidated since the lookup
+    void Insert(FsNode* dir, const char* name, FsNode* node, uint64_t generation);
+
+    // Drop the entry of name in dir
+    void Invalidate(FsNode* dir, const char* name);
+    // Drop every entry in or pointing to node, for when it is destroyed
+    void InvalidateNode(FsNode* node);
+
+    Statistics GetStatistics();
+}
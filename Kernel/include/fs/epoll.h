@@ -0,0 +1,93 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <fs/filesystem.h>
+#include <lock.h>
+
+#define EPOLLIN POLLIN
+#define EPOLLOUT POLLOUT
+#define EPOLLPRI POLLPRI
+#define EPOLLHUP POLLHUP // Always reported, whether requested or not
+#define EPOLLERR POLLERR
+#define EPOLLONESHOT (1U << 30) // Disable the interest once it has been reported, until it is modified
+#define EPOLLET (1U << 31) // Edge triggered
+
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
+
+struct epoll_event {
+    uint32_t events;
+    uint64_t data; // Returned with the events, untouched by the kernel
+} __attribute__((packed));
+
+// Persistent set of file descriptors to wait on.
+// Every interest watches its node through the Watch hooks and is queued on the ready list once the node signals,
+// so a wait only looks at descriptors that may have become ready instead of registering every one of them each time.
+// Level triggered interests are reported by every wait for as long as they are ready. Edge triggered interests are
+// reported once, and again only after the node signals (new data, a connection or a hangup).
+class EPoll : public FsNode {
+    struct Interest : public FilesystemWatcher {
+        EPoll* epoll;
+        int fd;
+        fs_fd_t* handle; // Copy of the descriptor, keeps the node open whilst it is watched
+        uint32_t events;
+        uint64_t data;
+
+        bool armed = false; // Given to the node with Watch
+        bool queued = false; // On the ready list
+        bool disabled = false; // Oneshot and reported
+
+        Interest* next = nullptr; // Interest list
+        Interest* nextReady = nullptr;
+        Interest* nextTaken = nullptr; // Taken off the ready list to be reported
+
+        // Called by the node once ready, possibly with interrupts disabled
+        void Signal() final;
+    };
+
+    Mutex interestLock; // Held whilst the interest list changes and whilst interests are being armed
+    Interest* interests = nullptr;
+    unsigned nestedCount = 0; // Interests in other instances
+    unsigned parentCount = 0; // Instances with an interest in this one
+
+    lock_t readyLock = 0; // Only ever held with interrupts disabled
+    Interest* ready = nullptr;
+    Interest* lastReady = nullptr;
+    Scheduler::GenericThreadBlocker waiters;
+    List<FilesystemWatcher*> watching; // Watching the instance itself, it is readable whilst anything is queued
+
+    Interest* Find(int fd);
+    // Put an interest on the ready list and wake waiters
+    void Queue(Interest* interest);
+    // Take an interest off the ready list if it is on it
+    void Dequeue(Interest* interest);
+    // Watch the node of an interest, queueing it if the node is already ready.
+    // With report unset an edge triggered interest is only queued on the next signal. interestLock must be held.
+    void Arm(Interest* interest, bool report);
+    void Disarm(Interest* interest);
+    // Stop watching and free an interest that has been taken off the interest list
+    void Remove(Interest* interest);
+    // Report queued interests until events is full, returns the amount reported
+    int Collect(epoll_event* events, int maxEvents);
+public:
+    EPoll();
+
+    // Add (EPOLL_CTL_ADD), change (EPOLL_CTL_MOD) or remove (EPOLL_CTL_DEL) the interest in fd.
+    // handle is the open descriptor of fd, it is copied when added. Returns 0 on success, negative error code on failure.
+    int Control(int op, int fd, fs_fd_t* handle, uint32_t events, uint64_t data);
+    // Wait for up to timeout ms (negative waits indefinitely) for any interest to become ready
+    // Returns the amount of events written
+    int Wait(epoll_event* events, int maxEvents, long timeout);
+
+    void Close();
+
+    bool CanRead();
+    void Watch(FilesystemWatcher& watcher, int events);
+    void Unwatch(FilesystemWatcher& watcher);
+
+    // Events of node that are currently ready out of events, POLLHUP is included regardless
+    static uint32_t PollNode(FsNode* node, uint32_t events);
+};
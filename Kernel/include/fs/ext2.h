@@ -44,6 +44,16 @@
 #define EXT2_DOUBLY_INDIRECT_INDEX 13
 #define EXT2_TRIPLY_INDIRECT_INDEX 14
 
+#define EXT2_INDEX_FL 0x1000 // Directory is indexed by a hash tree (htree)
+
+#define EXT2_FLAGS_SIGNED_HASH 0x1 // Superblock flags, names are hashed as signed chars
+#define EXT2_FLAGS_UNSIGNED_HASH 0x2 // Names are hashed as unsigned chars
+
+#define EXT2_DX_MAX_DEPTH 2 // Index blocks from the root to a leaf (including the root)
+#define EXT2_DX_BLOCK_MASK 0x00FFFFFF
+
+#define EXT2_FLUSH_INTERVAL 5000000000ULL // Dirty metadata and blocks are written back at least this often (ns)
+
 namespace fs::Ext2{
     enum ErrorAction{
         Continue = 1,       // Continue
@@ -83,6 +93,15 @@ namespace fs::Ext2{
         BinaryTree = 0x4,   // Binary tree directory structure    
     };
 
+    enum DirectoryHashVersion{
+        HashLegacy = 0,
+        HashHalfMD4 = 1,
+        HashTEA = 2,
+        HashLegacyUnsigned = 3, // Only used in memory, the signed version + 3 on filesystems with EXT2_FLAGS_UNSIGNED_HASH
+        HashHalfMD4Unsigned = 4,
+        HashTEAUnsigned = 5,
+    };
+
     enum CreatorOS{
         Linux, // Linux
         HURD,  // GNU HURD
@@ -146,6 +165,24 @@ namespace fs::Ext2{
         uint8_t preallocatedBlocks; // Blocks to preallocate when a file is created
         uint8_t preallocdDirBlocks; // Blocks to preallocate when a directory is created
         uint16_t align;
+        uint8_t journalUUID[16];    // UUID of the journal superblock
+        uint32_t journalInode;      // Inode number of the journal file
+        uint32_t journalDevice;     // Device number of the journal file
+        uint32_t lastOrphan;        // Start of the list of inodes to delete
+        uint32_t hashSeed[4];       // Seed of the directory hash, the default seed is used if zero
+        uint8_t defHashVersion;     // Hash used for newly indexed directories
+        uint8_t journalBackupType;
+        uint16_t descSize;          // Size of block group descriptors (64-bit only)
+        uint32_t defaultMountOptions;
+        uint32_t firstMetaBg;       // First metablock block group
+        uint32_t mkfsTime;          // UNIX timestamp of when the filesystem was created
+        uint32_t journalBlocks[17]; // Backup of the journal inode blocks
+        uint32_t blockCountHigh;    // Upper 32 bits of the block counts (64-bit only)
+        uint32_t resvBlockCountHigh;
+        uint32_t freeBlockCountHigh;
+        uint16_t minExtraInodeSize; // All inodes have at least this many extra bytes
+        uint16_t wantExtraInodeSize; // New inodes should reserve this many extra bytes
+        uint32_t flags;             // Miscellaneous flags (EXT2_FLAGS_*)
     } __attribute__((packed)) ext2_superblock_extended_t; // Ext2 extended superblock
 
     typedef struct {
@@ -191,20 +228,50 @@ namespace fs::Ext2{
         char name[];
     } __attribute__((packed)) ext2_directory_entry_t;
 
+    // Indexed directories keep '.' and '..' at the start of the first block as usual, with the record of '..' spanning the rest of the block.
+    // The index root follows them, interior index blocks start with an empty record spanning the whole block so they look like empty directory blocks.
+    typedef struct {
+        uint32_t reserved;          // Always zero
+        uint8_t hashVersion;        // Hash used for names in the directory (DirectoryHashVersion)
+        uint8_t infoLength;         // Length of this structure (8)
+        uint8_t indirectLevels;     // Levels of index blocks below the root
+        uint8_t flags;
+    } __attribute__((packed)) ext2_dx_root_info_t;
+
+    typedef struct {
+        uint32_t hash;              // Lowest hash in the block, the low bit is set if names with the same hash continue from the previous block
+        uint32_t block;             // Index of the block in the directory
+    } __attribute__((packed)) ext2_dx_entry_t;
+
+    typedef struct {
+        uint16_t limit;             // Amount of entries that fit in the block
+        uint16_t count;             // Amount of entries in use
+    } __attribute__((packed)) ext2_dx_countlimit_t; // Takes the place of the hash of the first entry (which is always 0)
+
+    inline uint16_t DirectoryRecordLength(uint8_t nameLength){
+        return (sizeof(ext2_directory_entry_t) + nameLength + 3) & ~3U; // Records are 4 byte aligned
+    }
+
     class Ext2Volume;
 
+    extern LockClass fileLockClass;
+
     class Ext2Node : public FsNode{ 
     protected:
-        List<uint32_t> cachedBlocks;
+        // Block map, cachedBlocks[i] is the block holding block i of the file or 0 if it has not been looked up yet
+        uint32_t* cachedBlocks = nullptr;
+        uint32_t cachedBlockCount = 0; // Length of cachedBlocks
+        lock_t blockMapLock = 0; // Only ever held with interrupts disabled
 
         Ext2Volume* vol;
         ext2_inode_t e2inode;
 
-        FilesystemLock flock; // Lock on file data
+        ReadWriteLock flock = ReadWriteLock(fileLockClass); // Lock on file data
 
         friend class Ext2Volume;
     public:
         Ext2Node(Ext2Volume* vol, ext2_inode_t& ino, ino_t inode);
+        ~Ext2Node();
 
         ssize_t Read(size_t, size_t, uint8_t *);
         ssize_t Write(size_t, size_t, uint8_t *);
@@ -219,7 +286,7 @@ namespace fs::Ext2{
         int Truncate(off_t length);
 
         void Close();
-        void Sync();
+        int Sync();
     };
 
     class Ext2Volume : public FsVolume {
@@ -243,12 +310,51 @@ namespace fs::Ext2{
         bool readOnly = false;
         
         bool sparse, largeFiles, filetype;
+        bool dirIndex; // Use the hash tree of indexed directories
+        uint8_t hashUnsigned = 0; // Added to signed hash versions if names are hashed as unsigned chars
         uint32_t inodeSize = 128;
 
+        // Index blocks on the way from the root of an indexed directory to a leaf
+        struct DxFrame{
+            uint8_t* block = nullptr;
+            uint32_t blockIndex; // Index of the block in the directory
+            ext2_dx_entry_t* entries;
+            ext2_dx_entry_t* at; // Entry the hash falls under
+        };
+
+        struct DxPath{
+            DxFrame frames[EXT2_DX_MAX_DEPTH];
+            int depth = 0;
+            int hashVersion;
+            uint32_t hash;
+
+            // Index of the leaf block in the directory
+            inline uint32_t Leaf() const {
+                return frames[depth - 1].at->block & EXT2_DX_BLOCK_MASK;
+            }
+        };
+
+        // Location of a directory entry
+        struct DirectoryLocation{
+            uint32_t blockIndex; // Index of the block in the directory
+            uint32_t offset; // Offset of the record in the block
+            uint32_t previous; // Offset of the previous record in the block, equal to offset for the first record
+        };
+
+        struct HashedEntry{
+            uint32_t hash;
+            uint32_t inode;
+            uint8_t fileType;
+            uint8_t nameLength;
+            const char* name;
+        };
+
         HashMap<uint32_t, Ext2Node*> inodeCache;
-        HashMap<uint32_t, uint8_t*> blockCache;
         HashMap<uint32_t, uint8_t*> bitmapCache;
-        unsigned blockCacheMemoryUsage;
+
+        lock_t metadataLock = 0; // Protects the free counts and the dirty flags below, only held with interrupts disabled
+        bool superDirty = false;
+        uint8_t* dirtyGroups; // Bitmap of block group descriptors to write back
 
         inline uint32_t LocationToBlock(uint64_t l){
             return (l >> super.logBlockSize) >> 10;
@@ -266,40 +372,96 @@ namespace fs::Ext2{
             return (inode - 1) % super.inodesPerGroup;
         }
 
-        inline uint64_t InodeLBA(uint32_t inode){
+        // Byte offset of an inode into the partition
+        inline uint64_t InodeLocation(uint32_t inode){
             uint32_t block = blockGroups[ResolveInodeBlockGroup(inode)].inodeTable;
-            uint64_t lba = (block * blocksize + ResolveInodeBlockGroupIndex(inode) * inodeSize) / part->parentDisk->blocksize;
-
-            return lba;
+            return static_cast<uint64_t>(block) * blocksize + ResolveInodeBlockGroupIndex(inode) * inodeSize;
         }
 
-        void WriteSuperblock();
-        void WriteBlockGroupDescriptor(uint32_t index);
+        // Free counts are only changed in memory, the superblock and descriptors are written back together by FlushMetadata
+        void UpdateFreeCounts(uint32_t group, int blocks, int inodes);
+        void FlushMetadata();
         
+        unsigned IndirectLevel(uint32_t index, uint64_t& relative, uint64_t& span);
+
+        // Walk the block lists of an inode, holes are returned as block 0
         uint32_t GetInodeBlock(uint32_t index, ext2_inode_t& inode);
         Vector<uint32_t> GetInodeBlocks(uint32_t index, uint32_t count, ext2_inode_t& inode);
+        // Any indirect blocks missing on the way to index are allocated
         void SetInodeBlock(uint32_t index, ext2_inode_t& inode, uint32_t block);
+        // Allocate a zeroed indirect block
+        uint32_t AllocateIndirectBlock(uint32_t goal);
+        // Free the blocks of an indirect table from block first (relative to the table) on
+        // Returns true if nothing was left and the table itself was freed. A table that cannot be read is kept, along with its parents
+        bool FreeIndirectBlocks(uint32_t table, unsigned level, uint64_t first);
+        // Free every block of an inode from block first on, along with any indirect blocks left empty
+        void FreeInodeBlocks(ext2_inode_t& inode, uint32_t first);
+
+        // Same as above going through the block map of the node, blocks are only read from the disk the first time
+        uint32_t GetNodeBlock(Ext2Node* node, uint32_t index);
+        Vector<uint32_t> GetNodeBlocks(Ext2Node* node, uint32_t index, uint32_t count);
+        void SetNodeBlock(Ext2Node* node, uint32_t index, uint32_t block);
+        void CacheBlocks(Ext2Node* node, uint32_t index, const uint32_t* blocks, uint32_t count);
+        void DropCachedBlocks(Ext2Node* node, uint32_t first);
 
         int ReadInode(uint32_t num, ext2_inode_t& inode);
         int WriteInode(uint32_t num, ext2_inode_t& inode);
 
+        // Blocks are read and written through the page cache, written blocks stay dirty until the volume is synced
         int ReadBlock(uint32_t block, void* buffer);
-        int ReadBlockCached(uint32_t block, void* buffer);
-        
         int WriteBlock(uint32_t block, void* buffer);
-        int WriteBlockCached(uint32_t block, void* buffer);
 
         Ext2Node* CreateNode();
         int EraseInode(ext2_inode_t& e2inode, uint32_t inode);
         void SyncInode(ext2_inode_t& e2ino, uint32_t inode);
 
-        uint32_t AllocateBlock();
+        // Allocate the first free block at or after goal, so that blocks allocated one after the other are contiguous
+        uint32_t AllocateBlock(uint32_t goal = 0);
         int FreeBlock(uint32_t block);
 
-        int ListDir(Ext2Node* node, List<DirectoryEntry>& entries);
-        int WriteDir(Ext2Node* node, List<DirectoryEntry>& entries);
-        int InsertDir(Ext2Node* node, List<DirectoryEntry>& entries);
+        inline bool IsIndexed(Ext2Node* node){
+            return dirIndex && (node->e2inode.flags & EXT2_INDEX_FL);
+        }
+
+        inline void SetNodeSize(Ext2Node* node, uint64_t size){
+            node->size = size;
+            node->e2inode.size = size & UINT32_MAX;
+            if(largeFiles && (node->e2inode.mode & EXT2_S_IFMT) == EXT2_S_IFREG){
+                node->e2inode.sizeHigh = size >> 32;
+            }
+        }
+
+        inline uint32_t DirectoryBlockCount(Ext2Node* node){
+            return node->e2inode.size / blocksize;
+        }
+
+        uint32_t HashName(const char* name, size_t length, int version);
+
+        // Walk the index of a directory down to the leaf that would hold names with the hash of name
+        // Returns 0 on success, 1 if the index cannot be used or negative on error, nothing needs to be released unless it succeeds
+        int ProbeIndex(Ext2Node* node, const char* name, DxPath& path);
+        // Move to the next leaf if names with the hash of the path may continue there
+        // Returns 1 if the path was moved, 0 if not, negative on error
+        int NextIndexLeaf(Ext2Node* node, DxPath& path);
+        void ReleaseIndex(DxPath& path);
+
+        // Gather the entries of a block from start sorted by hash, along with extra if it is not nullptr
+        unsigned CollectEntries(uint8_t* block, uint32_t start, HashedEntry* entries, int hashVersion, DirectoryEntry* extra);
+        // Index of the first entry to move to a new block so both halves are about the same size
+        unsigned SplitPoint(HashedEntry* entries, unsigned count);
+        void PackEntries(uint8_t* block, HashedEntry* entries, unsigned count);
+        int SplitLeaf(Ext2Node* node, DxPath& path, uint8_t* leaf);
+        int GrowIndex(Ext2Node* node, DxPath& path);
+        int MakeIndexed(Ext2Node* node, uint8_t* block, DirectoryEntry& ent);
+
+        // Find name in a directory, buffer holds the block containing the entry on return
+        // Returns 0 if found, -ENOENT if not
+        int FindEntry(Ext2Node* node, const char* name, uint8_t* buffer, DirectoryLocation& loc);
+        uint32_t AppendDirectoryBlock(Ext2Node* node, uint32_t& index);
+        // Add an entry to a single block, never rewriting more than the block (and the index if it needs to be split)
         int InsertDir(Ext2Node* node, DirectoryEntry& ent);
+        int InsertIndexed(Ext2Node* node, DirectoryEntry& ent);
+        int InsertLinear(Ext2Node* node, DirectoryEntry& ent);
     public:
         Ext2Volume(PartitionDevice* part, const char* name);
 
@@ -317,8 +479,16 @@ namespace fs::Ext2{
         void SyncNode(Ext2Node* node);
         void CleanNode(Ext2Node* node);
 
+        // Write back the metadata and every dirty block of the volume, returns 0 on success
+        int Sync();
+
         int Error() { return error; }
+
+        Ext2Volume* nextVolume = nullptr; // List of mounted volumes for the flusher
     };
     
     int Identify(PartitionDevice* part);
+
+    // Start the thread writing back every mounted volume each EXT2_FLUSH_INTERVAL
+    void StartFlusher();
 }
\ No newline at end of file
@@ -5,6 +5,8 @@
 #include <device.h>
 #include <fs/filesystem.h>
 #include <fs/fsvolume.h>
+#include <lock.h>
+#include <vector.h>
 
 #define FAT_ATTR_READ_ONLY 0x1
 #define FAT_ATTR_HIDDEN 0x2
@@ -93,6 +95,25 @@ typedef struct
 namespace fs::FAT32{
     class Fat32Volume;
 
+    // Run of clusters next to each other on the disk
+    struct ClusterExtent {
+        uint32_t index; // Index of the first cluster in the chain
+        uint32_t cluster;
+        uint32_t count;
+    };
+
+    // Position in a directory
+    struct DirectoryCursor {
+        uint32_t entry = 0; // Index, as passed to ReadDir, of the next file
+        uint32_t position = 0; // Index of the next 32 byte entry
+    };
+
+    // Cluster chain of a file or directory, read from the FAT once and never modified
+    struct ClusterChain {
+        uint32_t length; // In clusters
+        Vector<ClusterExtent> extents; // Sorted by index
+    };
+
     class Fat32Node : public FsNode {
     public:
         ssize_t Read(size_t, size_t, uint8_t *);
@@ -103,6 +124,11 @@ namespace fs::FAT32{
         FsNode* FindDir(char* name);
 
         Fat32Volume* vol;
+
+        ClusterChain* chain = nullptr; // Built on first access
+        lock_t chainLock = 0; // Only ever held with interrupts disabled, also guards readDirCursor
+
+        DirectoryCursor readDirCursor; // Where the last ReadDir stopped, so listing the directory does not start over for every entry
     };
 
     class Fat32Volume : public FsVolume {
@@ -118,15 +144,23 @@ namespace fs::FAT32{
 
     private:
         uint64_t ClusterToLBA(uint32_t cluster);
-        List<uint32_t>* GetClusterChain(uint32_t cluster);
-        void* ReadClusterChain(uint32_t cluster, int* count);
-        void* ReadClusterChain(uint32_t cluster, int* count, size_t max);
+        // Walk the FAT from cluster, reading it straight out of the page cache
+        ClusterChain* BuildClusterChain(uint32_t cluster);
+        ClusterChain* GetClusterChain(Fat32Node* node);
+        // Read size bytes at offset into a cluster chain, only touching the clusters in the range
+        // Returns the amount read or a negative error code
+        ssize_t ReadChain(ClusterChain* chain, uint64_t offset, size_t size, uint8_t* buffer);
+        // Find the next file in a directory from cursor, reading a cluster at a time into clusterBuffer (clusterSizeBytes long).
+        // clusterIndex is the cluster of the chain held in clusterBuffer, name has to hold NAME_MAX bytes
+        // Returns 1 if a file was found, 0 at the end of the directory or a negative error code
+        int NextDirectoryEntry(ClusterChain* chain, DirectoryCursor& cursor, fat_entry_t& entry, char* name, fat_entry_t* clusterBuffer, uint32_t& clusterIndex);
+
+        static constexpr unsigned maxLfnEntries = 16; // GetLongFilename fills 15 bytes per entry, keep the name within NAME_MAX
 
         PartitionDevice* part;
         fat32_boot_record_t* bootRecord;
 
-        uint32_t* fat;
-        uint32_t fatEntryCount;
+        uint32_t clusterCount; // Data clusters on the volume
 
         int clusterSizeBytes;
         Fat32Node fat32MountPoint;
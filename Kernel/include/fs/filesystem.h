@@ -30,6 +30,8 @@
 #define FS_NODE_SYMLINK S_IFLNK//0x20
 #define FS_NODE_CHARDEVICE S_IFCHR//0x40
 #define FS_NODE_SOCKET S_IFSOCK//0x80
+#define FS_NODE_SHAREDMEM 0x3000 // Shared memory object (SharedMemoryNode), not a POSIX file type
+#define FS_NODE_EPOLL 0x5000 // EPoll instance, not a POSIX file type
 
 #define POLLIN 0x01
 #define POLLOUT 0x02
@@ -159,6 +161,9 @@ public:
     unsigned handleCount = 0; // Amount of file handles that point to this node
     volume_id_t volumeID;
 
+    bool cacheLookups = false; // Set by filesystems whose directories only change through fs::, lookups are kept in the dentry cache
+    bool inDentryCache = false; // Directory or target of a dentry cache entry
+
     int error = 0;
 
     virtual ~FsNode();
@@ -203,7 +208,7 @@ public:
     virtual int Truncate(off_t length);
 
     virtual int Ioctl(uint64_t cmd, uint64_t arg); // I/O Control
-    virtual void Sync(); // Sync node to device
+    virtual int Sync(); // Write the node and its data back to the device, returns 0 on success
 
     virtual bool CanRead() { return true; }
     virtual bool CanWrite() { return true; }
@@ -214,12 +219,13 @@ public:
     FsNode* link;
     FsNode* parent;
 
-    FilesystemLock nodeLock; // Lock on FsNode info
+    ReadWriteLock nodeLock; // Lock on FsNode info
 };
 
 // FilesystemWatcher is a semaphore initialized to 0.
 // A thread can wait on it like any semaphore,
-// and when a file is ready it will signal and waiting thread(s) will get woken
+// and when a file is ready it will signal and waiting thread(s) will get woken.
+// Signal may be overridden to be notified directly instead (see EPoll), it may be called with interrupts disabled.
 class FilesystemWatcher : public Semaphore{
     List<FsNode*> watching;
 public:
@@ -233,7 +239,11 @@ public:
         watching.add_back(node);
     }
 
-    ~FilesystemWatcher(){
+    virtual void Signal(){
+        Semaphore::Signal();
+    }
+
+    virtual ~FilesystemWatcher(){
         for(auto& node : watching){
             node->Unwatch(*this);
         }
@@ -332,6 +342,8 @@ namespace fs{
     int ReadDir(fs_fd_t* handle, DirectoryEntry* dirent, uint32_t index);
     FsNode* FindDir(fs_fd_t* handle, char* name);
     
+    int Create(FsNode* dir, DirectoryEntry* ent, uint32_t mode);
+    int CreateDirectory(FsNode* dir, DirectoryEntry* ent, uint32_t mode);
     int Link(FsNode*, FsNode*, DirectoryEntry*);
     int Unlink(FsNode*, DirectoryEntry*, bool unlinkDirectories = false);
 
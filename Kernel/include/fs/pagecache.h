@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <device.h>
+
+#define PAGECACHE_PAGE_SIZE 4096
+#define PAGECACHE_MAX_PAGES 65536 // 256MB
+#define PAGECACHE_MAX_READAHEAD 32 // Pages read ahead of a sequential reader at most
+#define PAGECACHE_SYNC_BATCH 32 // Dirty pages written back per pass of the cache lock
+#define PAGECACHE_DIRECT_MIN 16 // Uncached, page aligned runs of at least this many pages are read straight into the caller's buffer
+#define PAGECACHE_DIRECT_MAX 256 // Most pages read directly by one request
+
+enum {
+    PageLoading, // Being read in, the contents are not valid yet
+    PageUptodate,
+    PageError, // Failed to read, no longer in the cache and freed once the last reference is released
+};
+
+struct PageWaiter;
+
+struct CachedPage {
+    PartitionDevice* device;
+    FsNode* node = nullptr; // Set instead of device for pages of a file
+    uint64_t index; // Offset into the device (or file) in pages
+
+    uint64_t physical = 0;
+    uint8_t* data = nullptr; // Stays mapped for the lifetime of the CachedPage
+
+    volatile int state = PageLoading;
+    int refCount = 0; // Pages are never evicted whilst referenced
+    bool referenced = false; // Accessed since the clock hand last passed
+    bool dirty = false;
+
+    PageWaiter* waiters = nullptr; // Threads blocked until the page has been read in
+    CachedPage* next = nullptr; // Clock list
+    CachedPage* prev = nullptr;
+};
+
+// Pages of block devices cached in memory, shared by every filesystem on the device.
+// Pages of files are cached as well for memory mapping, their frames are mapped straight into processes.
+// Pages are evicted with the CLOCK algorithm once the cache is full or memory is running low,
+// and handed back to the physical allocator when it runs out.
+namespace PageCache{
+    void Initialize();
+
+    // Get a referenced page, reading it (and possibly the pages after it) in if it is not cached
+    // Returns nullptr if the page could not be read
+    CachedPage* GetPage(PartitionDevice* device, uint64_t index);
+    void ReleasePage(CachedPage* page);
+    // Page has been modified and needs to be written back
+    void MarkDirty(CachedPage* page);
+
+    // Copy data to or from the cache at a byte offset into the device
+    // Pages missing from the cache are read in with as few requests as possible,
+    // large reads of uncached pages bypass the cache so streaming through a file does not evict everything else.
+    // Returns 0 on success
+    int Read(PartitionDevice* device, uint64_t offset, size_t size, void* buffer);
+    int Write(PartitionDevice* device, uint64_t offset, size_t size, const void* buffer);
+
+    // Write back the dirty pages of a device, or of every device and file if device is nullptr
+    // Returns 0 on success
+    int Sync(PartitionDevice* device);
+    // Write back the dirty pages covering a range of a device
+    int SyncRange(PartitionDevice* device, uint64_t offset, size_t size);
+
+    // Write back and drop every unreferenced page of a device, or of every device if device is nullptr
+    void Invalidate(PartitionDevice* device);
+
+    // Get a referenced page of a file, reading it in if it is not cached
+    // Anything past the end of the file is zeroed, returns nullptr if the page could not be read
+    CachedPage* GetFilePage(FsNode* node, uint64_t index);
+    // Get a referenced page of a file only if it is cached and up to date, never blocks
+    CachedPage* TryGetFilePage(FsNode* node, uint64_t index);
+    // Copy data written to a file into any of its cached pages
+    void UpdateFilePages(FsNode* node, uint64_t offset, size_t size, const void* buffer);
+    // Drop every page of a file without writing it back, for when the node is destroyed
+    void InvalidateFile(FsNode* node);
+
+    // Give back the frames of up to count clean, unreferenced pages to the physical allocator
+    // Never blocks, returns the amount freed
+    size_t Reclaim(size_t count);
+}
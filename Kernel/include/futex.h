@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+
+#define FUTEX_WAIT 0
+#define FUTEX_WAKE 1
+#define FUTEX_REQUEUE 3
+#define FUTEX_CMP_REQUEUE 4
+
+// Futexes are kept in one kernel wide hash table.
+// Private futexes are identified by address space and virtual address,
+// futexes in shared memory by physical address so processes mapping the same memory wait on the same futex.
+// Every pointer must be a 4 byte aligned user pointer in the current process that has already been checked.
+namespace Futex{
+    // Sleep whilst *futex is equal to expected until woken or until the deadline (system uptime in nanoseconds, 0 for none) passes
+    // Returns 0 once woken, -EAGAIN if *futex was not equal to expected, -ETIMEDOUT or -EINTR if the thread is being killed
+    long Wait(int* futex, int expected, uint64_t deadline);
+
+    // Wake up to count threads waiting on futex, returns the amount woken
+    long Wake(int* futex, int count);
+
+    // Wake up to wakeCount threads waiting on futex then move up to requeueCount of the remaining waiters onto target,
+    // so a broadcast wakes one thread rather than every thread racing for the same lock.
+    // If compare is set nothing is done unless *futex is equal to expected (-EAGAIN otherwise).
+    // Returns the amount of threads woken and requeued
+    long Requeue(int* futex, int wakeCount, int requeueCount, int* target, bool compare, int expected);
+}
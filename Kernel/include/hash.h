@@ -1,7 +1,8 @@
 #pragma once
 
 #include <stdint.h>
-#include <list.h>
+
+#define HASHMAP_MIN_CAPACITY 16
 
 inline static unsigned hash(unsigned value){
 	unsigned hash = value;
@@ -23,65 +24,244 @@ inline static unsigned hash(const char* str){
 	return val;
 }
 
+// Open addressing hash map using Robin Hood hashing.
+// Entries are stored inline in one array with a power of two capacity, which grows once it is 7/8 full.
+// Whilst probing, an entry further from its home slot takes the place of one closer to its own,
+// which keeps probe sequences short and lets lookups stop early.
+// Removal shifts the following entries back rather than leaving tombstones.
 template<typename K, typename T> // Key, Value
 class HashMap{
-private:
-	class KeyValuePair{
-		friend class HashMap;
-
-	protected:
-		T value;
+public:
+	struct KeyValuePair{
 		K key;
+		T value;
+	};
 
-		KeyValuePair() { value = T(); key = K(); }
-		KeyValuePair(K key, T value) { this->value = value; this->key = key; }
+private:
+	struct Entry{
+		KeyValuePair pair;
+		unsigned distance; // Distance from the home slot plus one, 0 if the slot is empty
 	};
 
-	List<KeyValuePair>* buckets;
-	unsigned bucketCount = 2048;
+	Entry* entries = nullptr;
+	unsigned capacity = 0;
+	unsigned count = 0;
 
-public:
-	HashMap(){
-		buckets = new List<KeyValuePair>[bucketCount];
+	inline unsigned Home(const K& key) const {
+		return hash(key) & (capacity - 1);
 	}
 
-	HashMap(unsigned bCount){
-		bucketCount = bCount;
+	// Returns the slot holding key, -1 if it is not present
+	long Find(const K& key) const {
+		if(!count){
+			return -1;
+		}
+
+		unsigned mask = capacity - 1;
+		unsigned i = Home(key);
+		for(unsigned distance = 1;; distance++){
+			Entry& entry = entries[i];
+			if(entry.distance < distance){
+				return -1; // key would have taken this slot
+			} else if(entry.distance == distance && entry.pair.key == key){
+				return i;
+			}
 
-		HashMap();
+			i = (i + 1) & mask;
+		}
 	}
 
-	void insert(K key, T& value){
-		auto& bucket = buckets[hash(key) % bucketCount];
+	// key must not be present and there must be a free slot
+	void Place(const K& key, const T& value){
+		Entry entry = {{key, value}, 1};
 
-		bucket.add_back(KeyValuePair(key, value));
+		unsigned mask = capacity - 1;
+		unsigned i = Home(key);
+		for(;;){
+			if(!entries[i].distance){
+				entries[i] = entry;
+				count++;
+				return;
+			} else if(entries[i].distance < entry.distance){
+				Entry temp = entries[i];
+				entries[i] = entry;
+				entry = temp;
+			}
+
+			i = (i + 1) & mask;
+			entry.distance++;
+		}
 	}
 
-	T remove(K key){
-		auto& bucket = buckets[hash(key) % bucketCount];
+	void Resize(unsigned newCapacity){
+		Entry* oldEntries = entries;
+		unsigned oldCapacity = capacity;
+
+		entries = new Entry[newCapacity];
+		for(unsigned i = 0; i < newCapacity; i++){
+			entries[i].distance = 0;
+		}
+
+		capacity = newCapacity;
+		count = 0;
 
-		for(unsigned i = 0; i < bucket.get_length(); i++){
-			if(bucket[i].key == key){
-				return bucket.remove_at(i).value;
+		for(unsigned i = 0; i < oldCapacity; i++){
+			if(oldEntries[i].distance){
+				Place(oldEntries[i].pair.key, oldEntries[i].pair.value);
 			}
 		}
 
-		return T();
+		if(oldEntries){
+			delete[] oldEntries;
+		}
 	}
 
-	T get(K key){
-		auto& bucket = buckets[hash(key) % bucketCount];
+public:
+	class iterator{
+		friend class HashMap;
+
+		Entry* entry;
+		Entry* end;
 
-		for(KeyValuePair& val : bucket){
-			if(val.key == key){
-				return val.value;
+		iterator(Entry* entry, Entry* end) : entry(entry), end(end){
+			while(this->entry != end && !this->entry->distance){
+				this->entry++;
 			}
 		}
+	public:
+		iterator& operator++(){
+			do {
+				entry++;
+			} while(entry != end && !entry->distance);
+
+			return *this;
+		}
+
+		iterator operator++(int){
+			iterator it = *this;
+			++*this;
+			return it;
+		}
+
+		// The key must not be modified
+		KeyValuePair& operator*() const {
+			return entry->pair;
+		}
+
+		KeyValuePair* operator->() const {
+			return &entry->pair;
+		}
+
+		bool operator==(const iterator& other) const {
+			return entry == other.entry;
+		}
+
+		bool operator!=(const iterator& other) const {
+			return entry != other.entry;
+		}
+	};
+
+	HashMap() = default;
+
+	// Reserve space for at least reserve entries
+	HashMap(unsigned reserve){
+		unsigned newCapacity = HASHMAP_MIN_CAPACITY;
+		while(newCapacity / 8 * 7 < reserve){
+			newCapacity *= 2;
+		}
+
+		Resize(newCapacity);
+	}
+
+	HashMap(const HashMap&) = delete;
+	HashMap& operator=(const HashMap&) = delete;
+
+	// Replaces the value if key is already present
+	void insert(K key, const T& value){
+		long i = Find(key);
+		if(i >= 0){
+			entries[i].pair.value = value;
+			return;
+		}
+
+		if((count + 1) * 8 > capacity * 7){
+			Resize(capacity ? capacity * 2 : HASHMAP_MIN_CAPACITY);
+		}
+
+		Place(key, value);
+	}
+
+	// Returns the value removed, T() if key was not present
+	T remove(K key){
+		long i = Find(key);
+		if(i < 0){
+			return T();
+		}
+
+		T value = entries[i].pair.value;
+
+		// Shift back the entries after it until one is empty or in its home slot
+		unsigned mask = capacity - 1;
+		unsigned next = (i + 1) & mask;
+		while(entries[next].distance > 1){
+			entries[i] = entries[next];
+			entries[i].distance--;
+
+			i = next;
+			next = (next + 1) & mask;
+		}
+
+		entries[i].pair = KeyValuePair();
+		entries[i].distance = 0;
+		count--;
+
+		return value;
+	}
+
+	// Returns T() if key is not present
+	T get(K key) const {
+		long i = Find(key);
+		return i >= 0 ? entries[i].pair.value : T();
+	}
+
+	// Returns true and sets value if key is present
+	bool find(K key, T& value) const {
+		long i = Find(key);
+		if(i < 0){
+			return false;
+		}
+
+		value = entries[i].pair.value;
+		return true;
+	}
+
+	inline bool contains(K key) const {
+		return Find(key) >= 0;
+	}
+
+	void clear(){
+		if(entries){
+			delete[] entries;
+		}
+
+		entries = nullptr;
+		capacity = 0;
+		count = 0;
+	}
+
+	inline unsigned get_length() const {
+		return count;
+	}
+
+	iterator begin() const {
+		return iterator(entries, entries + capacity);
+	}
 
-		return T();
+	iterator end() const {
+		return iterator(entries + capacity, entries + capacity);
 	}
 
 	~HashMap(){
-		delete[](buckets);
+		clear();
 	}
-};
\ No newline at end of file
+};
@@ -1,9 +1,18 @@
 #pragma once
 
+#define LEMON_SYSINFO_MAX_CPUS 64
+
+typedef struct {
+	uint32_t runnable; // Threads running or waiting to run on the CPU
+	uint32_t load; // Average number of runnable threads, 100 per thread
+	uint32_t utilisation; // Percentage of recent time spent running threads
+} lemon_cpu_load_t;
+
 typedef struct {
 	uint64_t totalMem;
 	uint64_t usedMem;
 	uint16_t cpuCount;
+	lemon_cpu_load_t cpuLoad[LEMON_SYSINFO_MAX_CPUS];
 } lemon_sysinfo_t;
 
 namespace Lemon{
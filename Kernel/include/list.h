@@ -3,6 +3,7 @@
 #include <memory.h>
 #include <spin.h>
 #include <assert.h>
+#include <slab.h>
 
 template<typename T>
 struct ListNode
@@ -215,7 +216,7 @@ public:
 		clear();
 
 		while(cache.get_length()){
-			kfree(cache.remove_at(0));
+			Slab::Free(cache.remove_at(0), sizeof(ListNode<T>));
 		}
 	}
 
@@ -225,7 +226,7 @@ public:
 		ListNode<T>* node = front;
 		while (node && node->next) {
 			ListNode<T>* n = node->next;
-			kfree(node);
+			Slab::Free(node, sizeof(ListNode<T>));
 			node = n;
 		}
 		front = NULL;
@@ -240,7 +241,7 @@ public:
 
 		ListNode<T>* node;
 		if(cache.get_length() <= 0){
-			node = (ListNode<T>*)kmalloc(sizeof(ListNode<T>));
+			node = (ListNode<T>*)Slab::Allocate(sizeof(ListNode<T>));
 		} else {
 			node = cache.remove_at(0);
 		}
@@ -268,7 +269,7 @@ public:
 
 		ListNode<T>* node;
 		if(!cache.get_length()){
-			node = (ListNode<T>*)kmalloc(sizeof(ListNode<T>));
+			node = (ListNode<T>*)Slab::Allocate(sizeof(ListNode<T>));
 		} else {
 			node = cache.remove_at(0);
 		}
@@ -307,7 +308,7 @@ public:
 
 		ListNode<T>* node;
 		if(!cache.get_length()){
-			node = (ListNode<T>*)kmalloc(sizeof(ListNode<T>));
+			node = (ListNode<T>*)Slab::Allocate(sizeof(ListNode<T>));
 		} else {
 			node = cache.remove_at(0);
 		}
@@ -385,7 +386,7 @@ public:
 		if (pos == num) back = current->prev;
 
 		if(cache.get_length() >= maxCache){
-			kfree(current);
+			Slab::Free(current, sizeof(ListNode<T>));
 		} else {
 			cache.add_back(current);
 		}
@@ -397,9 +398,10 @@ public:
 		return obj;
 	}
 
-	void remove(T val){
+	// Returns true if val was found and removed
+	bool remove(T val){
 		if(num <= 0 || !front){
-			return;
+			return false;
 		}
 
 		acquireLock(&lock);
@@ -408,7 +410,8 @@ public:
 
 		while(current && current != back && current->obj != val) current = current->next;
 
-		if(current){
+		bool found = current && current->obj == val; // Stopping at the back does not mean it was found
+		if(found){
 			current->prev->next = current->next;
 			current->next->prev = current->prev;
 			if (front == current) front = current->next;
@@ -417,13 +420,16 @@ public:
 			num--;
 
 			if(cache.get_length() >= maxCache){
-				kfree(current);
+				Slab::Free(current, sizeof(ListNode<T>));
 			} else {
 				cache.add_back(current);
 			}
+
+			if(!num) front = back = nullptr;
 		}
 
 		releaseLock(&lock);
+		return found;
 	}
 
 
@@ -441,7 +447,7 @@ public:
 		num--;
 
 		if(cache.get_length() >= maxCache){
-			kfree(it.node);
+			Slab::Free(it.node, sizeof(ListNode<T>));
 		} else {
 			cache.add_back(it.node);
 		}
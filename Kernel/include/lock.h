@@ -8,44 +8,97 @@ struct thread;
 #include <thread.h>
 #include <logging.h>
 
-class FilesystemLock {
-    unsigned activeReaders = 0;
-    lock_t fileLock = 0;
+#define MUTEX_SPIN_LIMIT 2000 // Attempts made whilst the owner is running before a waiter sleeps
+
+// Contention statistics shared by every lock of one class, reported through /dev/lockstat
+// Constructors are constexpr so that classes with static storage can be used before global constructors are called.
+class LockClass {
+    friend class LockStatDevice;
+
+    const char* name;
+    LockClass* next = nullptr;
+    volatile int registered = 0;
 
-    FastList<thread*> readers;
-    FastList<thread*> writers;
+    unsigned long acquisitions = 0;
+    unsigned long contended = 0; // Acquisitions that could not take the lock straight away
+    unsigned long spins = 0; // Iterations spent spinning on a held lock
+    unsigned long sleeps = 0; // Times a waiter was put to sleep
+    uint64_t holdTime = 0; // Total time held exclusively in nanoseconds
+    uint64_t maxHoldTime = 0;
+
+    void Register();
 public:
-    lock_t lock = 0;
+    constexpr LockClass(const char* name) : name(name) {}
 
-    FilesystemLock() {}
+    void RecordAcquire(unsigned long spinCount, unsigned long sleepCount);
+    // heldSince is the uptime in nanoseconds the lock was taken at
+    void RecordRelease(uint64_t heldSince);
+};
 
-    void AcquireRead(){
-        acquireLock(&lock);
+namespace Lock{
+    extern LockClass mutexClass; // Used by mutexes that are not given a class
+    extern LockClass readWriteClass; // Used by reader-writer locks that are not given a class
 
-        activeReaders++;
+    // Register /dev/lockstat
+    void InitializeDevice();
+}
 
-        if(activeReaders == 1){
-            acquireLock(&fileLock);
-        }
+// Sleeping lock, spins whilst the owner is running on another CPU then blocks until it is released.
+// Must not be acquired in interrupt handlers or with interrupts disabled.
+class Mutex {
+    lock_t value = 0; // Set whilst held
+    lock_t waitLock = 0; // Protects waiters, only held with interrupts disabled
+    volatile unsigned waiterCount = 0; // Length of the waiter list, read without the lock on release
+    Scheduler::GenericThreadBlocker waiters;
 
-        releaseLock(&lock);
-    }
+    thread_t* volatile owner = nullptr;
+    CPU* volatile ownerCPU = nullptr; // CPU the owner took the lock on, the owner is running if it is still the current thread there
 
-    void AcquireWrite(){
-        acquireLock(&fileLock);
-    }
+    LockClass* lockClass;
+    uint64_t acquiredAt = 0;
+public:
+    Mutex(LockClass& lockClass = Lock::mutexClass) : lockClass(&lockClass) {}
 
-    void ReleaseRead(){
-        if(activeReaders == 1){
-            releaseLock(&fileLock);
-        }
+    void Acquire();
+    // Returns true if the lock was taken
+    bool TryAcquire();
+    void Release();
 
-        activeReaders--;
+    inline bool IsLocked() const {
+        return value;
     }
+};
 
-    void ReleaseWrite(){
-        releaseLock(&fileLock);
-    }
+// Reader-writer lock that sleeps whilst waiting.
+// New readers queue behind waiting writers, and a releasing writer hands the lock to every
+// reader waiting at that point before the next writer, so neither side can starve the other.
+// Hold times are only recorded for writers. Can only be used once the scheduler is running.
+class ReadWriteLock {
+    lock_t lock = 0; // Protects the state below, only held with interrupts disabled
+
+    unsigned activeReaders = 0;
+    thread_t* writer = nullptr; // Thread holding the lock for writing
+
+    unsigned readGeneration = 0; // Incremented whenever waiting readers are handed the lock
+    Scheduler::GenericThreadBlocker readers;
+    Scheduler::GenericThreadBlocker writers;
+
+    LockClass* lockClass;
+    uint64_t acquiredAt = 0;
+
+    // Wait on blocker until woken, lock must be held with interrupts disabled and is held again on return
+    void Sleep(Scheduler::GenericThreadBlocker& blocker, thread_t* current);
+    // Pass the lock to whoever is waiting now that it is free, lock must be held.
+    // Waiting readers go first if preferReaders is set or there are no waiting writers.
+    void WakeWaiters(bool preferReaders);
+public:
+    ReadWriteLock(LockClass& lockClass = Lock::readWriteClass) : lockClass(&lockClass) {}
+
+    void AcquireRead();
+    void AcquireWrite();
+
+    void ReleaseRead();
+    void ReleaseWrite();
 };
 
 class Semaphore : public Scheduler::GenericThreadBlocker{
@@ -63,7 +116,9 @@ public:
 
     void Wait();
 
-    void WaitTimeout(long timeout);
+    // Returns true if timed out
+    bool WaitTimeout(long timeout); // Timeout in ms
+    bool WaitUntil(uint64_t deadline); // Deadline as system uptime in ns
 
     inline void Signal(){
         __sync_fetch_and_add(&value, 1);
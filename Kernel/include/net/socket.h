@@ -23,6 +23,11 @@
 
 #define STREAM_MAX_BUFSIZE 0x20000 // 128 KB
 
+#define SOL_SOCKET 1
+#define SCM_RIGHTS 1
+
+#define SCM_MAX_FD 64 // Most descriptors passed by one message
+
 typedef unsigned int sa_family_t;
 typedef uint32_t socklen_t;
 
@@ -62,6 +67,17 @@ struct msghdr {
     int flags;
 };
 
+struct cmsghdr {
+    socklen_t len; // Including the header
+    int level;
+    int type;
+};
+
+#define CMSG_ALIGN(len) (((len) + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1))
+#define CMSG_LEN(len) (CMSG_ALIGN(sizeof(struct cmsghdr)) + (len))
+#define CMSG_SPACE(len) (CMSG_ALIGN(sizeof(struct cmsghdr)) + CMSG_ALIGN(len))
+#define CMSG_DATA(cmsg) (reinterpret_cast<uint8_t*>(cmsg) + CMSG_ALIGN(sizeof(struct cmsghdr)))
+
 struct poll {
     int fd;
     short events;
@@ -144,9 +160,28 @@ public:
 };
 
 class LocalSocket : public Socket {
+    // Descriptors sent along with data, received with the data at position
+    struct PassedRights {
+        uint64_t position;
+        fs_fd_t** fds;
+        unsigned count;
+        PassedRights* next = nullptr;
+    };
+
     lock_t slock = 0;
+    lock_t rightsLock = 0; // Only ever held with interrupts disabled
 
     List<FilesystemWatcher*> watching;
+
+    PassedRights* rights = nullptr; // Sent to us by the peer and not received yet, oldest first
+    PassedRights* lastRights = nullptr;
+    volatile uint64_t sent = 0; // Bytes (or messages for datagram sockets) written to outbound
+    volatile uint64_t received = 0; // Bytes (or messages) read from inbound
+
+    // Wake anyone watching the peer if it has something to read
+    void SignalPeer();
+    // Take the oldest rights off the list if they were sent before position
+    PassedRights* TakeRights(uint64_t position);
 public:
     LocalSocket* peer = nullptr;
 
@@ -155,6 +190,9 @@ public:
 
     LocalSocket(int type, int protocol);
 
+    // Create two sockets connected to each other, returns 0 on success
+    static int CreatePair(int type, int protocol, LocalSocket* sockets[2]);
+
     int ConnectTo(Socket* client);
     void DisconnectPeer();
 
@@ -174,6 +212,18 @@ public:
     void Watch(FilesystemWatcher& watcher, int events);
     void Unwatch(FilesystemWatcher& watcher);
 
+    // Pass count descriptors to the peer along with whatever is sent next, the socket takes ownership of the descriptors
+    // Returns 0 on success
+    int SendRights(fs_fd_t** fds, unsigned count);
+    // Take back descriptors given to SendRights if nothing has been sent since.
+    // Returns true if they were taken back, in which case the caller owns fds again
+    bool WithdrawRights(fs_fd_t** fds);
+    // Take descriptors sent with the data read since start (a value of ReceivedCount), up to max of them.
+    // Any more are closed and truncated set. Descriptors sent with data read before start
+    // (by reads not asking for them) are closed. Returns the amount taken.
+    unsigned ReceiveRights(uint64_t start, fs_fd_t** fds, unsigned max, bool& truncated);
+    inline uint64_t ReceivedCount() { return received; }
+
     bool CanRead() { if(inbound) return !inbound->Empty(); else return false; }
 };
 
@@ -1,3 +1,206 @@
+#pragma once
+
+#include <stdint.h>
+#include <device.h>
+#include <lock.h>
+#include <scheduler.h>
+
+#define NVME_CAP_MQES(x) ((x) & 0xFFFF) // Maximum queue entries supported (0's based)
+#define NVME_CAP_TO(x) (((x) >> 24) & 0xFF) // Timeout in 500ms units
+#define NVME_CAP_DSTRD(x) (((x) >> 32) & 0xF) // Doorbell stride, 2 ^ (2 + DSTRD) bytes
+#define NVME_CAP_CSS_NVM (1ULL << 37) // NVM command set supported
+#define NVME_CAP_MPSMIN(x) (((x) >> 48) & 0xF) // Minimum page size, 2 ^ (12 + MPSMIN)
+
+#define NVME_CC_EN (1 << 0)
+#define NVME_CC_CSS_NVM (0 << 4)
+#define NVME_CC_MPS(x) ((x) << 7) // Page size, 2 ^ (12 + MPS)
+#define NVME_CC_AMS_RR (0 << 11) // Round robin arbitration
+#define NVME_CC_IOSQES(x) ((x) << 16) // I/O submission queue entry size, 2 ^ n
+#define NVME_CC_IOCQES(x) ((x) << 20) // I/O completion queue entry size, 2 ^ n
+
+#define NVME_CSTS_RDY (1 << 0)
+#define NVME_CSTS_CFS (1 << 1) // Controller fatal status
+
+#define NVME_DOORBELL_BASE 0x1000
+
+#define NVME_ADMIN_DELETE_SQ 0x00
+#define NVME_ADMIN_CREATE_SQ 0x01
+#define NVME_ADMIN_DELETE_CQ 0x04
+#define NVME_ADMIN_CREATE_CQ 0x05
+#define NVME_ADMIN_IDENTIFY 0x06
+#define NVME_ADMIN_SET_FEATURES 0x09
+
+#define NVME_IO_FLUSH 0x00
+#define NVME_IO_WRITE 0x01
+#define NVME_IO_READ 0x02
+
+#define NVME_IDENTIFY_NAMESPACE 0x00
+#define NVME_IDENTIFY_CONTROLLER 0x01
+#define NVME_IDENTIFY_ACTIVE_NAMESPACES 0x02
+
+#define NVME_FEATURE_NUMBER_OF_QUEUES 0x07
+
+#define NVME_QUEUE_PHYS_CONTIG (1 << 0)
+#define NVME_QUEUE_IRQ_ENABLED (1 << 1)
+
+#define NVME_STATUS_PHASE (1 << 0)
+#define NVME_STATUS_CODE(x) (((x) >> 1) & 0x7FF) // Status code and type
+
+#define NVME_ADMIN_QUEUE_DEPTH 32
+#define NVME_IO_QUEUE_DEPTH 32 // Both fit in a page
+#define NVME_MAX_IO_QUEUES 32
+#define NVME_MAX_TRANSFER_PAGES 128 // Most pages in one command, a PRP list page holds 512
+#define NVME_BOUNCE_PAGES 2 // Per command slot, for buffers that cannot be DMAed into directly
+#define NVME_MAX_NAMESPACES 16
+
 namespace NVMe{
+    struct Registers {
+        uint64_t cap; // Controller capabilities
+        uint32_t version;
+        uint32_t intms; // Interrupt mask set
+        uint32_t intmc; // Interrupt mask clear
+        uint32_t cc; // Controller configuration
+        uint32_t rsvd;
+        uint32_t csts; // Controller status
+        uint32_t nssr; // NVM subsystem reset
+        uint32_t aqa; // Admin queue attributes
+        uint64_t asq; // Admin submission queue base address
+        uint64_t acq; // Admin completion queue base address
+    } __attribute__((packed));
+
+    struct Command {
+        uint8_t opcode;
+        uint8_t flags;
+        uint16_t commandID;
+        uint32_t nsID;
+        uint64_t rsvd;
+        uint64_t metadata;
+        uint64_t prp1;
+        uint64_t prp2;
+        uint32_t cdw10;
+        uint32_t cdw11;
+        uint32_t cdw12;
+        uint32_t cdw13;
+        uint32_t cdw14;
+        uint32_t cdw15;
+    } __attribute__((packed));
+
+    struct Completion {
+        uint32_t result;
+        uint32_t rsvd;
+        uint16_t sqHead;
+        uint16_t sqID;
+        uint16_t commandID;
+        uint16_t status;
+    } __attribute__((packed));
+
+    struct IdentifyController {
+        uint16_t vendorID;
+        uint16_t subsystemVendorID;
+        char serialNumber[20];
+        char modelNumber[40];
+        char firmwareRevision[8];
+        uint8_t rab;
+        uint8_t ieee[3];
+        uint8_t cmic;
+        uint8_t mdts; // Maximum data transfer size, 2 ^ n minimum pages (0 is unlimited)
+        uint8_t rsvd[438];
+        uint32_t namespaceCount;
+    } __attribute__((packed));
+
+    struct LBAFormat {
+        uint16_t metadataSize;
+        uint8_t lbaDataSize; // 2 ^ n bytes
+        uint8_t relativePerformance;
+    } __attribute__((packed));
+
+    struct IdentifyNamespace {
+        uint64_t size; // In blocks
+        uint64_t capacity;
+        uint64_t utilization;
+        uint8_t features;
+        uint8_t lbaFormatCount;
+        uint8_t formattedLBASize; // Bits 0-3 are the index of the LBA format in use
+        uint8_t rsvd[101];
+        LBAFormat lbaFormats[16];
+    } __attribute__((packed));
+
+    // A submission and completion queue pair, there is one per CPU (as far as the controller allows)
+    class Queue {
+    public:
+        Queue(uint16_t id, uint16_t depth, bool bounceBuffers);
+
+        // Submit a command transferring size bytes of buffer (if any) and wait for it to complete
+        // Returns the NVMe status code, 0 on success, result is set to dword 0 of the completion
+        int Submit(Command& cmd, uint8_t* buffer = nullptr, uint32_t size = 0, uint32_t* result = nullptr);
+        // Read or write size bytes (rounded up to whole blocks), going through the bounce buffer of the slot if bounce is set
+        int Transfer(uint32_t nsID, uint64_t lba, uint32_t blockSize, uint8_t* buffer, uint32_t size, bool write, bool bounce);
+
+        // Consume new completion entries, interrupts must be disabled
+        void HandleInterrupt();
+
+        inline uint64_t SubmissionQueuePhysical() const { return sqPhys; }
+        inline uint64_t CompletionQueuePhysical() const { return cqPhys; }
+
+        uint16_t id;
+        uint16_t depth;
+        bool polled = true; // No interrupts, waiters poll the completion queue instead
+    private:
+        // A command in a slot, lives on the stack of the thread waiting for it
+        struct Request : public Scheduler::ThreadBlocker {
+            thread_t* thread = nullptr;
+            volatile bool done = false;
+            int status = 0;
+            uint32_t result = 0;
+
+            // The queue lock is held whenever these are called
+            void Block(thread_t* th) final { thread = th; }
+            void Remove(thread_t*) final {} // DMA may still be in progress, the thread has to wait for completion regardless
+        };
+
+        // Take a free slot, blocking until one is available
+        int AcquireSlot();
+        void ReleaseSlot(int slot);
+        // Issue the command in a slot and wait for it to complete
+        int Issue(int slot, Command& cmd, uint32_t* result);
+        // Fill in PRP1 and PRP2 for a buffer, using the PRP list of the slot for more than two pages
+        void BuildPRPs(int slot, Command& cmd, uint8_t* buffer, uint32_t size);
+
+        Command* submissionQueue;
+        volatile Completion* completionQueue;
+        uint64_t sqPhys;
+        uint64_t cqPhys;
+
+        volatile uint32_t* sqDoorbell;
+        volatile uint32_t* cqDoorbell;
+
+        uint16_t sqTail = 0;
+        uint16_t cqHead = 0;
+        uint16_t phase = 1; // Phase of new completion entries, flips every pass through the queue
+
+        uint64_t* prpLists[NVME_IO_QUEUE_DEPTH]; // One page of PRP entries per slot
+        uint64_t prpListPhys[NVME_IO_QUEUE_DEPTH];
+        uint8_t* bounceBuffers[NVME_IO_QUEUE_DEPTH] = {nullptr};
+        Request* requests[NVME_IO_QUEUE_DEPTH] = {nullptr};
+        uint32_t freeSlots = 0;
+
+        lock_t queueLock = 0; // Only ever held with interrupts disabled
+        Semaphore slotSemaphore = Semaphore(0); // Counts free slots
+    };
+
+    class Namespace : public DiskDevice {
+    public:
+        Namespace(uint32_t nsID, IdentifyNamespace& identify);
+
+        int ReadDiskBlock(uint64_t lba, uint32_t count, void* buffer);
+        int WriteDiskBlock(uint64_t lba, uint32_t count, void* buffer);
+
+        uint32_t nsID;
+        uint64_t blockCount;
+    private:
+        // Split a transfer into commands no larger than the controller allows on the queue of the current CPU
+        int Transfer(uint64_t lba, uint32_t size, uint8_t* buffer, bool write);
+    };
+
     void Initialize();
-}
\ No newline at end of file
+}
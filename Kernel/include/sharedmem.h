@@ -1,8 +1,10 @@
 #pragma once
 
 #include <scheduler.h>
+#include <fs/filesystem.h>
 
 #define SMEM_FLAGS_PRIVATE 1
+#define SMEM_FLAGS_HANDLE 2 // Only reachable through a SharedMemoryNode, never by key
 
 typedef struct {
     uintptr_t* pages; // Physical Pages
@@ -11,11 +13,25 @@ typedef struct {
     uint64_t flags; // Flags
     uint64_t key; // Key
     uint64_t mapCount; // Amount of references/mappings
+    uint64_t handleCount; // SharedMemoryNodes referring to it
 
     pid_t owner; // Owner Process
     pid_t recipient; // Recipient Process (if private)
 } shared_mem_t;
 
+// File descriptor for a shared memory object created with SMEM_FLAGS_HANDLE.
+// Holding a descriptor is what allows mapping the object, so it can be handed to another process (e.g. with SCM_RIGHTS)
+// without any key to guess. The object is destroyed once every descriptor is closed and every mapping is gone.
+class SharedMemoryNode : public FsNode {
+    uint64_t key;
+public:
+    SharedMemoryNode(uint64_t key, size_t size);
+
+    void Close();
+
+    inline uint64_t Key() const { return key; }
+};
+
 namespace Memory{
     void InitializeSharedMemory();
 
@@ -25,4 +41,7 @@ namespace Memory{
     uint64_t CreateSharedMemory(uint64_t size, uint64_t flags, pid_t owner, pid_t recipient);
     void* MapSharedMemory(uint64_t key, process_t* proc, uint64_t hint);
     void DestroySharedMemory(uint64_t key);
+
+    // Drop a mapping made by MapSharedMemory once it has been unmapped, destroying the memory if nothing else refers to it
+    void ReleaseSharedMemoryMapping(uint64_t key);
 }
\ No newline at end of file
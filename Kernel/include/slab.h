@@ -0,0 +1,101 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <spin.h>
+
+#define SLAB_MAX_CACHES 24 // Caches registered after this many do not get per-CPU magazines
+#define SLAB_MAGAZINE_SIZE 15 // Objects held by each per-CPU magazine
+#define SLAB_MAGAZINE_BATCH 8 // Objects moved between a magazine and the slabs at once
+#define SLAB_MIN_OBJECTS 8 // Slabs are grown until at least this many objects fit
+#define SLAB_MAX_PAGES 16
+
+#define SLAB_SIZE_CLASS_COUNT 7 // 16 to 1024 bytes
+
+inline void* operator new(size_t, void* ptr) noexcept {
+	return ptr;
+}
+
+// Free objects kept by a CPU for one cache, only touched by that CPU with interrupts disabled
+struct SlabMagazine {
+	void* objects[SLAB_MAGAZINE_SIZE];
+	unsigned count = 0;
+};
+
+struct SlabHeader;
+
+// Cache of fixed size objects carved out of slabs aligned to their size, objects are 16 byte aligned.
+// Constructors are constexpr so that caches with static storage can be used before global constructors are called.
+class SlabCache {
+	friend class SlabInfoDevice;
+protected:
+	const char* name;
+	size_t objectSize;
+
+	unsigned pagesPerSlab = 0;
+	unsigned objectsPerSlab = 0;
+	int index = -1; // Magazine index in each CPU, -1 if there are none
+
+	lock_t lock = 0; // Only ever held with interrupts disabled
+	SlabHeader* partial = nullptr; // Slabs with both free and allocated objects
+	SlabHeader* full = nullptr; // Slabs with no free objects
+	SlabHeader* empty = nullptr; // At most one slab kept around with every object free
+
+	SlabCache* nextCache = nullptr;
+
+	// Statistics
+	unsigned slabCount = 0;
+	unsigned long activeObjects = 0; // Objects handed out and not yet freed
+	unsigned long allocations = 0;
+	unsigned long magazineHits = 0; // Allocations served by a per-CPU magazine
+
+	void Register();
+	SlabHeader* Grow();
+	void DestroySlab(SlabHeader* slab);
+	void* TakeObject();
+	SlabHeader* PutObject(void* obj);
+public:
+	constexpr SlabCache(const char* name, size_t objectSize) : name(name), objectSize((objectSize + 15) & ~15UL) {}
+
+	void* Allocate();
+	void Free(void* obj);
+
+	inline const char* GetName() const {
+		return name;
+	}
+
+	inline size_t GetObjectSize() const {
+		return objectSize;
+	}
+};
+
+// Typed slab cache, objects are constructed on allocation and destroyed when freed
+template<typename T>
+class ObjectCache : public SlabCache {
+public:
+	constexpr ObjectCache(const char* name) : SlabCache(name, sizeof(T)) {}
+
+	template<typename... Args>
+	T* New(Args... args){
+		void* obj = Allocate();
+		return obj ? new (obj) T(args...) : nullptr;
+	}
+
+	void Delete(T* obj){
+		obj->~T();
+		Free(obj);
+	}
+};
+
+namespace Slab{
+	// Start using the per-CPU magazines, GS must point to the CPU local data of every CPU that allocates
+	void EnableCPUCaches();
+
+	// Register /dev/slabinfo
+	void InitializeDevice();
+
+	// Allocate from the smallest size class cache that fits, falls back to kmalloc for large sizes
+	void* Allocate(size_t size);
+	// size must be the same as the one used to allocate
+	void Free(void* obj, size_t size);
+}
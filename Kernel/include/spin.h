@@ -6,13 +6,16 @@ typedef volatile int lock_t;
 #ifdef CHECK_DEADLOCK
 #include <assert.h>
 
+// Spin on a plain read whilst the lock is held so waiting CPUs do not keep stealing the cache line from the owner
 #define acquireLock(lock) ({ \
     volatile unsigned i = 0; \
-    while(__sync_lock_test_and_set(lock, 1) && ++i < 0xFFFFFFF) asm("pause"); \
-    if( i >= 0xFFFFFFF) { assert(!"Deadlock!"); } \
+    while(__sync_lock_test_and_set(lock, 1)) { \
+        while(*(lock) && ++i < 0xFFFFFFF) asm("pause"); \
+        if( i >= 0xFFFFFFF) { assert(!"Deadlock!"); } \
+    } \
     })
 #else
-#define acquireLock(lock) ({while(__sync_lock_test_and_set(lock, 1)) asm("pause");})
+#define acquireLock(lock) ({while(__sync_lock_test_and_set(lock, 1)) { while(*(lock)) asm("pause"); }})
 #endif
 
 #define releaseLock(lock) ({ __sync_lock_release(lock); });
@@ -8,6 +8,8 @@
 #include <scheduler.h>
 
 #define DATASTREAM_BUFSIZE_DEFAULT 1024
+#define DATASTREAM_LEND_MIN 4 // Page aligned writes of at least this many pages lend the pages instead of copying them
+#define DATASTREAM_MAX_LENT_PAGES 512 // Most pages queued at once, further writes are copied
 
 typedef struct {
     uint8_t* data;
@@ -19,7 +21,12 @@ protected:
     List<thread_t*> waiting;
 
 public:
+    // Block until there is something to read
     virtual void Wait();
+    // Block until there is room to write, streams without a limit never block
+    virtual void WaitForSpace() {}
+    // Wake everyone waiting on the stream for good, for when the other end goes away
+    virtual void Hangup() {}
 
     virtual int64_t Read(void* buffer, size_t len);
     virtual int64_t Peek(void* buffer, size_t len);
@@ -31,24 +38,80 @@ public:
     virtual ~Stream();
 };
 
+// Fixed size ring buffer with one reader and one writer at a time.
+// The read and write positions only ever grow and are each advanced by one side, so data moves without a lock,
+// readers and writers are only serialised amongst themselves. The wait lock is only taken to block or when someone is blocked.
+// Large page aligned writes from user memory lend the pages (copy on write) instead of copying them into the ring,
+// the pages are mapped into the reader if it reads into a page aligned buffer and copied otherwise.
 class DataStream final : public Stream {
-    lock_t streamLock = 0;
-
-    size_t bufferSize = 0;
-    size_t bufferPos = 0;
+    // Pages queued between two bytes of the ring
+    struct PageRun {
+        size_t position; // Ring position the run comes before
+        uint64_t* blocks; // One reference to each is held by the run
+        unsigned count;
+        size_t offset = 0; // Bytes read so far
+        uint8_t* mapping = nullptr; // Kernel mapping of the blocks, made the first time the run has to be copied
+        PageRun* next = nullptr;
+    };
 
     uint8_t* buffer = nullptr;
+    size_t capacity; // Power of two
+
+    volatile size_t readPos = 0; // Bytes read so far
+    volatile size_t writePos = 0; // Bytes written so far
+    volatile bool hungUp = false;
+
+    Mutex readLock;
+    Mutex writeLock;
+
+    lock_t waitLock = 0; // Only ever held with interrupts disabled
+    Scheduler::GenericThreadBlocker readers; // Waiting for data
+    Scheduler::GenericThreadBlocker writers; // Waiting for space
+    volatile unsigned readerCount = 0; // Threads in readers or about to be
+    volatile unsigned writerCount = 0;
+
+    lock_t pageLock = 0; // Protects the run list, only ever held with interrupts disabled
+    PageRun* pageRuns = nullptr;
+    PageRun* lastPageRun = nullptr;
+    volatile size_t pageBytes = 0; // Unread bytes in page runs
+    unsigned lentPages = 0; // Pages held by runs, only changed with pageLock held
+
+    // Bytes in the ring
+    inline size_t RingUsed() const {
+        return __atomic_load_n(&writePos, __ATOMIC_SEQ_CST) - __atomic_load_n(&readPos, __ATOMIC_SEQ_CST);
+    }
+
+    inline size_t Available() const {
+        return RingUsed() + __atomic_load_n(&pageBytes, __ATOMIC_SEQ_CST);
+    }
+
+    // Copy len bytes starting at position pos out of the ring
+    void CopyOut(void* data, size_t pos, size_t len);
+    // Read (or peek) data, in order, out of the ring and page runs
+    size_t ReadData(uint8_t* data, size_t len, bool peek);
+    // Lend up to count pages of user memory starting at data to a new run
+    // Returns the amount lent, 0 if too many pages are queued already or they cannot be lent
+    unsigned WritePages(void* data, unsigned count);
+    // Run after run, or the first run if nullptr
+    PageRun* NextPageRun(PageRun* run);
+    void FreePageRun(PageRun* run);
+    // Block until there is data to read (or room to write if writer is set) or the stream is hung up
+    void Block(Scheduler::GenericThreadBlocker& blocker, volatile unsigned& waiterCount, bool writer);
+    void Wake(Scheduler::GenericThreadBlocker& blocker, volatile unsigned& waiterCount);
 public:
     DataStream(size_t bufSize);
     ~DataStream();
 
     void Wait();
+    void WaitForSpace();
+    void Hangup();
 
     int64_t Read(void* buffer, size_t len);
     int64_t Peek(void* buffer, size_t len);
+    // Write as much as there is room for, returns the amount written
     int64_t Write(void* buffer, size_t len);
     
-    int64_t Pos() { return bufferPos; }
+    int64_t Pos() { return Available(); }
     virtual int64_t Empty();
 };
 
@@ -5,6 +5,7 @@
 #include <scheduler.h>
 #include <paging.h>
 #include <physicalallocator.h>
+#include <fs/filesystem.h>
 #include <scheduler.h>
 
 int VerifyELF(void* elf){
@@ -18,52 +19,116 @@ int VerifyELF(void* elf){
     } else return 1;
 }
 
-elf_info_t LoadELFSegments(process_t* proc, void* _elf, uintptr_t base){
-    uint8_t* elf = reinterpret_cast<uint8_t*>(_elf);
+// Copy part of a segment from the file into pages allocated up front, zeroing the rest of the last page
+static void CopySegmentData(process_t* proc, FsNode* node, uint64_t offset, uintptr_t virt, size_t size){
+    if(!size){
+        return;
+    }
+
+    uint8_t* buffer = reinterpret_cast<uint8_t*>(kmalloc(size));
+    if(fs::Read(node, offset, size, buffer) != static_cast<ssize_t>(size)){
+        Log::Warning("Failed to read ELF segment");
+        memset(buffer, 0, size);
+    }
 
+    uintptr_t pageEnd = (virt + size + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1ULL);
+
+    asm("cli");
+    asm volatile("mov %%rax, %%cr3" :: "a"(proc->addressSpace->pml4Phys));
+    memset((void*)virt, 0, pageEnd - virt);
+    memcpy((void*)virt, buffer, size);
+    asm volatile("mov %%rax, %%cr3" :: "a"(Scheduler::GetCurrentProcess()->addressSpace->pml4Phys));
+    asm("sti");
+
+    kfree(buffer);
+}
+
+elf_info_t LoadELFSegments(process_t* proc, FsNode* node, uintptr_t base){
     elf_info_t elfInfo;
     memset(&elfInfo, 0, sizeof(elfInfo));
 
-    if(!VerifyELF(elf)) return elfInfo; // Invalid ELF Header
-
-    elf64_header_t elfHdr = *(elf64_header_t*)elf;
+    elf64_header_t elfHdr;
+    if(fs::Read(node, 0, sizeof(elf64_header_t), (uint8_t*)&elfHdr) != static_cast<ssize_t>(sizeof(elf64_header_t)) || !VerifyELF(&elfHdr)) return elfInfo; // Invalid ELF Header
 
     elfInfo.entry = base + elfHdr.entry;
     elfInfo.phEntrySize = elfHdr.phEntrySize;
     elfInfo.phNum = elfHdr.phNum;
 
+    // Only the program headers are read, segment contents come from the page cache
+    uint8_t* phdrs = reinterpret_cast<uint8_t*>(kmalloc(elfHdr.phNum * elfHdr.phEntrySize));
+    if(fs::Read(node, elfHdr.phOff, elfHdr.phNum * elfHdr.phEntrySize, phdrs) != elfHdr.phNum * elfHdr.phEntrySize){
+        kfree(phdrs);
+        memset(&elfInfo, 0, sizeof(elfInfo));
+        return elfInfo;
+    }
+
     for(uint16_t i = 0; i < elfHdr.phNum; i++){
-        elf64_program_header_t elfPHdr = *((elf64_program_header_t*)(elf + elfHdr.phOff + i * elfHdr.phEntrySize));
+        elf64_program_header_t elfPHdr = *((elf64_program_header_t*)(phdrs + i * elfHdr.phEntrySize));
 
-        if(elfPHdr.memSize == 0) continue;
-        for(unsigned j = 0; j < ((elfPHdr.memSize + (elfPHdr.vaddr & 0xFFF) + 0xFFF) >> 12); j++){
-            uint64_t phys = Memory::AllocatePhysicalMemoryBlock();
-            Memory::MapVirtualMemory4K(phys,base + elfPHdr.vaddr + j * PAGE_SIZE_4K, 1, proc->addressSpace);
+        if(elfPHdr.type != PT_LOAD || elfPHdr.memSize == 0) continue;
+
+        uintptr_t segment = base + elfPHdr.vaddr;
+        uintptr_t start = segment & ~(PAGE_SIZE_4K - 1ULL);
+        uintptr_t fileEnd = (segment + elfPHdr.fileSize + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1ULL);
+        uintptr_t end = (segment + elfPHdr.memSize + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1ULL);
+
+        // Pages entirely covered by file data are mapped private to the file so they get shared with every other process using it,
+        // the partial pages at either end are copied now as they can be shared with other segments or .bss
+        uintptr_t mapStart = (segment + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1ULL);
+        uintptr_t mapEnd = (segment + elfPHdr.fileSize) & ~(PAGE_SIZE_4K - 1ULL);
+        if(mapStart >= mapEnd || (segment - elfPHdr.offset) & (PAGE_SIZE_4K - 1)){
+            mapStart = mapEnd = fileEnd; // Not page aligned in the file, copy it all
+        }
+
+        for(uintptr_t page = start; page < fileEnd; page += PAGE_SIZE_4K){
+            if(page == mapStart){
+                page = mapEnd - PAGE_SIZE_4K;
+                continue;
+            }
+
+            if(!Memory::VirtualToPhysicalAddress(page, proc->addressSpace)){ // Segments can share a page
+                Memory::MapVirtualMemory4K(Memory::AllocatePhysicalMemoryBlock(), page, 1, proc->addressSpace);
+            }
+        }
+
+        if(mapStart < mapEnd){
+            Memory::MapFile(node, elfPHdr.offset + (mapStart - segment), mapStart, (mapEnd - mapStart) / PAGE_SIZE_4K, true, false, proc->addressSpace);
+        }
+
+        // The rest of the segment (.bss) is zeroed on demand
+        if(end > fileEnd){
+            Memory::MapLazyVirtualMemory4K(fileEnd, (end - fileEnd) / PAGE_SIZE_4K, proc->addressSpace);
         }
     }
 
     char* linkPath = nullptr;
 
     for(int i = 0; i < elfHdr.phNum; i++){
-        elf64_program_header_t elfPHdr = *((elf64_program_header_t*)(elf + elfHdr.phOff + i * elfHdr.phEntrySize));
+        elf64_program_header_t elfPHdr = *((elf64_program_header_t*)(phdrs + i * elfHdr.phEntrySize));
         
         if(elfPHdr.type == PT_LOAD && elfPHdr.memSize > 0){
-            asm("cli");
-            asm volatile("mov %%rax, %%cr3" :: "a"(proc->addressSpace->pml4Phys));
-            memset((void*)(base + elfPHdr.vaddr),0,elfPHdr.memSize);
-            memcpy((void*)(base + elfPHdr.vaddr),(void*)(elf + elfPHdr.offset),elfPHdr.fileSize);
-            asm volatile("mov %%rax, %%cr3" :: "a"(Scheduler::GetCurrentProcess()->addressSpace->pml4Phys));
-            asm("sti");
+            uintptr_t segment = base + elfPHdr.vaddr;
+            uintptr_t mapStart = (segment + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1ULL);
+            uintptr_t mapEnd = (segment + elfPHdr.fileSize) & ~(PAGE_SIZE_4K - 1ULL);
+
+            if(mapStart >= mapEnd || (segment - elfPHdr.offset) & (PAGE_SIZE_4K - 1)){
+                CopySegmentData(proc, node, elfPHdr.offset, segment, elfPHdr.fileSize);
+            } else {
+                // Only touch the pages that were allocated up front
+                CopySegmentData(proc, node, elfPHdr.offset, segment, mapStart - segment);
+                CopySegmentData(proc, node, elfPHdr.offset + (mapEnd - segment), mapEnd, segment + elfPHdr.fileSize - mapEnd);
+            }
         } else if (elfPHdr.type == PT_PHDR) {
             elfInfo.pHdrSegment = base + elfPHdr.vaddr;
         } else if(elfPHdr.type == PT_INTERP){
             linkPath = (char*)kmalloc(elfPHdr.fileSize + 1);
-            strncpy(linkPath, (char*)(elf + elfPHdr.offset), elfPHdr.fileSize);
+            fs::Read(node, elfPHdr.offset, elfPHdr.fileSize, (uint8_t*)linkPath);
             linkPath[elfPHdr.fileSize] = 0; // Null terminate the path
 
             elfInfo.linkerPath = linkPath;
         }
     }
 
+    kfree(phdrs);
     return elfInfo;
-}
\ No newline at end of file
+}
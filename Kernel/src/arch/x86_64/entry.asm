@@ -201,7 +201,7 @@ entry:
   wrmsr
 
   mov eax, cr0
-  or eax, 1 << 31
+  or eax, 1 << 31 | 1 << 16 ; Paging, Write protect (the kernel must fault on copy on write pages too)
   mov cr0, eax
 
   lgdt [GDT64Pointer]
@@ -28,6 +28,7 @@ namespace HAL{
     bool debugMode = false;
     bool disableSMP = false;
     bool useKCon = false;
+    bool runBenchmarks = false; // Run the kernel micro-benchmarks once devices are initialized
     VideoConsole* con;
 
     void InitCore(multiboot2_info_header_t* mbInfo){ // ALWAYS call this first
@@ -143,6 +144,7 @@ namespace HAL{
                 if(strcmp(cmdLine, "debug") == 0) debugMode = true;
                 else if(strcmp(cmdLine, "nosmp") == 0) disableSMP = true;
                 else if(strcmp(cmdLine, "kcon") == 0) useKCon = true;
+                else if(strcmp(cmdLine, "bench") == 0) runBenchmarks = true;
                 cmdLine = strtok(NULL, " ");
             }
         }
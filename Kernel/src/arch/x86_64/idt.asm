@@ -145,6 +145,9 @@ ISR_ERROR_CODE 30
 ISR_NO_ERROR_CODE 31
 ISR_NO_ERROR_CODE 32
 ISR_NO_ERROR_CODE 0x69 ; Syscall
+IPI 0xFA ; IPI_PAGE_CACHE_DRAIN
+IPI 0xFB ; IPI_TLB_FLUSH
+IPI 0xFC ; LAPIC_TIMER
 IPI 0xFD ; IPI_SCHEDULE
 IPI 0xFE ; IPI_HALT
 
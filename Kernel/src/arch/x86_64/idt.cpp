@@ -115,6 +115,12 @@ void irq15();
 extern "C"
 void isr0x69();
 
+extern "C"
+void ipi0xFA(); // IPI_PAGE_CACHE_DRAIN
+extern "C"
+void ipi0xFB(); // IPI_TLB_FLUSH
+extern "C"
+void ipi0xFC(); // LAPIC_TIMER
 extern "C"
 void ipi0xFD(); // IPI_SCHEDULE
 extern "C"
@@ -186,6 +192,9 @@ namespace IDT{
 		SetGate(30, (uint64_t)isr30,0x08,0x8E);
 		SetGate(31, (uint64_t)isr31,0x08,0x8E);
 		SetGate(0x69, (uint64_t)isr0x69, 0x08, 0xEE /* Allow syscalls to be called from user mode*/, 0); // Syscall
+		SetGate(IPI_PAGE_CACHE_DRAIN, (uint64_t)ipi0xFA,0x08,0x8E);
+		SetGate(IPI_TLB_FLUSH, (uint64_t)ipi0xFB,0x08,0x8E);
+		SetGate(LAPIC_TIMER, (uint64_t)ipi0xFC,0x08,0x8E);
 		SetGate(IPI_SCHEDULE, (uint64_t)ipi0xFD,0x08,0x8E);
 		SetGate(IPI_HALT, (uint64_t)ipi0xFE,0x08,0x8E);
 
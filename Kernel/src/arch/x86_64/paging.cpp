@@ -10,6 +10,10 @@
 #include <panic.h>
 #include <apic.h>
 #include <strace.h>
+#include <cpu.h>
+#include <smp.h>
+#include <fs/filesystem.h>
+#include <fs/pagecache.h>
 
 //extern uint32_t kernel_end;
 
@@ -29,6 +33,10 @@ namespace Memory{
 	page_t kernelHeapDirTables[TABLES_PER_DIR][PAGES_PER_TABLE] __attribute__((aligned(4096)));
 	page_dir_t ioDirs[4] __attribute__((aligned(4096)));
 
+	volatile uint64_t tlbGeneration = 0; // Incremented for every TLB shootdown
+
+	void TLBFlushHandler(regs64_t* r);
+
 	uint64_t VirtualToPhysicalAddress(uint64_t addr) {
 		uint64_t address = 0;
 
@@ -70,9 +78,26 @@ namespace Memory{
 		return address;
 	}
 
+	uint64_t GetPageEntry(uint64_t addr, address_space_t* addressSpace){
+		if(PML4_GET_INDEX(addr) != 0){
+			return 0; // Not in the process address space
+		}
+
+		uint32_t pdptIndex = PDPT_GET_INDEX(addr);
+		uint32_t pageDirIndex = PAGE_DIR_GET_INDEX(addr);
+		uint32_t pageTableIndex = PAGE_TABLE_GET_INDEX(addr);
+
+		if((addressSpace->pageDirs[pdptIndex][pageDirIndex] & 0x1) && addressSpace->pageTables[pdptIndex][pageDirIndex]){
+			return addressSpace->pageTables[pdptIndex][pageDirIndex][pageTableIndex];
+		}
+
+		return 0;
+	}
+
 	void InitializeVirtualMemory()
 	{
 		IDT::RegisterInterruptHandler(14,PageFaultHandler);
+		IDT::RegisterInterruptHandler(IPI_TLB_FLUSH, TLBFlushHandler);
 		memset(kernelPML4, 0, sizeof(pml4_t));
 		memset(kernelPDPT, 0, sizeof(pdpt_t));
 		memset(kernelHeapDir, 0, sizeof(page_dir_t));
@@ -109,6 +134,8 @@ namespace Memory{
 
 	address_space_t* CreateAddressSpace(){
 		address_space_t* addressSpace = (address_space_t*)kmalloc(sizeof(address_space_t));
+		addressSpace->lock = 0;
+		addressSpace->fileMappings = nullptr;
 		
 		pdpt_entry_t* pdpt = (pdpt_entry_t*)Memory::KernelAllocate4KPages(1); // PDPT;
 		uintptr_t pdptPhys = Memory::AllocatePhysicalMemoryBlock();
@@ -160,12 +187,12 @@ namespace Memory{
 			for(int j = 0; j < TABLES_PER_DIR; j++){
 				pd_entry_t dirEnt = addressSpace->pageDirs[i][j];
 				if(dirEnt & PAGE_PRESENT){
-					uint64_t phys = GetPageFrame(dirEnt);
+					uint64_t phys = dirEnt & PAGE_FRAME;
 
 					for(int k = 0; k < PAGES_PER_TABLE; k++){
-						if(addressSpace->pageTables[i][j][k] & 0x1){
-							uint64_t pagePhys = GetPageFrame(addressSpace->pageTables[i][j][k]);
-							FreePhysicalMemoryBlock(pagePhys);
+						page_t page = addressSpace->pageTables[i][j][k];
+						if((page & (PAGE_PRESENT | PAGE_USER)) == (PAGE_PRESENT | PAGE_USER) && !(page & PAGE_SHARED)){
+							FreePhysicalMemoryBlock(page & PAGE_FRAME); // Drops one reference if the block is shared copy on write
 						}
 					}
 
@@ -195,11 +222,11 @@ namespace Memory{
 			return 0;
 		}
 
-		if(!((addressSpace->pageTables[PDPT_GET_INDEX(addr)][PAGE_DIR_GET_INDEX(addr)][PAGE_TABLE_GET_INDEX(addr)] & (PAGE_PRESENT)) && addressSpace->pageTables[PDPT_GET_INDEX(addr)][PAGE_DIR_GET_INDEX(addr)][PAGE_TABLE_GET_INDEX(addr)] & (PAGE_USER))){
+		if(!((addressSpace->pageTables[PDPT_GET_INDEX(addr)][PAGE_DIR_GET_INDEX(addr)][PAGE_TABLE_GET_INDEX(addr)] & (PAGE_PRESENT | PAGE_LAZY)) && addressSpace->pageTables[PDPT_GET_INDEX(addr)][PAGE_DIR_GET_INDEX(addr)][PAGE_TABLE_GET_INDEX(addr)] & (PAGE_USER))){ // Lazy pages get allocated when the kernel touches them
 			return 0;
 		}
 		
-		if(!((addressSpace->pageTables[PDPT_GET_INDEX(addr + len)][PAGE_DIR_GET_INDEX(addr + len)][PAGE_TABLE_GET_INDEX(addr + len)] & (PAGE_PRESENT)) && addressSpace->pageTables[PDPT_GET_INDEX(addr + len)][PAGE_DIR_GET_INDEX(addr + len)][PAGE_TABLE_GET_INDEX(addr + len)] & (PAGE_USER))){
+		if(!((addressSpace->pageTables[PDPT_GET_INDEX(addr + len)][PAGE_DIR_GET_INDEX(addr + len)][PAGE_TABLE_GET_INDEX(addr + len)] & (PAGE_PRESENT | PAGE_LAZY)) && addressSpace->pageTables[PDPT_GET_INDEX(addr + len)][PAGE_DIR_GET_INDEX(addr + len)][PAGE_TABLE_GET_INDEX(addr + len)] & (PAGE_USER))){
 			return 0;
 		}
 
@@ -244,7 +271,7 @@ namespace Memory{
 			for(int i = 0; i < TABLES_PER_DIR; i++){
 				if(addressSpace->pageDirs[d][i] & 0x1 && !(addressSpace->pageDirs[d][i] & 0x80)){
 					for(int j = 0; j < PAGES_PER_TABLE; j++){
-						if(addressSpace->pageTables[d][i][j] & 0x1){
+						if(addressSpace->pageTables[d][i][j]){ // Lazy pages are not present but still in use
 							pageDirOffset = i;
 							offset = j+1;
 							counter = 0;
@@ -509,6 +536,10 @@ namespace Memory{
 	}
 
 	void MapVirtualMemory4K(uint64_t phys, uint64_t virt, uint64_t amount, address_space_t* addressSpace){
+		MapVirtualMemory4K(phys, virt, amount, 0, addressSpace);
+	}
+
+	void MapVirtualMemory4K(uint64_t phys, uint64_t virt, uint64_t amount, uint64_t flags, address_space_t* addressSpace){
 		uint64_t pml4Index, pdptIndex, pageDirIndex, pageIndex;
 
 		//phys &= ~(PAGE_SIZE_4K-1);
@@ -525,8 +556,7 @@ namespace Memory{
 
 			if(!(addressSpace->pageDirs[pdptIndex][pageDirIndex] & 0x1)) CreatePageTable(pdptIndex,pageDirIndex,addressSpace); // If we don't have a page table at this address, create one.
 			
-			SetPageFrame(&(addressSpace->pageTables[pdptIndex][pageDirIndex][pageIndex]), phys);
-			addressSpace->pageTables[pdptIndex][pageDirIndex][pageIndex] |= PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER;
+			addressSpace->pageTables[pdptIndex][pageDirIndex][pageIndex] = (phys & PAGE_FRAME) | PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER | flags;
 
 			invlpg(virt);
 
@@ -535,6 +565,540 @@ namespace Memory{
 		}
 	}
 
+	void MapLazyVirtualMemory4K(uint64_t virt, uint64_t amount, address_space_t* addressSpace){
+		uint64_t pml4Index, pdptIndex, pageDirIndex, pageIndex;
+
+		while(amount--){
+			pml4Index = PML4_GET_INDEX(virt);
+			pdptIndex = PDPT_GET_INDEX(virt);
+			pageDirIndex = PAGE_DIR_GET_INDEX(virt);
+			pageIndex = PAGE_TABLE_GET_INDEX(virt);
+
+			const char* panic[1] = {"Process address space cannot be >512GB"};
+			if(pdptIndex > MAX_PDPT_INDEX || pml4Index) KernelPanic(panic,1);
+
+			if(!(addressSpace->pageDirs[pdptIndex][pageDirIndex] & 0x1)) CreatePageTable(pdptIndex,pageDirIndex,addressSpace);
+
+			page_t* page = &addressSpace->pageTables[pdptIndex][pageDirIndex][pageIndex];
+			if(!(*page & PAGE_USER)){ // Either free or only reserved by Allocate4KPages
+				*page = PAGE_LAZY | PAGE_WRITABLE | PAGE_USER; // Not present so there is nothing to invalidate
+			}
+
+			virt += PAGE_SIZE_4K;
+		}
+	}
+
+	// Page table entry of a user address, nullptr if there is no page table for it
+	inline page_t* GetUserPage(uint64_t virt, address_space_t* addressSpace){
+		if(!(addressSpace->pageDirs[PDPT_GET_INDEX(virt)][PAGE_DIR_GET_INDEX(virt)] & PAGE_PRESENT)){
+			return nullptr;
+		}
+
+		return &addressSpace->pageTables[PDPT_GET_INDEX(virt)][PAGE_DIR_GET_INDEX(virt)][PAGE_TABLE_GET_INDEX(virt)];
+	}
+
+	// File mapping containing an address, the address space lock must be held
+	FileMapping* FindFileMapping(uint64_t virt, address_space_t* addressSpace){
+		for(FileMapping* mapping = addressSpace->fileMappings; mapping; mapping = mapping->next){
+			if(virt >= mapping->base && virt < mapping->base + mapping->pageCount * PAGE_SIZE_4K){
+				return mapping;
+			}
+		}
+
+		return nullptr;
+	}
+
+	address_space_t* CloneAddressSpace(address_space_t* addressSpace){
+		address_space_t* clone = CreateAddressSpace();
+
+		asm("cli");
+		acquireLock(&addressSpace->lock);
+
+		for(FileMapping* mapping = addressSpace->fileMappings; mapping; mapping = mapping->next){
+			FileMapping* copy = (FileMapping*)kmalloc(sizeof(FileMapping));
+			*copy = *mapping;
+			copy->handle = fs::Open(mapping->handle->node);
+
+			copy->next = clone->fileMappings;
+			clone->fileMappings = copy;
+		}
+
+		for(int i = 0; i < DIRS_PER_PDPT; i++){
+			for(int j = 0; j < TABLES_PER_DIR; j++){
+				if(!(addressSpace->pageDirs[i][j] & PAGE_PRESENT)){
+					continue;
+				}
+
+				page_t* table = addressSpace->pageTables[i][j];
+				for(int k = 0; k < PAGES_PER_TABLE; k++){
+					page_t page = table[k];
+					if(!page){
+						continue;
+					}
+
+					if((page & (PAGE_PRESENT | PAGE_USER)) == (PAGE_PRESENT | PAGE_USER) && !(page & PAGE_SHARED)){
+						FileMapping* mapping = (page & PAGE_FILE) ? FindFileMapping(i * PAGE_SIZE_1G + j * PAGE_SIZE_2M + k * PAGE_SIZE_4K, addressSpace) : nullptr;
+						if((page & PAGE_WRITABLE) && !(mapping && mapping->shared)){ // Shared file pages stay shared
+							page = (page & ~PAGE_WRITABLE) | PAGE_COW;
+							table[k] = page;
+						}
+
+						SharePhysicalMemoryBlock(page & PAGE_FRAME);
+					} // Lazy pages, shared pages and reservations are copied as they are
+
+					if(!(clone->pageDirs[i][j] & PAGE_PRESENT)){
+						CreatePageTable(i, j, clone);
+					}
+					clone->pageTables[i][j][k] = page;
+				}
+			}
+		}
+
+		releaseLock(&addressSpace->lock);
+
+		// Pages that were writable are now copy on write so get rid of any writable TLB entries
+		asm volatile("mov %%cr3, %%rax; mov %%rax, %%cr3" ::: "rax", "memory");
+		asm("sti");
+		FlushOtherTLBs(true);
+
+		return clone;
+	}
+
+	void MapFile(FsNode* node, uint64_t offset, uint64_t virt, uint64_t amount, bool writable, bool shared, address_space_t* addressSpace){
+		FileMapping* mapping = (FileMapping*)kmalloc(sizeof(FileMapping));
+		mapping->base = virt;
+		mapping->pageCount = amount;
+		mapping->offset = offset;
+		mapping->handle = fs::Open(node);
+		mapping->shared = shared;
+
+		bool ints = CheckInterrupts();
+		asm("cli");
+		acquireLock(&addressSpace->lock);
+
+		for(uint64_t i = 0; i < amount; i++, virt += PAGE_SIZE_4K){
+			const char* panic[1] = {"Process address space cannot be >512GB"};
+			if(PDPT_GET_INDEX(virt) > MAX_PDPT_INDEX || PML4_GET_INDEX(virt)) KernelPanic(panic,1);
+
+			if(!(addressSpace->pageDirs[PDPT_GET_INDEX(virt)][PAGE_DIR_GET_INDEX(virt)] & 0x1)) CreatePageTable(PDPT_GET_INDEX(virt),PAGE_DIR_GET_INDEX(virt),addressSpace);
+
+			page_t* page = GetUserPage(virt, addressSpace);
+			if((*page & (PAGE_PRESENT | PAGE_USER)) == (PAGE_PRESENT | PAGE_USER) && !(*page & PAGE_SHARED)){
+				FreePhysicalMemoryBlock(*page & PAGE_FRAME); // Whatever was mapped here gets replaced
+			}
+
+			*page = PAGE_FILE | PAGE_LAZY | PAGE_USER | (writable ? PAGE_WRITABLE : 0);
+			invlpg(virt);
+		}
+
+		mapping->next = addressSpace->fileMappings;
+		addressSpace->fileMappings = mapping;
+
+		releaseLock(&addressSpace->lock);
+		if(ints) asm("sti");
+	}
+
+	// Unmap the pages of a file mapping from virt, the address space lock must be held
+	// Pages that were written to through a shared mapping are marked dirty in the page cache
+	void UnmapFilePages(FileMapping* mapping, uint64_t virt, uint64_t amount, address_space_t* addressSpace){
+		for(; amount; amount--, virt += PAGE_SIZE_4K){
+			page_t* page = GetUserPage(virt, addressSpace);
+			if(!page || !(*page & PAGE_FILE)){
+				continue;
+			}
+
+			if(*page & PAGE_PRESENT){
+				uint64_t phys = *page & PAGE_FRAME;
+				if(mapping->shared && (*page & PAGE_DIRTY)){
+					CachedPage* cached = PageCache::TryGetFilePage(mapping->handle->node, (mapping->offset + virt - mapping->base) / PAGE_SIZE_4K);
+					if(cached){
+						if(cached->physical == phys){
+							PageCache::MarkDirty(cached);
+						}
+						PageCache::ReleasePage(cached);
+					}
+				}
+
+				FreePhysicalMemoryBlock(phys); // Drops our reference, the page cache keeps the block
+			}
+
+			*page = 0;
+			invlpg(virt);
+		}
+	}
+
+	// Whether amount pages at virt are all user pages with page tables, and within the address space
+	inline bool CheckUserPages(uint64_t virt, uint64_t amount, address_space_t* addressSpace){
+		if((virt & (PAGE_SIZE_4K - 1)) || PML4_GET_INDEX(virt) || PML4_GET_INDEX(virt + amount * PAGE_SIZE_4K - 1)){
+			return false;
+		}
+
+		for(uint64_t i = 0; i < amount; i++){
+			page_t* page = GetUserPage(virt + i * PAGE_SIZE_4K, addressSpace);
+			if(!page || !(*page & PAGE_USER) || (*page & (PAGE_SHARED | PAGE_FILE))){
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	bool LendPages(uint64_t virt, uint64_t amount, uint64_t* blocks, address_space_t* addressSpace){
+		if(!addressSpace){
+			return false;
+		}
+
+		asm("cli");
+		acquireLock(&addressSpace->lock);
+
+		bool lendable = CheckUserPages(virt, amount, addressSpace);
+		for(uint64_t i = 0; lendable && i < amount; i++){
+			lendable = *GetUserPage(virt + i * PAGE_SIZE_4K, addressSpace) & PAGE_PRESENT; // Lazy pages are still zero, nothing worth lending
+		}
+
+		if(!lendable){
+			releaseLock(&addressSpace->lock);
+			asm("sti");
+			return false;
+		}
+
+		for(uint64_t i = 0; i < amount; i++, virt += PAGE_SIZE_4K){
+			page_t* page = GetUserPage(virt, addressSpace);
+			if(*page & PAGE_WRITABLE){
+				*page = (*page & ~(uint64_t)PAGE_WRITABLE) | PAGE_COW;
+				invlpg(virt);
+			}
+
+			blocks[i] = *page & PAGE_FRAME;
+			SharePhysicalMemoryBlock(blocks[i]);
+		}
+
+		releaseLock(&addressSpace->lock);
+		asm("sti");
+
+		// Nothing may write to the blocks through a stale writable entry once they are handed over
+		thread_t* thread = GetCurrentThread();
+		if(thread->parent && thread->parent->threadCount > 1){
+			FlushOtherTLBs(true);
+		}
+
+		return true;
+	}
+
+	bool MapLentPages(uint64_t virt, uint64_t amount, const uint64_t* blocks, address_space_t* addressSpace){
+		if(!addressSpace){
+			return false;
+		}
+
+		uint64_t* replaced = (uint64_t*)kmalloc(amount * sizeof(uint64_t));
+		uint64_t replacedCount = 0;
+
+		asm("cli");
+		acquireLock(&addressSpace->lock);
+
+		bool mappable = CheckUserPages(virt, amount, addressSpace);
+		for(uint64_t i = 0; mappable && i < amount; i++){
+			mappable = *GetUserPage(virt + i * PAGE_SIZE_4K, addressSpace) & (PAGE_WRITABLE | PAGE_COW);
+		}
+
+		if(!mappable){
+			releaseLock(&addressSpace->lock);
+			asm("sti");
+
+			kfree(replaced);
+			return false;
+		}
+
+		for(uint64_t i = 0; i < amount; i++, virt += PAGE_SIZE_4K){
+			page_t* page = GetUserPage(virt, addressSpace);
+			if(*page & PAGE_PRESENT){
+				replaced[replacedCount++] = *page & PAGE_FRAME;
+			}
+
+			SharePhysicalMemoryBlock(blocks[i]);
+			*page = (blocks[i] & PAGE_FRAME) | PAGE_PRESENT | PAGE_USER | PAGE_COW;
+			invlpg(virt);
+		}
+
+		releaseLock(&addressSpace->lock);
+		asm("sti");
+
+		// Other threads must stop using the old blocks before they are freed
+		thread_t* thread = GetCurrentThread();
+		if(replacedCount && thread->parent && thread->parent->threadCount > 1){
+			FlushOtherTLBs(true);
+		}
+
+		for(uint64_t i = 0; i < replacedCount; i++){
+			FreePhysicalMemoryBlock(replaced[i]);
+		}
+		kfree(replaced);
+
+		return true;
+	}
+
+	bool UnmapFile(uint64_t virt, uint64_t amount, address_space_t* addressSpace){
+		uint64_t end = virt + amount * PAGE_SIZE_4K;
+		FileMapping* closed = nullptr; // Mappings to be closed once the lock is released
+		bool found = false;
+
+		asm("cli");
+		acquireLock(&addressSpace->lock);
+
+		FileMapping* prev = nullptr;
+		FileMapping* mapping = addressSpace->fileMappings;
+		while(mapping){
+			uint64_t mappingEnd = mapping->base + mapping->pageCount * PAGE_SIZE_4K;
+			if(mapping->base >= end || mappingEnd <= virt){
+				prev = mapping;
+				mapping = mapping->next;
+				continue;
+			}
+
+			found = true;
+
+			uint64_t first = mapping->base > virt ? mapping->base : virt;
+			uint64_t last = mappingEnd < end ? mappingEnd : end;
+			UnmapFilePages(mapping, first, (last - first) / PAGE_SIZE_4K, addressSpace);
+
+			if(first == mapping->base && last == mappingEnd){
+				FileMapping* next = mapping->next;
+				if(prev){ // Unmapped entirely
+					prev->next = next;
+				} else {
+					addressSpace->fileMappings = next;
+				}
+
+				mapping->next = closed;
+				closed = mapping;
+				mapping = next;
+				continue;
+			}
+
+			if(first == mapping->base){ // Start unmapped
+				mapping->offset += last - mapping->base;
+				mapping->base = last;
+				mapping->pageCount = (mappingEnd - last) / PAGE_SIZE_4K;
+			} else {
+				if(last != mappingEnd){ // Middle unmapped, split the end off into its own mapping
+					FileMapping* tail = (FileMapping*)kmalloc(sizeof(FileMapping));
+					*tail = *mapping;
+					tail->base = last;
+					tail->offset += last - mapping->base;
+					tail->pageCount = (mappingEnd - last) / PAGE_SIZE_4K;
+					tail->handle = fs::Open(mapping->handle->node);
+
+					mapping->next = tail;
+				}
+
+				mapping->pageCount = (first - mapping->base) / PAGE_SIZE_4K;
+			}
+
+			prev = mapping;
+			mapping = mapping->next;
+		}
+
+		releaseLock(&addressSpace->lock);
+		asm("sti");
+
+		if(found){
+			FlushOtherTLBs(true);
+		}
+
+		while(closed){
+			FileMapping* next = closed->next;
+			fs::Close(closed->handle);
+			kfree(closed);
+			closed = next;
+		}
+
+		return found;
+	}
+
+	void ReleaseFileMappings(address_space_t* addressSpace){
+		asm("cli");
+		acquireLock(&addressSpace->lock);
+
+		FileMapping* mappings = addressSpace->fileMappings;
+		addressSpace->fileMappings = nullptr;
+
+		for(FileMapping* mapping = mappings; mapping; mapping = mapping->next){
+			UnmapFilePages(mapping, mapping->base, mapping->pageCount, addressSpace);
+		}
+
+		releaseLock(&addressSpace->lock);
+		asm("sti");
+
+		while(mappings){
+			FileMapping* next = mappings->next;
+			fs::Close(mappings->handle);
+			kfree(mappings);
+			mappings = next;
+		}
+	}
+
+	// Map the cached page of a file to a lazy file page, the address space lock is held
+	// If canBlock is set the lock is dropped with interrupts enabled whilst the page is read in
+	bool HandleFilePageFault(uintptr_t virt, bool canBlock, address_space_t* addressSpace){
+		FileMapping* mapping = FindFileMapping(virt, addressSpace);
+		if(!mapping){
+			return false;
+		}
+
+		FsNode* node = mapping->handle->node;
+		uint64_t index = (mapping->offset + virt - mapping->base) / PAGE_SIZE_4K;
+
+		CachedPage* cached = PageCache::TryGetFilePage(node, index);
+		if(!cached){
+			if(!canBlock){
+				return false;
+			}
+
+			releaseLock(&addressSpace->lock);
+			asm("sti");
+
+			cached = PageCache::GetFilePage(node, index);
+
+			asm("cli");
+			acquireLock(&addressSpace->lock);
+
+			if(!cached){
+				return false; // Failed to read the file
+			}
+		}
+
+		page_t* page = GetUserPage(virt, addressSpace);
+		if((*page & (PAGE_FILE | PAGE_PRESENT)) != PAGE_FILE || FindFileMapping(virt, addressSpace) != mapping){
+			PageCache::ReleasePage(cached); // Changed whilst the lock was dropped, fault again if need be
+			return true;
+		}
+
+		SharePhysicalMemoryBlock(cached->physical);
+
+		uint64_t flags = PAGE_FILE | PAGE_PRESENT | PAGE_USER;
+		if(*page & PAGE_WRITABLE){
+			flags |= mapping->shared ? PAGE_WRITABLE : PAGE_COW; // The page cache keeps its reference so a private write always copies
+		}
+
+		*page = (cached->physical & PAGE_FRAME) | flags;
+		invlpg(virt);
+
+		PageCache::ReleasePage(cached);
+		return true;
+	}
+
+	void TLBFlushHandler(regs64_t* r){
+		uint64_t generation = __atomic_load_n(&tlbGeneration, __ATOMIC_ACQUIRE);
+		asm volatile("mov %%cr3, %%rax; mov %%rax, %%cr3" ::: "rax", "memory");
+
+		GetCPULocal()->tlbGeneration = generation;
+	}
+
+	void FlushOtherTLBs(bool wait){
+		if(SMP::processorCount <= 1){
+			return;
+		}
+
+		uint64_t generation = __atomic_add_fetch(&tlbGeneration, 1, __ATOMIC_ACQ_REL);
+		APIC::Local::SendIPI(0, ICR_DSH_OTHER /* Send to all other processors except us */, ICR_MESSAGE_TYPE_FIXED, IPI_TLB_FLUSH);
+
+		if(!wait){
+			return;
+		}
+
+		// Other CPUs may be waiting on us at the same time so interrupts have to stay enabled
+		CPU* self = GetCPULocal();
+		for(unsigned i = 0; i < SMP::processorCount; i++){
+			CPU* cpu = SMP::cpus[i];
+			if(cpu == self){
+				continue;
+			}
+
+			while(cpu->tlbGeneration < generation){
+				asm("pause");
+			}
+		}
+	}
+
+	// Resolve a fault on a lazily allocated, file backed or copy on write page of the running process
+	// canBlock is set if interrupts were enabled when the fault happened so the page can be read from disk
+	// Returns false if the fault was caused by none of them
+	bool HandleUserPageFault(uintptr_t address, bool canBlock){
+		thread_t* thread = GetCurrentThread(); // GetCurrentProcess would enable interrupts
+		if(!thread || !thread->parent || PML4_GET_INDEX(address)){
+			return false;
+		}
+
+		address_space_t* addressSpace = thread->parent->addressSpace;
+
+		uint64_t cr3;
+		asm volatile("mov %%cr3, %0" : "=r"(cr3));
+		if(!addressSpace || cr3 != addressSpace->pml4Phys){
+			return false; // Another address space is loaded, e.g. whilst a new process is being set up
+		}
+
+		uint64_t pdptIndex = PDPT_GET_INDEX(address);
+		uint64_t pageDirIndex = PAGE_DIR_GET_INDEX(address);
+		if(!(addressSpace->pageDirs[pdptIndex][pageDirIndex] & PAGE_PRESENT)){
+			return false;
+		}
+
+		uintptr_t virt = address & ~(PAGE_SIZE_4K - 1ULL);
+		bool handled = true;
+		uint64_t replaced = 0; // Original of a copied page, freed once no CPU can be reading it
+
+		acquireLock(&addressSpace->lock);
+		page_t* page = &addressSpace->pageTables[pdptIndex][pageDirIndex][PAGE_TABLE_GET_INDEX(address)];
+
+		if((*page & (PAGE_FILE | PAGE_PRESENT)) == PAGE_FILE){
+			handled = HandleFilePageFault(virt, canBlock, addressSpace);
+		} else if((*page & (PAGE_LAZY | PAGE_PRESENT)) == PAGE_LAZY){
+			*page = (*page & ~(uint64_t)PAGE_LAZY) | (AllocatePhysicalMemoryBlock() & PAGE_FRAME) | PAGE_PRESENT;
+			invlpg(virt);
+
+			memset((void*)virt, 0, PAGE_SIZE_4K);
+		} else if((*page & (PAGE_COW | PAGE_PRESENT)) == (PAGE_COW | PAGE_PRESENT)){
+			uint64_t phys = *page & PAGE_FRAME;
+
+			if(IsPhysicalMemoryBlockShared(phys)){
+				uint64_t copy = AllocatePhysicalMemoryBlock();
+
+				void* temp = KernelAllocate4KPages(1);
+				KernelMapVirtualMemory4K(copy, (uintptr_t)temp, 1);
+				memcpy(temp, (void*)virt, PAGE_SIZE_4K);
+				KernelFree4KPages(temp, 1);
+
+				SetPageFrame(page, copy);
+				replaced = phys;
+			} // Otherwise every other reference has already been dropped so take the block over
+
+			*page = (*page & ~(uint64_t)PAGE_COW) | PAGE_WRITABLE;
+			invlpg(virt);
+		} else if((*page & (PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER)) == (PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER)){
+			invlpg(virt); // Stale TLB entry from before another CPU resolved the fault
+		} else {
+			handled = false;
+		}
+
+		releaseLock(&addressSpace->lock);
+
+		if(replaced){
+			// Other threads must not keep reading the original through a stale entry once it goes to someone else
+			if(thread->parent->threadCount > 1){
+				if(canBlock){
+					asm("sti"); // Other CPUs may be waiting on us at the same time
+				}
+
+				FlushOtherTLBs(true);
+				asm("cli");
+			}
+
+			FreePhysicalMemoryBlock(replaced); // Drop our reference to the original
+		}
+
+		return handled;
+	}
+
 	uintptr_t GetIOMapping(uintptr_t addr){
 		if(addr > 0xffffffff){ // Typically most MMIO will not reside > 4GB, but check just in case
 			Log::Error("MMIO >4GB current unsupported");
@@ -551,14 +1115,19 @@ namespace Memory{
 	void PageFaultHandler(regs64_t* regs)
 	{
 		asm("cli");
+
+		uint64_t faultAddress;
+		asm volatile("movq %%cr2, %0" : "=r" (faultAddress));
+
+		if(HandleUserPageFault(faultAddress, regs->rflags & 0x200 /* Interrupt flag */)){
+			return;
+		}
+
 		Log::Error("Page Fault!\r\n");
 		Log::SetVideoConsole(nullptr);
 
 		int err_code = IDT::GetErrCode();
 
-		uint64_t faultAddress;
-		asm volatile("movq %%cr2, %0" : "=r" (faultAddress));
-
 		int present = !(err_code & 0x1); // Page not present
 		int rw = err_code & 0x2;           // Attempted write to read only page
 		int us = err_code & 0x4;           // Processor was in user-mode and tried to access kernel page
@@ -6,6 +6,7 @@
 #include <acpi.h>
 #include <apic.h>
 #include <idt.h>
+#include <paging.h>
 
 namespace PCI{
 	Vector<PCIDevice>* devices;
@@ -47,7 +48,7 @@ namespace PCI{
 		return data;
 	}
 
-	void ConfigWriteDword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint16_t data){
+	void ConfigWriteDword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t data){
 		uint32_t address = (uint32_t)((bus << 16) | (slot << 11) | (func << 8) | (offset & 0xfc) | 0x80000000);
 
 		outportl(0xCF8, address);
@@ -170,6 +171,9 @@ namespace PCI{
 					if(device.msiCap.msiControl & PCI_CAP_MSI_CONTROL_64){ // 64-bit capable
 						device.msiCap.data64 = ConfigReadDword(bus, slot, func, ptr + sizeof(uint32_t) * 3);
 					}
+				} else if((cap & 0xFF) == PCICapabilityIDs::PCICapMSIX){
+					device.msixPtr = ptr;
+					device.msixCapable = true;
 				}
 
 				ptr = (cap >> 8);
@@ -268,4 +272,47 @@ uint8_t PCIDevice::AllocateVector(PCIVectors type){
 
 	Log::Error("[PCIDevice] AllocateVector: Could not allocate interrupt (type %i)!", static_cast<int>(type));
 	return 0xFF;
+}
+
+unsigned PCIDevice::MSIXVectorCount(){
+	if(!msixCapable){
+		return 0;
+	}
+
+	return PCI_CAP_MSIX_CONTROL_TABLE_SIZE(PCI::ConfigReadWord(bus, slot, func, msixPtr + 2));
+}
+
+uint8_t PCIDevice::AllocateMSIXVector(unsigned entry, uint8_t cpu){
+	if(entry >= MSIXVectorCount()){
+		Log::Error("[PCIDevice] AllocateMSIXVector: Invalid entry %u!", entry);
+		return 0xFF;
+	}
+
+	uint8_t interrupt = IDT::ReserveUnusedInterrupt();
+	if(interrupt == 0xFF){
+		Log::Error("[PCIDevice] AllocateMSIXVector: Could not reserve unused interrupt (no free interrupts?)!");
+		return interrupt;
+	}
+
+	uint32_t table = PCI::ConfigReadDword(bus, slot, func, msixPtr + sizeof(uint32_t));
+	uintptr_t tableBase = Memory::GetIOMapping(GetBaseAddressRegister(PCI_CAP_MSIX_BIR(table)) + PCI_CAP_MSIX_OFFSET(table));
+
+	volatile PCIMSIXEntry* ent = reinterpret_cast<PCIMSIXEntry*>(tableBase) + entry;
+	ent->vectorControl = PCI_MSIX_ENTRY_MASKED;
+	ent->addressLow = 0xFEE00000 | (static_cast<uint32_t>(cpu) << 12); // Destination APIC ID
+	ent->addressHigh = 0;
+	ent->data = ICR_VECTOR(interrupt) | ICR_MESSAGE_TYPE_FIXED;
+	ent->vectorControl = 0; // Unmask
+
+	uint16_t control = PCI::ConfigReadWord(bus, slot, func, msixPtr + 2);
+	if(!(control & PCI_CAP_MSIX_CONTROL_ENABLE) || (control & PCI_CAP_MSIX_CONTROL_FUNCTION_MASK)){
+		if(msiCapable){ // MSI and MSI-X cannot both be enabled
+			PCI::ConfigWriteWord(bus, slot, func, msiPtr + 2, PCI::ConfigReadWord(bus, slot, func, msiPtr + 2) & ~PCI_CAP_MSI_CONTROL_ENABLE);
+		}
+
+		SetCommand(GetCommand() | PCI_CMD_INTERRUPT_DISABLE); // No legacy interrupts either
+		PCI::ConfigWriteWord(bus, slot, func, msixPtr + 2, (control | PCI_CAP_MSIX_CONTROL_ENABLE) & ~PCI_CAP_MSIX_CONTROL_FUNCTION_MASK);
+	}
+
+	return interrupt;
 }
\ No newline at end of file
@@ -6,124 +6,529 @@
 #include <logging.h>
 #include <panic.h>
 #include <lock.h>
+#include <cpu.h>
+#include <smp.h>
+#include <apic.h>
+#include <idt.h>
 
 namespace Memory{
-    uint32_t physicalMemoryBitmap[PHYSALLOC_BITMAP_SIZE_DWORDS];
+    constexpr size_t BitmapWords(uint64_t bits){
+        return (bits + 63) / 64;
+    }
+
+    // Bitmap of the free blocks of one order with two levels of summary bitmaps,
+    // so finding a free block never has to scan over all of physical memory
+    class FreeBlockMap {
+        uint64_t* blocks; // Bit n is set when block n is free
+        uint64_t* summary; // Bit n is set when blocks[n] is not 0
+        uint64_t* summary2; // Bit n is set when summary[n] is not 0
+    public:
+        uint64_t count = 0; // Amount of free blocks
+
+        static constexpr size_t StorageWords(uint64_t blockCount){
+            return BitmapWords(blockCount) + BitmapWords(BitmapWords(blockCount)) + BitmapWords(BitmapWords(BitmapWords(blockCount)));
+        }
+
+        // Take the bitmaps out of pool, every block starts off used
+        void Initialize(uint64_t*& pool, uint64_t blockCount){
+            blocks = pool;
+            summary = blocks + BitmapWords(blockCount);
+            summary2 = summary + BitmapWords(BitmapWords(blockCount));
+            pool += StorageWords(blockCount);
+
+            memset(blocks, 0, StorageWords(blockCount) * sizeof(uint64_t));
+            count = 0;
+        }
+
+        inline bool Test(uint64_t block) const {
+            return blocks[block >> 6] & (1ULL << (block & 63));
+        }
+
+        inline void Set(uint64_t block){
+            uint64_t word = block >> 6;
+
+            blocks[word] |= 1ULL << (block & 63);
+            summary[word >> 6] |= 1ULL << (word & 63);
+            summary2[word >> 12] |= 1ULL << ((word >> 6) & 63);
+            count++;
+        }
+
+        inline void Clear(uint64_t block){
+            uint64_t word = block >> 6;
+
+            blocks[word] &= ~(1ULL << (block & 63));
+            if(!blocks[word]){
+                summary[word >> 6] &= ~(1ULL << (word & 63));
+                if(!summary[word >> 6]){
+                    summary2[word >> 12] &= ~(1ULL << ((word >> 6) & 63));
+                }
+            }
+            count--;
+        }
+
+        // Lowest free block, there must be at least one
+        uint64_t First() const {
+            uint64_t i = 0;
+            while(!summary2[i]) i++;
+
+            uint64_t summaryWord = (i << 6) | __builtin_ctzll(summary2[i]);
+            uint64_t word = (summaryWord << 6) | __builtin_ctzll(summary[summaryWord]);
+            return (word << 6) | __builtin_ctzll(blocks[word]);
+        }
+    };
+
+    constexpr size_t FreeBlockMapWords(){
+        size_t words = 0;
+        for(unsigned order = 0; order <= PHYSALLOC_MAX_ORDER; order++){
+            words += FreeBlockMap::StorageWords(PHYSALLOC_MAX_BLOCKS >> order);
+        }
+        return words;
+    }
 
-    uint64_t usedPhysicalBlocks = PHYSALLOC_BITMAP_SIZE_DWORDS * 32;
-    uint64_t maxPhysicalBlocks = PHYSALLOC_BITMAP_SIZE_DWORDS * 32;
+    uint64_t freeBlockMapStorage[FreeBlockMapWords()];
+    FreeBlockMap freeBlocks[PHYSALLOC_MAX_ORDER + 1]; // A free region is always kept as the largest aligned buddies that make it up
 
-    lock_t allocatorLock = 0;
+    uint64_t usedPhysicalBlocks = PHYSALLOC_MAX_BLOCKS;
+    uint64_t maxPhysicalBlocks = PHYSALLOC_MAX_BLOCKS;
+
+    lock_t allocatorLock = 0; // Only ever held with interrupts disabled
+    bool cpuCachesEnabled = false;
+    uint64_t pageCacheDrainGeneration = 0; // Bumped every time the other CPUs are asked to give back their caches
+
+    uint16_t* shareCounts[PHYSALLOC_MAX_BLOCKS / PHYSALLOC_SHARE_COUNTS_PER_PAGE]; // Extra references to each block, nullptr until a block in range is shared
+    lock_t shareCountLock = 0;
+
+    reclaimer_t reclaimers[PHYSALLOC_MAX_RECLAIMERS];
+    unsigned reclaimerCount = 0;
 
     // Initialize the physical page allocator
     void InitializePhysicalAllocator(memory_info_t* mem_info)
     {
-        memset(physicalMemoryBitmap, 0xFFFFFFFF, PHYSALLOC_BITMAP_SIZE_DWORDS * sizeof(uint32_t));
+        uint64_t* pool = freeBlockMapStorage;
+        for(unsigned order = 0; order <= PHYSALLOC_MAX_ORDER; order++){
+            freeBlocks[order].Initialize(pool, PHYSALLOC_MAX_BLOCKS >> order);
+        }
 
-        maxPhysicalBlocks = PHYSALLOC_BITMAP_SIZE_DWORDS;
+        maxPhysicalBlocks = PHYSALLOC_MAX_BLOCKS;
         usedPhysicalBlocks = maxPhysicalBlocks;
     }
 
-    // Sets a bit in the physical memory bitmap
-    inline void bit_set(uint64_t bit) {  
-        physicalMemoryBitmap[bit >> 5] |= (1 << (bit % 32));
+    void PageCacheDrainHandler(regs64_t* r);
+
+    void EnableCPUPageCaches(){
+        IDT::RegisterInterruptHandler(IPI_PAGE_CACHE_DRAIN, PageCacheDrainHandler);
+        cpuCachesEnabled = true;
     }
 
-    // Clears a bit in the physical memory bitmap
-    inline void bit_clear(uint64_t bit) {
-        physicalMemoryBitmap[bit >> 5] &= ~ (1 << (bit % 32));
+    // Free a buddy, merging it with its pair for as long as the pair is free
+    // The allocator lock must be held
+    void FreeBuddy(uint64_t index, unsigned order){
+        while(order < PHYSALLOC_MAX_ORDER && freeBlocks[order].Test((index >> order) ^ 1)){
+            freeBlocks[order].Clear((index >> order) ^ 1);
+
+            order++;
+            index &= ~((1ULL << order) - 1);
+        }
+
+        freeBlocks[order].Set(index >> order);
+    }
+
+    // Allocate a buddy, splitting a larger one if there is none free of this order
+    // Returns the index of the first block or 0 if out of memory
+    // The allocator lock must be held
+    uint64_t AllocateBuddy(unsigned order){
+        unsigned o = order;
+        while(o <= PHYSALLOC_MAX_ORDER && !freeBlocks[o].count){
+            o++;
+        }
+
+        if(o > PHYSALLOC_MAX_ORDER){
+            return 0; // The first block is always reserved
+        }
+
+        uint64_t index = freeBlocks[o].First() << o;
+        freeBlocks[o].Clear(index >> o);
+
+        while(o > order){ // Give back the upper half of each split
+            o--;
+            freeBlocks[o].Set((index >> o) | 1);
+        }
+
+        return index;
+    }
+
+    // Free the blocks in [index, end) as the largest aligned buddies that fit
+    // The allocator lock must be held
+    void FreeRange(uint64_t index, uint64_t end){
+        while(index < end){
+            unsigned order = index ? __builtin_ctzll(index) : PHYSALLOC_MAX_ORDER;
+            if(order > PHYSALLOC_MAX_ORDER){
+                order = PHYSALLOC_MAX_ORDER;
+            }
+
+            while(index + (1ULL << order) > end){
+                order--;
+            }
+
+            FreeBuddy(index, order);
+            index += 1ULL << order;
+        }
     }
 
-    // Tests a bit in the physical memory bitmap
-    inline bool bit_test(uint64_t bit) {
-        return physicalMemoryBitmap[bit >> 5] & (1 << (bit % 32));
+    // Take the blocks in [index, end) out of the free buddies, giving back whatever lies outside of the range
+    // Returns the amount of blocks that were free
+    // The allocator lock must be held
+    uint64_t ReserveRange(uint64_t index, uint64_t end){
+        uint64_t reserved = 0;
+
+        while(index < end){
+            unsigned order = 0;
+            while(order <= PHYSALLOC_MAX_ORDER && !freeBlocks[order].Test(index >> order)){
+                order++;
+            }
+
+            if(order > PHYSALLOC_MAX_ORDER){ // Already in use
+                index++;
+                continue;
+            }
+
+            uint64_t buddy = (index >> order) << order;
+            uint64_t buddyEnd = buddy + (1ULL << order);
+            freeBlocks[order].Clear(buddy >> order);
+
+            FreeRange(buddy, index);
+            if(buddyEnd > end){
+                FreeRange(end, buddyEnd);
+                buddyEnd = end;
+            }
+
+            reserved += buddyEnd - index;
+            index = buddyEnd;
+        }
+
+        return reserved;
     }
 
     // Finds the first free block in physical memory
     uint64_t GetFirstFreeMemoryBlock() {
-        for (uint32_t i = 0; i < maxPhysicalBlocks / 32; i++)
-            if (physicalMemoryBitmap[i] != 0xffffffff) // If all 32 bits at the index are used then ignore them
-                for (uint32_t j = 0; j < 32; j++) // Test each bit in the dword
-                    if (!(physicalMemoryBitmap[i] & (1 << j)) && (i || j))
-                        return i * 32 + j;
+        uint64_t first = 0;
+
+        for(unsigned order = 0; order <= PHYSALLOC_MAX_ORDER; order++){
+            if(freeBlocks[order].count){
+                uint64_t index = freeBlocks[order].First() << order;
+                if(!first || index < first){
+                    first = index;
+                }
+            }
+        }
 
         // The first block is always reserved
-        return 0;
+        return first;
     }
 
     // Marks a region in physical memory as being used
     void MarkMemoryRegionUsed(uint64_t base, size_t size) {
-        for (uint32_t blocks = (size + (PHYSALLOC_BLOCK_SIZE - 1)) / PHYSALLOC_BLOCK_SIZE, align = base / PHYSALLOC_BLOCK_SIZE; blocks > 0; blocks--, usedPhysicalBlocks++)
-            bit_set(align++);
+        uint64_t index = base / PHYSALLOC_BLOCK_SIZE;
+        uint64_t end = (base + size + (PHYSALLOC_BLOCK_SIZE - 1)) / PHYSALLOC_BLOCK_SIZE;
+        if(end > PHYSALLOC_MAX_BLOCKS){
+            end = PHYSALLOC_MAX_BLOCKS;
+        }
+
+        if(index < end){
+            usedPhysicalBlocks += ReserveRange(index, end);
+        }
     }
 
     // Marks a region in physical memory as being free
     void MarkMemoryRegionFree(uint64_t base, size_t size) {
-        for (uint32_t blocks = (size + (PHYSALLOC_BLOCK_SIZE - 1)) / PHYSALLOC_BLOCK_SIZE, align = base / PHYSALLOC_BLOCK_SIZE; blocks > 0; blocks--, usedPhysicalBlocks--)
-            bit_clear(align++);
+        uint64_t index = base / PHYSALLOC_BLOCK_SIZE;
+        uint64_t end = (base + size) / PHYSALLOC_BLOCK_SIZE;
+        if(!index){
+            index = 1; // The first block is always reserved
+        }
+        if(end > PHYSALLOC_MAX_BLOCKS){
+            end = PHYSALLOC_MAX_BLOCKS;
+        }
+
+        if(index < end){
+            FreeRange(index, end);
+            usedPhysicalBlocks -= end - index;
+        }
     }
 
-    // Allocates a block of physical memory
-    uint64_t AllocatePhysicalMemoryBlock() {
+    void RegisterReclaimer(reclaimer_t reclaimer){
+        assert(reclaimerCount < PHYSALLOC_MAX_RECLAIMERS);
+
+        reclaimers[reclaimerCount] = reclaimer;
+        __atomic_store_n(&reclaimerCount, reclaimerCount + 1, __ATOMIC_RELEASE);
+    }
+
+    // Ask every reclaimer for memory, returns true if any was freed
+    bool Reclaim(){
+        size_t freed = 0;
+        for(unsigned i = 0; i < __atomic_load_n(&reclaimerCount, __ATOMIC_ACQUIRE); i++){
+            freed += reclaimers[i](PHYSALLOC_RECLAIM_BATCH);
+        }
+
+        return freed > 0;
+    }
+
+    [[noreturn]] void OutOfMemory(){
+        Log::Error("Out of memory!");
+        KernelPanic((const char**)(&"Out of memory!"),1);
+        for(;;);
+    }
+
+    // Fill the cache of this CPU up to PHYSALLOC_CPU_CACHE_BATCH blocks
+    // Interrupts must be disabled
+    void RefillPageCache(CPU* cpu){
+        acquireLock(&allocatorLock);
+        while(cpu->pageCacheCount < PHYSALLOC_CPU_CACHE_BATCH){
+            uint64_t index = AllocateBuddy(0);
+            if(!index){
+                break;
+            }
+
+            cpu->pageCache[cpu->pageCacheCount++] = index;
+        }
+        releaseLock(&allocatorLock);
+    }
+
+    // Give the least recently freed PHYSALLOC_CPU_CACHE_BATCH blocks in the cache of this CPU back to the buddy allocator
+    // Interrupts must be disabled
+    void DrainPageCache(CPU* cpu){
         acquireLock(&allocatorLock);
+        for(unsigned i = 0; i < PHYSALLOC_CPU_CACHE_BATCH; i++){
+            FreeBuddy(cpu->pageCache[i], 0);
+        }
+        releaseLock(&allocatorLock);
 
-        uint64_t index = GetFirstFreeMemoryBlock();
-        if (!index){
-            Log::Error("Out of memory!");
-            KernelPanic((const char**)(&"Out of memory!"),1);
-            for(;;);
-            //return 0;
+        cpu->pageCacheCount -= PHYSALLOC_CPU_CACHE_BATCH;
+        for(unsigned i = 0; i < cpu->pageCacheCount; i++){
+            cpu->pageCache[i] = cpu->pageCache[i + PHYSALLOC_CPU_CACHE_BATCH];
         }
+    }
 
-        bit_set(index);
-        usedPhysicalBlocks++;
+    // Give back every block in the cache of this CPU
+    void PageCacheDrainHandler(regs64_t* r){
+        uint64_t generation = __atomic_load_n(&pageCacheDrainGeneration, __ATOMIC_ACQUIRE);
+        CPU* cpu = GetCPULocal();
 
+        acquireLock(&allocatorLock);
+        for(unsigned i = 0; i < cpu->pageCacheCount; i++){
+            FreeBuddy(cpu->pageCache[i], 0);
+        }
         releaseLock(&allocatorLock);
 
-        return index * PHYSALLOC_BLOCK_SIZE;
+        cpu->pageCacheCount = 0;
+        cpu->pageCacheDrainGeneration = generation;
     }
 
-    // Allocates a block of 2MB physical memory
-    /*uint64_t AllocateLargePhysicalMemoryBlock() {
-        uint64_t index = GetFirstFreeMemoryBlock();
-        uint64_t blockCount = 0x200000
-        uint64_t counter = 0;
-        while(counter < blockCount){
-            if(bit_test(index)){
-                index++;
-                counter = 0;
-                continue;
+    // Ask the other CPUs to give back the blocks in their caches
+    // Only waits for them if wait is set, in which case interrupts must be enabled as they may be waiting on us
+    // Returns true if any of them had cached blocks
+    bool DrainOtherPageCaches(bool wait){
+        if(!cpuCachesEnabled || SMP::processorCount <= 1){
+            return false;
+        }
+
+        CPU* self = GetCPULocal();
+        bool cached = false;
+        for(unsigned i = 0; i < SMP::processorCount; i++){
+            if(SMP::cpus[i] != self && __atomic_load_n(&SMP::cpus[i]->pageCacheCount, __ATOMIC_RELAXED)){
+                cached = true;
             }
+        }
+
+        if(!cached){
+            return false;
+        }
+
+        uint64_t generation = __atomic_add_fetch(&pageCacheDrainGeneration, 1, __ATOMIC_ACQ_REL);
+        APIC::Local::SendIPI(0, ICR_DSH_OTHER /* Send to all other processors except us */, ICR_MESSAGE_TYPE_FIXED, IPI_PAGE_CACHE_DRAIN);
+
+        if(wait){
+            for(unsigned i = 0; i < SMP::processorCount; i++){
+                CPU* cpu = SMP::cpus[i];
+                if(cpu == self){
+                    continue;
+                }
+
+                while(cpu->pageCacheDrainGeneration < generation){
+                    asm("pause");
+                }
+            }
+        }
+
+        return true;
+    }
+
+    // Allocates a block of physical memory
+    uint64_t AllocatePhysicalMemoryBlock() {
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+
+        uint64_t index = 0;
+        if(cpuCachesEnabled){
+            CPU* cpu = GetCPULocal();
+            if(!cpu->pageCacheCount){
+                RefillPageCache(cpu);
+            }
+
+            if(cpu->pageCacheCount){ // The most recently freed block is the most likely to still be in the cache
+                index = cpu->pageCache[--cpu->pageCacheCount];
+            }
+        } else {
+            acquireLock(&allocatorLock);
+            index = AllocateBuddy(0);
+            releaseLock(&allocatorLock);
+        }
+
+        if(intsEnabled) asm("sti");
+
+        if(!index){
+            // Blocks sitting in the caches of other CPUs are cheaper to get back than anything a reclaimer frees
+            if(DrainOtherPageCaches(intsEnabled) || Reclaim()){
+                return AllocatePhysicalMemoryBlock(); // Memory was given back by a cache, try again
+            }
+
+            OutOfMemory();
+        }
+
+        __sync_fetch_and_add(&usedPhysicalBlocks, 1);
+
+        return index * PHYSALLOC_BLOCK_SIZE;
+    }
+
+    uint64_t AllocateContiguousPhysicalMemory(size_t count) {
+        assert(count && count <= PHYSALLOC_LARGE_BLOCK_COUNT);
+
+        unsigned order = 0;
+        while((1ULL << order) < count){
+            order++;
+        }
+
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&allocatorLock);
 
-            index++;
-            counter++;
+        uint64_t index = AllocateBuddy(order);
+        if(index){
+            FreeRange(index + count, index + (1ULL << order)); // Give back what we do not need
         }
 
-        if (index == 0)
+        releaseLock(&allocatorLock);
+        if(intsEnabled) asm("sti");
+
+        if(!index){
             return 0;
+        }
 
-        uint64_t addr = index * PHYSALLOC_BLOCK_SIZE;
-        
-        while(blockCount--)
-            bit_set(index++);
-        usedPhysicalBlocks += counter;
+        __sync_fetch_and_add(&usedPhysicalBlocks, count);
 
-        return addr;
-    }*/
+        return index * PHYSALLOC_BLOCK_SIZE;
+    }
+
+    // Allocates a block of 2MB physical memory
+    uint64_t AllocateLargePhysicalMemoryBlock() {
+        return AllocateContiguousPhysicalMemory(PHYSALLOC_LARGE_BLOCK_COUNT);
+    }
 
     // Frees a block of physical memory
     void FreePhysicalMemoryBlock(uint64_t addr) {
         uint64_t index = addr / PHYSALLOC_BLOCK_SIZE;
-        bit_clear(index);
-        usedPhysicalBlocks--;
+
+        if(index < PHYSALLOC_MAX_BLOCKS){
+            uint16_t* counts = __atomic_load_n(&shareCounts[index / PHYSALLOC_SHARE_COUNTS_PER_PAGE], __ATOMIC_ACQUIRE);
+            if(counts){
+                uint16_t& count = counts[index % PHYSALLOC_SHARE_COUNTS_PER_PAGE];
+                uint16_t c = __atomic_load_n(&count, __ATOMIC_ACQUIRE);
+                while(c){ // Someone else still holds a reference
+                    if(__atomic_compare_exchange_n(&count, &c, c - 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+                        return;
+                    }
+                }
+            }
+        }
+
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+
+        if(cpuCachesEnabled){
+            CPU* cpu = GetCPULocal();
+            if(cpu->pageCacheCount >= PHYSALLOC_CPU_CACHE_SIZE){
+                DrainPageCache(cpu);
+            }
+
+            cpu->pageCache[cpu->pageCacheCount++] = index;
+        } else {
+            acquireLock(&allocatorLock);
+            FreeBuddy(index, 0);
+            releaseLock(&allocatorLock);
+        }
+
+        if(intsEnabled) asm("sti");
+
+        __sync_fetch_and_sub(&usedPhysicalBlocks, 1);
+    }
+
+    void SharePhysicalMemoryBlock(uint64_t addr) {
+        uint64_t index = addr / PHYSALLOC_BLOCK_SIZE;
+        assert(index < PHYSALLOC_MAX_BLOCKS);
+
+        uint16_t*& counts = shareCounts[index / PHYSALLOC_SHARE_COUNTS_PER_PAGE];
+        if(!__atomic_load_n(&counts, __ATOMIC_ACQUIRE)){
+            uint16_t* page = (uint16_t*)KernelAllocate4KPages(1);
+            KernelMapVirtualMemory4K(AllocatePhysicalMemoryBlock(), (uintptr_t)page, 1);
+            memset(page, 0, PAGE_SIZE_4K);
+
+            bool intsEnabled = CheckInterrupts();
+            asm("cli");
+            acquireLock(&shareCountLock);
+            if(!counts){
+                __atomic_store_n(&counts, page, __ATOMIC_RELEASE);
+                page = nullptr;
+            }
+            releaseLock(&shareCountLock);
+            if(intsEnabled) asm("sti");
+
+            if(page){ // Another CPU got there first
+                FreePhysicalMemoryBlock(VirtualToPhysicalAddress((uintptr_t)page));
+                KernelFree4KPages(page, 1);
+            }
+        }
+
+        uint16_t previous = __atomic_fetch_add(&counts[index % PHYSALLOC_SHARE_COUNTS_PER_PAGE], 1, __ATOMIC_ACQ_REL);
+        assert(previous < UINT16_MAX);
+    }
+
+    bool IsPhysicalMemoryBlockShared(uint64_t addr) {
+        uint64_t index = addr / PHYSALLOC_BLOCK_SIZE;
+        if(index >= PHYSALLOC_MAX_BLOCKS){
+            return false;
+        }
+
+        uint16_t* counts = __atomic_load_n(&shareCounts[index / PHYSALLOC_SHARE_COUNTS_PER_PAGE], __ATOMIC_ACQUIRE);
+        return counts && __atomic_load_n(&counts[index % PHYSALLOC_SHARE_COUNTS_PER_PAGE], __ATOMIC_ACQUIRE);
+    }
+
+    void FreeContiguousPhysicalMemory(uint64_t addr, size_t count) {
+        uint64_t index = addr / PHYSALLOC_BLOCK_SIZE;
+
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&allocatorLock);
+
+        FreeRange(index, index + count);
+
+        releaseLock(&allocatorLock);
+        if(intsEnabled) asm("sti");
+
+        __sync_fetch_and_sub(&usedPhysicalBlocks, count);
     }
 
     // Frees a block of physical memory
     void FreeLargePhysicalMemoryBlock(uint64_t addr) {
-        uint64_t index = addr / PHYSALLOC_BLOCK_SIZE;
-        uint64_t blockCount = 0x200000 /* 2MB */ / PHYSALLOC_BLOCK_SIZE;
-        usedPhysicalBlocks-=blockCount;
-        while(blockCount--)
-            bit_clear(index++);
+        FreeContiguousPhysicalMemory(addr, PHYSALLOC_LARGE_BLOCK_COUNT);
     }
-}
\ No newline at end of file
+}
@@ -28,6 +28,13 @@ section .text
 TaskSwitch:
     mov rsp, rdi ; Set the stack pointer to the location of our register context
     mov rax, rsi ; PML4
+
+    ; We are off the old thread's stack so it is now safe for another CPU to run it
+    mov dword [rdx], 0 ; Release the run queue lock
+    test rcx, rcx
+    jz .noStateLock
+    mov dword [rcx], 0 ; Release the old thread's state lock
+.noStateLock:
     popaq ; Load register context (we don't load RAX yet)
 
     mov cr3, rax ; Set CR3
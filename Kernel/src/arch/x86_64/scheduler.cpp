@@ -17,10 +17,16 @@
 #include <smp.h>
 #include <apic.h>
 #include <timer.h>
+#include <slab.h>
+#include <sharedmem.h>
 
 #define INITIAL_HANDLE_TABLE_SIZE 0xFFFF
 
-extern "C" [[noreturn]] void TaskSwitch(regs64_t* r, uint64_t pml4);
+#define SCHEDULER_LOAD_DECAY_SHIFT 3 // Each tick the load averages move 1/8 of the way to the current value
+#define SCHEDULER_DECAY_TICKS 64 // Recent thread CPU time is halved after this many ticks
+#define SCHEDULER_BALANCE_TICKS 32 // How often each CPU looks for an imbalance
+
+extern "C" [[noreturn]] void TaskSwitch(regs64_t* r, uint64_t pml4, lock_t* runQueueLock, lock_t* stateLock);
 
 extern "C"
 void IdleProc();
@@ -35,40 +41,232 @@ namespace Scheduler{
     unsigned processTableSize = 512;
     uint64_t nextPID = 1;
 
+    ObjectCache<process_t> processCache = ObjectCache<process_t>("process");
+    ObjectCache<thread_t> threadCache = ObjectCache<thread_t>("thread");
+
     handle_t handles[INITIAL_HANDLE_TABLE_SIZE];
     uint64_t handleCount = 1; // We don't want null handles
     uint32_t handleTableSize = INITIAL_HANDLE_TABLE_SIZE;
     
     void Schedule(regs64_t* r);
-    
-    inline void InsertThreadIntoQueue(thread_t* thread){
-        GetCPULocal()->runQueue->add_back(thread);
+
+    inline bool IsIdle(CPU* cpu){
+        return !cpu->currentThread || cpu->currentThread->parent == cpu->idleProcess;
+    }
+
+    // Idle CPUs stop ticking so their averages are only brought up to date once they schedule again,
+    // decay an average for the ticks the CPU has spent idle since
+    unsigned DecayIdleAverage(CPU* cpu, unsigned average){
+        uint64_t now = Timer::GetTicksSinceBoot();
+        if(!IsIdle(cpu) || now <= cpu->lastTick){
+            return average;
+        }
+
+        for(uint64_t i = 0; i < now - cpu->lastTick && i < 32 && average; i++){
+            average -= average >> SCHEDULER_LOAD_DECAY_SHIFT;
+        }
+
+        return average;
+    }
+
+    // Average of the runnable threads on the CPU right now and over the last few ticks
+    inline unsigned CPULoad(CPU* cpu){
+        unsigned runnable = cpu->runQueue->get_length() + (IsIdle(cpu) ? 0 : 1);
+        return ((runnable << CPU_LOAD_SHIFT) + DecayIdleAverage(cpu, cpu->load)) / 2;
     }
 
-    inline void RemoveThreadFromQueue(thread_t* thread){
-        GetCPULocal()->runQueue->remove(thread);
+    inline unsigned RecentTicks(thread_t* thread, uint64_t now){
+        uint64_t periods = (now - thread->recentTicksStamp) / SCHEDULER_DECAY_TICKS;
+        if(periods){
+            thread->recentTicks = (periods >= 32) ? 0 : (thread->recentTicks >> periods);
+            thread->recentTicksStamp += periods * SCHEDULER_DECAY_TICKS;
+        }
+
+        return thread->recentTicks;
+    }
+
+    // Update the load averages of the CPU and charge the elapsed ticks to the running thread
+    // Only the owning CPU calls this, with interrupts disabled
+    void UpdateLoad(CPU* cpu, thread_t* current, bool idle){
+        uint64_t now = Timer::GetTicksSinceBoot();
+        uint64_t elapsed = now - cpu->lastTick;
+
+        if(!elapsed){
+            return;
+        }
+        cpu->lastTick = now;
+
+        unsigned runnable = (cpu->runQueue->get_length() + (idle ? 0 : 1)) << CPU_LOAD_SHIFT;
+        unsigned busy = idle ? 0 : CPU_LOAD_SCALE;
+        for(uint64_t i = 0; i < elapsed && i < 32; i++){ // After 32 ticks the averages have all but converged
+            cpu->load = cpu->load - (cpu->load >> SCHEDULER_LOAD_DECAY_SHIFT) + (runnable >> SCHEDULER_LOAD_DECAY_SHIFT);
+            cpu->utilisation = cpu->utilisation - (cpu->utilisation >> SCHEDULER_LOAD_DECAY_SHIFT) + (busy >> SCHEDULER_LOAD_DECAY_SHIFT);
+        }
+
+        if(!idle){
+            RecentTicks(current, now);
+            current->recentTicks += elapsed;
+        }
+    }
+
+    // Choose the CPU a thread should run on when it becomes runnable
+    // A thread goes back to the CPU it last ran on, where its cache is likely to still be warm,
+    // unless another CPU is carrying noticeably less load
+    CPU* SelectCPU(thread_t* thread){
+        CPU* best = SMP::cpus[0];
+        unsigned bestLoad = CPULoad(best);
+        for(unsigned i = 1; i < SMP::processorCount && bestLoad; i++){
+            unsigned load = CPULoad(SMP::cpus[i]);
+            if(load < bestLoad) {
+                best = SMP::cpus[i];
+                bestLoad = load;
+            }
+        }
+
+        CPU* prev = thread->lastCPU;
+        if(!prev || prev == best){
+            return best;
+        }
+
+        if(CPULoad(prev) <= bestLoad + CPU_LOAD_SCALE / 4){
+            return prev;
+        }
+
+        return best;
     }
     
-    void InsertNewThreadIntoQueue(thread_t* thread){
-        CPU* cpu = SMP::cpus[0];
-        for(unsigned i = 1; i < SMP::processorCount; i++){
-            if(SMP::cpus[i]->runQueue->get_length() < cpu->runQueue->get_length()) {
-                cpu = SMP::cpus[i];
+    // Interrupts must be disabled and the thread's state lock held
+    void EnqueueThread(CPU* cpu, thread_t* thread){
+        acquireLock(&cpu->runQueueLock);
+        thread->cpu = cpu;
+        cpu->runQueue->Enqueue(thread);
+
+        bool idle = IsIdle(cpu);
+        releaseLock(&cpu->runQueueLock);
+
+        // Idle CPUs do not tick so wake the CPU up from hlt.
+        // If it is this CPU we are in an interrupt handler, and the IPI arrives once it returns to the idle thread.
+        if(schedulerReady && idle){
+            APIC::Local::SendIPI(cpu->id, ICR_DSH_DEST, ICR_MESSAGE_TYPE_FIXED, IPI_SCHEDULE);
+        }
+    }
+
+    // Take a thread off whichever CPU it is queued or running on
+    // Interrupts must be disabled and the thread's state lock held
+    void DequeueThread(thread_t* thread){
+        CPU* cpu;
+        while((cpu = thread->cpu)){
+            acquireLock(&cpu->runQueueLock);
+
+            if(thread->cpu != cpu){ // Another CPU stole the thread before we got the lock
+                releaseLock(&cpu->runQueueLock);
+                continue;
+            }
+
+            if(cpu->currentThread == thread){
+                cpu->currentThread = nullptr; // Force the CPU to reschedule
+
+                if(cpu != GetCPULocal()){
+                    APIC::Local::SendIPI(cpu->id, ICR_DSH_DEST, ICR_MESSAGE_TYPE_FIXED, IPI_SCHEDULE);
+                }
+            } else {
+                cpu->runQueue->Remove(thread);
+            }
+
+            thread->cpu = nullptr;
+            releaseLock(&cpu->runQueueLock);
+        }
+    }
+
+    // Find the other CPU with the most load that has threads waiting to run
+    CPU* FindBusiestCPU(CPU* cpu, unsigned& busiestLoad){
+        CPU* busiest = nullptr;
+        busiestLoad = 0;
+        for(unsigned i = 0; i < SMP::processorCount; i++){
+            CPU* other = SMP::cpus[i];
+            if(other == cpu || !other || !other->runQueue->get_length()){
+                continue;
             }
 
-            if(!cpu->runQueue->get_length()){
-                break;
+            unsigned load = CPULoad(other);
+            if(!busiest || load > busiestLoad){
+                busiest = other;
+                busiestLoad = load;
             }
         }
 
-        //Log::Info("Inserting thread into run queue of CPU %d", cpu->id);
+        return busiest;
+    }
+
+    // Take the most urgent waiting thread from the busiest CPU
+    // Interrupts must be disabled and the run queue lock of cpu held
+    thread_t* StealThread(CPU* cpu){
+        unsigned busiestLoad;
+        CPU* busiest = FindBusiestCPU(cpu, busiestLoad);
 
-        asm("sti");
-        acquireLock(&cpu->runQueueLock);
+        if(!busiest || acquireTestLock(&busiest->runQueueLock)){ // Never spin here, the other CPU may be trying to steal from us
+            return nullptr;
+        }
+
+        thread_t* thread = busiest->runQueue->Dequeue();
+        if(thread){
+            thread->cpu = cpu;
+        }
+
+        releaseLock(&busiest->runQueueLock);
+        return thread;
+    }
+
+    // Idle CPUs stop ticking, so get one to steal from us when we have threads waiting to run
+    // Interrupts must be disabled and the run queue lock of cpu held
+    void WakeIdleCPU(CPU* cpu){
+        if(!cpu->runQueue->get_length()){
+            return;
+        }
+
+        for(unsigned i = 0; i < SMP::processorCount; i++){
+            CPU* other = SMP::cpus[i];
+            if(other != cpu && other && IsIdle(other)){
+                APIC::Local::SendIPI(other->id, ICR_DSH_DEST, ICR_MESSAGE_TYPE_FIXED, IPI_SCHEDULE);
+                return;
+            }
+        }
+    }
+
+    // Periodically pull a thread over from the busiest CPU when it carries more than one thread's worth of load above ours.
+    // The waiting thread that has used the most CPU time recently is moved as it evens out the load the most.
+    // Interrupts must be disabled and the run queue lock of cpu held
+    void BalanceLoad(CPU* cpu){
+        unsigned busiestLoad;
+        CPU* busiest = FindBusiestCPU(cpu, busiestLoad);
+
+        if(!busiest || busiestLoad <= CPULoad(cpu) + CPU_LOAD_SCALE){
+            return;
+        }
+
+        if(acquireTestLock(&busiest->runQueueLock)){
+            return;
+        }
+
+        uint64_t now = cpu->lastTick;
+        thread_t* thread = busiest->runQueue->RemoveBest([now](thread_t* t) -> uint64_t { return RecentTicks(t, now); });
+        if(thread){
+            thread->cpu = cpu;
+            cpu->runQueue->Enqueue(thread);
+        }
+
+        releaseLock(&busiest->runQueueLock);
+    }
+
+    void InsertNewThreadIntoQueue(thread_t* thread){
+        bool intsEnabled = CheckInterrupts();
         asm("cli");
-        cpu->runQueue->add_back(thread);
-        releaseLock(&cpu->runQueueLock);
-        asm("sti");
+
+        acquireLock(&thread->stateLock);
+        EnqueueThread(SelectCPU(thread), thread);
+        releaseLock(&thread->stateLock);
+
+        if(intsEnabled) asm("sti");
     }
 
     void Initialize() {
@@ -96,6 +294,7 @@ namespace Scheduler{
         cpu->currentThread = nullptr;
         schedulerReady = true;
         asm("sti");
+        Yield(); // Nothing ticks until the first schedule
         for(;;);
     }
 
@@ -177,7 +376,7 @@ namespace Scheduler{
 
     process_t* InitializeProcessStructure(){
         // Create process structure
-        process_t* proc = new process_t;
+        process_t* proc = processCache.New();
 
         proc->fileDescriptors.clear();
         proc->sharedMemory.clear();
@@ -185,7 +384,7 @@ namespace Scheduler{
         proc->blocking.clear();
         proc->threads.clear();
 
-        proc->threads.add_back(new thread_t);
+        proc->threads.add_back(threadCache.New());
         proc->threadCount = 1;
 
         memset(proc->threads[0], 0, sizeof(thread_t));
@@ -262,10 +461,10 @@ namespace Scheduler{
     }
 
     void Yield(){
-        CPU* cpu = GetCPULocal();
+        thread_t* thread = GetCurrentThread();
         
-        if(cpu->currentThread) {
-            cpu->currentThread->timeSlice = 0;
+        if(thread) {
+            thread->timeSlice = 0;
         }
         asm("int $0xFD"); // Send schedule IPI to self
     }
@@ -293,7 +492,7 @@ namespace Scheduler{
 
     pid_t CreateChildThread(process_t* process, uintptr_t entry, uintptr_t stack){
         pid_t threadID = process->threadCount++;
-        process->threads.add_back(new thread_t);
+        process->threads.add_back(threadCache.New());
         thread_t& thread = *process->threads[threadID];
 
         thread.tid = threadID;
@@ -334,11 +533,19 @@ namespace Scheduler{
         while(process->children.get_length())
             EndProcess(process->children.get_front());
         
-        CPU* cpu = GetCPULocal();
+        thread_t* currentThread = GetCurrentThread();
         for(unsigned i = 0; i < process->threads.get_length(); i++){
             thread_t* thread = process->threads[i];
-            if(thread != cpu->currentThread && thread){
+            if(thread != currentThread && thread){
+                asm("cli");
+                acquireLock(&thread->stateLock);
                 thread->state = ThreadStateZombie;
+                if(!thread->cpu){
+                    EnqueueThread(SelectCPU(thread), thread); // Let blocked threads run so they can leave any syscall
+                }
+                releaseLock(&thread->stateLock);
+                asm("sti");
+
                 acquireLock(&thread->lock); // Make sure we acquire a lock on all threads to ensure that they are not in a syscall and are not retaining a lock
             }
         }
@@ -362,8 +569,17 @@ namespace Scheduler{
             
             process->threads[i]->waiting.clear();
 
-            thread->state = ThreadStateBlocked;
+            if(thread == currentThread){
+                continue; // We are still running on this thread, it gets taken off the CPU at the end
+            }
+
+            asm("cli");
+            acquireLock(&thread->stateLock);
+            thread->state = ThreadStateDying;
             thread->timeSlice = thread->timeSliceDefault = 0;
+            DequeueThread(thread);
+            releaseLock(&thread->stateLock);
+            asm("sti");
         }
 
         for(unsigned i = 0; i < process->fileDescriptors.get_length(); i++){
@@ -372,44 +588,19 @@ namespace Scheduler{
             }
         }
 
-        acquireLock(&cpu->runQueueLock);
-        asm("cli");
-
-        for(unsigned j = 0; j < cpu->runQueue->get_length(); j++){
-            if(cpu->runQueue->get_at(j)->parent == process) cpu->runQueue->remove_at(j);
-        }
-
         process->fileDescriptors.clear();
-        
-        for(unsigned i = 0; i < SMP::processorCount; i++){
-            if(i == cpu->id) continue; // Is current processor?
-
-            if(SMP::cpus[i]->currentThread->parent == process){
-                SMP::cpus[i]->currentThread = nullptr;
-            }
-
-            asm("sti");
-            //acquireLock(&SMP::cpus[i]->runQueueLock);
-            asm("cli");
-            
-            for(unsigned j = 0; j < SMP::cpus[i]->runQueue->get_length(); j++){
-                thread_t* thread = SMP::cpus[i]->runQueue->get_at(j);
-
-                assert(thread);
 
-                if(thread->parent == process){
-                    SMP::cpus[i]->runQueue->remove(thread);
-                }
-            }
-            
-            //releaseLock(&SMP::cpus[i]->runQueueLock);
+        Memory::ReleaseFileMappings(process->addressSpace); // Hand changes to shared file mappings to the page cache
 
-            if(SMP::cpus[i]->currentThread == nullptr){
-                APIC::Local::SendIPI(i, 0, ICR_MESSAGE_TYPE_FIXED, IPI_SCHEDULE);
+        for(unsigned i = 0; i < process->sharedMemory.get_length(); i++){
+            if(process->sharedMemory[i].key){
+                Memory::ReleaseSharedMemoryMapping(process->sharedMemory[i].key); // Destroyed here if we were the last to use it, nothing runs in the address space anymore
             }
         }
 
-        if(cpu->currentThread->parent == process){
+        asm("cli"); // We must not be preempted whilst tearing down the address space we could be running in
+
+        if(currentThread->parent == process){
             asm volatile("mov %%rax, %%cr3" :: "a"(((uint64_t)Memory::kernelPML4) - KERNEL_VIRTUAL_BASE)); // If we are using the PML4 of the current process switch to the kernel's
         }
 
@@ -423,49 +614,82 @@ namespace Scheduler{
             process->threads[i]->waiting.~List();
         }
 
-        if(cpu->currentThread->parent == process){
+        if(currentThread->parent == process){
+            CPU* cpu = GetCPULocal();
+
+            acquireLock(&currentThread->stateLock);
+            currentThread->state = ThreadStateDying;
+            currentThread->timeSlice = currentThread->timeSliceDefault = 0;
+            currentThread->cpu = nullptr;
+            releaseLock(&currentThread->stateLock);
+
+            acquireLock(&cpu->runQueueLock);
             cpu->currentThread = nullptr; // Force reschedule
-            kfree(process);
             releaseLock(&cpu->runQueueLock);
-            asm("sti");
+
+            processCache.Delete(process);
 
             Schedule(nullptr);
             for(;;) {
-                asm("hlt");
+                asm("sti; hlt; cli");
                 Schedule(nullptr);
             }
         }
 
-        releaseLock(&cpu->runQueueLock);
-        kfree(process);
+        processCache.Delete(process);
         asm("sti");
     }
 
 	void BlockCurrentThread(List<thread_t*>& list, lock_t& lock){
-        CPU* cpu = GetCPULocal();
+        thread_t* thread = GetCurrentThread();
 
         acquireLock(&lock);
-        acquireLock(&cpu->runQueueLock);
-        releaseLock(&cpu->currentThread->lock);
-        list.add_back(cpu->currentThread);
-        cpu->currentThread->state = ThreadStateBlocked;
+
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&thread->stateLock);
+        releaseLock(&thread->lock);
+        list.add_back(thread);
+        if(thread->state != ThreadStateZombie){ // Killed threads keep running so they can leave the kernel
+            thread->state = ThreadStateBlocked;
+        }
+        releaseLock(&thread->stateLock);
         releaseLock(&lock);
-        releaseLock(&cpu->runQueueLock);
+        if(intsEnabled) asm("sti");
 
         Yield();
     }
 
 	void BlockCurrentThread(ThreadBlocker& blocker, lock_t& lock){
-        CPU* cpu = GetCPULocal();
+        thread_t* thread = GetCurrentThread();
 
         acquireLock(&lock);
-        acquireLock(&cpu->currentThread->stateLock);
-        acquireLock(&cpu->runQueueLock);
-        blocker.Block(cpu->currentThread);
-        cpu->currentThread->state = ThreadStateBlocked;
-        releaseLock(&cpu->currentThread->stateLock);
+
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&thread->stateLock);
+        blocker.Block(thread);
+        if(thread->state != ThreadStateZombie){
+            thread->state = ThreadStateBlocked;
+        }
+        releaseLock(&thread->stateLock);
         releaseLock(&lock);
-        releaseLock(&cpu->runQueueLock);
+        if(intsEnabled) asm("sti");
+
+        Yield();
+    }
+
+	void BlockCurrentThreadLocked(ThreadBlocker& blocker, lock_t& lock){
+        thread_t* thread = GetCurrentThread();
+
+        acquireLock(&thread->stateLock);
+        blocker.Block(thread);
+        if(thread->state != ThreadStateZombie){ // Killed threads keep running so they can leave the kernel
+            thread->state = ThreadStateBlocked;
+        }
+        releaseLock(&thread->stateLock);
+        releaseLock(&lock);
+        asm("sti");
 
         Yield();
     }
@@ -481,10 +705,21 @@ namespace Scheduler{
     }
     
 	void UnblockThread(thread_t* thread){
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+
         acquireLock(&thread->stateLock);
-        thread->state = ThreadStateRunning;
+        if(thread->state == ThreadStateBlocked){
+            thread->state = ThreadStateRunning;
+
+            if(!thread->cpu){ // Thread has been switched out, otherwise Schedule will see it is runnable and requeue it
+                EnqueueThread(SelectCPU(thread), thread);
+            }
+        }
         releaseLock(&thread->stateLock);
 
+        if(intsEnabled) asm("sti");
+
         /*for(List<thread_t*>* l : thread->waiting){
             l->remove(thread);
         }*/
@@ -493,64 +728,93 @@ namespace Scheduler{
     void Tick(regs64_t* r){
         if(!schedulerReady) return;
 
-        APIC::Local::SendIPI(0, ICR_DSH_OTHER, ICR_MESSAGE_TYPE_FIXED, IPI_SCHEDULE);
-
         Schedule(r);
     }
 
+    // Called with interrupts disabled
     void Schedule(regs64_t* r){
         CPU* cpu = GetCPULocal();
+        thread_t* current = cpu->currentThread;
+        bool idle = IsIdle(cpu);
+
+        UpdateLoad(cpu, current, idle);
 
-        if(cpu->currentThread) {
-            cpu->currentThread->parent->activeTicks++;
-            if(cpu->currentThread->timeSlice > 0) {
-                cpu->currentThread->timeSlice--;
+        if(current) {
+            current->parent->activeTicks++;
+            if(!idle && current->timeSlice > 0) {
+                current->timeSlice--;
+                Timer::UpdateTimerInterrupt(true);
                 return;
             }
         }
 
-        while(__builtin_expect(acquireTestLock(&cpu->runQueueLock), 0)) {
-            return;
+        // Lock order is thread state lock then run queue lock
+        if(!idle){
+            acquireLock(&current->stateLock);
+        }
+        acquireLock(&cpu->runQueueLock);
+
+        if(cpu->lastTick - cpu->lastBalance >= SCHEDULER_BALANCE_TICKS){
+            cpu->lastBalance = cpu->lastTick;
+            BalanceLoad(cpu);
+            WakeIdleCPU(cpu);
         }
 
-        if (__builtin_expect(cpu->runQueue->get_length() <= 0 || !cpu->runQueue->front, 0)){
-            cpu->currentThread = cpu->idleProcess->threads[0];
-        } else if(__builtin_expect(cpu->currentThread && cpu->currentThread->parent != cpu->idleProcess, 1)){
-            cpu->currentThread->timeSlice = cpu->currentThread->timeSliceDefault;
+        if(!idle){
+            current->timeSlice = current->timeSliceDefault;
+
+            bool runnable = (current->state == ThreadStateRunning || current->state == ThreadStateZombie);
+            if(runnable && cpu->runQueue->HighestPriority() > RunQueue::PriorityLevel(current)){
+                releaseLock(&cpu->runQueueLock); // Nothing as urgent is waiting so keep running
+                releaseLock(&current->stateLock);
+                Timer::UpdateTimerInterrupt(true);
+                return;
+            }
 
-            asm volatile ("fxsave64 (%0)" :: "r"((uintptr_t)cpu->currentThread->fxState) : "memory");
+            asm volatile ("fxsave64 (%0)" :: "r"((uintptr_t)current->fxState) : "memory");
 
-            cpu->currentThread->registers = *r;
+            current->registers = *r;
 
-            cpu->currentThread = cpu->currentThread->next;
-        } else {
-            cpu->currentThread = cpu->runQueue->front;
+            if(runnable){
+                cpu->runQueue->Enqueue(current);
+            } else {
+                current->cpu = nullptr; // Keep blocked threads off the run queue until they are unblocked
+            }
         }
-            
-        if(cpu->currentThread->state == ThreadStateBlocked){
-            thread_t* first = cpu->currentThread;
 
-            do {
-                cpu->currentThread = cpu->currentThread->next;
-            } while(cpu->currentThread->state == ThreadStateBlocked && cpu->currentThread != first);
+        thread_t* next = cpu->runQueue->Dequeue();
+        if(!next){
+            next = StealThread(cpu);
+        }
 
-            if(cpu->currentThread->state == ThreadStateBlocked){
-                cpu->currentThread = cpu->idleProcess->threads[0];
+        if(!next){
+            if(idle && current){ // Already idle and nothing to steal
+                releaseLock(&cpu->runQueueLock);
+                Timer::UpdateTimerInterrupt(false);
+                return;
             }
+
+            next = cpu->idleProcess->threads[0];
         }
 
-        releaseLock(&cpu->runQueueLock);
-        asm volatile ("fxrstor64 (%0)" :: "r"((uintptr_t)cpu->currentThread->fxState) : "memory");
+        Timer::UpdateTimerInterrupt(next->parent != cpu->idleProcess); // Stop ticking whilst idle
 
-	    asm volatile ("wrmsr" :: "a"(cpu->currentThread->fsBase & 0xFFFFFFFF) /*Value low*/, "d"((cpu->currentThread->fsBase >> 32) & 0xFFFFFFFF) /*Value high*/, "c"(0xC0000100) /*Set FS Base*/);
+        cpu->currentThread = next;
+        next->lastCPU = cpu;
+
+        asm volatile ("fxrstor64 (%0)" :: "r"((uintptr_t)next->fxState) : "memory");
+
+	    asm volatile ("wrmsr" :: "a"(next->fsBase & 0xFFFFFFFF) /*Value low*/, "d"((next->fsBase >> 32) & 0xFFFFFFFF) /*Value high*/, "c"(0xC0000100) /*Set FS Base*/);
         
-        TSS::SetKernelStack(&cpu->tss, (uintptr_t)cpu->currentThread->kernelStack);
+        TSS::SetKernelStack(&cpu->tss, (uintptr_t)next->kernelStack);
 
-        TaskSwitch(&cpu->currentThread->registers, cpu->currentThread->parent->addressSpace->pml4Phys);
+        // The locks are released once we are off the old thread's stack
+        TaskSwitch(&next->registers, next->parent->addressSpace->pml4Phys, &cpu->runQueueLock, idle ? nullptr : &current->stateLock);
     }
 
-    process_t* CreateELFProcess(void* elf, int argc, char** argv, int envc, char** envp) {
-        if(!VerifyELF(elf)) return nullptr;
+    process_t* CreateELFProcess(FsNode* node, int argc, char** argv, int envc, char** envp) {
+        elf64_header_t header;
+        if(fs::Read(node, 0, sizeof(elf64_header_t), (uint8_t*)&header) != static_cast<ssize_t>(sizeof(elf64_header_t)) || !VerifyELF(&header)) return nullptr;
 
         // Create process structure
         process_t* proc = InitializeProcessStructure();
@@ -564,7 +828,7 @@ namespace Scheduler{
 
         Memory::MapVirtualMemory4K(Memory::AllocatePhysicalMemoryBlock(),0,1,proc->addressSpace);
 
-        elf_info_t elfInfo = LoadELFSegments(proc, elf, 0);
+        elf_info_t elfInfo = LoadELFSegments(proc, node, 0);
         
         thread->registers.rip = elfInfo.entry;
         
@@ -572,36 +836,43 @@ namespace Scheduler{
             //char* linkPath = elfInfo.linkerPath;
             uintptr_t linkerBaseAddress = 0x7FC0000000; // Linker base address
 
-            FsNode* node = fs::ResolvePath("/initrd/ld.so");
-
-            void* linkerElf = kmalloc(node->size);
+            FsNode* linker = fs::ResolvePath("/initrd/ld.so"); // Load Dynamic Linker
 
-            fs::Read(node, 0, node->size, (uint8_t*)linkerElf); // Load Dynamic Linker
-            
-            if(!VerifyELF(linkerElf)){
+            elf_info_t linkerELFInfo;
+            if(!linker || !(linkerELFInfo = LoadELFSegments(proc, linker, linkerBaseAddress)).entry){
                 Log::Warning("Invalid Dynamic Linker ELF");
                 asm volatile("mov %%rax, %%cr3" :: "a"(GetCurrentProcess()->addressSpace->pml4Phys));
                 asm("sti");
                 return nullptr;
             }
 
-            elf_info_t linkerELFInfo = LoadELFSegments(proc, linkerElf, linkerBaseAddress);
-
             thread->registers.rip = linkerELFInfo.entry;
-
-            kfree(linkerElf);
         }
 
         char** tempArgv = (char**)kmalloc(argc * sizeof(char*));
         char** tempEnvp = (char**)kmalloc((envc) * sizeof(char*));
 
+        // Only allocate the top of the stack that the arguments get written to, the rest is allocated on demand.
+        // Leave room for the argv and envp arrays, auxiliary vector and alignment.
+        size_t argumentSize = (argc + envc + 8) * sizeof(uint64_t) + 4 * sizeof(auxv_t) + 32;
+        for(int i = 0; i < argc; i++){
+            argumentSize += strlen(argv[i]) + 1;
+        }
+        for(int i = 0; envp && i < envc; i++){
+            argumentSize += strlen(envp[i]) + 1;
+        }
+
+        unsigned argumentPages = (argumentSize + PAGE_SIZE_4K - 1) / PAGE_SIZE_4K;
+        assert(argumentPages <= 64);
+
         asm("cli");
         asm volatile("mov %%rax, %%cr3" :: "a"(proc->addressSpace->pml4Phys));
         void* _stack = (void*)Memory::Allocate4KPages(64, proc->addressSpace);
-        for(int i = 0; i < 64; i++){
+        Memory::MapLazyVirtualMemory4K((uintptr_t)_stack, 64 - argumentPages, proc->addressSpace);
+        for(unsigned i = 64 - argumentPages; i < 64; i++){
             Memory::MapVirtualMemory4K(Memory::AllocatePhysicalMemoryBlock(),(uintptr_t)_stack + PAGE_SIZE_4K * i, 1, proc->addressSpace);
         }
-        memset(_stack, 0, PAGE_SIZE_4K * 64);
+        memset((void*)((uintptr_t)_stack + PAGE_SIZE_4K * (64 - argumentPages)), 0, PAGE_SIZE_4K * argumentPages);
 
         thread->stack = _stack; // 256KB stack size
         thread->registers.rsp = (uintptr_t)thread->stack + PAGE_SIZE_4K * 64;
@@ -60,8 +60,7 @@ namespace SMP{
         TSS::InitializeTSS(&cpu->tss, cpu->gdt);
 
         APIC::Local::Enable();
-
-        cpu->runQueue = new FastList<thread_t*>();
+        Timer::InitializeLocalTimer();
 
         asm("sti");
 
@@ -78,6 +77,8 @@ namespace SMP{
         CPU* cpu = new CPU;
         cpu->id = id;
         cpu->runQueueLock = 0;
+        cpu->runQueue = new RunQueue(); // Other CPUs may look at our run queue as soon as we are started
+        cpu->timers = new TimerQueue();
         cpus[id] = cpu;
         
         *smpMagic = 0; // Set magic to 0
@@ -120,8 +121,13 @@ namespace SMP{
         cpus[0]->gdtPtr = GDT64Pointer64;
         cpus[0]->currentThread = nullptr;
         cpus[0]->runQueueLock = 0;
-        cpus[0]->runQueue = new FastList<thread_t*>();
+        cpus[0]->runQueue = new RunQueue();
+        cpus[0]->timers = new TimerQueue();
         SetCPULocal(cpus[0]);
+        Memory::EnableCPUPageCaches();
+        Slab::EnableCPUCaches();
+
+        Timer::InitializeLocalTimer(); // Calibrates the local APIC timer so do this before starting the other CPUs
 
         if(HAL::disableSMP) {
             TSS::InitializeTSS(&cpus[0]->tss, cpus[0]->gdt);
@@ -21,7 +21,7 @@ or eax, 1 << 8
 wrmsr
 
 mov eax, cr0
-or eax, 0x80000001 ; Paging, Protected Mode
+or eax, 0x80010001 ; Paging, Write protect, Protected Mode
 mov cr0, eax
 
 lgdt [SMP_TRAMPOLINE_GDT_PTR]
@@ -20,6 +20,8 @@
 #include <lock.h>
 #include <smp.h>
 #include <pair.h>
+#include <futex.h>
+#include <fs/epoll.h>
 
 #define SYS_EXIT 1
 #define SYS_EXEC 2
@@ -94,11 +96,22 @@
 #define SYS_GET_FILE_STATUS_FLAGS 73
 #define SYS_SET_FILE_STATUS_FLAGS 74
 #define SYS_SELECT 75
+#define SYS_FUTEX 76
+#define SYS_FSYNC 77
+#define SYS_CREATE_SHARED_MEMORY_FD 78
+#define SYS_MAP_SHARED_MEMORY_FD 79
+#define SYS_EPOLL_CREATE 80
+#define SYS_EPOLL_CTL 81
+#define SYS_EPOLL_WAIT 82
 
-#define NUM_SYSCALLS 76
+#define NUM_SYSCALLS 83
 
 #define EXEC_CHILD 1
 
+#define MAP_SHARED 0x1
+#define MAP_PRIVATE 0x2
+#define MAP_ANON 0x20
+
 typedef long(*syscall_t)(regs64_t*);
 
 long SysExit(regs64_t* r){
@@ -127,15 +140,6 @@ long SysExec(regs64_t* r){
 	}
 
 	Log::Info("Loading: %s", (char*)r->rbx);
-	timeval_t tv = Timer::GetSystemUptimeStruct();
-	uint8_t* buffer = (uint8_t*)kmalloc(current_node->size);
-	size_t read = fs::Read(current_node, 0, current_node->size, buffer);
-	if(!read){
-		Log::Warning("Could not read file: %s", filepath);
-		return 0;
-	}
-	timeval_t tvnew = Timer::GetSystemUptimeStruct();
-	Log::Info("Done (took %d ms)", Timer::TimeDifference(tvnew, tv));
 
 	char** kernelArgv = (char**)kmalloc(argc * sizeof(char*));
 	for(int i = 0; i < argc; i++){
@@ -158,7 +162,10 @@ long SysExec(regs64_t* r){
 		}
 	}
 
-	process_t* proc = Scheduler::CreateELFProcess((void*)buffer, argc, kernelArgv, envCount, kernelEnvp);
+	timeval_t tv = Timer::GetSystemUptimeStruct();
+	process_t* proc = Scheduler::CreateELFProcess(current_node, argc, kernelArgv, envCount, kernelEnvp);
+	timeval_t tvnew = Timer::GetSystemUptimeStruct();
+	Log::Info("Done (took %d ms)", Timer::TimeDifference(tvnew, tv));
 	
 	if(!proc) {
 		for(int i = 0; i < argc; i++){
@@ -166,7 +173,6 @@ long SysExec(regs64_t* r){
 		}
 
 		kfree(kernelArgv);
-		kfree(buffer);
 
 		return 0;
 	}
@@ -184,7 +190,6 @@ long SysExec(regs64_t* r){
 	}
 	
 	kfree(kernelArgv);
-	kfree(buffer);
 
 
 	if(flags & EXEC_CHILD){
@@ -292,7 +297,7 @@ open:
 
 			DirectoryEntry ent;
 			strcpy(ent.name, basename);
-			parent->Create(&ent, flags);
+			fs::Create(parent, &ent, flags);
 
 			kfree(basename);
 
@@ -391,7 +396,7 @@ long SysLink(regs64_t* r){
 
 	DirectoryEntry entry;
 	strcpy(entry.name, linkName);
-	return parentDirectory->Link(file, &entry);
+	return fs::Link(parentDirectory, file, &entry);
 }
 
 long SysUnlink(regs64_t* r){
@@ -419,7 +424,7 @@ long SysUnlink(regs64_t* r){
 
 	DirectoryEntry entry;
 	strcpy(entry.name, linkName);
-	return parentDirectory->Unlink(&entry);
+	return fs::Unlink(parentDirectory, &entry);
 }
 
 long SysChdir(regs64_t* r){
@@ -446,11 +451,12 @@ long SysMapFB(regs64_t *r){
 
 	uint64_t pageCount = (vMode.height * vMode.pitch + 0xFFF) >> 12;
 	uintptr_t fbVirt = (uintptr_t)Memory::Allocate4KPages(pageCount, Scheduler::GetCurrentProcess()->addressSpace);
-	Memory::MapVirtualMemory4K((uintptr_t)HAL::videoMode.physicalAddress,fbVirt,pageCount,Scheduler::GetCurrentProcess()->addressSpace);
+	Memory::MapVirtualMemory4K((uintptr_t)HAL::videoMode.physicalAddress,fbVirt,pageCount,PAGE_SHARED,Scheduler::GetCurrentProcess()->addressSpace);
 
 	mem_region_t memR;
 	memR.base = fbVirt;
 	memR.pageCount = pageCount;
+	memR.key = 0;
 	Scheduler::GetCurrentProcess()->sharedMemory.add_back(memR);
 
 	fb_info_t fbInfo;
@@ -475,10 +481,7 @@ long SysAlloc(regs64_t* r){
 
 	assert(address);
 
-	for(unsigned i = 0; i < pageCount; i++){
-		Memory::MapVirtualMemory4K(Memory::AllocatePhysicalMemoryBlock(),address + i * PAGE_SIZE_4K,1,Scheduler::GetCurrentProcess()->addressSpace);
-		memset((void*)(address + i * PAGE_SIZE_4K), 0, PAGE_SIZE_4K);
-	}
+	Memory::MapLazyVirtualMemory4K(address, pageCount, Scheduler::GetCurrentProcess()->addressSpace); // Zeroed pages are allocated on first access
 
 	*addressPointer = address;
 
@@ -640,7 +643,7 @@ long SysMkdir(regs64_t* r){
 
 	DirectoryEntry dir;
 	strcpy(dir.name, dirPath);
-	int ret = parentDirectory->CreateDirectory(&dir, mode);
+	int ret = fs::CreateDirectory(parentDirectory, &dir, mode);
 
 	return ret;
 }
@@ -850,14 +853,43 @@ long SysReadDir(regs64_t* r){
 
 long SysSetFsBase(regs64_t* r){
 	asm volatile ("wrmsr" :: "a"(r->rbx & 0xFFFFFFFF) /*Value low*/, "d"((r->rbx >> 32) & 0xFFFFFFFF) /*Value high*/, "c"(0xC0000100) /*Set FS Base*/);
-	GetCPULocal()->currentThread->fsBase = r->rbx;
+	GetCurrentThread()->fsBase = r->rbx;
 	return 0;
 }
 
+/*
+ * SysMmap - Map memory (address, count, hint, flags, fd, offset)
+ * 
+ * address - Pointer to store the address of the mapping
+ * Anonymous memory is mapped unless flags has MAP_SHARED or MAP_PRIVATE without MAP_ANON,
+ * in which case count pages of the file fd are mapped from offset (page aligned)
+ * 
+ * On success - return 0
+ * On failure - return error code
+ */
 long SysMmap(regs64_t* r){
 	uint64_t* address = (uint64_t*)r->rbx;
 	size_t count = r->rcx;
 	uintptr_t hint = r->rdx;
+	uint64_t flags = r->rsi;
+	uint64_t fd = r->rdi;
+	uint64_t offset = r->r8;
+
+	process_t* proc = Scheduler::GetCurrentProcess();
+
+	FsNode* node = nullptr;
+	if((flags & (MAP_SHARED | MAP_PRIVATE)) && !(flags & MAP_ANON)){
+		if(fd >= proc->fileDescriptors.get_length() || !proc->fileDescriptors[fd]){
+			*address = 0;
+			return -EBADF;
+		}
+
+		node = proc->fileDescriptors[fd]->node;
+		if((node->flags & FS_NODE_TYPE) != FS_NODE_FILE || (offset & (PAGE_SIZE_4K - 1))){
+			*address = 0;
+			return -EINVAL;
+		}
+	}
 
 	uintptr_t _address;
 	if(hint){
@@ -870,9 +902,10 @@ long SysMmap(regs64_t* r){
 		}
 	} else _address = (uintptr_t)Memory::Allocate4KPages(count, Scheduler::GetCurrentProcess()->addressSpace);
 
-	for(size_t i = 0; i < count; i++){
-		Memory::MapVirtualMemory4K(Memory::AllocatePhysicalMemoryBlock(), _address + i * PAGE_SIZE_4K, 1, Scheduler::GetCurrentProcess()->addressSpace);
-		memset((void*)(_address + i * PAGE_SIZE_4K), 0, PAGE_SIZE_4K);
+	if(node){
+		Memory::MapFile(node, offset, _address, count, true, flags & MAP_SHARED, proc->addressSpace); // Pages come from the page cache on first access
+	} else {
+		Memory::MapLazyVirtualMemory4K(_address, count, Scheduler::GetCurrentProcess()->addressSpace); // Zeroed pages are allocated on first access
 	}
 
 	*address = _address;
@@ -933,8 +966,7 @@ long SysWaitPID(regs64_t* r){
 long SysNanoSleep(regs64_t* r){
 	uint64_t nanoseconds = r->rbx;
 
-	uint64_t ticks = nanoseconds * Timer::GetFrequency() / 1000000000;
-	Timer::SleepCurrentThread(ticks);
+	Timer::SleepCurrentThreadUntil(Timer::GetSystemUptimeNs() + nanoseconds);
 
 	return 0;
 }
@@ -1003,7 +1035,7 @@ long SysIoctl(regs64_t* r){
 long SysInfo(regs64_t* r){
 	lemon_sysinfo_t* s = (lemon_sysinfo_t*)r->rbx;
 
-	if(!s){
+	if(!s || !Memory::CheckUsermodePointer(r->rbx, sizeof(lemon_sysinfo_t), Scheduler::GetCurrentProcess()->addressSpace)){
 		return -1;
 	}
 
@@ -1011,12 +1043,23 @@ long SysInfo(regs64_t* r){
 	s->totalMem = HAL::mem_info.memory_high + HAL::mem_info.memory_low;
 	s->cpuCount = static_cast<uint16_t>(SMP::processorCount);
 
+	for(unsigned i = 0; i < SMP::processorCount && i < LEMON_SYSINFO_MAX_CPUS; i++){
+		CPU* cpu = SMP::cpus[i];
+		bool idle = !cpu->currentThread || cpu->currentThread->parent == cpu->idleProcess;
+
+		s->cpuLoad[i].runnable = cpu->runQueue->get_length() + (idle ? 0 : 1);
+		s->cpuLoad[i].load = Scheduler::DecayIdleAverage(cpu, cpu->load) * 100 / CPU_LOAD_SCALE;
+		s->cpuLoad[i].utilisation = Scheduler::DecayIdleAverage(cpu, cpu->utilisation) * 100 / CPU_LOAD_SCALE;
+	}
+
 	return 0;
 }
 
 /*
  * SysMunmap - Unmap memory (addr, count)
  * 
+ * Only file mappings are unmapped, changes to shared file mappings get written back with the page cache
+ * 
  * On success - return 0
  * On failure - return -1
  */
@@ -1026,6 +1069,7 @@ long SysMunmap(regs64_t* r){
 	
 	if(Memory::CheckRegion(address, count * PAGE_SIZE_4K, Scheduler::GetCurrentProcess()->addressSpace) /*Check availibilty of the requested map*/){
 		//Memory::Free4KPages((void*)address, count, Scheduler::GetCurrentProcess()->addressSpace);
+		Memory::UnmapFile(address, count, Scheduler::GetCurrentProcess()->addressSpace);
 	} else {
 		return -1;
 	}
@@ -1049,7 +1093,7 @@ long SysCreateSharedMemory(regs64_t* r){
 	uint64_t flags = r->rdx;
 	uint64_t recipient = r->rsi;
 
-	*key = Memory::CreateSharedMemory(size, flags, Scheduler::GetCurrentProcess()->pid, recipient);
+	*key = Memory::CreateSharedMemory(size, flags & ~SMEM_FLAGS_HANDLE, Scheduler::GetCurrentProcess()->pid, recipient);
 
 	if(!*key) return -1; // Failed
 
@@ -1070,6 +1114,12 @@ long SysMapSharedMemory(regs64_t* r){
 	uint64_t key = r->rcx;
 	uint64_t hint = r->rdx;
 
+	shared_mem_t* sMem = Memory::GetSharedMemory(key);
+	if(sMem && (sMem->flags & SMEM_FLAGS_HANDLE)){
+		*ptr = nullptr; // Only mapped through its descriptors
+		return 0;
+	}
+
 	*ptr = Memory::MapSharedMemory(key,Scheduler::GetCurrentProcess(), hint);
 
 	return 0;
@@ -1078,7 +1128,7 @@ long SysMapSharedMemory(regs64_t* r){
 /* 
  * SysUnmapSharedMemory (address, key) - Map Shared Memory
  * address - address of mapped memory
- * key - Memory key
+ * key - Memory key, 0 for memory mapped through a descriptor
  *
  * On Success - return 0
  * On Failure - return -1
@@ -1087,19 +1137,24 @@ long SysUnmapSharedMemory(regs64_t* r){
 	uint64_t address = r->rbx;
 	uint64_t key = r->rcx;
 
-	shared_mem_t* sMem = Memory::GetSharedMemory(key);
-	if(!sMem) return -1;
+	process_t* proc = Scheduler::GetCurrentProcess();
 
-	if(!Memory::CheckRegion(address, sMem->pgCount * PAGE_SIZE_4K, Scheduler::GetCurrentProcess()->addressSpace)) // Make sure the process is not screwing with kernel memory
-		return -1;
+	// Only what the process actually mapped there can be unmapped, so nobody can drop references to memory they do not hold
+	for(unsigned i = 0; i < proc->sharedMemory.get_length(); i++){
+		mem_region_t region = proc->sharedMemory[i];
+		if(region.base != address || !region.key || (key && region.key != key)){
+			continue;
+		}
 
-	Memory::Free4KPages((void*)address, sMem->pgCount, Scheduler::GetCurrentProcess()->addressSpace);
+		proc->sharedMemory.remove_at(i);
+		Memory::Free4KPages((void*)address, region.pageCount, proc->addressSpace);
 
-	sMem->mapCount--;
+		Memory::ReleaseSharedMemoryMapping(region.key); // Active shared memory will not be destroyed
 
-	Memory::DestroySharedMemory(key); // Active shared memory will not be destroyed and this will return
+		return 0;
+	}
 
-	return 0;
+	return -1;
 }
 
 /* 
@@ -1112,6 +1167,11 @@ long SysUnmapSharedMemory(regs64_t* r){
 long SysDestroySharedMemory(regs64_t* r){
 	uint64_t key = r->rbx;
 
+	shared_mem_t* sMem = Memory::GetSharedMemory(key);
+	if(sMem && (sMem->flags & SMEM_FLAGS_HANDLE)){
+		return -1; // Destroyed along with its last descriptor and mapping
+	}
+
 	if(Memory::CanModifySharedMemory(Scheduler::GetCurrentProcess()->pid, key)){
 		Memory::DestroySharedMemory(key);
 	} else return -1;
@@ -1484,7 +1544,7 @@ long SysPoll(regs64_t* r){
 	unsigned nfds = r->rcx;
 	long timeout = r->rdx;
 
-	thread_t* thread = GetCPULocal()->currentThread;
+	thread_t* thread = GetCurrentThread();
 	process_t* proc = Scheduler::GetCurrentProcess();
 	if(!Memory::CheckUsermodePointer(r->rbx, nfds * sizeof(pollfd), proc->addressSpace)){
 		Log::Warning("sys_poll: Invalid pointer to file descriptor array");
@@ -1546,23 +1606,21 @@ long SysPoll(regs64_t* r){
 	}
 
 	if(!eventCount && timeout){
-		timeval_t tVal = Timer::GetSystemUptimeStruct();
+		uint64_t deadline = Timer::GetSystemUptimeNs() + timeout * 1000000;
 
 		FilesystemWatcher fsWatcher;
 		for(unsigned i = 0; i < nfds; i++){
 			fsWatcher.WatchNode(files[i]->node, fds[i].events);
 		}
 
-		releaseLock(&GetCPULocal()->currentThread->lock);
-		if(timeout > 0){
-			fsWatcher.WaitTimeout(timeout);
-		} else {
-			fsWatcher.Wait();
-		}
+		releaseLock(&GetCurrentThread()->lock);
 
-		do{
-			if(eventCount > 0){
-				break;
+		bool timedOut = false;
+		while(!eventCount && !timedOut && thread->state != ThreadStateZombie){ // Wait until timeout, unless timeout is negative in which wait infinitely
+			if(timeout > 0){
+				timedOut = fsWatcher.WaitUntil(deadline);
+			} else {
+				fsWatcher.Wait();
 			}
 
 			for(unsigned i = 0; i < nfds; i++){
@@ -1594,8 +1652,7 @@ long SysPoll(regs64_t* r){
 
 				if(hasEvent) eventCount++;
 			}
-			Scheduler::Yield();
-		} while(thread->state != ThreadStateZombie && (timeout < 0 || Timer::TimeDifference(Timer::GetSystemUptimeStruct(), tVal) < timeout)); // Wait until timeout, unless timeout is negative in which wait infinitely
+		}
 	}
 
 	if(files)
@@ -1604,12 +1661,112 @@ long SysPoll(regs64_t* r){
 	return eventCount;
 }
 
+// Duplicate the descriptors of every SCM_RIGHTS control message in msg, for them to be passed to a peer.
+// fds is set to an array of count duplicates, or nullptr if there are none. Returns 0 on success, nothing is kept on failure
+static long CollectRights(process_t* proc, msghdr* msg, fs_fd_t**& fds, unsigned& count){
+	uint8_t* control = reinterpret_cast<uint8_t*>(msg->control);
+	fs_fd_t* collected[SCM_MAX_FD];
+
+	fds = nullptr;
+	count = 0;
+
+	long error = 0;
+	for(size_t offset = 0; offset + sizeof(cmsghdr) <= msg->controllen;){
+		cmsghdr* cmsg = reinterpret_cast<cmsghdr*>(control + offset);
+		if(cmsg->len < sizeof(cmsghdr) || offset + cmsg->len > msg->controllen){
+			error = -EINVAL;
+			break;
+		}
+
+		if(cmsg->level == SOL_SOCKET && cmsg->type == SCM_RIGHTS && cmsg->len > CMSG_LEN(0)){
+			unsigned fdCount = (cmsg->len - CMSG_LEN(0)) / sizeof(int);
+			if(count + fdCount > SCM_MAX_FD){ // Across every control message
+				error = -EINVAL;
+				break;
+			}
+
+			int* fdList = reinterpret_cast<int*>(CMSG_DATA(cmsg));
+			for(unsigned i = 0; i < fdCount; i++){
+				fs_fd_t* handle;
+				if(static_cast<unsigned>(fdList[i]) >= proc->fileDescriptors.get_length() || !(handle = proc->fileDescriptors[fdList[i]])){
+					error = -EBADF;
+					break;
+				}
+
+				// The receiver gets a duplicate, as with SysDup
+				fs_fd_t* dup = new fs_fd_t;
+				*dup = *handle;
+				dup->node->handleCount++;
+				collected[count++] = dup;
+			}
+
+			if(error){
+				break;
+			}
+		}
+
+		offset += CMSG_ALIGN(cmsg->len);
+	}
+
+	if(error){
+		while(count){
+			fs::Close(collected[--count]);
+		}
+		return error;
+	}
+
+	if(count){
+		fds = reinterpret_cast<fs_fd_t**>(kmalloc(count * sizeof(fs_fd_t*)));
+		memcpy(fds, collected, count * sizeof(fs_fd_t*));
+	}
+	return 0;
+}
+
+// Hand any descriptors received since start to the process in the control buffer of msg
+static void ReceiveRights(process_t* proc, LocalSocket* sock, msghdr* msg, uint64_t start){
+	fs_fd_t* fds[SCM_MAX_FD];
+
+	unsigned max = 0;
+	if(msg->control && msg->controllen >= CMSG_LEN(sizeof(int)) && Memory::CheckUsermodePointer((uintptr_t)msg->control, msg->controllen, proc->addressSpace)){
+		max = (msg->controllen - CMSG_LEN(0)) / sizeof(int);
+		if(max > SCM_MAX_FD){
+			max = SCM_MAX_FD;
+		}
+	}
+
+	bool truncated;
+	unsigned count = sock->ReceiveRights(start, fds, max, truncated);
+
+	msg->flags = truncated ? MSG_CTRUNC : 0;
+	if(!count){
+		msg->controllen = 0;
+		return;
+	}
+
+	cmsghdr* cmsg = reinterpret_cast<cmsghdr*>(msg->control);
+	cmsg->level = SOL_SOCKET;
+	cmsg->type = SCM_RIGHTS;
+	cmsg->len = CMSG_LEN(count * sizeof(int));
+
+	int* fdList = reinterpret_cast<int*>(CMSG_DATA(cmsg));
+	for(unsigned i = 0; i < count; i++){
+		fdList[i] = proc->fileDescriptors.get_length();
+		proc->fileDescriptors.add_back(fds[i]);
+	}
+
+	if(CMSG_SPACE(count * sizeof(int)) < msg->controllen){
+		msg->controllen = CMSG_SPACE(count * sizeof(int));
+	}
+}
+
 /* 
  * SysSend (sockfd, msg, flags) - Send data through a socket
  * sockfd - Socket file descriptor
  * msg - Message Header
  * flags - flags
  *
+ * SCM_RIGHTS control messages pass file descriptors over UNIX domain sockets
+ *
  * On Success - return amount of data sent
  * On Failure - return -1
  */
@@ -1651,22 +1808,64 @@ long SysSendMsg(regs64_t* r){
 		return -EFAULT;
 	}
 
-	long sent = 0;
 	Socket* sock = (Socket*)handle->node;
 
+	// Everything is checked before any descriptors are passed, so a failed call never leaves them behind
 	for(unsigned i = 0; i < msg->iovlen; i++){
 		if(!Memory::CheckUsermodePointer((uintptr_t)msg->iov[i].base, msg->iov[i].len, proc->addressSpace)){
 			Log::Warning("sys_sendmsg: msg: Invalid iovec entry base");
 			return -EFAULT;
 		}
+	}
 
-		long ret = sock->SendTo(msg->iov[i].base, msg->iov[i].len, flags, (sockaddr*)msg->name, msg->namelen);
+	fs_fd_t** fds = nullptr;
+	unsigned fdCount = 0;
+	if(msg->control && msg->controllen){
+		if(!Memory::CheckUsermodePointer((uintptr_t)msg->control, msg->controllen, proc->addressSpace)){
+			Log::Warning("sys_sendmsg: msg: Invalid control ptr");
+			return -EFAULT;
+		}
+
+		if(sock->GetDomain() != UnixDomain){
+			return -EOPNOTSUPP;
+		}
 
+		long ret = CollectRights(proc, msg, fds, fdCount);
 		if(ret < 0) return ret;
+	}
+
+	LocalSocket* localSock = static_cast<LocalSocket*>(sock);
+	if(fdCount){
+		long ret = localSock->SendRights(fds, fdCount); // Takes ownership of fds
+		if(ret < 0){
+			for(unsigned i = 0; i < fdCount; i++){
+				fs::Close(fds[i]);
+			}
+			kfree(fds);
+			return ret;
+		}
+	}
+
+	long sent = 0;
+	for(unsigned i = 0; i < msg->iovlen; i++){
+		long ret = sock->SendTo(msg->iov[i].base, msg->iov[i].len, flags, (sockaddr*)msg->name, msg->namelen);
+
+		if(ret < 0){
+			if(!sent) sent = ret; // Report what was sent before the error
+			break;
+		}
 
 		sent += ret;
 	}
 
+	// The descriptors go with the first byte (or message) sent, take them back if there was none
+	if(fdCount && sent <= 0 && localSock->WithdrawRights(fds)){
+		for(unsigned i = 0; i < fdCount; i++){
+			fs::Close(fds[i]);
+		}
+		kfree(fds);
+	}
+
 	return sent;
 }
 
@@ -1719,6 +1918,9 @@ long SysRecvMsg(regs64_t* r){
 	long read = 0;
 	Socket* sock = (Socket*)handle->node;
 
+	LocalSocket* local = (sock->GetDomain() == UnixDomain && !(flags & MSG_PEEK)) ? static_cast<LocalSocket*>(sock) : nullptr;
+	uint64_t start = local ? local->ReceivedCount() : 0;
+
 	for(unsigned i = 0; i < msg->iovlen; i++){
 		if(!Memory::CheckUsermodePointer((uintptr_t)msg->iov[i].base, msg->iov[i].len, proc->addressSpace)){
 			Log::Warning("sys_recvmsg: msg: Invalid iovec entry base");
@@ -1734,6 +1936,10 @@ long SysRecvMsg(regs64_t* r){
 		read += ret;
 	}
 
+	if(local){
+		ReceiveRights(proc, local, msg, start);
+	}
+
 	return read;
 }
 
@@ -1902,9 +2108,9 @@ long SysSpawnThread(regs64_t* r){
 long SysExitThread(regs64_t* r){
 	Log::Warning("SysExitThread is unimplemented! Hanging!");
 	
-	releaseLock(&GetCPULocal()->currentThread->lock);
+	releaseLock(&GetCurrentThread()->lock);
 
-	GetCPULocal()->currentThread->state = ThreadStateBlocked;
+	GetCurrentThread()->state = ThreadStateBlocked;
 
 	for(;;) Scheduler::Yield();
 }
@@ -1919,68 +2125,54 @@ long SysExitThread(regs64_t* r){
 long SysFutexWake(regs64_t* r){
 	int* futex = reinterpret_cast<int*>(r->rbx);
 
-	if(!Memory::CheckUsermodePointer(r->rbx, sizeof(int), Scheduler::GetCurrentProcess()->addressSpace)){
+	if((r->rbx & (sizeof(int) - 1)) || !Memory::CheckUsermodePointer(r->rbx, sizeof(int), Scheduler::GetCurrentProcess()->addressSpace)){
 		return EFAULT;
 	}
 
-	process_t* currentProcess = Scheduler::GetCurrentProcess();
-
-	Scheduler::FutexThreadBlocker* blocker = currentProcess->futexWaitQueue.get(reinterpret_cast<uintptr_t>(futex));
-
-	if(!blocker){
-		return 0;
-	}
-
-	auto front = blocker->blocked.get_front();
-
-	if(front){
-		blocker->Remove(front);
-
-		Scheduler::UnblockThread(front);
-	}
+	Futex::Wake(futex, 1);
 
 	return 0;
 }
 
 /////////////////////////////
-/// \brief SysFutexWait(futex, expected) Wait on a futex.
+/// \brief SysFutexWait(futex, expected, timeout) Wait on a futex.
 ///
 /// Will wait on the futex if the value is equal to expected
 ///
 /// \param futex (void*) Futex pointer
 /// \param expected (int) Expected futex value
+/// \param timeout (timespec*) Relative timeout, may be null to wait indefinitely
 ///
-/// \return 0 on success, error code on failure
+/// \return 0 on success, ETIMEDOUT if the timeout expired, error code on failure
 /////////////////////////////
 long SysFutexWait(regs64_t* r){
 	int* futex = reinterpret_cast<int*>(r->rbx);
+	int expected = static_cast<int>(r->rcx);
+	timespec_t* timeout = reinterpret_cast<timespec_t*>(r->rdx);
 
-	if(!Memory::CheckUsermodePointer(r->rbx, sizeof(int), Scheduler::GetCurrentProcess()->addressSpace)){
+	process_t* currentProcess = Scheduler::GetCurrentProcess();
+	if((r->rbx & (sizeof(int) - 1)) || !Memory::CheckUsermodePointer(r->rbx, sizeof(int), currentProcess->addressSpace)){
 		return EFAULT;
 	}
 
-	int expected = static_cast<int>(r->rcx);
+	uint64_t deadline = 0;
+	if(timeout){
+		if(!Memory::CheckUsermodePointer(r->rdx, sizeof(timespec_t), currentProcess->addressSpace)){
+			return EFAULT;
+		} else if(timeout->tv_sec < 0 || timeout->tv_nsec < 0 || timeout->tv_nsec >= 1000000000){
+			return EINVAL;
+		}
 
-	if(*futex != expected){
-		return 0;
+		deadline = Timer::GetSystemUptimeNs() + timeout->tv_sec * 1000000000 + timeout->tv_nsec;
 	}
 
-	process_t* currentProcess = Scheduler::GetCurrentProcess();
-
-	Scheduler::FutexThreadBlocker* blocker = currentProcess->futexWaitQueue.get(reinterpret_cast<uintptr_t>(futex));
+	releaseLock(&GetCurrentThread()->lock);
 
-	if(!blocker){
-		blocker = new Scheduler::FutexThreadBlocker();
-
-		currentProcess->futexWaitQueue.insert(reinterpret_cast<uintptr_t>(futex), blocker);
+	if(Futex::Wait(futex, expected, deadline) == -ETIMEDOUT){
+		return ETIMEDOUT;
 	}
 
-	releaseLock(&GetCPULocal()->currentThread->lock);
-
-	lock_t temp = 0;
-	Scheduler::BlockCurrentThread(*blocker, temp);
-
-	return 0;
+	return 0; // Callers recheck the futex value so a value mismatch is not an error
 }
 
 /////////////////////////////
@@ -2162,8 +2354,22 @@ long SysSelect(regs64_t* r){
 		return evCount;
 	}
 
-	timeval_t timeEnd = {.seconds = timeout->tv_sec + Timer::GetSystemUptimeStruct().seconds, .milliseconds = timeout->tv_nsec / 1000000 + Timer::GetSystemUptimeStruct().milliseconds};
-	while(Timer::GetSystemUptimeStruct() < timeEnd){
+	uint64_t deadline = Timer::GetSystemUptimeNs() + timeout->tv_sec * 1000000000 + timeout->tv_nsec;
+
+	FilesystemWatcher fsWatcher;
+	for(auto& handle : readfds){
+		fsWatcher.WatchNode(handle.item1->node, POLLIN);
+	}
+
+	for(auto& handle : writefds){
+		fsWatcher.WatchNode(handle.item1->node, POLLOUT);
+	}
+
+	thread_t* thread = GetCurrentThread();
+	bool timedOut = false;
+	while(!timedOut && thread->state != ThreadStateZombie){
+		timedOut = fsWatcher.WaitUntil(deadline);
+
 		evCount = 0;
 
 		for(auto& handle : readfds){
@@ -2185,13 +2391,260 @@ long SysSelect(regs64_t* r){
 		if(evCount){
 			break;
 		}
-
-		Scheduler::Yield();
 	}
 
 	return evCount;
 }
 
+/////////////////////////////
+/// \brief SysFutex(futex, op, val, val2, target, val3) Futex operations
+///
+/// FUTEX_WAIT waits whilst *futex is equal to val, val2 is a (timespec*) relative timeout which may be null.
+/// FUTEX_WAKE wakes up to val waiters.
+/// FUTEX_REQUEUE wakes up to val waiters and moves up to val2 of the rest to wait on target.
+/// FUTEX_CMP_REQUEUE is the same as FUTEX_REQUEUE but fails with EAGAIN unless *futex is equal to val3.
+///
+/// \param futex (int*) Futex pointer
+/// \param op (int) Operation
+/// \param val (int)
+/// \param val2 (uint64_t)
+/// \param target (int*) Futex to requeue waiters on
+/// \param val3 (int) Passed in r8
+///
+/// \return Threads woken (and requeued) or 0 for FUTEX_WAIT, negative error code on failure
+/////////////////////////////
+long SysFutex(regs64_t* r){
+	int* futex = reinterpret_cast<int*>(r->rbx);
+	int op = static_cast<int>(r->rcx);
+	int val = static_cast<int>(r->rdx);
+
+	process_t* currentProcess = Scheduler::GetCurrentProcess();
+	if(r->rbx & (sizeof(int) - 1)){
+		return -EINVAL;
+	} else if(!Memory::CheckUsermodePointer(r->rbx, sizeof(int), currentProcess->addressSpace)){
+		return -EFAULT;
+	}
+
+	switch(op){
+	case FUTEX_WAIT: {
+		timespec_t* timeout = reinterpret_cast<timespec_t*>(r->rsi);
+
+		uint64_t deadline = 0;
+		if(timeout){
+			if(!Memory::CheckUsermodePointer(r->rsi, sizeof(timespec_t), currentProcess->addressSpace)){
+				return -EFAULT;
+			} else if(timeout->tv_sec < 0 || timeout->tv_nsec < 0 || timeout->tv_nsec >= 1000000000){
+				return -EINVAL;
+			}
+
+			deadline = Timer::GetSystemUptimeNs() + timeout->tv_sec * 1000000000 + timeout->tv_nsec;
+		}
+
+		releaseLock(&GetCurrentThread()->lock);
+
+		return Futex::Wait(futex, val, deadline);
+	}
+	case FUTEX_WAKE:
+		return Futex::Wake(futex, val);
+	case FUTEX_REQUEUE:
+	case FUTEX_CMP_REQUEUE: {
+		int* target = reinterpret_cast<int*>(r->rdi);
+		if(r->rdi & (sizeof(int) - 1)){
+			return -EINVAL;
+		} else if(!Memory::CheckUsermodePointer(r->rdi, sizeof(int), currentProcess->addressSpace)){
+			return -EFAULT;
+		}
+
+		return Futex::Requeue(futex, val, static_cast<int>(r->rsi), target, op == FUTEX_CMP_REQUEUE, static_cast<int>(r->r8));
+	}
+	default:
+		return -ENOSYS;
+	}
+}
+
+/////////////////////////////
+/// \brief SysFsync(fd) Write the data and metadata of a file back to the disk
+///
+/// \param fd (int) file descriptor
+///
+/// \return 0 on success, negative error code on failure
+/////////////////////////////
+long SysFsync(regs64_t* r){
+	int fd = static_cast<int>(r->rbx);
+	fs_fd_t* handle;
+
+	process_t* currentProcess = Scheduler::GetCurrentProcess();
+	if(static_cast<unsigned>(fd) >= currentProcess->fileDescriptors.get_length() || !(handle = currentProcess->fileDescriptors[fd])){
+		return -EBADF;
+	}
+
+	return handle->node->Sync();
+}
+
+/////////////////////////////
+/// \brief SysCreateSharedMemoryFd(size, flags) Create shared memory only reachable through file descriptors
+///
+/// The memory can be passed to other processes with SCM_RIGHTS and is destroyed once every descriptor is closed and every mapping is gone
+///
+/// \param size (uint64_t) size in bytes
+/// \param flags (uint64_t) SMEM_FLAGS_*, private memory is not supported
+///
+/// \return file descriptor on success, negative error code on failure
+/////////////////////////////
+long SysCreateSharedMemoryFd(regs64_t* r){
+	uint64_t size = r->rbx;
+	uint64_t flags = r->rcx;
+
+	if(!size || (flags & SMEM_FLAGS_PRIVATE)){
+		return -EINVAL;
+	}
+
+	process_t* currentProcess = Scheduler::GetCurrentProcess();
+
+	uint64_t key = Memory::CreateSharedMemory(size, flags | SMEM_FLAGS_HANDLE, currentProcess->pid, 0);
+	if(!key){
+		return -ENOMEM;
+	}
+
+	int fd = currentProcess->fileDescriptors.get_length();
+	currentProcess->fileDescriptors.add_back(fs::Open(new SharedMemoryNode(key, size)));
+
+	return fd;
+}
+
+/////////////////////////////
+/// \brief SysMapSharedMemoryFd(ptr, fd, hint) Map shared memory by its descriptor
+///
+/// Unmap with SysUnmapSharedMemory and a key of 0
+///
+/// \param ptr (void**) pointer to the mapping, set to nullptr on failure
+/// \param fd (int) descriptor from SysCreateSharedMemoryFd or received over a socket
+/// \param hint (uintptr_t) address hint
+///
+/// \return 0 on success, negative error code on failure
+/////////////////////////////
+long SysMapSharedMemoryFd(regs64_t* r){
+	void** ptr = reinterpret_cast<void**>(r->rbx);
+	int fd = static_cast<int>(r->rcx);
+	uint64_t hint = r->rdx;
+	fs_fd_t* handle;
+
+	process_t* currentProcess = Scheduler::GetCurrentProcess();
+	if(!Memory::CheckUsermodePointer(r->rbx, sizeof(void*), currentProcess->addressSpace)){
+		return -EFAULT;
+	}
+
+	*ptr = nullptr;
+
+	if(static_cast<unsigned>(fd) >= currentProcess->fileDescriptors.get_length() || !(handle = currentProcess->fileDescriptors[fd])){
+		return -EBADF;
+	}
+
+	if((handle->node->flags & FS_NODE_TYPE) != FS_NODE_SHAREDMEM){
+		return -EINVAL;
+	}
+
+	*ptr = Memory::MapSharedMemory(static_cast<SharedMemoryNode*>(handle->node)->Key(), currentProcess, hint);
+	if(!*ptr){
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/////////////////////////////
+/// \brief SysEpollCreate() Create an epoll instance
+///
+/// Unlike SysPoll, the descriptors of interest are registered once with SysEpollCtl and stay registered between waits
+///
+/// \return file descriptor on success, negative error code on failure
+/////////////////////////////
+long SysEpollCreate(regs64_t* r){
+	process_t* currentProcess = Scheduler::GetCurrentProcess();
+
+	int fd = currentProcess->fileDescriptors.get_length();
+	currentProcess->fileDescriptors.add_back(fs::Open(new EPoll()));
+
+	return fd;
+}
+
+/////////////////////////////
+/// \brief SysEpollCtl(epfd, op, fd, event) Add, modify or remove an interest in a file descriptor
+///
+/// \param epfd (int) epoll instance
+/// \param op (int) EPOLL_CTL_ADD, EPOLL_CTL_MOD or EPOLL_CTL_DEL
+/// \param fd (int) file descriptor of interest, the instance keeps the file open until the interest is removed
+/// \param event (epoll_event*) events of interest (EPOLLIN, EPOLLOUT, EPOLLET, EPOLLONESHOT) and data to return with them, ignored for EPOLL_CTL_DEL
+///
+/// \return 0 on success, negative error code on failure
+/////////////////////////////
+long SysEpollCtl(regs64_t* r){
+	int epfd = static_cast<int>(r->rbx);
+	int op = static_cast<int>(r->rcx);
+	int fd = static_cast<int>(r->rdx);
+	epoll_event* event = reinterpret_cast<epoll_event*>(r->rsi);
+	fs_fd_t* epHandle;
+	fs_fd_t* handle;
+
+	process_t* currentProcess = Scheduler::GetCurrentProcess();
+	if(static_cast<unsigned>(epfd) >= currentProcess->fileDescriptors.get_length() || !(epHandle = currentProcess->fileDescriptors[epfd])
+		|| static_cast<unsigned>(fd) >= currentProcess->fileDescriptors.get_length() || !(handle = currentProcess->fileDescriptors[fd])){
+		return -EBADF;
+	}
+
+	if((epHandle->node->flags & FS_NODE_TYPE) != FS_NODE_EPOLL){
+		return -EINVAL;
+	}
+
+	epoll_event ev = {0, 0};
+	if(op != EPOLL_CTL_DEL){
+		if(!Memory::CheckUsermodePointer(r->rsi, sizeof(epoll_event), currentProcess->addressSpace)){
+			return -EFAULT;
+		}
+
+		ev = *event;
+	}
+
+	return static_cast<EPoll*>(epHandle->node)->Control(op, fd, handle, ev.events, ev.data);
+}
+
+/////////////////////////////
+/// \brief SysEpollWait(epfd, events, maxevents, timeout) Wait for interests of an epoll instance to become ready
+///
+/// \param epfd (int) epoll instance
+/// \param events (epoll_event*) array to fill with ready events
+/// \param maxevents (int) size of events
+/// \param timeout (long) timeout in ms, 0 returns immediately and a negative timeout waits indefinitely
+///
+/// \return amount of events on success, negative error code on failure
+/////////////////////////////
+long SysEpollWait(regs64_t* r){
+	int epfd = static_cast<int>(r->rbx);
+	epoll_event* events = reinterpret_cast<epoll_event*>(r->rcx);
+	int maxEvents = static_cast<int>(r->rdx);
+	long timeout = r->rsi;
+	fs_fd_t* handle;
+
+	process_t* currentProcess = Scheduler::GetCurrentProcess();
+	if(static_cast<unsigned>(epfd) >= currentProcess->fileDescriptors.get_length() || !(handle = currentProcess->fileDescriptors[epfd])){
+		return -EBADF;
+	}
+
+	if((handle->node->flags & FS_NODE_TYPE) != FS_NODE_EPOLL || maxEvents <= 0){
+		return -EINVAL;
+	}
+
+	if(!Memory::CheckUsermodePointer(r->rcx, maxEvents * sizeof(epoll_event), currentProcess->addressSpace)){
+		return -EFAULT;
+	}
+
+	if(timeout){
+		releaseLock(&GetCurrentThread()->lock);
+	}
+
+	return static_cast<EPoll*>(handle->node)->Wait(events, maxEvents, timeout);
+}
+
 syscall_t syscalls[]{
 	SysDebug,
 	SysExit,					// 1
@@ -2269,6 +2722,13 @@ syscall_t syscalls[]{
 	SysGetFileStatusFlags,
 	SysSetFileStatusFlags,
 	SysSelect,
+	SysFutex,
+	SysFsync,
+	SysCreateSharedMemoryFd,
+	SysMapSharedMemoryFd,
+	SysEpollCreate,				// 80
+	SysEpollCtl,
+	SysEpollWait,
 };
 
 int lastSyscall = 0;
@@ -2278,7 +2738,7 @@ void SyscallHandler(regs64_t* regs) {
 		
 	asm("sti"); // By reenabling interrupts a thread in a syscall can be preempted
 
-	thread_t* thread = GetCPULocal()->currentThread;
+	thread_t* thread = GetCurrentThread();
 	if(!syscalls[regs->rax]) return;
 	if(thread->state == ThreadStateZombie) for(;;);
 
@@ -8,88 +8,107 @@
 #include <cpu.h>
 #include <logging.h>
 
+#define PIT_FREQUENCY 1193182
+#define PIT_CALIBRATION_MS 10
+
+#define LOCAL_APIC_TIMER_MASKED (1 << 16)
+#define LOCAL_APIC_TIMER_ONE_SHOT (0 << 17)
+#define LOCAL_APIC_TIMER_TSC_DEADLINE (2 << 17)
+#define LOCAL_APIC_TIMER_DIVIDE_16 0x3
+
+#define MSR_TSC_DEADLINE 0x6E0
+
 namespace Timer{
 
-    int frequency; // Timer frequency
-    int ticks = 0; // Timer tick counter
-    long long uptime = 0; // System uptime in seconds since the timer was initialized
+    int frequency; // Scheduler tick frequency
+    uint64_t tickPeriod; // Nanoseconds between scheduler ticks
 
-    struct SleepCounter{
-        thread_t* thread;
-        long ticksLeft;
-    };
+    uint64_t tscBase = 0; // TSC at the time the timer was initialized
+    uint64_t tscFrequency = 0; // TSC cycles per second
+    uint64_t nsPerTSC = 0; // Nanoseconds per TSC cycle as 32.32 fixed point
+    uint64_t tscPerNs = 0; // TSC cycles per nanosecond as 40.24 fixed point
+
+    bool useTSCDeadline = false; // Program the local APIC timer with absolute TSC deadlines instead of one shot counts
+    uint64_t apicTimerPerNs = 0; // Local APIC timer counts per nanosecond as 32.32 fixed point
+
+    inline uint64_t ReadTSC(){
+        uint32_t low;
+        uint32_t high;
+        asm volatile("rdtsc" : "=a"(low), "=d"(high));
 
-    lock_t sleepQueueLock = 0; // Prevent deadlocks
+        return (static_cast<uint64_t>(high) << 32) | low;
+    }
+
+    uint64_t GetSystemUptimeNs(){
+        return (static_cast<unsigned __int128>(ReadTSC() - tscBase) * nsPerTSC) >> 32;
+    }
 
-    // In the sleep queue, all waiting threads have a counter as an offset from the previous waiting thread.
-    // For example there are 2 threads, thread 1 is waiting for 10 ticks and thread 2 is waiting for 15 ticks.
-    // Thread 1's ticks value will be 10, and as 15 - 10 is 5, thread 2's value will be 5 so it waits 5 ticks after thread 1
-    List<SleepCounter> sleeping;
+    inline uint64_t NsToTSC(uint64_t ns){
+        return tscBase + ((static_cast<unsigned __int128>(ns) * tscPerNs) >> 24);
+    }
+
+    // Arm a timer on the queue of this CPU
+    // Interrupts must be disabled
+    void ArmTimer(TimerEvent& event, thread_t* thread);
+    // Returns true if the timer had already fired
+    bool CancelTimer(TimerEvent& event);
 
+    // Wakes the thread once the deadline passes, also blocking the thread on another blocker if one is given
     class SleepBlocker : public Scheduler::ThreadBlocker {
         private:
-            long ticks = 0;
+            TimerEvent event;
+            Scheduler::ThreadBlocker* other = nullptr;
         public:
-        SleepBlocker(long ticks){
-            this->ticks = ticks;
+        SleepBlocker(uint64_t deadline, Scheduler::ThreadBlocker* other = nullptr){
+            event.deadline = deadline;
+            this->other = other;
         }
 
         void Block(thread_t* thread) final {
-            if(!sleeping.get_length()){
-                sleeping.add_back({.thread = thread, .ticksLeft = ticks}); // No sleeping threads in queue, just add
-                return;
+            if(other){
+                other->Block(thread);
             }
 
-            long total = 0;
-            for(unsigned i = 0; i < sleeping.get_length(); i++){
-                if(total + sleeping[i].ticksLeft >= ticks){ // See if we need to insert in middle of queue
-                    ticks -= total;
-                    sleeping[i].ticksLeft -= ticks;
-                    sleeping.insert({.thread = thread, .ticksLeft = ticks}, i);
-                    return;
-                }
-
-                total += sleeping[i].ticksLeft;
-            }
-
-            sleeping.add_back({.thread = thread, .ticksLeft = ticks - sleeping.get_back().ticksLeft}); // Add to back
+            ArmTimer(event, thread);
         }
 
         void Remove(thread_t* thread) final {
-            for(auto it = sleeping.begin(); it != sleeping.end(); it++){
-                SleepCounter& cnt = *it;
-                if(cnt.thread == thread){
-                    auto next = it;
-                    next++;
-
-                    next->ticksLeft += cnt.ticksLeft;
+            CancelTimer(event);
 
-                    sleeping.remove(it);
-                }
+            if(other){
+                other->Remove(thread);
             }
         }
+
+        // Stop the timer if it has not fired, returns true if the deadline passed
+        // Must be called before the blocker goes out of scope
+        bool Finish(){
+            return CancelTimer(event);
+        }
     };
 
     uint64_t GetSystemUptime(){
-        return uptime;
+        return GetSystemUptimeNs() / 1000000000;
     }
 
     uint32_t GetTicks(){
-        return ticks;
+        return (GetSystemUptimeNs() % 1000000000) / tickPeriod;
     }
 
-    uint32_t GetFrequency(){
-        return frequency;
+    uint64_t GetTicksSinceBoot(){
+        return GetSystemUptimeNs() / tickPeriod;
     }
 
-    inline uint64_t MsToTicks(long ms){
-        return ms * frequency / 1000;
+    uint32_t GetFrequency(){
+        return frequency;
     }
 
     timeval_t GetSystemUptimeStruct(){
+        uint64_t ns = GetSystemUptimeNs();
+
         timeval_t tval;
-        tval.seconds = uptime;
-        tval.milliseconds = ticks * 1000 / frequency;
+        tval.seconds = ns / 1000000000;
+        tval.milliseconds = (ns % 1000000000) / 1000000;
         return tval;
     }
 
@@ -101,63 +120,242 @@ namespace Timer{
     }
 
     void SleepCurrentThread(timeval_t& time){
-        long ticks = time.seconds * frequency + MsToTicks(time.milliseconds);
-        SleepCurrentThread(ticks);
+        SleepCurrentThreadUntil(GetSystemUptimeNs() + time.seconds * 1000000000 + time.milliseconds * 1000000);
     }
 
     void Wait(long ms){
         assert(ms > 0);
 
-        uint64_t ticksPerMs = (Timer::GetFrequency() / 1000);
-        uint64_t timeMs = Timer::GetSystemUptime() * 1000 + (Timer::GetTicks() * ticksPerMs);
-    
-        while((Timer::GetSystemUptime() * 1000 + (Timer::GetTicks() * ticksPerMs)) - timeMs <= static_cast<unsigned long>(ms));
+        uint64_t end = GetSystemUptimeNs() + ms * 1000000;
+        while(GetSystemUptimeNs() < end);
     }
 
     void SleepCurrentThread(long ticks){
-        SleepBlocker blocker = SleepBlocker(ticks);
-        Scheduler::BlockCurrentThread(blocker, sleepQueueLock);
+        SleepCurrentThreadUntil(GetSystemUptimeNs() + ticks * tickPeriod);
     }
 
-    // Timer handler
-    void Handler(regs64_t *r) {
-        ticks++;
-        if(ticks >= frequency){
-            uptime++;
-            ticks -= frequency;
+    void SleepCurrentThreadUntil(uint64_t deadline){
+        if(deadline <= GetSystemUptimeNs()){
+            return;
         }
 
-        if(sleeping.get_length() && !(acquireTestLock(&sleepQueueLock))){
-            if(sleeping.get_length()){ // Make sure the queue has not changed inbetween checking the length and acquiring the lock
-                sleeping.get_front().ticksLeft--;
+        SleepBlocker blocker = SleepBlocker(deadline);
+        Scheduler::BlockCurrentThread(blocker);
 
-                while(sleeping.get_length() && sleeping.get_front().ticksLeft <= 0){
-                    Scheduler::UnblockThread(sleeping.remove_at(0).thread);
-                }
+        blocker.Finish();
+    }
+
+    bool BlockCurrentThreadUntil(uint64_t deadline, Scheduler::ThreadBlocker& blocker, lock_t& lock){
+        SleepBlocker sleepBlocker = SleepBlocker(deadline, &blocker);
+        Scheduler::BlockCurrentThread(sleepBlocker, lock);
+
+        return sleepBlocker.Finish();
+    }
+
+    bool BlockCurrentThreadUntilLocked(uint64_t deadline, Scheduler::ThreadBlocker& blocker, lock_t& lock){
+        SleepBlocker sleepBlocker = SleepBlocker(deadline, &blocker);
+        Scheduler::BlockCurrentThreadLocked(sleepBlocker, lock);
+
+        return sleepBlocker.Finish();
+    }
+
+    // Program the local APIC timer for whichever comes first of the next tick and the earliest timer
+    // Interrupts must be disabled
+    void ProgramTimer(CPU* cpu){
+        uint64_t deadline = cpu->nextTick;
+
+        acquireLock(&cpu->timerLock);
+        TimerEvent* earliest = cpu->timers->Earliest();
+        if(earliest && (!deadline || earliest->deadline < deadline)){
+            deadline = earliest->deadline;
+        }
+        releaseLock(&cpu->timerLock);
+
+        if(deadline == cpu->timerDeadline){
+            return;
+        }
+        cpu->timerDeadline = deadline;
+
+        if(useTSCDeadline){
+            uint64_t tsc = deadline ? NsToTSC(deadline) : 0; // Writing 0 disarms the timer
+            asm volatile("wrmsr" :: "a"(tsc & 0xFFFFFFFF), "d"(tsc >> 32), "c"(MSR_TSC_DEADLINE));
+            return;
+        }
+
+        if(!deadline){
+            APIC::Local::Write(LOCAL_APIC_TIMER_INITIAL_COUNT, 0); // Stop the timer
+            return;
+        }
+
+        uint64_t now = GetSystemUptimeNs();
+        uint64_t count = 1; // Fire straight away if the deadline has already passed
+        if(deadline > now){
+            count = (static_cast<unsigned __int128>(deadline - now) * apicTimerPerNs) >> 32;
+        }
+
+        if(count > 0xFFFFFFFF){
+            count = 0xFFFFFFFF; // The timer will fire early and get programmed again
+        } else if(!count){
+            count = 1;
+        }
+
+        APIC::Local::Write(LOCAL_APIC_TIMER_INITIAL_COUNT, count);
+    }
+
+    void UpdateTimerInterrupt(bool tick){
+        CPU* cpu = GetCPULocal();
+
+        if(!tick){
+            cpu->nextTick = 0; // Idle CPUs only wake up for their timers
+        } else if(!cpu->nextTick){
+            cpu->nextTick = GetSystemUptimeNs() + tickPeriod;
+        }
+
+        ProgramTimer(cpu);
+    }
+
+    void ArmTimer(TimerEvent& event, thread_t* thread){
+        CPU* cpu = GetCPULocal();
+
+        event.thread = thread;
+        event.firing = false;
+
+        acquireLock(&cpu->timerLock);
+        event.cpu = cpu;
+        cpu->timers->Insert(&event);
+        releaseLock(&cpu->timerLock);
+
+        if(!cpu->timerDeadline || event.deadline < cpu->timerDeadline){
+            ProgramTimer(cpu);
+        }
+    }
+
+    bool CancelTimer(TimerEvent& event){
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+
+        bool fired = true;
+
+        // Timers never move between CPUs and event.cpu is only ever cleared by that CPU
+        CPU* cpu = event.cpu;
+        if(cpu){
+            acquireLock(&cpu->timerLock);
+            if(event.cpu == cpu && !event.firing){
+                cpu->timers->Remove(&event);
+                event.cpu = nullptr;
+                fired = false;
             }
+            releaseLock(&cpu->timerLock);
+
+            // Once we return the thread can never be woken by this timer, so wait for the handler to finish with it
+            while(__atomic_load_n(&event.cpu, __ATOMIC_ACQUIRE)){
+                asm("pause");
+            }
+        }
+
+        if(intsEnabled) asm("sti");
+        return fired;
+    }
+
+    // Local APIC timer handler
+    void Handler(regs64_t *r) {
+        CPU* cpu = GetCPULocal();
+        uint64_t now = GetSystemUptimeNs();
+
+        cpu->timerDeadline = 0; // The timer has fired, make sure it gets programmed again
 
-            releaseLock(&sleepQueueLock);
+        acquireLock(&cpu->timerLock);
+        TimerEvent* fired = nullptr;
+        TimerEvent* event;
+        while((event = cpu->timers->Earliest()) && event->deadline <= now){
+            cpu->timers->Remove(event);
+            event->firing = true;
+
+            event->next = fired;
+            fired = event;
+        }
+        releaseLock(&cpu->timerLock);
+
+        // UnblockThread takes the state lock of the thread, which is held whilst blockers arm timers
+        while(fired){
+            event = fired;
+            fired = event->next;
+
+            Scheduler::UnblockThread(event->thread);
+            __atomic_store_n(&event->cpu, nullptr, __ATOMIC_RELEASE); // The event may be gone as soon as this is cleared
+        }
+
+        if(cpu->nextTick && cpu->nextTick <= now){
+            cpu->nextTick = 0;
+            Scheduler::Tick(r); // Schedule programs the next interrupt
+            return;
+        }
+
+        ProgramTimer(cpu);
+    }
+
+    // Wait for PIT channel 2 to count down ms milliseconds, channel 2 can be polled without interrupts
+    void PITWait(unsigned ms){
+        uint16_t count = PIT_FREQUENCY * ms / 1000;
+
+        outportb(0x61, (inportb(0x61) & ~0x02) | 0x01); // Disable the speaker and enable the channel 2 gate
+        outportb(0x43, 0xB0); // Channel 2, lobyte/hibyte, mode 0 (interrupt on terminal count)
+        outportb(0x42, count & 0xFF);
+        outportb(0x42, (count >> 8) & 0xFF);
+
+        while(!(inportb(0x61) & 0x20)); // Channel 2 output goes high once the count reaches 0
+    }
+
+    void InitializeLocalTimer(){
+        CPU* cpu = GetCPULocal();
+        cpu->nextTick = 0;
+        cpu->timerDeadline = 0;
+
+        if(useTSCDeadline){
+            APIC::Local::Write(LOCAL_APIC_LVT_TIMER, LOCAL_APIC_TIMER_TSC_DEADLINE | LAPIC_TIMER);
+            return;
         }
 
-        Scheduler::Tick(r);
+        APIC::Local::Write(LOCAL_APIC_TIMER_DIVIDE, LOCAL_APIC_TIMER_DIVIDE_16);
+
+        if(!apicTimerPerNs){ // Every local APIC timer runs at the same rate so only calibrate once
+            APIC::Local::Write(LOCAL_APIC_LVT_TIMER, LOCAL_APIC_TIMER_MASKED | LOCAL_APIC_TIMER_ONE_SHOT | LAPIC_TIMER);
+            APIC::Local::Write(LOCAL_APIC_TIMER_INITIAL_COUNT, 0xFFFFFFFF);
+            Wait(PIT_CALIBRATION_MS);
+            uint64_t elapsed = 0xFFFFFFFF - APIC::Local::Read(LOCAL_APIC_TIMER_CURRENT_COUNT);
+            APIC::Local::Write(LOCAL_APIC_TIMER_INITIAL_COUNT, 0);
+
+            apicTimerPerNs = (elapsed << 32) / (PIT_CALIBRATION_MS * 1000000);
+
+            Log::Info("[Timer] Local APIC timer frequency: %d Hz", elapsed * (1000 / PIT_CALIBRATION_MS));
+        }
+
+        APIC::Local::Write(LOCAL_APIC_LVT_TIMER, LOCAL_APIC_TIMER_ONE_SHOT | LAPIC_TIMER);
     }
 
     // Initialize
     void Initialize(uint32_t freq) {
-        IDT::RegisterInterruptHandler(IRQ0, Handler);
+        IDT::RegisterInterruptHandler(LAPIC_TIMER, Handler);
 
         frequency = freq;
-        uint32_t divisor = 1193182 / freq;
+        tickPeriod = 1000000000 / freq;
+
+        // Count TSC cycles across a known period of the PIT
+        uint64_t start = ReadTSC();
+        PITWait(PIT_CALIBRATION_MS);
+        uint64_t end = ReadTSC();
+
+        tscFrequency = (end - start) * (1000 / PIT_CALIBRATION_MS);
+        nsPerTSC = (1000000000ULL << 32) / tscFrequency;
+        tscPerNs = (tscFrequency << 24) / 1000000000;
+        tscBase = start;
 
-        // Send the command byte.
-        outportb(0x43, 0x36);
+        // Timekeeping comes from the TSC and interrupts from the local APIC timer of each CPU, so stop PIT channel 0.
+        // In mode 0 the counter does not start until a count is written.
+        outportb(0x43, 0x30);
 
-        // Divisor has to be sent byte-wise, so split here into upper/lower bytes.
-        uint8_t l = (uint8_t)(divisor & 0xFF);
-        uint8_t h = (uint8_t)( (divisor>>8) & 0xFF );
+        useTSCDeadline = CPUID().features_ecx & CPUID_ECX_TSC_DEADLINE;
 
-        // Send the frequency divisor.
-        outportb(0x40, l);
-        outportb(0x40, h);
+        Log::Info("[Timer] TSC frequency: %d Hz%s", tscFrequency, useTSCDeadline ? ", using TSC deadline mode" : "");
     }
 }
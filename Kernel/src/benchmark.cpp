@@ -0,0 +1,371 @@
+#include <benchmark.h>
+
+#include <hash.h>
+#include <list.h>
+#include <timer.h>
+#include <logging.h>
+#include <device.h>
+#include <fs/pagecache.h>
+#include <net/socket.h>
+#include <scheduler.h>
+#include <cpu.h>
+
+#define HASHMAP_BENCHMARK_KEYS 4096
+
+#define SEQREAD_BENCHMARK_SIZE (16 * 1024 * 1024)
+#define SEQREAD_BENCHMARK_BLOCK 4096 // One ext2 block
+#define SEQREAD_BENCHMARK_RUN (1024 * 1024) // A run of contiguous blocks
+
+#define RANDREAD_BENCHMARK_READS 4096
+#define RANDREAD_BENCHMARK_BLOCK 4096
+
+#define SOCKPAIR_BENCHMARK_SIZE (64 * 1024 * 1024)
+#define SOCKPAIR_BENCHMARK_CHUNK 4096
+#define SOCKPAIR_BENCHMARK_ROUNDS 4096 // Round trips timed for latency
+#define SOCKPAIR_BENCHMARK_MESSAGE 64
+#define SOCKPAIR_BENCHMARK_STACKSIZE 32768
+
+namespace Benchmark{
+    // The HashMap used before open addressing, a fixed array of 2048 List buckets, kept as a baseline
+    template<typename K, typename T>
+    class ChainedHashMap{
+        struct KeyValuePair{
+            K key;
+            T value;
+        };
+
+        List<KeyValuePair>* buckets;
+        unsigned bucketCount = 2048;
+    public:
+        ChainedHashMap(){
+            buckets = new List<KeyValuePair>[bucketCount];
+        }
+
+        void insert(K key, const T& value){
+            buckets[hash(key) % bucketCount].add_back({key, value});
+        }
+
+        T remove(K key){
+            auto& bucket = buckets[hash(key) % bucketCount];
+
+            for(unsigned i = 0; i < bucket.get_length(); i++){
+                if(bucket[i].key == key){
+                    return bucket.remove_at(i).value;
+                }
+            }
+
+            return T();
+        }
+
+        T get(K key){
+            for(KeyValuePair& val : buckets[hash(key) % bucketCount]){
+                if(val.key == key){
+                    return val.value;
+                }
+            }
+
+            return T();
+        }
+
+        ~ChainedHashMap(){
+            delete[] buckets;
+        }
+    };
+
+    struct HashMapResult{
+        uint64_t insert; // Nanoseconds per operation
+        uint64_t hit;
+        uint64_t miss;
+        uint64_t remove;
+    };
+
+    // Keys are either sequential (like block numbers) or scattered by a xorshift generator
+    void FillKeys(unsigned* keys, unsigned count, bool sequential){
+        unsigned state = 2463534242;
+        for(unsigned i = 0; i < count; i++){
+            if(sequential){
+                keys[i] = i + 1;
+                continue;
+            }
+
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            keys[i] = state | 1; // Misses are looked up with even keys
+        }
+    }
+
+    template<typename Map>
+    HashMapResult TimeHashMap(const unsigned* keys, unsigned count){
+        HashMapResult result;
+        volatile uintptr_t sink = 0; // Stop lookups from being optimized out
+
+        Map* map = new Map();
+
+        uint64_t start = Timer::GetSystemUptimeNs();
+        for(unsigned i = 0; i < count; i++){
+            map->insert(keys[i], keys[i]);
+        }
+        result.insert = (Timer::GetSystemUptimeNs() - start) / count;
+
+        start = Timer::GetSystemUptimeNs();
+        for(unsigned i = 0; i < count; i++){
+            sink = sink + map->get(keys[i]);
+        }
+        result.hit = (Timer::GetSystemUptimeNs() - start) / count;
+
+        start = Timer::GetSystemUptimeNs();
+        for(unsigned i = 0; i < count; i++){
+            sink = sink + map->get(keys[i] * 2);
+        }
+        result.miss = (Timer::GetSystemUptimeNs() - start) / count;
+
+        start = Timer::GetSystemUptimeNs();
+        for(unsigned i = 0; i < count; i++){
+            sink = sink + map->remove(keys[i]);
+        }
+        result.remove = (Timer::GetSystemUptimeNs() - start) / count;
+
+        delete map;
+        return result;
+    }
+
+    void HashMapBenchmark(){
+        unsigned* keys = new unsigned[HASHMAP_BENCHMARK_KEYS];
+
+        for(int sequential = 1; sequential >= 0; sequential--){
+            FillKeys(keys, HASHMAP_BENCHMARK_KEYS, sequential);
+
+            HashMapResult chained = TimeHashMap<ChainedHashMap<unsigned, uintptr_t>>(keys, HASHMAP_BENCHMARK_KEYS);
+            HashMapResult open = TimeHashMap<HashMap<unsigned, uintptr_t>>(keys, HASHMAP_BENCHMARK_KEYS);
+
+            Log::Info("[Benchmark] HashMap, %d %s keys (ns/op): insert %d (chained %d), hit %d (chained %d), miss %d (chained %d), remove %d (chained %d)",
+                HASHMAP_BENCHMARK_KEYS, sequential ? "sequential" : "random",
+                open.insert, chained.insert, open.hit, chained.hit, open.miss, chained.miss, open.remove, chained.remove);
+        }
+
+        delete[] keys;
+    }
+
+    // Returns MB/s
+    uint64_t TimeSequentialRead(PartitionDevice* part, uint64_t size, size_t chunk, bool cached){
+        uint8_t* buffer = new uint8_t[chunk];
+        PageCache::Invalidate(part); // Start cold
+
+        uint64_t start = Timer::GetSystemUptimeNs();
+        for(uint64_t offset = 0; offset < size; offset += chunk){
+            int e = cached ? PageCache::Read(part, offset, chunk, buffer)
+                : part->Read(offset / part->parentDisk->blocksize, chunk, buffer);
+            if(e){
+                Log::Warning("[Benchmark] Sequential read: disk error %d", e);
+                break;
+            }
+        }
+        uint64_t elapsed = Timer::GetSystemUptimeNs() - start;
+
+        delete[] buffer;
+        return elapsed ? size * 1000 / elapsed : 0; // Bytes per microsecond
+    }
+
+    // First partition of the first disk with one
+    PartitionDevice* FindPartition(){
+        PartitionDevice* part = nullptr;
+        for(int i = 0; i < 8 && !part; i++){
+            char path[] = {'/', 'd', 'e', 'v', '/', 'h', 'd', static_cast<char>('0' + i), 0};
+
+            FsNode* node = fs::ResolvePath(path);
+            if(node && static_cast<Device*>(node)->GetDeviceType() == TypeDiskDevice){
+                DiskDevice* disk = static_cast<DiskDevice*>(node);
+                if(disk->partitions.get_length()){
+                    part = disk->partitions.get_at(0);
+                }
+            }
+        }
+
+        return part;
+    }
+
+    void SequentialReadBenchmark(){
+        PartitionDevice* part = FindPartition();
+        if(!part){
+            Log::Info("[Benchmark] Sequential read: no disk partitions, skipping");
+            return;
+        }
+
+        uint64_t size = SEQREAD_BENCHMARK_SIZE;
+        if(size > part->GetSize()){
+            size = part->GetSize() / SEQREAD_BENCHMARK_RUN * SEQREAD_BENCHMARK_RUN;
+        }
+
+        uint64_t perBlock = TimeSequentialRead(part, size, SEQREAD_BENCHMARK_BLOCK, false);
+        uint64_t coalesced = TimeSequentialRead(part, size, SEQREAD_BENCHMARK_RUN, false);
+        uint64_t cachedPerBlock = TimeSequentialRead(part, size, SEQREAD_BENCHMARK_BLOCK, true);
+        uint64_t cachedCoalesced = TimeSequentialRead(part, size, SEQREAD_BENCHMARK_RUN, true);
+
+        Log::Info("[Benchmark] Sequential read of %u KB from %s (MB/s): device %u per block, %u coalesced; page cache %u per block, %u coalesced",
+            size / 1024, part->GetName(), perBlock, coalesced, cachedPerBlock, cachedCoalesced);
+    }
+
+    struct Percentiles {
+        uint64_t p50;
+        uint64_t p99;
+        uint64_t p999;
+        uint64_t max;
+    };
+
+    // Sort count latencies (count must not be 0) in place and pick out the percentiles
+    static Percentiles SortLatencies(uint64_t* latencies, unsigned count){
+        // Shell sort
+        for(unsigned gap = count / 2; gap; gap /= 2){
+            for(unsigned i = gap; i < count; i++){
+                uint64_t latency = latencies[i];
+
+                unsigned j = i;
+                for(; j >= gap && latencies[j - gap] > latency; j -= gap){
+                    latencies[j] = latencies[j - gap];
+                }
+                latencies[j] = latency;
+            }
+        }
+
+        return {latencies[count / 2], latencies[count * 99 / 100], latencies[count * 999 / 1000], latencies[count - 1]};
+    }
+
+    void RandomReadBenchmark(){
+        PartitionDevice* part = FindPartition();
+        if(!part || part->GetSize() < RANDREAD_BENCHMARK_BLOCK){
+            Log::Info("[Benchmark] Random read: no disk partitions, skipping");
+            return;
+        }
+
+        uint8_t* buffer = new uint8_t[RANDREAD_BENCHMARK_BLOCK];
+        uint64_t* latencies = new uint64_t[RANDREAD_BENCHMARK_READS];
+        uint64_t blocks = part->GetSize() / RANDREAD_BENCHMARK_BLOCK;
+        uint64_t sectorsPerBlock = RANDREAD_BENCHMARK_BLOCK / part->parentDisk->blocksize;
+
+        unsigned state = 2463534242;
+        unsigned reads = 0;
+
+        uint64_t start = Timer::GetSystemUptimeNs();
+        for(; reads < RANDREAD_BENCHMARK_READS; reads++){
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+
+            uint64_t readStart = Timer::GetSystemUptimeNs();
+            if(int e = part->Read((state % blocks) * sectorsPerBlock, RANDREAD_BENCHMARK_BLOCK, buffer)){
+                Log::Warning("[Benchmark] Random read: disk error %d", e);
+                break;
+            }
+            latencies[reads] = Timer::GetSystemUptimeNs() - readStart;
+        }
+        uint64_t elapsed = Timer::GetSystemUptimeNs() - start;
+
+        if(reads){
+            Percentiles p = SortLatencies(latencies, reads);
+            Log::Info("[Benchmark] Random %d byte reads from %s, queue depth 1: %u IOPS, latency (us) p50 %u, p99 %u, p99.9 %u, max %u",
+                RANDREAD_BENCHMARK_BLOCK, part->GetName(), elapsed ? reads * 1000000000ULL / elapsed : 0,
+                p.p50 / 1000, p.p99 / 1000, p.p999 / 1000, p.max / 1000);
+        }
+
+        delete[] latencies;
+        delete[] buffer;
+    }
+
+    LocalSocket* pairPeer; // Socket the helper thread works on
+    Semaphore pairDone = Semaphore(0);
+
+    // Drains SOCKPAIR_BENCHMARK_SIZE bytes then echoes back SOCKPAIR_BENCHMARK_ROUNDS messages
+    void SocketPairThread(){
+        uint8_t* buffer = new uint8_t[SOCKPAIR_BENCHMARK_CHUNK];
+
+        uint64_t received = 0;
+        while(received < SOCKPAIR_BENCHMARK_SIZE){
+            int64_t r = pairPeer->ReceiveFrom(buffer, SOCKPAIR_BENCHMARK_CHUNK, 0, nullptr, nullptr);
+            if(r <= 0){
+                break;
+            }
+
+            received += r;
+        }
+        pairDone.Signal();
+
+        for(unsigned i = 0; i < SOCKPAIR_BENCHMARK_ROUNDS; i++){
+            size_t message = 0;
+            while(message < SOCKPAIR_BENCHMARK_MESSAGE){
+                int64_t r = pairPeer->ReceiveFrom(buffer + message, SOCKPAIR_BENCHMARK_MESSAGE - message, 0, nullptr, nullptr);
+                if(r <= 0){
+                    break;
+                }
+
+                message += r;
+            }
+
+            pairPeer->SendTo(buffer, message, 0, nullptr, 0);
+        }
+        pairDone.Signal();
+
+        delete[] buffer;
+
+        for(;;){ // Kernel threads cannot exit
+            GetCurrentThread()->state = ThreadStateBlocked;
+            Scheduler::Yield();
+        }
+    }
+
+    void SocketPairBenchmark(){
+        LocalSocket* sockets[2];
+        if(LocalSocket::CreatePair(StreamSocket, 0, sockets)){
+            Log::Info("[Benchmark] Socket pair: could not create sockets, skipping");
+            return;
+        }
+
+        pairPeer = sockets[1];
+        Scheduler::CreateChildThread(Scheduler::GetCurrentProcess(), (uintptr_t)SocketPairThread, (uintptr_t)kmalloc(SOCKPAIR_BENCHMARK_STACKSIZE) + SOCKPAIR_BENCHMARK_STACKSIZE);
+
+        uint8_t* buffer = new uint8_t[SOCKPAIR_BENCHMARK_CHUNK];
+        uint64_t* latencies = new uint64_t[SOCKPAIR_BENCHMARK_ROUNDS];
+        memset(buffer, 0xAA, SOCKPAIR_BENCHMARK_CHUNK);
+
+        uint64_t start = Timer::GetSystemUptimeNs();
+        for(uint64_t sent = 0; sent < SOCKPAIR_BENCHMARK_SIZE; sent += SOCKPAIR_BENCHMARK_CHUNK){
+            sockets[0]->SendTo(buffer, SOCKPAIR_BENCHMARK_CHUNK, 0, nullptr, 0);
+        }
+        pairDone.Wait();
+        uint64_t elapsed = Timer::GetSystemUptimeNs() - start;
+
+        unsigned rounds = 0;
+        for(; rounds < SOCKPAIR_BENCHMARK_ROUNDS; rounds++){
+            uint64_t roundStart = Timer::GetSystemUptimeNs();
+            sockets[0]->SendTo(buffer, SOCKPAIR_BENCHMARK_MESSAGE, 0, nullptr, 0);
+
+            size_t message = 0;
+            while(message < SOCKPAIR_BENCHMARK_MESSAGE){
+                int64_t r = sockets[0]->ReceiveFrom(buffer + message, SOCKPAIR_BENCHMARK_MESSAGE - message, 0, nullptr, nullptr);
+                if(r <= 0){
+                    break;
+                }
+
+                message += r;
+            }
+
+            latencies[rounds] = Timer::GetSystemUptimeNs() - roundStart;
+        }
+        pairDone.Wait();
+
+        Percentiles p = SortLatencies(latencies, rounds);
+        Log::Info("[Benchmark] Socket pair: %u MB in %u byte writes at %u MB/s, %u byte round trip (us) p50 %u, p99 %u, max %u",
+            SOCKPAIR_BENCHMARK_SIZE / 1024 / 1024, SOCKPAIR_BENCHMARK_CHUNK, elapsed ? SOCKPAIR_BENCHMARK_SIZE * 1000ULL / elapsed : 0,
+            SOCKPAIR_BENCHMARK_MESSAGE, p.p50 / 1000, p.p99 / 1000, p.max / 1000);
+
+        delete[] latencies;
+        delete[] buffer;
+    }
+
+    void RunAll(){
+        HashMapBenchmark();
+        SequentialReadBenchmark();
+        RandomReadBenchmark();
+        SocketPairBenchmark();
+    }
+}
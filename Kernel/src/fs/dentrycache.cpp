@@ -0,0 +1,262 @@
+#include <fs/dentrycache.h>
+
+#include <device.h>
+#include <slab.h>
+#include <hash.h>
+#include <spin.h>
+#include <cpu.h>
+#include <string.h>
+#include <logging.h>
+
+namespace DentryCache{
+    struct Dentry{
+        FsNode* dir;
+        FsNode* node; // nullptr if the name does not exist
+        unsigned nameHash;
+        char name[DENTRYCACHE_NAME_MAX + 1];
+
+        Dentry* next = nullptr; // LRU list, most recently used first
+        Dentry* prev = nullptr;
+    };
+
+    struct DentryKey{
+        FsNode* dir;
+        const char* name; // Points into the Dentry once inserted
+        unsigned nameHash;
+
+        inline bool operator==(const DentryKey& other) const {
+            return dir == other.dir && nameHash == other.nameHash && !strcmp(name, other.name);
+        }
+    };
+
+    inline unsigned hash(const DentryKey& key){
+        return ::hash(static_cast<unsigned>(reinterpret_cast<uintptr_t>(key.dir) >> 4)) ^ key.nameHash;
+    }
+
+    ObjectCache<Dentry> dentryCache = ObjectCache<Dentry>("dentry");
+
+    lock_t cacheLock = 0; // Only ever held with interrupts disabled
+    HashMap<DentryKey, Dentry*>* entries = nullptr;
+    Dentry* head = nullptr;
+    Dentry* tail = nullptr;
+    Dentry* spare = nullptr; // Evicted entries, linked through next
+
+    uint64_t generation = 0; // Incremented on every invalidation
+    Statistics stats;
+
+    inline bool AcquireCacheLock(){
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&cacheLock);
+        return intsEnabled;
+    }
+
+    inline void ReleaseCacheLock(bool intsEnabled){
+        releaseLock(&cacheLock);
+        if(intsEnabled) asm("sti");
+    }
+
+    void Unlink(Dentry* d){
+        if(d->prev){
+            d->prev->next = d->next;
+        } else {
+            head = d->next;
+        }
+
+        if(d->next){
+            d->next->prev = d->prev;
+        } else {
+            tail = d->prev;
+        }
+
+        d->next = d->prev = nullptr;
+    }
+
+    void PushFront(Dentry* d){
+        d->prev = nullptr;
+        d->next = head;
+        if(head){
+            head->prev = d;
+        } else {
+            tail = d;
+        }
+        head = d;
+    }
+
+    void Remove(Dentry* d){
+        entries->remove({d->dir, d->name, d->nameHash});
+        Unlink(d);
+
+        d->next = spare;
+        spare = d;
+        stats.entries--;
+    }
+
+    bool Lookup(FsNode* dir, const char* name, FsNode*& node, uint64_t& gen){
+        if(!entries || strlen(name) > DENTRYCACHE_NAME_MAX){
+            gen = UINT64_MAX; // Never inserted
+            return false;
+        }
+
+        bool intsEnabled = AcquireCacheLock();
+        Dentry* d = entries->get({dir, name, ::hash(name)});
+        if(d){
+            if(d != head){
+                Unlink(d);
+                PushFront(d);
+            }
+
+            node = d->node;
+            if(node){
+                stats.hits++;
+            } else {
+                stats.negativeHits++;
+            }
+        } else {
+            gen = generation;
+            stats.misses++;
+        }
+        ReleaseCacheLock(intsEnabled);
+
+        return d;
+    }
+
+    void Insert(FsNode* dir, const char* name, FsNode* node, uint64_t gen){
+        Dentry* d = nullptr;
+
+        bool intsEnabled = AcquireCacheLock();
+        if(gen != generation){
+            ReleaseCacheLock(intsEnabled); // Something changed since the lookup, the result may be stale
+            return;
+        }
+
+        if(stats.entries >= DENTRYCACHE_MAX_ENTRIES){
+            Remove(tail);
+            stats.evictions++;
+        }
+
+        if(spare){
+            d = spare;
+            spare = spare->next;
+        }
+        ReleaseCacheLock(intsEnabled);
+
+        if(!d){
+            d = dentryCache.New();
+        }
+
+        d->dir = dir;
+        d->node = node;
+        d->nameHash = ::hash(name);
+        strcpy(d->name, name);
+
+        intsEnabled = AcquireCacheLock();
+        if(gen != generation || entries->contains({dir, name, d->nameHash})){
+            d->next = spare; // Raced with an invalidation or another insert
+            spare = d;
+            ReleaseCacheLock(intsEnabled);
+            return;
+        }
+
+        dir->inDentryCache = true;
+        if(node){
+            node->inDentryCache = true;
+        }
+
+        entries->insert({dir, d->name, d->nameHash}, d);
+        PushFront(d);
+        stats.entries++;
+        ReleaseCacheLock(intsEnabled);
+    }
+
+    void Invalidate(FsNode* dir, const char* name){
+        if(!entries){
+            return;
+        }
+
+        bool intsEnabled = AcquireCacheLock();
+        generation++;
+
+        if(Dentry* d = entries->get({dir, name, ::hash(name)})){
+            Remove(d);
+            stats.invalidations++;
+        }
+        ReleaseCacheLock(intsEnabled);
+    }
+
+    void InvalidateNode(FsNode* node){
+        if(!node->inDentryCache){
+            return;
+        }
+
+        bool intsEnabled = AcquireCacheLock();
+        generation++;
+
+        Dentry* d = head;
+        while(d){
+            Dentry* next = d->next;
+            if(d->dir == node || d->node == node){
+                Remove(d);
+                stats.invalidations++;
+            }
+
+            d = next;
+        }
+
+        node->inDentryCache = false;
+        ReleaseCacheLock(intsEnabled);
+    }
+
+    Statistics GetStatistics(){
+        bool intsEnabled = AcquireCacheLock();
+        Statistics s = stats;
+        ReleaseCacheLock(intsEnabled);
+
+        return s;
+    }
+
+    // Reports the lookup statistics, one counter per line
+    class DentryStatDevice : public Device{
+    public:
+        DentryStatDevice(const char* name) : Device(name, TypeGenericDevice){
+            flags = FS_NODE_FILE;
+        }
+
+        ssize_t Read(size_t offset, size_t size, uint8_t* buffer){
+            Statistics s = GetStatistics();
+
+            const char* names[] = {"hits", "negative_hits", "misses", "evictions", "invalidations", "entries", "hit_percent"};
+            uint64_t lookups = s.hits + s.negativeHits + s.misses;
+            uint64_t values[] = {s.hits, s.negativeHits, s.misses, s.evictions, s.invalidations, s.entries, lookups ? (s.hits + s.negativeHits) * 100 / lookups : 0};
+
+            char text[512];
+            text[0] = 0;
+            for(unsigned i = 0; i < sizeof(values) / sizeof(uint64_t); i++){
+                char number[24];
+                strcat(text, names[i]);
+                strcat(text, ": ");
+                strcat(text, itoa(values[i], number, 10));
+                strcat(text, "\n");
+            }
+
+            size_t length = strlen(text);
+            if(offset >= length){
+                return 0;
+            }
+
+            if(offset + size > length){
+                size = length - offset;
+            }
+
+            memcpy(buffer, text + offset, size);
+            return size;
+        }
+    };
+
+    void Initialize(){
+        entries = new HashMap<DentryKey, Dentry*>(DENTRYCACHE_MAX_ENTRIES); // Sized up front so the table never grows with the lock held
+        memset(&stats, 0, sizeof(Statistics));
+
+        DeviceManager::RegisterDevice(*(new DentryStatDevice("dentrystat")));
+    }
+}
@@ -0,0 +1,366 @@
+#include <fs/epoll.h>
+
+#include <net/socket.h>
+#include <scheduler.h>
+#include <timer.h>
+#include <cpu.h>
+#include <errno.h>
+
+void EPoll::Interest::Signal(){
+    armed = false; // The node takes the watcher off its list before signalling
+    epoll->Queue(this);
+}
+
+EPoll::EPoll(){
+    flags = FS_NODE_EPOLL;
+}
+
+EPoll::Interest* EPoll::Find(int fd){
+    for(Interest* interest = interests; interest; interest = interest->next){
+        if(interest->fd == fd){
+            return interest;
+        }
+    }
+
+    return nullptr;
+}
+
+void EPoll::Queue(Interest* interest){
+    bool intsEnabled = CheckInterrupts();
+    asm("cli");
+    acquireLock(&readyLock);
+
+    if(!interest->queued && !interest->disabled){
+        interest->queued = true;
+        interest->nextReady = nullptr;
+
+        if(lastReady){
+            lastReady->nextReady = interest;
+        } else {
+            ready = interest;
+        }
+        lastReady = interest;
+
+        while(waiters.blocked.get_length()){
+            Scheduler::UnblockThread(waiters.blocked.remove_at(0));
+        }
+
+        while(watching.get_length()){
+            watching.remove_at(0)->Signal();
+        }
+    }
+
+    releaseLock(&readyLock);
+    if(intsEnabled) asm("sti");
+}
+
+void EPoll::Dequeue(Interest* interest){
+    bool intsEnabled = CheckInterrupts();
+    asm("cli");
+    acquireLock(&readyLock);
+
+    if(interest->queued){
+        Interest* previous = nullptr;
+        for(Interest* i = ready; i != interest; i = i->nextReady){
+            previous = i;
+        }
+
+        if(previous){
+            previous->nextReady = interest->nextReady;
+        } else {
+            ready = interest->nextReady;
+        }
+
+        if(lastReady == interest){
+            lastReady = previous;
+        }
+
+        interest->queued = false;
+    }
+
+    releaseLock(&readyLock);
+    if(intsEnabled) asm("sti");
+}
+
+void EPoll::Arm(Interest* interest, bool report){
+    if(interest->disabled){
+        return;
+    }
+
+    FsNode* node = interest->handle->node;
+    if(!interest->armed){
+        interest->armed = true;
+        node->Watch(*interest, interest->events); // May signal straight away
+    }
+
+    if(report && PollNode(node, interest->events)){
+        Queue(interest);
+    }
+}
+
+void EPoll::Disarm(Interest* interest){
+    if(interest->armed){
+        interest->handle->node->Unwatch(*interest);
+        interest->armed = false;
+    }
+}
+
+int EPoll::Collect(epoll_event* events, int maxEvents){
+    interestLock.Acquire();
+
+    // Take what we can report off the ready list first, the nodes are not polled with readyLock held
+    bool intsEnabled = CheckInterrupts();
+    asm("cli");
+    acquireLock(&readyLock);
+
+    // Linked through nextTaken, a node may signal and queue an interest again before we get to it
+    Interest* taken = nullptr;
+    Interest** link = &taken;
+    for(int i = 0; i < maxEvents && ready; i++){
+        *link = ready;
+        link = &ready->nextTaken;
+
+        ready->queued = false;
+        ready = ready->nextReady;
+    }
+    *link = nullptr;
+
+    if(!ready){
+        lastReady = nullptr;
+    }
+
+    releaseLock(&readyLock);
+    if(intsEnabled) asm("sti");
+
+    int count = 0;
+    while(taken){
+        Interest* interest = taken;
+        taken = taken->nextTaken;
+
+        // It may no longer be ready by now
+        if(uint32_t revents = PollNode(interest->handle->node, interest->events)){
+            events[count].events = revents;
+            events[count].data = interest->data;
+            count++;
+
+            if(interest->events & EPOLLONESHOT){
+                interest->disabled = true;
+                Disarm(interest);
+                continue;
+            }
+        }
+
+        // Level triggered interests that are still ready go straight back on the ready list,
+        // edge triggered ones wait for the node to signal again
+        Arm(interest, !(interest->events & EPOLLET));
+    }
+
+    interestLock.Release();
+    return count;
+}
+
+int EPoll::Control(int op, int fd, fs_fd_t* handle, uint32_t events, uint64_t data){
+    FsNode* node = handle->node;
+    if(node == this){
+        return -EINVAL;
+    }
+
+    interestLock.Acquire();
+
+    int ret = 0;
+    Interest* interest = Find(fd);
+    switch(op){
+    case EPOLL_CTL_ADD:
+        if(interest){
+            ret = -EEXIST;
+            break;
+        } else if((node->flags & FS_NODE_TYPE) == FS_NODE_FILE || (node->flags & FS_NODE_TYPE) == FS_NODE_DIRECTORY){
+            ret = -EPERM; // Always ready
+            break;
+        } else if((node->flags & FS_NODE_TYPE) == FS_NODE_EPOLL){
+            // Only one level of nesting, an instance signals the instances watching it with its own lock held
+            EPoll* nested = static_cast<EPoll*>(node);
+            if(nested->nestedCount || parentCount){
+                ret = -ELOOP;
+                break;
+            }
+
+            nested->parentCount++;
+            nestedCount++;
+        }
+
+        interest = new Interest();
+        interest->epoll = this;
+        interest->fd = fd;
+        interest->events = events;
+        interest->data = data;
+
+        interest->handle = new fs_fd_t;
+        *interest->handle = *handle;
+        node->handleCount++;
+
+        interest->next = interests;
+        interests = interest;
+
+        Arm(interest, true);
+        break;
+    case EPOLL_CTL_MOD:
+        if(!interest){
+            ret = -ENOENT;
+            break;
+        }
+
+        Disarm(interest);
+        Dequeue(interest);
+
+        interest->events = events;
+        interest->data = data;
+        interest->disabled = false;
+
+        Arm(interest, true);
+        break;
+    case EPOLL_CTL_DEL:
+        if(!interest){
+            ret = -ENOENT;
+            break;
+        }
+
+        for(Interest** link = &interests; *link; link = &(*link)->next){
+            if(*link == interest){
+                *link = interest->next;
+                break;
+            }
+        }
+
+        Remove(interest);
+        break;
+    default:
+        ret = -EINVAL;
+        break;
+    }
+
+    interestLock.Release();
+    return ret;
+}
+
+void EPoll::Remove(Interest* interest){
+    Disarm(interest);
+    Dequeue(interest);
+
+    if((interest->handle->node->flags & FS_NODE_TYPE) == FS_NODE_EPOLL){
+        static_cast<EPoll*>(interest->handle->node)->parentCount--;
+        nestedCount--;
+    }
+
+    fs::Close(interest->handle);
+    delete interest;
+}
+
+int EPoll::Wait(epoll_event* events, int maxEvents, long timeout){
+    thread_t* thread = GetCurrentThread();
+    uint64_t deadline = Timer::GetSystemUptimeNs() + timeout * 1000000;
+
+    for(;;){
+        int count = Collect(events, maxEvents);
+        if(count || !timeout || thread->state == ThreadStateZombie){
+            return count;
+        }
+
+        asm("cli");
+        acquireLock(&readyLock);
+
+        if(ready){
+            releaseLock(&readyLock); // Queued since we looked
+            asm("sti");
+            continue;
+        }
+
+        if(timeout < 0){
+            Scheduler::BlockCurrentThreadLocked(waiters, readyLock);
+            continue;
+        } else if(Timer::GetSystemUptimeNs() >= deadline){
+            releaseLock(&readyLock);
+            asm("sti");
+            return 0;
+        }
+
+        if(Timer::BlockCurrentThreadUntilLocked(deadline, waiters, readyLock)){
+            // Timed out, unless Queue took us off the list in the meantime
+            asm("cli");
+            acquireLock(&readyLock);
+            waiters.blocked.remove(thread);
+            releaseLock(&readyLock);
+            asm("sti");
+
+            return Collect(events, maxEvents);
+        }
+    }
+}
+
+void EPoll::Close(){
+    if(handleCount && --handleCount){
+        return;
+    }
+
+    interestLock.Acquire();
+    while(interests){
+        Interest* interest = interests;
+        interests = interest->next;
+
+        Remove(interest);
+    }
+    interestLock.Release();
+
+    delete this;
+}
+
+bool EPoll::CanRead(){
+    return ready;
+}
+
+void EPoll::Watch(FilesystemWatcher& watcher, int events){
+    bool intsEnabled = CheckInterrupts();
+    asm("cli");
+    acquireLock(&readyLock);
+
+    watching.add_back(&watcher); // Signalled on the next interest queued, even if something is queued already
+
+    releaseLock(&readyLock);
+    if(intsEnabled) asm("sti");
+}
+
+void EPoll::Unwatch(FilesystemWatcher& watcher){
+    bool intsEnabled = CheckInterrupts();
+    asm("cli");
+    acquireLock(&readyLock);
+
+    watching.remove(&watcher);
+
+    releaseLock(&readyLock);
+    if(intsEnabled) asm("sti");
+}
+
+uint32_t EPoll::PollNode(FsNode* node, uint32_t events){
+    uint32_t revents = 0;
+
+    if((node->flags & FS_NODE_TYPE) == FS_NODE_SOCKET){
+        Socket* sock = static_cast<Socket*>(node);
+        if(!sock->IsConnected() && !sock->IsListening()){
+            revents |= POLLHUP;
+        }
+
+        if(sock->PendingConnections() && (events & POLLIN)){
+            revents |= POLLIN;
+        }
+    }
+
+    if((events & POLLIN) && node->CanRead()){
+        revents |= POLLIN;
+    }
+
+    if((events & POLLOUT) && node->CanWrite()){
+        revents |= POLLOUT;
+    }
+
+    return revents;
+}
@@ -1,15 +1,43 @@
 #include <fs/ext2.h>
 
+#include <fs/pagecache.h>
+#include <scheduler.h>
+#include <timer.h>
+#include <cpu.h>
 #include <logging.h>
 #include <errno.h>
 #include <assert.h>
 #include <math.h>
- 
-#ifdef EXT2_ENABLE_TIMER
-    #include <timer.h>
-#endif
+
+#define EXT2_FLUSHER_STACKSIZE 32768
 
 namespace fs::Ext2{
+    LockClass fileLockClass("ext2-file");
+
+    lock_t volumeListLock = 0;
+    Ext2Volume* volumes = nullptr; // Volumes are never removed
+
+    void FlusherThread(){
+        for(;;){
+            Timer::SleepCurrentThreadUntil(Timer::GetSystemUptimeNs() + EXT2_FLUSH_INTERVAL);
+
+            bool intsEnabled = CheckInterrupts();
+            asm("cli");
+            acquireLock(&volumeListLock);
+            Ext2Volume* vol = volumes;
+            releaseLock(&volumeListLock);
+            if(intsEnabled) asm("sti");
+
+            for(; vol; vol = vol->nextVolume){
+                vol->Sync();
+            }
+        }
+    }
+
+    void StartFlusher(){
+        Scheduler::CreateChildThread(Scheduler::GetCurrentProcess(), (uintptr_t)FlusherThread, (uintptr_t)kmalloc(EXT2_FLUSHER_STACKSIZE) + EXT2_FLUSHER_STACKSIZE);
+    }
+
     int Identify(PartitionDevice* part){
         ext2_superblock_t* superblock = (ext2_superblock_t*)kmalloc(sizeof(ext2_superblock_t));
 
@@ -58,8 +86,14 @@ namespace fs::Ext2{
 
             if(superext.featuresRoCompat & ReadonlyFeatures::Sparse) sparse = true;
             else sparse = false;
+
+            if(superext.featuresCompat & CompatibleFeatures::DirectoryIndexing) dirIndex = true;
+            else dirIndex = false;
+
+            if(superext.flags & EXT2_FLAGS_UNSIGNED_HASH) hashUnsigned = HashLegacyUnsigned - HashLegacy; // Signed unless specified, as chars are signed on x86
         } else {
             memset(&superext, 0, sizeof(ext2_superblock_extended_t));
+            dirIndex = false;
         }
 
         blockGroupCount = (super.blockCount % super.blocksPerGroup) ? (super.blockCount / super.blocksPerGroup + 1) : (super.blockCount / super.blocksPerGroup); // Round up
@@ -82,7 +116,7 @@ namespace fs::Ext2{
 
         Log::Info("[Ext2] Initializing Volume\tRevision: %d, Block Size: %d, %d KB/%d KB used, Last mounted on: %s", super.revLevel, blocksize, super.freeBlockCount * blocksize / 1024, super.blockCount * blocksize / 1024, superext.lastMounted);
         Log::Info("[Ext2] Block Group Count: %d, Inodes Per Block Group: %d, Inode Size: %d", blockGroupCount, super.inodesPerGroup, inodeSize);
-        Log::Info("[Ext2] Sparse Superblock? %s Large Files? %s, Filetype Extension? %s", (sparse ? "Yes" : "No"), (largeFiles ? "Yes" : "No"), (filetype ? "Yes" : "No"));
+        Log::Info("[Ext2] Sparse Superblock? %s Large Files? %s, Filetype Extension? %s, Directory Indexing? %s", (sparse ? "Yes" : "No"), (largeFiles ? "Yes" : "No"), (filetype ? "Yes" : "No"), (dirIndex ? "Yes" : "No"));
 
         blockGroups = (ext2_blockgrp_desc_t*)kmalloc(blockGroupCount * sizeof(ext2_blockgrp_desc_t));
         
@@ -106,253 +140,477 @@ namespace fs::Ext2{
 
         mountPointDirent.node = mountPoint; 
         strcpy(mountPointDirent.name, name);
+
+        dirtyGroups = (uint8_t*)kmalloc(blockGroupCount / 8 + 1);
+        memset(dirtyGroups, 0, blockGroupCount / 8 + 1);
+
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&volumeListLock);
+        nextVolume = volumes;
+        volumes = this;
+        releaseLock(&volumeListLock);
+        if(intsEnabled) asm("sti");
     }
 
-    void Ext2Volume::WriteSuperblock(){
-        uint8_t buffer[blocksize];
+    void Ext2Volume::UpdateFreeCounts(uint32_t group, int blocks, int inodes){
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&metadataLock);
 
-        uint32_t superindex = LocationToBlock(EXT2_SUPERBLOCK_LOCATION);
-        if(ReadBlockCached(superindex, buffer)){
-            Log::Info("[Ext2] WriteBlock: Error reading block %d", superindex);
-            return;
-        }
+        super.freeBlockCount += blocks;
+        super.freeInodeCount += inodes;
+        blockGroups[group].freeBlockCount += blocks;
+        blockGroups[group].freeInodeCount += inodes;
 
-        memcpy(buffer + (EXT2_SUPERBLOCK_LOCATION % blocksize), &super, sizeof(ext2_superblock_t) + sizeof(ext2_superblock_extended_t));
-        
-        if(WriteBlockCached(superindex, buffer)){
-            Log::Info("[Ext2] WriteBlock: Error writing block %d", superindex);
-            return;
-        }
+        superDirty = true;
+        dirtyGroups[group / 8] |= (1U << (group % 8));
+
+        releaseLock(&metadataLock);
+        if(intsEnabled) asm("sti");
     }
 
-    void Ext2Volume::WriteBlockGroupDescriptor(uint32_t index){
-        uint32_t firstBlockGroup = LocationToBlock(EXT2_SUPERBLOCK_LOCATION) + 1;
-        uint32_t block = firstBlockGroup + LocationToBlock(index * sizeof(ext2_blockgrp_desc_t));
+    void Ext2Volume::FlushMetadata(){
         uint8_t buffer[blocksize];
-        
-        if(ReadBlockCached(block, buffer)){
-            Log::Info("[Ext2] WriteBlock: Error reading block %d", block);
-            return;
+
+        if(superDirty){
+            if(ReadBlock(superBlockIndex, buffer)){
+                Log::Info("[Ext2] FlushMetadata: Error reading block %d", superBlockIndex);
+                return;
+            }
+
+            bool intsEnabled = CheckInterrupts();
+            asm("cli");
+            acquireLock(&metadataLock);
+            memcpy(buffer + (EXT2_SUPERBLOCK_LOCATION % blocksize), &super, sizeof(ext2_superblock_t) + sizeof(ext2_superblock_extended_t));
+            superDirty = false; // Anything changed from here on is written next time
+            releaseLock(&metadataLock);
+            if(intsEnabled) asm("sti");
+
+            if(WriteBlock(superBlockIndex, buffer)){
+                Log::Info("[Ext2] FlushMetadata: Error writing block %d", superBlockIndex);
+                superDirty = true;
+                return;
+            }
         }
 
-        memcpy(buffer + ((index * sizeof(ext2_blockgrp_desc_t)) % blocksize), &blockGroups[index], sizeof(ext2_blockgrp_desc_t));
-        
-        if(WriteBlock(block, buffer)){
-            Log::Info("[Ext2] WriteBlock: Error writing block %d", block);
-            return;
+        // Descriptors sharing a block are written back together
+        uint32_t perBlock = blocksize / sizeof(ext2_blockgrp_desc_t);
+        for(uint32_t first = 0; first < blockGroupCount; first += perBlock){
+            uint32_t last = first + perBlock;
+            if(last > blockGroupCount){
+                last = blockGroupCount;
+            }
+
+            bool dirty = false;
+            for(uint32_t i = first; i < last && !dirty; i++){
+                dirty = dirtyGroups[i / 8] & (1U << (i % 8));
+            }
+
+            if(!dirty){
+                continue;
+            }
+
+            uint32_t block = superBlockIndex + 1 + first / perBlock;
+            if(ReadBlock(block, buffer)){
+                Log::Info("[Ext2] FlushMetadata: Error reading block %d", block);
+                continue;
+            }
+
+            bool intsEnabled = CheckInterrupts();
+            asm("cli");
+            acquireLock(&metadataLock);
+            memcpy(buffer, &blockGroups[first], (last - first) * sizeof(ext2_blockgrp_desc_t));
+            for(uint32_t i = first; i < last; i++){
+                dirtyGroups[i / 8] &= ~(1U << (i % 8));
+            }
+            releaseLock(&metadataLock);
+            if(intsEnabled) asm("sti");
+
+            if(WriteBlock(block, buffer)){
+                Log::Info("[Ext2] FlushMetadata: Error writing block %d", block);
+                UpdateFreeCounts(first, 0, 0); // Try again next time
+            }
         }
     }
 
-    uint32_t Ext2Volume::GetInodeBlock(uint32_t index, ext2_inode_t& ino){
+    // Find the indirect tree (1 = singly, 2 = doubly, 3 = triply) holding block index, index must not be a direct block
+    // relative is set to the index of the block within the tree, span to the amount of blocks the tree covers
+    unsigned Ext2Volume::IndirectLevel(uint32_t index, uint64_t& relative, uint64_t& span){
         uint32_t blocksPerPointer = blocksize / sizeof(uint32_t); // Amount of blocks in a indirect block table
-        uint32_t singlyIndirectStart = EXT2_DIRECT_BLOCK_COUNT;
-        uint32_t doublyIndirectStart = singlyIndirectStart + blocksPerPointer;
-        uint32_t triplyIndirectStart = doublyIndirectStart + blocksPerPointer * blocksPerPointer;
 
-        assert(index < triplyIndirectStart + blocksPerPointer * blocksPerPointer * blocksPerPointer); // Make sure that an invalid index was not passed
+        unsigned level = 1;
+        relative = index - EXT2_DIRECT_BLOCK_COUNT;
+        span = blocksPerPointer;
+        while(relative >= span){
+            relative -= span;
+            span *= blocksPerPointer;
+            level++;
+        }
+
+        assert(level <= 3); // Make sure that an invalid index was not passed
+        return level;
+    }
 
+    uint32_t Ext2Volume::GetInodeBlock(uint32_t index, ext2_inode_t& ino){
         if(index < EXT2_DIRECT_BLOCK_COUNT){
             // Index lies within the direct blocklist
             return ino.blocks[index];
-        } else if(index < doublyIndirectStart){
-            // Index lies within the singly indirect blocklist
-            uint32_t buffer[blocksize / sizeof(uint32_t)];
-
-            if(int e = ReadBlockCached(ino.blocks[EXT2_SINGLY_INDIRECT_INDEX], buffer)){
-                (void)e;
-                error = DiskReadError;
-                return 0;
-            }
-
-            return buffer[index - singlyIndirectStart];
-        } else if(index < triplyIndirectStart){
-            // Index lies within the doubly indirect blocklist
-            uint32_t blockPointers[blocksize / sizeof(uint32_t)];
-            uint32_t buffer[blocksize / sizeof(uint32_t)];
+        }
 
-            if(int e = ReadBlockCached(ino.blocks[EXT2_DOUBLY_INDIRECT_INDEX], blockPointers)){
-                (void)e;
-                error = DiskReadError;
-                return 0;
-            }
+        uint32_t blocksPerPointer = blocksize / sizeof(uint32_t);
+        uint32_t buffer[blocksize / sizeof(uint32_t)];
 
-            uint32_t blockPointer = blockPointers[(index - doublyIndirectStart) / blocksPerPointer];
+        uint64_t relative, span;
+        unsigned level = IndirectLevel(index, relative, span);
 
-            if(int e = ReadBlockCached(blockPointer, buffer)){
-                (void)e;
+        // Walk down the tree, span is the amount of blocks covered by each entry of the table being read
+        uint32_t block = ino.blocks[EXT2_SINGLY_INDIRECT_INDEX + level - 1];
+        while(block && span > 1){
+            if(int e = ReadBlock(block, buffer)){
+                Log::Info("[Ext2] GetInodeBlock: Error %i reading block %u (indirect block)", e, block);
                 error = DiskReadError;
                 return 0;
             }
 
-            return buffer[(index - doublyIndirectStart) % blocksPerPointer];
-        } else {
-            assert(!"Yet to support triply indirect");
-            return 0;
+            span /= blocksPerPointer;
+            block = buffer[relative / span];
+            relative %= span;
         }
+
+        return block; // 0 if the block lies in a hole
     }
 
     Vector<uint32_t> Ext2Volume::GetInodeBlocks(uint32_t index, uint32_t count, ext2_inode_t& ino){
-        uint32_t blocksPerPointer = blocksize / sizeof(uint32_t); // Amount of blocks in a indirect block table
-        uint32_t singlyIndirectStart = EXT2_DIRECT_BLOCK_COUNT;
-        uint32_t doublyIndirectStart = singlyIndirectStart + blocksPerPointer;
-        uint32_t triplyIndirectStart = doublyIndirectStart + blocksPerPointer * blocksPerPointer;
-
-        assert(index + count < triplyIndirectStart + blocksPerPointer * blocksPerPointer * blocksPerPointer); // Make sure that an invalid index was not passed
+        uint32_t blocksPerPointer = blocksize / sizeof(uint32_t);
 
         unsigned i = index;
+        unsigned end = index + count;
         Vector<uint32_t> blocks;
         blocks.reserve(count);
 
-        while(i < EXT2_DIRECT_BLOCK_COUNT && i < index + count){
+        while(i < EXT2_DIRECT_BLOCK_COUNT && i < end){
             // Index lies within the direct blocklist
             blocks.add_back(ino.blocks[i++]);
         }
-        
-        if(i < doublyIndirectStart && i < index + count){
-            // Index lies within the singly indirect blocklist
-            uint32_t buffer[blocksize / sizeof(uint32_t)];
 
-            if(int e = ReadBlockCached(ino.blocks[EXT2_SINGLY_INDIRECT_INDEX], buffer)){
-                Log::Info("[Ext2] GetInodeBlocks: Error %i reading block %u (singly indirect block)", e, ino.blocks[EXT2_SINGLY_INDIRECT_INDEX]);
-                error = DiskReadError;
+        uint32_t buffer[blocksize / sizeof(uint32_t)];
+        while(i < end){
+            uint64_t relative, span;
+            unsigned level = IndirectLevel(i, relative, span);
 
-                blocks.clear();
-                return blocks;
+            // Walk down to the table holding block i, then take every block in it from there on
+            uint32_t table = ino.blocks[EXT2_SINGLY_INDIRECT_INDEX + level - 1];
+            while(table && span > blocksPerPointer){
+                if(int e = ReadBlock(table, buffer)){
+                    Log::Info("[Ext2] GetInodeBlocks: Error %i reading block %u (indirect block pointer)", e, table);
+                    error = DiskReadError;
+
+                    blocks.clear();
+                    return blocks;
+                }
+
+                span /= blocksPerPointer;
+                table = buffer[relative / span];
+                relative %= span;
             }
 
-            while(i < doublyIndirectStart && i < index + count){
-                uint32_t block = buffer[(i++) - singlyIndirectStart];
-                if(block >= super.blockCount){
-                    Log::Warning("[Ext2] GetInodeBlocks: Invalid singly indirect block %u, Singly indirect blocklist: %u", block, ino.blocks[EXT2_SINGLY_INDIRECT_INDEX]);
+            // span is now the amount of blocks covered by table
+            uint64_t runLength = span - relative;
+            if(runLength > end - i){
+                runLength = end - i;
+            }
+
+            if(!table){
+                for(uint64_t j = 0; j < runLength; j++){
+                    blocks.add_back(0); // Hole
                 }
-                blocks.add_back(block);
+
+                i += runLength;
+                continue;
             }
-        }
-        
-        if(i < triplyIndirectStart && i < index + count){
-            // Index lies within the doubly indirect blocklist
-            uint32_t blockPointers[blocksize / sizeof(uint32_t)];
-            uint32_t buffer[blocksize / sizeof(uint32_t)];
 
-            if(int e = ReadBlockCached(ino.blocks[EXT2_DOUBLY_INDIRECT_INDEX], blockPointers)){
-                Log::Info("[Ext2] GetInodeBlocks: Error %i reading block %u (doubly indirect block)", e, ino.blocks[EXT2_DOUBLY_INDIRECT_INDEX]);
+            if(int e = ReadBlock(table, buffer)){
+                Log::Info("[Ext2] GetInodeBlocks: Error %i reading block %u (indirect block)", e, table);
                 error = DiskReadError;
 
                 blocks.clear();
                 return blocks;
             }
 
-            while(i < triplyIndirectStart && i < index + count){
-                uint32_t blockPointer = blockPointers[(i - doublyIndirectStart) / blocksPerPointer];
-
-                if(int e = ReadBlockCached(blockPointer, buffer)){
-                    Log::Info("[Ext2] GetInodeBlocks: Error %i reading block %u (doubly indirect block pointer)", e, blockPointer);
-                    error = DiskReadError;
-
-                    blocks.clear();
-                    return blocks;
+            for(uint64_t j = relative; j < relative + runLength; j++){
+                uint32_t block = buffer[j];
+                if(block >= super.blockCount){
+                    Log::Warning("[Ext2] GetInodeBlocks: Invalid block %u in indirect block %u", block, table);
                 }
 
-                uint32_t blockPointerEnd = i + (blocksPerPointer - (i - doublyIndirectStart) % blocksPerPointer);
-                while(i < blockPointerEnd && i < index + count){
-                    uint32_t block = buffer[(i - doublyIndirectStart) % blocksPerPointer];
-                    if(block >= super.blockCount){
-                        Log::Warning("[Ext2] GetInodeBlocks: Invalid doubly indirect block %u", block);
-                    }
-
-                    blocks.add_back(block);
-                    i++;
-                }
+                blocks.add_back(block);
             }
-        } 
-        
-        if(i < index + count) {
-            assert(!"[Ext2] Yet to support triply indirect blocklists");
 
-            blocks.clear();
-            return blocks;
+            i += runLength;
         }
 
         return blocks;
     }
-    
-    void Ext2Volume::SetInodeBlock(uint32_t index, ext2_inode_t& ino, uint32_t block){
-        uint32_t blocksPerPointer = blocksize / sizeof(uint32_t); // Amount of blocks in a indirect block table
-        uint32_t singlyIndirectStart = EXT2_DIRECT_BLOCK_COUNT;
-        uint32_t doublyIndirectStart = singlyIndirectStart + blocksPerPointer;
-        uint32_t triplyIndirectStart = doublyIndirectStart + blocksPerPointer * blocksPerPointer;
 
-        assert(index < triplyIndirectStart + blocksPerPointer * blocksPerPointer * blocksPerPointer); // Make sure that an invalid index was not passed
+    uint32_t Ext2Volume::AllocateIndirectBlock(uint32_t goal){
+        uint32_t block = AllocateBlock(goal);
+        if(!block){
+            return 0;
+        }
+
+        uint8_t buffer[blocksize];
+        memset(buffer, 0, blocksize);
+
+        if(int e = WriteBlock(block, buffer)){
+            Log::Error("[Ext2] Disk error (%d) clearing indirect block %u", e, block);
+            error = DiskWriteError;
+            FreeBlock(block);
+            return 0;
+        }
 
+        return block;
+    }
+    
+    void Ext2Volume::SetInodeBlock(uint32_t index, ext2_inode_t& ino, uint32_t block){
         if(index < EXT2_DIRECT_BLOCK_COUNT){
             // Index lies within the direct blocklist
             ino.blocks[index] = block;
-        } else if(index < doublyIndirectStart){
-            // Index lies within the singly indirect blocklist
-            uint32_t buffer[blocksize / sizeof(uint32_t)];
+            return;
+        }
 
-            if(ino.blocks[EXT2_SINGLY_INDIRECT_INDEX] == 0){
-                ino.blocks[EXT2_SINGLY_INDIRECT_INDEX] = AllocateBlock();
-            }
+        uint32_t blocksPerPointer = blocksize / sizeof(uint32_t);
+        uint32_t buffer[blocksize / sizeof(uint32_t)];
+
+        uint64_t relative, span;
+        unsigned level = IndirectLevel(index, relative, span);
 
-            if(int e = ReadBlockCached(ino.blocks[EXT2_SINGLY_INDIRECT_INDEX], buffer)){
-                (void)e;
+        uint32_t rootIndex = EXT2_SINGLY_INDIRECT_INDEX + level - 1;
+        if(!ino.blocks[rootIndex] && !(ino.blocks[rootIndex] = AllocateIndirectBlock(block))){
+            return;
+        }
+
+        // Walk down the tree, filling in any missing tables on the way
+        uint32_t table = ino.blocks[rootIndex];
+        for(;;){
+            if(int e = ReadBlock(table, buffer)){
+                Log::Info("[Ext2] SetInodeBlock: Error %i reading block %u (indirect block)", e, table);
                 error = DiskReadError;
                 return;
             }
 
-            buffer[index - singlyIndirectStart] = block;
-            
-            if(int e = WriteBlockCached(ino.blocks[EXT2_SINGLY_INDIRECT_INDEX], buffer)){
-                (void)e;
+            span /= blocksPerPointer;
+            uint32_t& entry = buffer[relative / span];
+            relative %= span;
+
+            if(span == 1){
+                entry = block;
+            } else if(!entry){
+                if(!(entry = AllocateIndirectBlock(block))){
+                    return;
+                }
+            } else {
+                table = entry;
+                continue;
+            }
+
+            uint32_t next = entry;
+            if(int e = WriteBlock(table, buffer)){ // Write our updated blocklist
+                Log::Info("[Ext2] SetInodeBlock: Error %i writing block %u (indirect block)", e, table);
                 error = DiskWriteError;
                 return;
             }
-            return;
-        } else if(index < triplyIndirectStart){
-            // Index lies within the doubly indirect blocklist
-            uint32_t blockPointers[blocksize / sizeof(uint32_t)];
-            uint32_t buffer[blocksize / sizeof(uint32_t)];
 
-            if(int e = ReadBlockCached(ino.blocks[EXT2_DOUBLY_INDIRECT_INDEX], blockPointers)){ // Read indirect block pointer list
-                (void)e;
-                error = DiskReadError;
+            if(span == 1){
                 return;
             }
 
-            uint32_t blockPointer = blockPointers[(index - doublyIndirectStart) / blocksPerPointer];
+            table = next;
+        }
+    }
 
-            if(int e = ReadBlockCached(blockPointer, buffer)){ // Read blocklist
-                (void)e;
-                error = DiskReadError;
-                return;
+    bool Ext2Volume::FreeIndirectBlocks(uint32_t table, unsigned level, uint64_t first){
+        uint32_t blocksPerPointer = blocksize / sizeof(uint32_t);
+        uint32_t buffer[blocksize / sizeof(uint32_t)];
+
+        if(int e = ReadBlock(table, buffer)){
+            Log::Info("[Ext2] FreeIndirectBlocks: Error %i reading block %u (indirect block)", e, table);
+            error = DiskReadError;
+            return false;
+        }
+
+        uint64_t span = 1; // Blocks covered by each entry
+        for(unsigned l = 1; l < level; l++){
+            span *= blocksPerPointer;
+        }
+
+        bool modified = false;
+        bool kept = false; // An entry is still in use, or could not be freed
+        for(uint64_t i = first / span; i < blocksPerPointer; i++){
+            if(!buffer[i]){
+                continue;
             }
 
-            buffer[(index - doublyIndirectStart) % blocksPerPointer] = block; // Update the index
-            
-            if(int e = WriteBlockCached(blockPointer, buffer)){ // Write our updated blocklist
-                (void)e;
+            uint64_t start = i * span;
+            if(level == 1){
+                FreeBlock(buffer[i]);
+            } else if(!FreeIndirectBlocks(buffer[i], level - 1, first > start ? first - start : 0)){
+                kept = true; // Part of the table is still in use, or it could not be read. Either way we still point to it
+                continue;
+            }
+
+            buffer[i] = 0;
+            modified = true;
+        }
+
+        if(!first && !kept){
+            FreeBlock(table);
+            return true;
+        }
+
+        if(modified){
+            if(int e = WriteBlock(table, buffer)){
+                Log::Info("[Ext2] FreeIndirectBlocks: Error %i writing block %u (indirect block)", e, table);
                 error = DiskWriteError;
-                return;
             }
-            return;
+        }
+
+        return false;
+    }
+
+    void Ext2Volume::FreeInodeBlocks(ext2_inode_t& ino, uint32_t first){
+        for(uint32_t i = first; i < EXT2_DIRECT_BLOCK_COUNT; i++){
+            if(ino.blocks[i]){
+                FreeBlock(ino.blocks[i]);
+                ino.blocks[i] = 0;
+            }
+        }
+
+        uint64_t start = EXT2_DIRECT_BLOCK_COUNT; // First block covered by the tree
+        uint64_t span = blocksize / sizeof(uint32_t);
+        for(unsigned level = 1; level <= 3; level++){
+            uint32_t rootIndex = EXT2_SINGLY_INDIRECT_INDEX + level - 1;
+            if(ino.blocks[rootIndex] && first < start + span && FreeIndirectBlocks(ino.blocks[rootIndex], level, first > start ? first - start : 0)){
+                ino.blocks[rootIndex] = 0;
+            }
+
+            start += span;
+            span *= blocksize / sizeof(uint32_t);
+        }
+    }
+
+    uint32_t Ext2Volume::GetNodeBlock(Ext2Node* node, uint32_t index){
+        uint32_t block = 0;
+
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&node->blockMapLock);
+        if(index < node->cachedBlockCount){
+            block = node->cachedBlocks[index];
+        }
+        releaseLock(&node->blockMapLock);
+        if(intsEnabled) asm("sti");
+
+        if(block){
+            return block;
+        }
+
+        block = GetInodeBlock(index, node->e2inode);
+        if(block){
+            CacheBlocks(node, index, &block, 1);
+        }
+
+        return block;
+    }
+
+    Vector<uint32_t> Ext2Volume::GetNodeBlocks(Ext2Node* node, uint32_t index, uint32_t count){
+        Vector<uint32_t> cached;
+        cached.reserve(count); // Never allocates with the lock held
+
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&node->blockMapLock);
+        if(index + count <= node->cachedBlockCount){
+            for(uint32_t i = index; i < index + count && node->cachedBlocks[i]; i++){
+                cached.add_back(node->cachedBlocks[i]);
+            }
+        }
+        releaseLock(&node->blockMapLock);
+        if(intsEnabled) asm("sti");
+
+        if(cached.get_length() == count){
+            return cached;
+        }
+
+        Vector<uint32_t> blocks = GetInodeBlocks(index, count, node->e2inode);
+        if(blocks.get_length() == count){
+            CacheBlocks(node, index, &blocks[0], count);
+        }
+
+        return blocks;
+    }
+
+    void Ext2Volume::SetNodeBlock(Ext2Node* node, uint32_t index, uint32_t block){
+        SetInodeBlock(index, node->e2inode, block);
+        CacheBlocks(node, index, &block, 1);
+    }
+
+    void Ext2Volume::CacheBlocks(Ext2Node* node, uint32_t index, const uint32_t* blocks, uint32_t count){
+        uint32_t* newMap = nullptr;
+        uint32_t newCount = 0;
+
+        if(index + count > node->cachedBlockCount){
+            newCount = node->cachedBlockCount ? node->cachedBlockCount * 2 : EXT2_DIRECT_BLOCK_COUNT;
+            if(newCount < index + count){
+                newCount = index + count;
+            }
+
+            newMap = (uint32_t*)kmalloc(newCount * sizeof(uint32_t));
+        }
+
+        uint32_t* oldMap = nullptr;
+
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&node->blockMapLock);
+        if(newMap && newCount > node->cachedBlockCount){
+            memcpy(newMap, node->cachedBlocks, node->cachedBlockCount * sizeof(uint32_t));
+            memset(newMap + node->cachedBlockCount, 0, (newCount - node->cachedBlockCount) * sizeof(uint32_t));
+
+            oldMap = node->cachedBlocks;
+            node->cachedBlocks = newMap;
+            node->cachedBlockCount = newCount;
         } else {
-            assert(!"Yet to support triply indirect");
-            return;
+            oldMap = newMap; // Grown by someone else in the meantime
+        }
+
+        memcpy(node->cachedBlocks + index, blocks, count * sizeof(uint32_t));
+        releaseLock(&node->blockMapLock);
+        if(intsEnabled) asm("sti");
+
+        if(oldMap){
+            kfree(oldMap);
         }
     }
 
-    int Ext2Volume::ReadInode(uint32_t num, ext2_inode_t& inode){
-        uint8_t buf[part->parentDisk->blocksize];
-        uint64_t lba = InodeLBA(num);
+    void Ext2Volume::DropCachedBlocks(Ext2Node* node, uint32_t first){
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&node->blockMapLock);
+        if(first < node->cachedBlockCount){
+            memset(node->cachedBlocks + first, 0, (node->cachedBlockCount - first) * sizeof(uint32_t));
+        }
+        releaseLock(&node->blockMapLock);
+        if(intsEnabled) asm("sti");
+    }
 
-        if(int e = part->Read(lba, part->parentDisk->blocksize, buf)){
+    int Ext2Volume::ReadInode(uint32_t num, ext2_inode_t& inode){
+        if(int e = PageCache::Read(part, InodeLocation(num), sizeof(ext2_inode_t), &inode)){
             Log::Error("[Ext2] Disk Error (%d) Reading Inode %d", e, num);
             error = DiskReadError;
             return e;
         }
 
-        inode = *(ext2_inode_t*)(buf + (ResolveInodeBlockGroupIndex(num) * inodeSize) % part->parentDisk->blocksize);
         return 0;
     }
 
@@ -360,7 +618,7 @@ namespace fs::Ext2{
         if(block > super.blockCount)
             return 1;
 
-        if(int e = part->Read(BlockToLBA(block), blocksize, buffer)){
+        if(int e = PageCache::Read(part, static_cast<uint64_t>(block) * blocksize, blocksize, buffer)){
             Log::Error("[Ext2] Disk error (%d) reading block %d (blocksize: %d)", e, block, blocksize);
             return e;
         }
@@ -372,54 +630,22 @@ namespace fs::Ext2{
         if(block > super.blockCount)
             return 1;
 
-        if(int e = part->Write(BlockToLBA(block), blocksize, buffer)){
-            Log::Error("[Ext2] Disk error (%e) reading block %d (blocksize: %d)", e, block, blocksize);
+        if(int e = PageCache::Write(part, static_cast<uint64_t>(block) * blocksize, blocksize, buffer)){
+            Log::Error("[Ext2] Disk error (%d) writing block %d (blocksize: %d)", e, block, blocksize);
             return e;
         }
 
         return 0;
     }
     
-    int Ext2Volume::ReadBlockCached(uint32_t block, void* buffer){
-        if(block > super.blockCount)
-            return 1;
-
-        uint8_t* cachedBlock;
-        if((cachedBlock = blockCache.get(block))){
-            memcpy(buffer, cachedBlock, blocksize);
-        } else {
-            cachedBlock = (uint8_t*)kmalloc(blocksize);
-            if(int e = part->Read(BlockToLBA(block), blocksize, cachedBlock)){
-                Log::Error("[Ext2] Disk error (%d) reading block %d (blocksize: %d)", e, block, blocksize);
-                return e;
-            }
-            blockCache.insert(block, cachedBlock);
-            blockCacheMemoryUsage += blocksize;
-            
-            memcpy(buffer, cachedBlock, blocksize);
-        }
-        return 0;
-    }
-    
-    int Ext2Volume::WriteBlockCached(uint32_t block, void* buffer){
-        if(block > super.blockCount)
-            return -1;
-
-        uint8_t* cachedBlock;
-        if((cachedBlock = blockCache.get(block))){
-            memcpy(cachedBlock, buffer, blocksize);
-        }
-        
-        if(int e = part->Write(BlockToLBA(block), blocksize, buffer)){
-            Log::Error("[Ext2] Disk error (%d) reading block %d (blocksize: %d)", e, block, blocksize);
-            return e;
+    uint32_t Ext2Volume::AllocateBlock(uint32_t goal){
+        if(goal >= super.blockCount){
+            goal = 0;
         }
 
-        return 0;
-    }
-    
-    uint32_t Ext2Volume::AllocateBlock(){
-        for(unsigned i = 0; i < blockGroupCount; i++){
+        uint32_t goalGroup = goal / super.blocksPerGroup;
+        for(unsigned n = 0; n <= blockGroupCount; n++){
+            unsigned i = (goalGroup + n) % blockGroupCount;
             ext2_blockgrp_desc_t& group = blockGroups[i];
 
             if(group.freeBlockCount <= 0) continue; // No free blocks in this blockgroup
@@ -436,21 +662,25 @@ namespace fs::Ext2{
                 }
             }
 
-            uint32_t block = 0;
-            unsigned e = 0;
-            for(; e < blocksize / sizeof(uint8_t); e++){
-                if(bitmap[e] == UINT8_MAX) continue; // Full
+            // The goal group is searched from the goal first, and from its start once every other group is full
+            uint32_t bit = (n == 0) ? goal % super.blocksPerGroup : 0;
+            uint32_t bitCount = super.blocksPerGroup;
+            if(bitCount > blocksize * 8){
+                bitCount = blocksize * 8;
+            }
 
-                for(uint8_t b = 0; b < sizeof(uint8_t) * 8; b++){ // Iterate through all bits in the entry
-                    if(((bitmap[e] >> b) & 0x1) == 0){
-                        bitmap[e] |= (1U << b);
-                        block = (i * super.blocksPerGroup) + e * (sizeof(uint8_t) * 8) + b; // Block Number = (Group number * blocks per group) + (bitmap entry * 8 (8 bits per byte)) + bit (block 0 is least significant bit, block 7 is most significant)
-                        break;
-                    }
+            uint32_t block = 0;
+            for(; bit < bitCount; bit++){
+                if(bitmap[bit / 8] == UINT8_MAX){
+                    bit |= 7; // Full, skip to the next entry
+                    continue;
                 }
 
-
-                if(block) break;
+                if(((bitmap[bit / 8] >> (bit % 8)) & 0x1) == 0){
+                    bitmap[bit / 8] |= (1U << (bit % 8));
+                    block = (i * super.blocksPerGroup) + bit; // Block Number = (Group number * blocks per group) + bit (block 0 of the group is the least significant bit of the first entry)
+                    break;
+                }
             }
 
             if(!block){
@@ -467,11 +697,7 @@ namespace fs::Ext2{
                 return 0;
             }
 
-            super.freeBlockCount--;
-            blockGroups[i].freeBlockCount--;
-
-            WriteBlockGroupDescriptor(i);
-            WriteSuperblock();
+            UpdateFreeCounts(i, -1, 0);
 
             return block;
         }
@@ -511,11 +737,7 @@ namespace fs::Ext2{
             return -1;
         }
 
-        super.freeBlockCount++;
-        blockGroups[block / super.blocksPerGroup].freeBlockCount++;
-
-        WriteBlockGroupDescriptor(block / super.blocksPerGroup);
-        WriteSuperblock();
+        UpdateFreeCounts(block / super.blocksPerGroup, 1, 0);
 
         return 0;
     }
@@ -528,7 +750,7 @@ namespace fs::Ext2{
 
             uint8_t bitmap[blocksize / sizeof(uint8_t)];
 
-            if(int e = ReadBlockCached(group.inodeBitmap, bitmap)){
+            if(int e = ReadBlock(group.inodeBitmap, bitmap)){
                 Log::Error("[Ext2] Disk error (%d) reading inode bitmap (group %d)", e, i);
                 error = DiskReadError;
                 return nullptr;
@@ -553,7 +775,7 @@ namespace fs::Ext2{
 
             if(!inode) continue;
 
-            if(int e = WriteBlockCached(group.inodeBitmap, bitmap)){
+            if(int e = WriteBlock(group.inodeBitmap, bitmap)){
                 Log::Error("[Ext2] Disk error (%d) write inode bitmap (group %d)", e, i);
                 error = DiskWriteError;
                 return nullptr;
@@ -563,7 +785,7 @@ namespace fs::Ext2{
 
             memset(&ino, 0, sizeof(ext2_inode_t));
 
-            ino.blocks[0] = AllocateBlock(); // Give it one block
+            ino.blocks[0] = AllocateBlock(i * super.blocksPerGroup); // Give it one block, near its inode
             ino.uid = 0;
             ino.mode = 0;
             ino.accessTime = ino.createTime = ino.deleteTime = ino.modTime = 0;
@@ -574,12 +796,9 @@ namespace fs::Ext2{
             ino.fragAddr = 0;
             ino.fileACL = 0;
 
-            super.freeInodeCount--;
-            blockGroups[i].freeInodeCount--;
+            UpdateFreeCounts(i, 0, -1);
 
             Ext2Node* node = new Ext2Node(this, ino, inode);
-            WriteSuperblock();
-            WriteBlockGroupDescriptor(i);
 
             //Log::Info("[Ext2] Created inode %d", node->inode);
 
@@ -598,242 +817,860 @@ namespace fs::Ext2{
             return -2;
         }
 
-        for(unsigned i = 0; i < e2inode.blockCount * (blocksize / 512); i++){
-            uint32_t block = GetInodeBlock(i, e2inode);
-            FreeBlock(block);
-            if(blockCache.get(block)){
-                blockCache.remove(block);
+        FreeInodeBlocks(e2inode, 0);
+
+        ext2_blockgrp_desc_t& group = blockGroups[inode / super.inodesPerGroup];
+
+        uint8_t bitmap[blocksize / sizeof(uint8_t)];
+
+        if(uint8_t* cachedBitmap = bitmapCache.get(group.inodeBitmap)){
+            memcpy(bitmap, cachedBitmap, blocksize);
+        } else {
+            if(int e = ReadBlock(group.inodeBitmap, bitmap)){
+                Log::Error("[Ext2] Disk error (%d) reading inode bitmap (group %d)", e, inode / super.inodesPerGroup);
+                error = DiskReadError;
+                return -1;
+            }
+        }
+
+        int bmapIndex = (inode % super.inodesPerGroup) / (sizeof(uint8_t) * 8);
+        int bitmask = ~(1 << (inode % 8));
+        bitmap[bmapIndex] &= bitmask;
+
+        if(uint8_t* cachedBitmap = bitmapCache.get(group.inodeBitmap)){
+            memcpy(cachedBitmap, bitmap, blocksize);
+        }
+
+        if(int e = WriteBlock(group.blockBitmap, bitmap)){
+            Log::Error("[Ext2] Disk error (%d) write block bitmap (group %d)", e, inode / super.inodesPerGroup);
+            error = DiskWriteError;
+            return -1;
+        }
+
+        UpdateFreeCounts(inode / super.inodesPerGroup, 0, 1);
+
+        return 0;
+    }
+    
+    // Directory name hashes, these have to match what Linux (and e2fsck) use to build the index
+    static void TEATransform(uint32_t buf[4], const uint32_t in[4]){
+        uint32_t sum = 0;
+        uint32_t b0 = buf[0], b1 = buf[1];
+        uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+
+        for(int n = 0; n < 16; n++){
+            sum += 0x9E3779B9;
+            b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+            b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+        }
+
+        buf[0] += b0;
+        buf[1] += b1;
+    }
+
+    static inline uint32_t MD4F(uint32_t x, uint32_t y, uint32_t z) { return z ^ (x & (y ^ z)); }
+    static inline uint32_t MD4G(uint32_t x, uint32_t y, uint32_t z) { return (x & y) + ((x ^ y) & z); }
+    static inline uint32_t MD4H(uint32_t x, uint32_t y, uint32_t z) { return x ^ y ^ z; }
+
+    template<uint32_t(*F)(uint32_t, uint32_t, uint32_t)>
+    static inline void MD4Round(uint32_t& a, uint32_t b, uint32_t c, uint32_t d, uint32_t x, int s){
+        a += F(b, c, d) + x;
+        a = (a << s) | (a >> (32 - s));
+    }
+
+    static void HalfMD4Transform(uint32_t buf[4], const uint32_t in[8]){
+        const uint32_t k2 = 0x5A827999;
+        const uint32_t k3 = 0x6ED9EBA1;
+        uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+        MD4Round<MD4F>(a, b, c, d, in[0], 3);
+        MD4Round<MD4F>(d, a, b, c, in[1], 7);
+        MD4Round<MD4F>(c, d, a, b, in[2], 11);
+        MD4Round<MD4F>(b, c, d, a, in[3], 19);
+        MD4Round<MD4F>(a, b, c, d, in[4], 3);
+        MD4Round<MD4F>(d, a, b, c, in[5], 7);
+        MD4Round<MD4F>(c, d, a, b, in[6], 11);
+        MD4Round<MD4F>(b, c, d, a, in[7], 19);
+
+        MD4Round<MD4G>(a, b, c, d, in[1] + k2, 3);
+        MD4Round<MD4G>(d, a, b, c, in[3] + k2, 5);
+        MD4Round<MD4G>(c, d, a, b, in[5] + k2, 9);
+        MD4Round<MD4G>(b, c, d, a, in[7] + k2, 13);
+        MD4Round<MD4G>(a, b, c, d, in[0] + k2, 3);
+        MD4Round<MD4G>(d, a, b, c, in[2] + k2, 5);
+        MD4Round<MD4G>(c, d, a, b, in[4] + k2, 9);
+        MD4Round<MD4G>(b, c, d, a, in[6] + k2, 13);
+
+        MD4Round<MD4H>(a, b, c, d, in[3] + k3, 3);
+        MD4Round<MD4H>(d, a, b, c, in[7] + k3, 9);
+        MD4Round<MD4H>(c, d, a, b, in[2] + k3, 11);
+        MD4Round<MD4H>(b, c, d, a, in[6] + k3, 15);
+        MD4Round<MD4H>(a, b, c, d, in[1] + k3, 3);
+        MD4Round<MD4H>(d, a, b, c, in[5] + k3, 9);
+        MD4Round<MD4H>(c, d, a, b, in[0] + k3, 11);
+        MD4Round<MD4H>(b, c, d, a, in[4] + k3, 15);
+
+        buf[0] += a;
+        buf[1] += b;
+        buf[2] += c;
+        buf[3] += d;
+    }
+
+    static inline int HashChar(char c, bool isUnsigned){
+        return isUnsigned ? static_cast<int>(static_cast<unsigned char>(c)) : static_cast<int>(static_cast<signed char>(c));
+    }
+
+    static uint32_t LegacyHash(const char* name, int length, bool isUnsigned){
+        uint32_t hash0 = 0x12A3FE2D, hash1 = 0x37ABE8F9;
+
+        while(length--){
+            uint32_t hash = hash1 + (hash0 ^ static_cast<uint32_t>(HashChar(*name++, isUnsigned) * 7152373));
+
+            if(hash & 0x80000000){
+                hash -= 0x7FFFFFFF;
+            }
+
+            hash1 = hash0;
+            hash0 = hash;
+        }
+
+        return hash0 << 1;
+    }
+
+    // Pack up to num words of a name into buf, padded with the length
+    static void NameToHashBuffer(const char* name, int length, uint32_t* buf, int num, bool isUnsigned){
+        uint32_t pad = static_cast<uint32_t>(length) | (static_cast<uint32_t>(length) << 8);
+        pad |= pad << 16;
+
+        uint32_t val = pad;
+        if(length > num * 4){
+            length = num * 4;
+        }
+
+        for(int i = 0; i < length; i++){
+            val = static_cast<uint32_t>(HashChar(name[i], isUnsigned)) + (val << 8);
+            if((i % 4) == 3){
+                *buf++ = val;
+                val = pad;
+                num--;
+            }
+        }
+
+        if(--num >= 0){
+            *buf++ = val;
+        }
+
+        while(--num >= 0){
+            *buf++ = pad;
+        }
+    }
+
+    uint32_t Ext2Volume::HashName(const char* name, size_t length, int version){
+        uint32_t buf[4] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476};
+        uint32_t in[8];
+        uint32_t hash = 0;
+
+        if(superext.hashSeed[0] || superext.hashSeed[1] || superext.hashSeed[2] || superext.hashSeed[3]){
+            memcpy(buf, superext.hashSeed, sizeof(buf));
+        }
+
+        int len = length;
+        switch(version){
+        case HashLegacy:
+        case HashLegacyUnsigned:
+            hash = LegacyHash(name, len, version == HashLegacyUnsigned);
+            break;
+        case HashHalfMD4:
+        case HashHalfMD4Unsigned:
+            for(; len > 0; len -= 32, name += 32){
+                NameToHashBuffer(name, len, in, 8, version == HashHalfMD4Unsigned);
+                HalfMD4Transform(buf, in);
+            }
+            hash = buf[1];
+            break;
+        case HashTEA:
+        case HashTEAUnsigned:
+            for(; len > 0; len -= 16, name += 16){
+                NameToHashBuffer(name, len, in, 4, version == HashTEAUnsigned);
+                TEATransform(buf, in);
+            }
+            hash = buf[0];
+            break;
+        }
+
+        hash &= ~1U; // The low bit marks hash collisions across blocks in the index
+        if(hash == (0x7FFFFFFFU << 1)){
+            hash = (0x7FFFFFFFU - 1) << 1; // Reserved for the end of the directory
+        }
+
+        return hash;
+    }
+
+    int Ext2Volume::ProbeIndex(Ext2Node* node, const char* name, DxPath& path){
+        path.depth = 0;
+
+        uint8_t* block = (uint8_t*)kmalloc(blocksize);
+        if(ReadBlock(GetNodeBlock(node, 0), block)){
+            error = DiskReadError;
+            kfree(block);
+            return -EIO;
+        }
+
+        ext2_dx_root_info_t* info = (ext2_dx_root_info_t*)(block + DirectoryRecordLength(1) + DirectoryRecordLength(2)); // After '.' and '..'
+        if(info->reserved || info->infoLength != sizeof(ext2_dx_root_info_t) || info->hashVersion > HashTEA || info->indirectLevels >= EXT2_DX_MAX_DEPTH){
+            Log::Warning("[Ext2] Unsupported directory index (inode %d, hash version %d, levels %d)", node->inode, info->hashVersion, info->indirectLevels);
+            kfree(block);
+            return 1;
+        }
+
+        path.hashVersion = info->hashVersion + hashUnsigned;
+        path.hash = HashName(name, strlen(name), path.hashVersion);
+
+        int levels = info->indirectLevels;
+        uint32_t blockIndex = 0;
+        ext2_dx_entry_t* entries = (ext2_dx_entry_t*)(((uint8_t*)info) + info->infoLength);
+        unsigned limit = (blocksize - (((uint8_t*)entries) - block)) / sizeof(ext2_dx_entry_t);
+
+        for(;;){
+            ext2_dx_countlimit_t* countLimit = (ext2_dx_countlimit_t*)entries;
+            if(countLimit->limit != limit || !countLimit->count || countLimit->count > limit){
+                Log::Warning("[Ext2] Corrupt directory index (inode %d, block %d)", node->inode, blockIndex);
+                kfree(block);
+                ReleaseIndex(path);
+                return 1;
+            }
+
+            // Find the last entry with a hash below or equal to ours, the first entry covers every hash below the second
+            unsigned low = 1, high = countLimit->count;
+            while(low < high){
+                unsigned mid = (low + high) / 2;
+                if(entries[mid].hash > path.hash){
+                    high = mid;
+                } else {
+                    low = mid + 1;
+                }
+            }
+
+            DxFrame& frame = path.frames[path.depth++];
+            frame.block = block;
+            frame.blockIndex = blockIndex;
+            frame.entries = entries;
+            frame.at = entries + low - 1;
+
+            if(path.depth > levels){
+                break;
+            }
+
+            blockIndex = frame.at->block & EXT2_DX_BLOCK_MASK;
+            if(blockIndex >= DirectoryBlockCount(node)){
+                Log::Warning("[Ext2] Corrupt directory index (inode %d, block %d)", node->inode, blockIndex);
+                ReleaseIndex(path);
+                return 1;
+            }
+
+            block = (uint8_t*)kmalloc(blocksize);
+            if(ReadBlock(GetNodeBlock(node, blockIndex), block)){
+                error = DiskReadError;
+                kfree(block);
+                ReleaseIndex(path);
+                return -EIO;
+            }
+
+            entries = (ext2_dx_entry_t*)(block + sizeof(ext2_directory_entry_t)); // After the empty record
+            limit = (blocksize - sizeof(ext2_directory_entry_t)) / sizeof(ext2_dx_entry_t);
+        }
+
+        if(path.Leaf() >= DirectoryBlockCount(node)){
+            Log::Warning("[Ext2] Corrupt directory index (inode %d, leaf %d)", node->inode, path.Leaf());
+            ReleaseIndex(path);
+            return 1;
+        }
+
+        return 0;
+    }
+
+    int Ext2Volume::NextIndexLeaf(Ext2Node* node, DxPath& path){
+        int level = path.depth - 1;
+        while(level >= 0){
+            DxFrame& frame = path.frames[level];
+            if(frame.at + 1 < frame.entries + ((ext2_dx_countlimit_t*)frame.entries)->count){
+                break;
+            }
+
+            level--;
+        }
+
+        if(level < 0){
+            return 0; // Last leaf
+        }
+
+        path.frames[level].at++;
+        if((path.frames[level].at->hash & ~1U) != path.hash){
+            return 0; // Names with our hash do not continue in the next block
+        }
+
+        while(++level < path.depth){
+            DxFrame& frame = path.frames[level];
+            frame.blockIndex = path.frames[level - 1].at->block & EXT2_DX_BLOCK_MASK;
+            if(frame.blockIndex >= DirectoryBlockCount(node)){
+                return -EIO;
+            }
+
+            if(ReadBlock(GetNodeBlock(node, frame.blockIndex), frame.block)){
+                error = DiskReadError;
+                return -EIO;
+            }
+
+            frame.entries = (ext2_dx_entry_t*)(frame.block + sizeof(ext2_directory_entry_t));
+            frame.at = frame.entries;
+            if(!((ext2_dx_countlimit_t*)frame.entries)->count){
+                return -EIO;
+            }
+        }
+
+        if(path.Leaf() >= DirectoryBlockCount(node)){
+            return -EIO;
+        }
+
+        return 1;
+    }
+
+    void Ext2Volume::ReleaseIndex(DxPath& path){
+        for(int i = 0; i < path.depth; i++){
+            kfree(path.frames[i].block);
+        }
+
+        path.depth = 0;
+    }
+
+    static void PutRecord(ext2_directory_entry_t* e2dirent, uint32_t inode, uint8_t fileType, const char* name, uint8_t nameLength, uint16_t recordLength){
+        e2dirent->inode = inode;
+        e2dirent->recordLength = recordLength;
+        e2dirent->nameLength = nameLength;
+        e2dirent->fileType = fileType;
+        memcpy(e2dirent->name, name, nameLength);
+    }
+
+    // Returns true if name was found in the block
+    static bool SearchBlock(uint8_t* block, uint32_t blocksize, const char* name, size_t length, uint32_t& offset, uint32_t& previous){
+        uint32_t off = 0;
+        uint32_t prev = 0;
+
+        while(off + sizeof(ext2_directory_entry_t) <= blocksize){
+            ext2_directory_entry_t* e2dirent = (ext2_directory_entry_t*)(block + off);
+            if(e2dirent->recordLength < sizeof(ext2_directory_entry_t) || off + e2dirent->recordLength > blocksize){
+                break; // Corrupt record
+            }
+
+            if(e2dirent->inode && e2dirent->nameLength == length && strncmp(e2dirent->name, name, length) == 0){
+                offset = off;
+                previous = prev;
+                return true;
+            }
+
+            prev = off;
+            off += e2dirent->recordLength;
+        }
+
+        return false;
+    }
+
+    // Add an entry to the block if it has space for it, either in an empty record or in the slack at the end of one
+    static bool InsertIntoBlock(uint8_t* block, uint32_t blocksize, DirectoryEntry& ent){
+        uint8_t nameLength = strlen(ent.name);
+        uint16_t needed = DirectoryRecordLength(nameLength);
+        uint32_t offset = 0;
+
+        while(offset + sizeof(ext2_directory_entry_t) <= blocksize){
+            ext2_directory_entry_t* e2dirent = (ext2_directory_entry_t*)(block + offset);
+            uint16_t recordLength = e2dirent->recordLength;
+            if(recordLength < sizeof(ext2_directory_entry_t) || offset + recordLength > blocksize){
+                return false; // Corrupt record
+            }
+
+            if(!e2dirent->inode && recordLength >= needed){
+                PutRecord(e2dirent, ent.inode, ent.flags, ent.name, nameLength, recordLength);
+                return true;
+            }
+
+            uint16_t used = DirectoryRecordLength(e2dirent->nameLength);
+            if(e2dirent->inode && recordLength >= used + needed){
+                e2dirent->recordLength = used;
+                PutRecord((ext2_directory_entry_t*)(block + offset + used), ent.inode, ent.flags, ent.name, nameLength, recordLength - used);
+                return true;
+            }
+
+            offset += recordLength;
+        }
+
+        return false;
+    }
+
+    unsigned Ext2Volume::CollectEntries(uint8_t* block, uint32_t start, HashedEntry* entries, int hashVersion, DirectoryEntry* extra){
+        unsigned count = 0;
+        uint32_t offset = start;
+
+        auto insertSorted = [&](const HashedEntry& entry){
+            unsigned i = count++;
+            for(; i > 0 && entries[i - 1].hash > entry.hash; i--){
+                entries[i] = entries[i - 1];
+            }
+            entries[i] = entry;
+        };
+
+        while(offset + sizeof(ext2_directory_entry_t) <= blocksize){
+            ext2_directory_entry_t* e2dirent = (ext2_directory_entry_t*)(block + offset);
+            if(e2dirent->recordLength < sizeof(ext2_directory_entry_t) || offset + e2dirent->recordLength > blocksize){
+                break;
+            }
+
+            if(e2dirent->inode){
+                insertSorted({HashName(e2dirent->name, e2dirent->nameLength, hashVersion), e2dirent->inode, e2dirent->fileType, e2dirent->nameLength, e2dirent->name});
+            }
+
+            offset += e2dirent->recordLength;
+        }
+
+        if(extra){
+            uint8_t nameLength = strlen(extra->name);
+            insertSorted({HashName(extra->name, nameLength, hashVersion), extra->inode, static_cast<uint8_t>(extra->flags), nameLength, extra->name});
+        }
+
+        return count;
+    }
+
+    unsigned Ext2Volume::SplitPoint(HashedEntry* entries, unsigned count){
+        unsigned total = 0;
+        for(unsigned i = 0; i < count; i++){
+            total += DirectoryRecordLength(entries[i].nameLength);
+        }
+
+        unsigned split = 0;
+        unsigned size = 0;
+        while(split < count - 1 && size + DirectoryRecordLength(entries[split].nameLength) <= total / 2){
+            size += DirectoryRecordLength(entries[split++].nameLength);
+        }
+
+        return split ? split : 1;
+    }
+
+    void Ext2Volume::PackEntries(uint8_t* block, HashedEntry* entries, unsigned count){
+        memset(block, 0, blocksize);
+
+        if(!count){
+            ((ext2_directory_entry_t*)block)->recordLength = blocksize; // Empty block
+            return;
+        }
+
+        uint32_t offset = 0;
+        for(unsigned i = 0; i < count; i++){
+            HashedEntry& entry = entries[i];
+            uint16_t recordLength = (i == count - 1) ? (blocksize - offset) : DirectoryRecordLength(entry.nameLength); // The last record spans the rest of the block
+
+            PutRecord((ext2_directory_entry_t*)(block + offset), entry.inode, entry.fileType, entry.name, entry.nameLength, recordLength);
+            offset += recordLength;
+        }
+    }
+
+    int Ext2Volume::SplitLeaf(Ext2Node* node, DxPath& path, uint8_t* leaf){
+        DxFrame& frame = path.frames[path.depth - 1];
+        ext2_dx_countlimit_t* countLimit = (ext2_dx_countlimit_t*)frame.entries;
+        if(countLimit->count >= countLimit->limit){
+            return GrowIndex(node, path); // Make room in the index, the leaf is split on the next attempt
+        }
+
+        HashedEntry* entries = (HashedEntry*)kmalloc(sizeof(HashedEntry) * (blocksize / DirectoryRecordLength(1) + 1));
+        unsigned count = CollectEntries(leaf, 0, entries, path.hashVersion, nullptr);
+        if(count < 2){
+            kfree(entries);
+            return 1;
+        }
+
+        unsigned split = SplitPoint(entries, count);
+
+        uint32_t newIndex;
+        uint32_t newBlock = AppendDirectoryBlock(node, newIndex);
+        if(!newBlock){
+            kfree(entries);
+            return -ENOSPC;
+        }
+
+        // The upper half of the hashes moves to the new block
+        uint8_t* buffer = (uint8_t*)kmalloc(blocksize);
+        PackEntries(buffer, entries + split, count - split);
+        int e = WriteBlock(newBlock, buffer);
+
+        if(!e){
+            PackEntries(buffer, entries, split);
+            e = WriteBlock(GetNodeBlock(node, path.Leaf()), buffer);
+        }
+
+        if(!e){
+            ext2_dx_entry_t* at = frame.at + 1;
+            for(ext2_dx_entry_t* entry = frame.entries + countLimit->count; entry > at; entry--){
+                *entry = *(entry - 1);
+            }
+            at->hash = entries[split].hash | (entries[split].hash == entries[split - 1].hash); // Names with the same hash continue in the new block
+            at->block = newIndex;
+            countLimit->count++;
+
+            e = WriteBlock(GetNodeBlock(node, frame.blockIndex), frame.block);
+        }
+
+        kfree(buffer);
+        kfree(entries);
+        SyncNode(node);
+
+        if(e){
+            error = DiskWriteError;
+            return -EIO;
+        }
+
+        return 0;
+    }
+
+    int Ext2Volume::GrowIndex(Ext2Node* node, DxPath& path){
+        DxFrame& root = path.frames[0];
+        ext2_dx_countlimit_t* rootCountLimit = (ext2_dx_countlimit_t*)root.entries;
+
+        if(path.depth > 1 && rootCountLimit->count >= rootCountLimit->limit){
+            return 1; // Both levels are full and deeper trees are not supported
+        }
+
+        uint32_t newIndex;
+        uint32_t newBlock = AppendDirectoryBlock(node, newIndex);
+        if(!newBlock){
+            return -ENOSPC;
+        }
+
+        // Index blocks look like empty directory blocks to anything ignoring the index
+        uint8_t* buffer = (uint8_t*)kmalloc(blocksize);
+        memset(buffer, 0, blocksize);
+        ((ext2_directory_entry_t*)buffer)->recordLength = blocksize;
+
+        ext2_dx_entry_t* entries = (ext2_dx_entry_t*)(buffer + sizeof(ext2_directory_entry_t));
+        ext2_dx_countlimit_t* countLimit = (ext2_dx_countlimit_t*)entries;
+        uint16_t limit = (blocksize - sizeof(ext2_directory_entry_t)) / sizeof(ext2_dx_entry_t);
+
+        int e;
+        if(path.depth == 1){
+            // Move every entry of the root into the new block, which becomes the only entry of the root
+            memcpy(entries, root.entries, rootCountLimit->count * sizeof(ext2_dx_entry_t));
+            countLimit->limit = limit;
+            countLimit->count = rootCountLimit->count;
+
+            e = WriteBlock(newBlock, buffer);
+            if(!e){
+                root.entries[0].block = newIndex;
+                rootCountLimit->count = 1;
+                ((ext2_dx_root_info_t*)(root.block + DirectoryRecordLength(1) + DirectoryRecordLength(2)))->indirectLevels = 1;
+
+                e = WriteBlock(GetNodeBlock(node, 0), root.block);
+            }
+        } else {
+            // Move the upper half of the full index block to the new block
+            DxFrame& frame = path.frames[1];
+            ext2_dx_countlimit_t* fullCountLimit = (ext2_dx_countlimit_t*)frame.entries;
+            unsigned split = fullCountLimit->count / 2;
+            uint32_t splitHash = frame.entries[split].hash;
+
+            memcpy(entries, frame.entries + split, (fullCountLimit->count - split) * sizeof(ext2_dx_entry_t));
+            countLimit->limit = limit;
+            countLimit->count = fullCountLimit->count - split;
+            fullCountLimit->count = split;
+
+            e = WriteBlock(newBlock, buffer);
+            if(!e){
+                e = WriteBlock(GetNodeBlock(node, frame.blockIndex), frame.block);
             }
-        }
-        
-        if(e2inode.blocks[EXT2_SINGLY_INDIRECT_INDEX]){
-            FreeBlock(e2inode.blocks[EXT2_SINGLY_INDIRECT_INDEX]);
-            if(e2inode.blocks[EXT2_DOUBLY_INDIRECT_INDEX]){
-                uint32_t blockPointers[blocksize / sizeof(uint32_t)];
 
-                if(int e = ReadBlockCached(e2inode.blocks[EXT2_DOUBLY_INDIRECT_INDEX], blockPointers)){
-                    (void)e;
-                    error = DiskReadError;
-                    return 0;
-                }
-                
-                for(unsigned i = 0; i < (blocksize / sizeof(uint32_t)) && blockPointers[i] != 0; i++){
-                    FreeBlock(blockPointers[i]);
-                    if(blockCache.get(blockPointers[i])){
-                        blockCache.remove(blockPointers[i]);
-                    }
+            if(!e){
+                ext2_dx_entry_t* at = root.at + 1;
+                for(ext2_dx_entry_t* entry = root.entries + rootCountLimit->count; entry > at; entry--){
+                    *entry = *(entry - 1);
                 }
+                at->hash = splitHash;
+                at->block = newIndex;
+                rootCountLimit->count++;
 
-                FreeBlock(e2inode.blocks[EXT2_DOUBLY_INDIRECT_INDEX]);
-
-                if(e2inode.blocks[EXT2_TRIPLY_INDIRECT_INDEX]){
-                    Log::Error("[Ext2] We do not support triply indirect blocks, will not free them.");
-                }
+                e = WriteBlock(GetNodeBlock(node, 0), root.block);
             }
         }
 
-        ext2_blockgrp_desc_t& group = blockGroups[inode / super.inodesPerGroup];
-
-        uint8_t bitmap[blocksize / sizeof(uint8_t)];
+        kfree(buffer);
+        SyncNode(node);
 
-        if(uint8_t* cachedBitmap = bitmapCache.get(group.inodeBitmap)){
-            memcpy(bitmap, cachedBitmap, blocksize);
-        } else {
-            if(int e = ReadBlock(group.inodeBitmap, bitmap)){
-                Log::Error("[Ext2] Disk error (%d) reading inode bitmap (group %d)", e, inode / super.inodesPerGroup);
-                error = DiskReadError;
-                return -1;
-            }
+        if(e){
+            error = DiskWriteError;
+            return -EIO;
         }
 
-        int bmapIndex = (inode % super.inodesPerGroup) / (sizeof(uint8_t) * 8);
-        int bitmask = ~(1 << (inode % 8));
-        bitmap[bmapIndex] &= bitmask;
+        return 0;
+    }
 
-        if(uint8_t* cachedBitmap = bitmapCache.get(group.inodeBitmap)){
-            memcpy(cachedBitmap, bitmap, blocksize);
+    int Ext2Volume::MakeIndexed(Ext2Node* node, uint8_t* block, DirectoryEntry& ent){
+        ext2_directory_entry_t* dot = (ext2_directory_entry_t*)block;
+        ext2_directory_entry_t* dotdot = (ext2_directory_entry_t*)(block + DirectoryRecordLength(1));
+        if(dot->recordLength != DirectoryRecordLength(1) || dot->nameLength != 1 || dot->name[0] != '.'
+            || dotdot->nameLength != 2 || strncmp(dotdot->name, "..", 2) != 0 || dot->recordLength + dotdot->recordLength > blocksize){
+            return 1; // The directory has to start with '.' and '..'
         }
 
-        if(int e = WriteBlock(group.blockBitmap, bitmap)){
-            Log::Error("[Ext2] Disk error (%d) write block bitmap (group %d)", e, inode / super.inodesPerGroup);
-            error = DiskWriteError;
-            return -1;
+        int hashVersion = (superext.defHashVersion <= HashTEA) ? superext.defHashVersion : static_cast<int>(HashHalfMD4);
+
+        HashedEntry* entries = (HashedEntry*)kmalloc(sizeof(HashedEntry) * (blocksize / DirectoryRecordLength(1) + 1));
+        unsigned count = CollectEntries(block, dot->recordLength + dotdot->recordLength, entries, hashVersion + hashUnsigned, &ent);
+        if(count < 2){
+            kfree(entries);
+            return 1;
         }
 
-        super.freeInodeCount++;
-        blockGroups[inode / super.inodesPerGroup].freeInodeCount++;
+        unsigned split = SplitPoint(entries, count);
 
-        WriteBlockGroupDescriptor(inode / super.inodesPerGroup);
-        WriteSuperblock();
+        uint32_t lowIndex, highIndex;
+        uint32_t low = AppendDirectoryBlock(node, lowIndex);
+        uint32_t high = low ? AppendDirectoryBlock(node, highIndex) : 0;
 
-        return 0;
-    }
-    
-    int Ext2Volume::ListDir(Ext2Node* node, List<DirectoryEntry>& entries){
-        if((node->flags & FS_NODE_TYPE) != FS_NODE_DIRECTORY){
-            Log::Warning("[Ext2] ListDir: Not a directory (inode %d)", node->inode);
-            error = MiscError;
-            return -1;
+        uint8_t* buffer = (uint8_t*)kmalloc(blocksize);
+        if(!high){
+            if(low){
+                PackEntries(buffer, nullptr, 0);
+                WriteBlock(low, buffer);
+                SyncNode(node);
+            }
+
+            kfree(buffer);
+            kfree(entries);
+            return -ENOSPC;
         }
 
-        if(node->inode < 1){
-            Log::Warning("[Ext2] ReadDir: Invalid inode: %d", node->inode);
-            error = InvalidInodeError;
-            return -1;
+        // Names point into block so the leaves are written before the root
+        PackEntries(buffer, entries, split);
+        int e = WriteBlock(low, buffer);
+
+        if(!e){
+            PackEntries(buffer, entries + split, count - split);
+            e = WriteBlock(high, buffer);
         }
 
-        ext2_inode_t& ino = node->e2inode;
+        if(!e){
+            uint32_t rootOffset = dot->recordLength + DirectoryRecordLength(2);
+            memset(block + rootOffset, 0, blocksize - rootOffset);
 
-        uint8_t* buffer = (uint8_t*)kmalloc(blocksize);
-        uint32_t currentBlockIndex = 0;
-        uint32_t blockOffset = 0;
-        uint32_t totalOffset = 0;
+            dotdot->recordLength = blocksize - dot->recordLength;
 
-        ext2_directory_entry_t* e2dirent = (ext2_directory_entry_t*)buffer;
+            ext2_dx_root_info_t* info = (ext2_dx_root_info_t*)(block + rootOffset);
+            info->hashVersion = hashVersion;
+            info->infoLength = sizeof(ext2_dx_root_info_t);
 
-        if(ReadBlock(GetInodeBlock(currentBlockIndex, ino), buffer)){
-            Log::Info("[Ext2] ListDir: Error reading block %d", ino.blocks[currentBlockIndex]);
-            error = DiskReadError;
-            return -1;
+            ext2_dx_entry_t* dxEntries = (ext2_dx_entry_t*)(block + rootOffset + sizeof(ext2_dx_root_info_t));
+            ext2_dx_countlimit_t* countLimit = (ext2_dx_countlimit_t*)dxEntries;
+            countLimit->limit = (blocksize - rootOffset - sizeof(ext2_dx_root_info_t)) / sizeof(ext2_dx_entry_t);
+            countLimit->count = 2;
+            dxEntries[0].block = lowIndex;
+            dxEntries[1].hash = entries[split].hash | (entries[split].hash == entries[split - 1].hash);
+            dxEntries[1].block = highIndex;
+
+            e = WriteBlock(GetNodeBlock(node, 0), block);
         }
 
-        for(;;){
-            if(e2dirent->recordLength == 0) break;
+        kfree(buffer);
+        kfree(entries);
 
-            DirectoryEntry dirent;
-            dirent.flags = e2dirent->fileType;
-            strncpy(dirent.name, e2dirent->name, e2dirent->nameLength);
-            dirent.name[e2dirent->nameLength] = 0;
-            dirent.inode = e2dirent->inode;
+        if(!e){
+            node->e2inode.flags |= EXT2_INDEX_FL;
+        }
+        SyncNode(node);
 
-            entries.add_back(dirent);
+        if(e){
+            error = DiskWriteError;
+            return -EIO;
+        }
 
-            blockOffset += e2dirent->recordLength;
-            totalOffset += e2dirent->recordLength;
+        return 0;
+    }
 
-            if(blockOffset >= blocksize){
-                currentBlockIndex++;
+    int Ext2Volume::FindEntry(Ext2Node* node, const char* name, uint8_t* buffer, DirectoryLocation& loc){
+        size_t length = strlen(name);
 
-                if(currentBlockIndex > ino.blockCount / (blocksize / 512)){
-                    // End of dir
-                    break;
-                }
+        if(IsIndexed(node)){
+            DxPath path;
+            int e = ProbeIndex(node, name, path);
+            if(e < 0){
+                return e;
+            } else if(!e){
+                do {
+                    loc.blockIndex = path.Leaf();
+                    if(ReadBlock(GetNodeBlock(node, loc.blockIndex), buffer)){
+                        error = DiskReadError;
+                        ReleaseIndex(path);
+                        return -EIO;
+                    }
 
-                blockOffset = 0;
-                if(ReadBlock(GetInodeBlock(currentBlockIndex, ino), buffer)){
-                    error = DiskReadError;
-                    return -1;
-                }
+                    if(SearchBlock(buffer, blocksize, name, length, loc.offset, loc.previous)){
+                        ReleaseIndex(path);
+                        return 0;
+                    }
+                } while((e = NextIndexLeaf(node, path)) > 0);
+
+                ReleaseIndex(path);
+                return e ? e : -ENOENT;
+            }
+            // Fall back to searching every block if the index cannot be used
+        }
+
+        uint32_t blockCount = DirectoryBlockCount(node);
+        for(loc.blockIndex = 0; loc.blockIndex < blockCount; loc.blockIndex++){
+            if(ReadBlock(GetNodeBlock(node, loc.blockIndex), buffer)){
+                Log::Info("[Ext2] FindEntry: Error reading block %d", GetNodeBlock(node, loc.blockIndex));
+                error = DiskReadError;
+                return -EIO;
             }
 
-            e2dirent = (ext2_directory_entry_t*)(buffer + blockOffset);
+            if(SearchBlock(buffer, blocksize, name, length, loc.offset, loc.previous)){
+                return 0;
+            }
         }
 
-        return 0;
+        return -ENOENT;
+    }
+
+    uint32_t Ext2Volume::AppendDirectoryBlock(Ext2Node* node, uint32_t& index){
+        uint32_t block = AllocateBlock();
+        if(!block){
+            return 0;
+        }
+
+        index = DirectoryBlockCount(node);
+        SetNodeBlock(node, index, block);
+        node->e2inode.blockCount += blocksize / 512;
+        node->e2inode.size += blocksize;
+        node->size = node->e2inode.size;
+
+        return block;
     }
 
-    int Ext2Volume::WriteDir(Ext2Node* node, List<DirectoryEntry>& entries){
+    int Ext2Volume::InsertDir(Ext2Node* node, DirectoryEntry& ent){
         if((node->flags & FS_NODE_TYPE) != FS_NODE_DIRECTORY){
             return -ENOTDIR;
         }
 
-        if(node->inode < 1){
-            Log::Warning("[Ext2] WriteDir: Invalid inode: %d", node->inode);
-            return -1;
+        if(node->e2inode.flags & EXT2_INDEX_FL){
+            if(IsIndexed(node)){
+                int e = InsertIndexed(node, ent);
+                if(e <= 0){
+                    return e;
+                }
+            }
+
+            // The index cannot take the entry, drop it so the directory is treated as plain blocks of entries
+            Log::Warning("[Ext2] Dropping index of directory (inode %d)", node->inode);
+            node->e2inode.flags &= ~EXT2_INDEX_FL;
+            SyncNode(node);
         }
 
-        ext2_inode_t& ino = node->e2inode;
+        return InsertLinear(node, ent);
+    }
 
+    int Ext2Volume::InsertIndexed(Ext2Node* node, DirectoryEntry& ent){
         uint8_t* buffer = (uint8_t*)kmalloc(blocksize);
-        uint32_t currentBlockIndex = 0;
-        uint32_t blockOffset = 0;
-        uint32_t totalOffset = 0;
-
-        ext2_directory_entry_t* e2dirent = (ext2_directory_entry_t*)kmalloc(sizeof(ext2_directory_entry_t) + NAME_MAX);
 
-        unsigned lastIndex = entries.get_length() - 1;
-        for(unsigned i = 0; i < entries.get_length(); i++){
-            DirectoryEntry ent = entries[i];
-
-            //Log::Info("[Ext2] Writing entry: %s", ent.name);
+        for(int attempt = 0; attempt < 4; attempt++){ // The index may have to grow before the leaf can be split
+            DxPath path;
+            if(int e = ProbeIndex(node, ent.name, path)){
+                kfree(buffer);
+                return e;
+            }
 
-            e2dirent->fileType = ent.flags;
-            e2dirent->inode = ent.inode;
-            strncpy(e2dirent->name, ent.name, strlen(ent.name));
-            e2dirent->nameLength = strlen(ent.name);
-            
-            if(i == lastIndex){
-                e2dirent->recordLength = blocksize - blockOffset;
-            } else {
-                if(strlen(entries[i + 1].name) + sizeof(ext2_directory_entry_t) + blockOffset > blocksize){
-                    e2dirent->recordLength = blocksize - blockOffset; // Directory entries cannot span multiple blocks
-                } else {
-                    e2dirent->recordLength = sizeof(ext2_directory_entry_t) + e2dirent->nameLength;
-                    if(e2dirent->recordLength % 4){
-                        memset(((uint8_t*)e2dirent) + e2dirent->recordLength, 0, 4 - (e2dirent->recordLength % 4)); // Pad with zeros
-                        e2dirent->recordLength += 4 - (e2dirent->recordLength % 4); // Round up to nearest multiple of 4
-                    }
-                }
+            uint32_t block = GetNodeBlock(node, path.Leaf());
+            if(ReadBlock(block, buffer)){
+                error = DiskReadError;
+                ReleaseIndex(path);
+                kfree(buffer);
+                return -EIO;
             }
 
-            memcpy((buffer + blockOffset), e2dirent, sizeof(ext2_directory_entry_t) + e2dirent->nameLength);
-            blockOffset += e2dirent->recordLength;
-            totalOffset += e2dirent->recordLength;
+            if(InsertIntoBlock(buffer, blocksize, ent)){
+                int e = WriteBlock(block, buffer);
+
+                ReleaseIndex(path);
+                kfree(buffer);
 
-            if(blockOffset >= blocksize){
-                if(WriteBlockCached(GetInodeBlock(currentBlockIndex, ino), buffer)){
-                    Log::Error("[Ext2] WriteDir: Failed to write directory block");
+                if(e){
                     error = DiskWriteError;
-                    return -1;
+                    return -EIO;
                 }
+                return 0;
+            }
 
-                currentBlockIndex++;
-
-                if(currentBlockIndex > ino.blockCount / (blocksize / 512)){
-                    // Allocate a new block
-                    SetInodeBlock(currentBlockIndex, node->e2inode, AllocateBlock());
-                    node->e2inode.blockCount += blocksize / 512;
-                    WriteSuperblock();
-                }
+            int e = SplitLeaf(node, path, buffer);
+            ReleaseIndex(path);
 
-                blockOffset = 0;
+            if(e){
+                kfree(buffer);
+                return e;
             }
-            
-            node->e2inode.size = totalOffset;
-            node->size = node->e2inode.size;
         }
 
         kfree(buffer);
-        kfree(e2dirent);
-
-        SyncNode(node);
-
-        return 0;
+        return 1;
     }
 
-    int Ext2Volume::InsertDir(Ext2Node* node, List<DirectoryEntry>& newEntries){
-        List<DirectoryEntry> entries;
-        ListDir(node, entries);
+    int Ext2Volume::InsertLinear(Ext2Node* node, DirectoryEntry& ent){
+        uint8_t* buffer = (uint8_t*)kmalloc(blocksize);
+        uint32_t blockCount = DirectoryBlockCount(node);
+
+        // Entries are usually appended so start looking for space at the last block
+        for(uint32_t i = blockCount; i > 0; i--){
+            uint32_t block = GetNodeBlock(node, i - 1);
+            if(ReadBlock(block, buffer)){
+                Log::Info("[Ext2] InsertDir: Error reading block %d", block);
+                error = DiskReadError;
+                kfree(buffer);
+                return -EIO;
+            }
 
+            if(InsertIntoBlock(buffer, blocksize, ent)){
+                int e = WriteBlock(block, buffer);
+                kfree(buffer);
 
-        for(DirectoryEntry& newEnt : newEntries){
-            for(DirectoryEntry& ent : entries){
-                if(strcmp(ent.name, newEnt.name) == 0){
-                    Log::Info("[Ext2] InsertDir: Entry %s already exists!", newEnt.name);
-                    return -EEXIST;
+                if(e){
+                    error = DiskWriteError;
+                    return -EIO;
                 }
+                return 0;
             }
-            entries.add_back(newEnt);
         }
 
-        return WriteDir(node, entries);
-    }
-    
-    int Ext2Volume::InsertDir(Ext2Node* node, DirectoryEntry& ent){
-        List<DirectoryEntry> ents;
-        ents.add_back(ent);
+        if(blockCount == 1 && dirIndex){
+            // Index the directory once it outgrows its first block, buffer still holds the block
+            int e = MakeIndexed(node, buffer, ent);
+            if(e <= 0){
+                kfree(buffer);
+                return e;
+            }
+        }
+
+        uint32_t index;
+        uint32_t block = AppendDirectoryBlock(node, index);
+        if(!block){
+            kfree(buffer);
+            return -ENOSPC;
+        }
 
-        return InsertDir(node, ents);
+        memset(buffer, 0, blocksize);
+        PutRecord((ext2_directory_entry_t*)buffer, ent.inode, ent.flags, ent.name, strlen(ent.name), blocksize);
+
+        int e = WriteBlock(block, buffer);
+        kfree(buffer);
+        SyncNode(node);
+
+        if(e){
+            error = DiskWriteError;
+            return -EIO;
+        }
+
+        return 0;
     }
 
     int Ext2Volume::ReadDir(Ext2Node* node, DirectoryEntry* dirent, uint32_t index){
@@ -846,50 +1683,44 @@ namespace fs::Ext2{
             return -1;
         }
 
-        ext2_inode_t& ino = node->e2inode;
-
         uint8_t* buffer = (uint8_t*)kmalloc(blocksize);
-        uint32_t currentBlockIndex = 0;
-        uint32_t blockOffset = 0;
-        uint32_t totalOffset = 0;
+        uint32_t blockCount = DirectoryBlockCount(node);
 
-        ext2_directory_entry_t* e2dirent = (ext2_directory_entry_t*)buffer;
-
-        if(ReadBlockCached(GetInodeBlock(currentBlockIndex, ino), buffer)){
-            Log::Info("[Ext2] Failed to read block %d", GetInodeBlock(currentBlockIndex, ino));
-            error = DiskReadError;
-            return -1;
-        }
+        for(uint32_t currentBlockIndex = 0; currentBlockIndex < blockCount; currentBlockIndex++){
+            if(ReadBlock(GetNodeBlock(node, currentBlockIndex), buffer)){
+                Log::Info("[Ext2] Failed to read block %d", GetNodeBlock(node, currentBlockIndex));
+                error = DiskReadError;
+                kfree(buffer);
+                return -1;
+            }
 
-        for(unsigned i = 0; i < index; i++){
-            if(e2dirent->recordLength == 0) return 0;
+            uint32_t blockOffset = 0;
+            while(blockOffset + sizeof(ext2_directory_entry_t) <= blocksize){
+                ext2_directory_entry_t* e2dirent = (ext2_directory_entry_t*)(buffer + blockOffset);
+                if(e2dirent->recordLength < sizeof(ext2_directory_entry_t)){
+                    break;
+                }
 
-            blockOffset += e2dirent->recordLength;
-            totalOffset += e2dirent->recordLength;
+                if(e2dirent->inode){ // Empty records (removed entries and index blocks) are skipped
+                    if(!index){
+                        strncpy(dirent->name, e2dirent->name, e2dirent->nameLength);
+                        dirent->name[e2dirent->nameLength] = 0; // Null terminate
+                        dirent->flags = e2dirent->fileType;
+                        dirent->inode = e2dirent->inode;
 
-            if(blockOffset >= blocksize){
-                currentBlockIndex++;
+                        kfree(buffer);
+                        return 1;
+                    }
 
-                if(currentBlockIndex >= ino.blockCount / (blocksize / 512)){
-                    // End of dir
-                    return 0;
+                    index--;
                 }
 
-                blockOffset = 0;
-                if(ReadBlockCached(GetInodeBlock(currentBlockIndex, ino), buffer)){
-                    Log::Info("[Ext2] Failed to read block");
-                    return -1;
-                }
+                blockOffset += e2dirent->recordLength;
             }
-
-            e2dirent = (ext2_directory_entry_t*)(buffer + blockOffset);
         }
 
-        strncpy(dirent->name, e2dirent->name, e2dirent->nameLength);
-        dirent->name[e2dirent->nameLength] = 0; // Null terminate
-        dirent->flags = e2dirent->fileType;
-
-        return 1;
+        kfree(buffer);
+        return 0;
     }
 
     FsNode* Ext2Volume::FindDir(Ext2Node* node, char* name){
@@ -902,62 +1733,17 @@ namespace fs::Ext2{
             return nullptr;
         }
 
-        ext2_inode_t& ino = node->e2inode;
-
         uint8_t* buffer = (uint8_t*)kmalloc(blocksize);
-        memset(buffer, 0, blocksize);
-        uint32_t currentBlockIndex = 0;
-        uint32_t blockOffset = 0;
-        uint32_t totalOffset = 0;
-
-        ext2_directory_entry_t* e2dirent = (ext2_directory_entry_t*)buffer;
-
-        if(ReadBlockCached(GetInodeBlock(currentBlockIndex, ino), buffer)){
-            Log::Info("[Ext2] Failed to read block %d", GetInodeBlock(currentBlockIndex, ino));
-            return nullptr;
-        }
-
-        while(totalOffset < ino.size && currentBlockIndex < ino.blockCount / (blocksize / 512)){
-            /*char buf[e2dirent->nameLength + 1];
-            strncpy(buf, e2dirent->name, e2dirent->nameLength);
-            buf[e2dirent->nameLength] = 0;
-            Log::Info("Checking name %s, inode %d, len %d (parent inode: %d)", buf, e2dirent->inode, e2dirent->recordLength, node->inode);*/
-
-            if(strlen(name) == e2dirent->nameLength && strncmp(name, e2dirent->name, e2dirent->nameLength) == 0){
-                break;
-            }
-
-            blockOffset += e2dirent->recordLength;
-            totalOffset += e2dirent->recordLength;
-
-            if(totalOffset > ino.size) return nullptr;
-
-            if(blockOffset >= blocksize){
-                currentBlockIndex++;
-                
-                if(currentBlockIndex >= ino.blockCount / (blocksize / 512)){
-                    // End of dir
-                    kfree(buffer);
-                    return nullptr;
-                }
-
-                blockOffset = 0;
-
-                if(ReadBlockCached(GetInodeBlock(currentBlockIndex, ino), buffer)){
-                    Log::Info("[Ext2] Failed to read block");
-                    return nullptr;
-                }
-            }
-
-            e2dirent = (ext2_directory_entry_t*)(buffer + blockOffset);
-        }
+        DirectoryLocation loc;
 
-        if(strlen(name) != e2dirent->nameLength || strncmp(e2dirent->name, name, e2dirent->nameLength) != 0){
+        if(FindEntry(node, name, buffer, loc)){
             // Not found
             kfree(buffer);
             return nullptr;
         }
 
+        ext2_directory_entry_t* e2dirent = (ext2_directory_entry_t*)(buffer + loc.offset);
+
         if(!e2dirent->inode || e2dirent->inode > super.inodeCount){
             Log::Error("[Ext2] Directory Entry %s contains invalid inode %d", name, e2dirent->inode);
             kfree(buffer);
@@ -969,7 +1755,8 @@ namespace fs::Ext2{
         if(!returnNode){ // Could not locate inode in cache
             ext2_inode_t direntInode;
             if(ReadInode(e2dirent->inode, direntInode)){
-                Log::Error("[Ext2] Failed to read inode of directory (inode %d) entry %s", node->inode, e2dirent->name);
+                Log::Error("[Ext2] Failed to read inode of directory (inode %d) entry %s", node->inode, name);
+                kfree(buffer);
                 return nullptr; // Could not read inode
             }
 
@@ -988,7 +1775,6 @@ namespace fs::Ext2{
 
         uint32_t blockIndex = LocationToBlock(offset);
         uint32_t blockLimit = LocationToBlock(offset + size);
-        uint8_t blockBuffer[blocksize];
 
         //Log::Info("[Ext2] Reading: Block index: %d, Block limit: %d, Offset: %d, Size: %d", blockIndex, blockLimit, offset, size);
 
@@ -997,52 +1783,37 @@ namespace fs::Ext2{
         #endif
 
         ssize_t ret = size;
-        Vector<uint32_t> blocks = GetInodeBlocks(blockIndex, blockLimit - blockIndex + 1, node->e2inode);
+        Vector<uint32_t> blocks = GetNodeBlocks(node, blockIndex, blockLimit - blockIndex + 1);
         
         #ifdef EXT2_ENABLE_TIMER
         timeval_t blktv2 = Timer::GetSystemUptimeStruct();
         timeval_t readtv1 = Timer::GetSystemUptimeStruct();
         #endif
 
-        for(uint32_t block : blocks){
-            if(size <= 0) break;
-            
-            if(offset % blocksize){
-                if(int e = ReadBlockCached(block, blockBuffer); e){
-                    Log::Info("[Ext2] Error %i reading block %u", e, block);
-                    error = DiskReadError;
-                    //return -1;
-                }
-
-                size_t readSize = blocksize - (offset % blocksize);
-                size_t readOffset = (offset % blocksize);
-
-                if(readSize > size) readSize = size;
+        size_t blockOffset = offset % blocksize;
+        for(unsigned i = 0; i < blocks.get_length() && size > 0;){
+            // Coalesce blocks that are next to each other on disk into one request
+            uint32_t block = blocks[i];
+            unsigned runLength = 1;
+            while(block && i + runLength < blocks.get_length() && blocks[i + runLength] == block + runLength){
+                runLength++;
+            }
 
-                memcpy(buffer, blockBuffer + readOffset, readSize);
+            size_t runSize = runLength * blocksize - blockOffset;
+            if(runSize > size) runSize = size;
 
-                size -= readSize;
-                buffer += readSize;
-                offset += readSize;
-            } else if(size >= blocksize){
-                if(int e = ReadBlockCached(block, buffer); e){
-                    Log::Info("[Ext2] Error %i reading block %u", e, block);
-                    error = DiskReadError;
-                    //return -1;
-                }
-                size -= blocksize;
-                buffer += blocksize;
-                offset += blocksize;
-            } else {
-                if(int e = ReadBlockCached(block, blockBuffer); e){
-                    Log::Info("[Ext2] Error %i reading block %u", e, block);
-                    error = DiskReadError;
-                    //return -1;
-                }
-                memcpy(buffer, blockBuffer, size);
-                size = 0;
+            if(!block){
+                memset(buffer, 0, runSize); // Sparse block
+            } else if(int e = PageCache::Read(part, static_cast<uint64_t>(block) * blocksize + blockOffset, runSize, buffer)){
+                Log::Info("[Ext2] Error %i reading blocks %u-%u", e, block, block + runLength - 1);
+                error = DiskReadError;
                 break;
             }
+
+            size -= runSize;
+            buffer += runSize;
+            blockOffset = 0;
+            i += runLength;
         }
 
         #ifdef EXT2_ENABLE_TIMER
@@ -1052,7 +1823,7 @@ namespace fs::Ext2{
         #endif
 
         if(size){
-            Log::Info("[Ext2] Requested %d bytes, read %d bytes (offset: %d)", ret, ret - size, offset);
+            Log::Info("[Ext2] Requested %d bytes, read %d bytes (offset: %d)", ret, ret - size, offset + ret - size);
             return ret - size;
         }
 
@@ -1068,24 +1839,23 @@ namespace fs::Ext2{
         uint32_t blockIndex = LocationToBlock(offset); // Index of first block to write
         uint32_t fileBlockCount = node->e2inode.blockCount / (blocksize / 512); // Size of file in blocks
         uint32_t blockLimit = LocationToBlock(offset + size); // Amount of blocks to write
-        uint8_t* blockBuffer = (uint8_t*)kmalloc(blocksize); // block buffer
         bool sync = false; // Need to sync the inode?
 
         if(blockLimit >= fileBlockCount){
             //Log::Info("[Ext2] Allocating blocks for inode %d", node->inode);
+            uint32_t goal = fileBlockCount ? GetNodeBlock(node, fileBlockCount - 1) + 1 : 0; // Carry on from the end of the file
             for(unsigned i = fileBlockCount; i <= blockLimit; i++){
-                uint32_t block = AllocateBlock();
-                SetInodeBlock(i, node->e2inode, block);
+                uint32_t block = AllocateBlock(goal);
+                SetNodeBlock(node, i, block);
+                goal = block + 1;
             }
             node->e2inode.blockCount = (blockLimit + 1) * (blocksize / 512);
 
-            WriteSuperblock();
             sync = true;
         }
 
         if(offset + size > node->size){
-            node->size = offset + size;
-            node->e2inode.size = node->size;
+            SetNodeSize(node, offset + size);
 
             sync = true;
         }
@@ -1097,41 +1867,31 @@ namespace fs::Ext2{
         //Log::Info("[Ext2] Writing: Block index: %d, Blockcount: %d, Offset: %d, Size: %d", blockIndex, blockLimit - blockIndex + 1, offset, size);
 
         size_t ret = size;
+        Vector<uint32_t> blocks = GetNodeBlocks(node, blockIndex, blockLimit - blockIndex + 1);
+
+        size_t blockOffset = offset % blocksize;
+        for(unsigned i = 0; i < blocks.get_length() && size > 0;){
+            // Coalesce blocks that are next to each other on disk into one request
+            uint32_t block = blocks[i];
+            unsigned runLength = 1;
+            while(i + runLength < blocks.get_length() && blocks[i + runLength] == block + runLength){
+                runLength++;
+            }
 
-        for(; blockIndex <= blockLimit && size > 0; blockIndex++){
-            uint32_t block = GetInodeBlock(blockIndex, node->e2inode);
-            
-            if(offset % blocksize){
-                ReadBlockCached(block, blockBuffer);
-
-                size_t writeSize = blocksize - (offset % blocksize);
-                size_t writeOffset = (offset % blocksize);
-                
-                if(writeSize > size) writeSize = size;
-
-                memcpy(blockBuffer + writeOffset, buffer, writeSize);
-                WriteBlockCached(block, blockBuffer);
-
-                size -= writeSize;
-                buffer += writeSize;
-                offset += writeSize;
-            } else if(size >= blocksize){
-                memcpy(blockBuffer, buffer, blocksize);
-                WriteBlockCached(block, blockBuffer);
-
-                size -= blocksize;
-                buffer += blocksize;
-                offset += blocksize;
-            } else {
-                ReadBlockCached(block, blockBuffer);
-                memcpy(blockBuffer, buffer, size);
-                WriteBlockCached(block, blockBuffer);
+            size_t runSize = runLength * blocksize - blockOffset;
+            if(runSize > size) runSize = size;
 
-                buffer += size;
-                offset += size;
-                size = 0;
+            uint64_t location = static_cast<uint64_t>(block) * blocksize + blockOffset;
+            if(int e = PageCache::Write(part, location, runSize, buffer)){
+                Log::Info("[Ext2] Error %i writing blocks %u-%u", e, block, block + runLength - 1);
+                error = DiskWriteError;
                 break;
             }
+
+            size -= runSize;
+            buffer += runSize;
+            blockOffset = 0;
+            i += runLength;
         }
 
         if(size > 0){
@@ -1142,18 +1902,9 @@ namespace fs::Ext2{
     }
 
     void Ext2Volume::SyncInode(ext2_inode_t& e2inode, uint32_t inode){
-        uint8_t buf[part->parentDisk->blocksize];
-        uint64_t lba = InodeLBA(inode);
-
-        if(int e = part->Read(lba, part->parentDisk->blocksize, buf)){
-            Log::Error("[Ext2] Sync: Disk Error (%d) Reading Inode %d", e, inode);
-            error = DiskReadError;
-            return;
-        }
+        uint64_t location = InodeLocation(inode);
 
-        *(ext2_inode_t*)(buf + (ResolveInodeBlockGroupIndex(inode) * inodeSize) % part->parentDisk->blocksize) = e2inode;
-
-        if(int e = part->Write(lba, part->parentDisk->blocksize, buf)){
+        if(int e = PageCache::Write(part, location, sizeof(ext2_inode_t), &e2inode)){
             Log::Error("[Ext2] Sync: Disk Error (%d) Writing Inode %d", e, inode);
             error = DiskWriteError;
             return;
@@ -1164,6 +1915,22 @@ namespace fs::Ext2{
         SyncInode(node->e2inode, node->inode);
     }
 
+    int Ext2Volume::Sync(){
+        if(readOnly){
+            return 0;
+        }
+
+        FlushMetadata();
+
+        if(int e = PageCache::Sync(part)){
+            Log::Error("[Ext2] Sync: Disk Error (%d) writing back volume", e);
+            error = DiskWriteError;
+            return -EIO;
+        }
+
+        return 0;
+    }
+
     int Ext2Volume::Create(Ext2Node* node, DirectoryEntry* ent, uint32_t mode){
         if((node->flags & FS_NODE_TYPE) != FS_NODE_DIRECTORY) return -ENOTDIR;
 
@@ -1236,11 +2003,11 @@ namespace fs::Ext2{
         parentEnt.flags = EXT2_FT_DIR;
         node->e2inode.linkCount++;
 
-        List<DirectoryEntry> entries;
-        entries.add_back(currentEnt);
-        entries.add_back(parentEnt);
+        if(int e = InsertDir(dir, currentEnt)){
+            return e;
+        }
 
-        if(int e = InsertDir(dir, entries)){
+        if(int e = InsertDir(dir, parentEnt)){
             return e;
         }
 
@@ -1278,55 +2045,53 @@ namespace fs::Ext2{
             return -EINVAL;
         }
 
-        List<DirectoryEntry> entries;
-        if(int e = ListDir(node, entries)){
-            Log::Error("[Ext2] Link: Error listing directory!", ent->inode);
+        uint8_t* buffer = (uint8_t*)kmalloc(blocksize);
+        DirectoryLocation loc;
+        int e = FindEntry(node, ent->name, buffer, loc);
+        kfree(buffer);
+
+        if(!e){
+            Log::Error("[Ext2] Link: Directory entry %s already exists!", ent->name);
+            return -EEXIST;
+        } else if(e != -ENOENT){
+            Log::Error("[Ext2] Link: Error searching directory!");
             return e;
         }
 
-        for(DirectoryEntry& dirent : entries){
-            if(strcmp(dirent.name, ent->name) == 0){
-                Log::Error("[Ext2] Link: Directory entry %s already exists!", ent->name);
-                return -EEXIST;
-            }
+        if(int e = InsertDir(node, *ent)){
+            return e;
         }
 
-        entries.add_back(*ent);
-
         file->nlink++;
         file->e2inode.linkCount++;
 
         SyncNode(file);
 
-        return WriteDir(node, entries);
+        return 0;
     }
 
     int Ext2Volume::Unlink(Ext2Node* node, DirectoryEntry* ent, bool unlinkDirectories){
-        List<DirectoryEntry> entries;
-        if(int e = ListDir(node, entries)){
-            Log::Error("[Ext2] Unlink: Error listing directory!", ent->inode);
-            return e;
-        }
+        uint8_t* buffer = (uint8_t*)kmalloc(blocksize);
+        DirectoryLocation loc;
 
-        for(unsigned i = 0; i < entries.get_length(); i++) {
-            if(strcmp(entries[i].name, ent->name) == 0){
-                ent->inode = entries.remove_at(i).inode;
-                goto found;
+        if(int e = FindEntry(node, ent->name, buffer, loc)){
+            if(e == -ENOENT){
+                Log::Error("[Ext2] Unlink: Directory entry %s does not exist!", ent->name);
+            } else {
+                Log::Error("[Ext2] Unlink: Error searching directory!");
             }
-        }
-        
-        Log::Error("[Ext2] Unlink: Directory entry %s does not exist!", ent->name);
-        return -ENOENT;
 
-    found:
-        if(!ent->inode){
-            Log::Error("[Ext2] Unlink: Invalid inode %d", ent->inode);
-            return -EINVAL;
+            kfree(buffer);
+            return e;
         }
 
+        ext2_directory_entry_t* e2dirent = (ext2_directory_entry_t*)(buffer + loc.offset);
+        ent->inode = e2dirent->inode;
+
         if(Ext2Node* file = inodeCache.get(ent->inode)){
             if((file->flags & FS_NODE_TYPE) == FS_NODE_DIRECTORY){
                 if(!unlinkDirectories){
+                    kfree(buffer);
                     return -EISDIR;
                 }
             }
@@ -1342,11 +2107,13 @@ namespace fs::Ext2{
             ext2_inode_t e2inode;
             if(ReadInode(ent->inode, e2inode)){
                 Log::Error("[Ext2] Link: Error reading inode %d", ent->inode);
+                kfree(buffer);
                 return -1;
             }
 
             if((e2inode.mode & EXT2_S_IFMT) == EXT2_S_IFDIR){
                 if(!unlinkDirectories){
+                    kfree(buffer);
                     return -EISDIR;
                 }
             }
@@ -1360,7 +2127,22 @@ namespace fs::Ext2{
             }
         }
 
-        return WriteDir(node, entries);
+        // Only the block holding the entry is rewritten, the index stays valid as hashes do not move between blocks
+        if(loc.previous != loc.offset){
+            ((ext2_directory_entry_t*)(buffer + loc.previous))->recordLength += e2dirent->recordLength; // Merge into the previous record
+        } else {
+            e2dirent->inode = 0; // First record in the block, leave it empty
+        }
+
+        int e = WriteBlock(GetNodeBlock(node, loc.blockIndex), buffer);
+        kfree(buffer);
+
+        if(e){
+            error = DiskWriteError;
+            return -EIO;
+        }
+
+        return 0;
     }
 
     int Ext2Volume::Truncate(Ext2Node* node, off_t length){
@@ -1368,18 +2150,28 @@ namespace fs::Ext2{
             return -EINVAL;
         }
 
-        if(length > node->e2inode.blockCount * 512){ // We need to allocate blocks
+        if(static_cast<uint64_t>(length) > node->e2inode.blockCount * 512ULL){ // We need to allocate blocks
             uint64_t blocksNeeded = (length + blocksize - 1) / blocksize;
             uint64_t blocksAllocated = node->e2inode.blockCount / (blocksize / 512);
 
+            uint32_t goal = blocksAllocated ? GetNodeBlock(node, blocksAllocated - 1) + 1 : 0;
             while(blocksAllocated < blocksNeeded){
-                SetInodeBlock(blocksAllocated++, node->e2inode, AllocateBlock());
+                uint32_t block = AllocateBlock(goal);
+                SetNodeBlock(node, blocksAllocated++, block);
+                goal = block + 1;
             }
 
+            node->e2inode.blockCount = blocksNeeded * (blocksize / 512);
+        } else if(static_cast<uint64_t>(length) < node->e2inode.blockCount * 512ULL){ // Free the blocks past the new end
+            uint32_t blocksNeeded = (length + blocksize - 1) / blocksize;
+
+            FreeInodeBlocks(node->e2inode, blocksNeeded);
+            DropCachedBlocks(node, blocksNeeded);
+
             node->e2inode.blockCount = blocksNeeded * (blocksize / 512);
         }
 
-        node->size = node->e2inode.size = length; // TODO: Actually free blocks in inode if possible
+        SetNodeSize(node, length);
 
         SyncNode(node);
 
@@ -1400,12 +2192,22 @@ namespace fs::Ext2{
         delete node;
     }
 
+    Ext2Node::~Ext2Node(){
+        if(cachedBlocks){
+            kfree(cachedBlocks);
+        }
+    }
+
     Ext2Node::Ext2Node(Ext2Volume* vol, ext2_inode_t& ino, ino_t inode){
         this->vol = vol;
         volumeID = vol->volumeID;
+        cacheLookups = true; // Directories only change through fs::
 
         uid = ino.uid;
         size = ino.size;
+        if((ino.mode & EXT2_S_IFMT) == EXT2_S_IFREG){
+            size |= static_cast<uint64_t>(ino.sizeHigh) << 32; // Upper half of the size of regular files on large file volumes, 0 otherwise
+        }
         nlink = ino.linkCount;
         this->inode = inode;
 
@@ -1509,8 +2311,12 @@ namespace fs::Ext2{
         return ret;
     }
 
-    void Ext2Node::Sync(){
+    int Ext2Node::Sync(){
+        flock.AcquireRead();
         vol->SyncNode(this);
+        flock.ReleaseRead();
+
+        return vol->Sync(); // Dirty blocks are not tracked per file, so the whole volume is written back
     }
 
     void Ext2Node::Close(){
@@ -1,6 +1,8 @@
 #include <fs/fat32.h>
 
 #include <device.h>
+#include <fs/pagecache.h>
+#include <cpu.h>
 #include <logging.h>
 #include <memory.h>
 #include <string.h>
@@ -49,11 +51,15 @@ namespace fs::FAT32{
 
         clusterSizeBytes = bootRecord->bpb.sectorsPerCluster * part->parentDisk->blocksize;
 
+        uint32_t dataSectors = bootRecord->bpb.largeSectorCount - (bootRecord->bpb.reservedSectors + (bootRecord->ebr.sectorsPerFAT * bootRecord->bpb.fatCount));
+        clusterCount = dataSectors / bootRecord->bpb.sectorsPerCluster;
+
         fat32MountPoint.flags = FS_NODE_MOUNTPOINT | FS_NODE_DIRECTORY;
         fat32MountPoint.inode = bootRecord->ebr.rootClusterNum;
 
         fat32MountPoint.vol = this;
         fat32MountPoint.size = 0;
+        fat32MountPoint.cacheLookups = true; // Read only, directories never change
 
         mountPoint = &fat32MountPoint;
 
@@ -63,103 +69,194 @@ namespace fs::FAT32{
         
     }
 
-    List<uint32_t>* Fat32Volume::GetClusterChain(uint32_t cluster){
-        List<uint32_t>* list = new List<uint32_t>();
-
-        uint32_t* buf = (uint32_t*)kmalloc(4096);
+    ClusterChain* Fat32Volume::BuildClusterChain(uint32_t cluster){
+        ClusterChain* chain = new ClusterChain();
+        ClusterExtent extent = {0, cluster, 1};
+        uint32_t length = 1;
 
-        uint32_t lastBlock = 0xFFFFFFFF;
+        uint64_t fatOffset = static_cast<uint64_t>(bootRecord->bpb.reservedSectors) * part->parentDisk->blocksize;
+        CachedPage* page = nullptr;
 
-        do
-        {
-            list->add_back(cluster);
+        for(;;){
+            uint64_t location = fatOffset + static_cast<uint64_t>(cluster) * sizeof(uint32_t);
+            if(!page || page->index != location / PAGECACHE_PAGE_SIZE){
+                if(page){
+                    PageCache::ReleasePage(page);
+                }
 
-            uint32_t block = ((cluster * 4) / 4096);
-            uint32_t offset = cluster % (4096 / 4);
-    
-            if(block != lastBlock) {
-                if(part->Read(bootRecord->bpb.reservedSectors + block * (4096 / part->parentDisk->blocksize) /* Get Sector of Block */, 4096, buf)){
-                    delete list;
+                if(!(page = PageCache::GetPage(part, location / PAGECACHE_PAGE_SIZE))){
+                    Log::Warning("[FAT32] Error reading FAT (cluster %u)", cluster);
+                    delete chain;
                     return nullptr;
                 }
+            }
 
-                lastBlock = block;
+            cluster = *reinterpret_cast<uint32_t*>(page->data + location % PAGECACHE_PAGE_SIZE) & 0x0FFFFFFF;
+            if(cluster < 2 || cluster >= 0x0FFFFFF7 || length > clusterCount){ // End of chain, bad cluster or a loop
+                break;
             }
-    
-            cluster = buf[offset] & 0x0FFFFFFF;
-    
-        } while(cluster && (cluster & 0x0FFFFFFF) < 0x0FFFFFF8);
-    
-        return list;
-    }
-    
-    void* Fat32Volume::ReadClusterChain(uint32_t cluster, int* clusterCount, size_t max){
-        uint32_t maxCluster = (max / (bootRecord->bpb.sectorsPerCluster * part->parentDisk->blocksize)) + 1;
-        List<uint32_t>* clusterChain = GetClusterChain(cluster);
 
-        if(!clusterChain) return nullptr;
+            if(cluster == extent.cluster + extent.count){
+                extent.count++;
+            } else {
+                chain->extents.add_back(extent);
+                extent = {length, cluster, 1};
+            }
+
+            length++;
+        }
+
+        if(page){
+            PageCache::ReleasePage(page);
+        }
 
-        uint8_t* buf = reinterpret_cast<uint8_t*>(kmalloc(clusterChain->get_length() * clusterSizeBytes));
-        void* _buf = buf;
+        chain->extents.add_back(extent);
+        chain->length = length;
+        return chain;
+    }
 
-        for(unsigned i = 0; i < clusterChain->get_length() && maxCluster; i++){
-            part->Read(ClusterToLBA(clusterChain->get_at(i)), clusterSizeBytes, buf);
+    ClusterChain* Fat32Volume::GetClusterChain(Fat32Node* node){
+        if(node->chain){
+            return node->chain;
+        }
 
-            buf += clusterSizeBytes;
+        ClusterChain* chain = BuildClusterChain(node->inode);
+        if(!chain){
+            return nullptr;
         }
 
-        if(clusterCount)
-            *clusterCount = clusterChain->get_length();
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&node->chainLock);
+        ClusterChain* existing = node->chain;
+        if(!existing){
+            node->chain = chain;
+        }
+        releaseLock(&node->chainLock);
+        if(intsEnabled) asm("sti");
 
-        delete clusterChain;
+        if(existing){
+            delete chain; // Built by someone else in the meantime
+            return existing;
+        }
 
-        return _buf;
+        return chain;
     }
 
-    void* Fat32Volume::ReadClusterChain(uint32_t cluster, int* clusterCount){
-        if(cluster == 0) cluster = bootRecord->ebr.rootClusterNum;
-        List<uint32_t>* clusterChain = GetClusterChain(cluster);
+    ssize_t Fat32Volume::ReadChain(ClusterChain* chain, uint64_t offset, size_t size, uint8_t* buffer){
+        uint32_t index = offset / clusterSizeBytes;
+        size_t clusterOffset = offset % clusterSizeBytes;
+
+        // Find the extent holding the first cluster
+        unsigned low = 0;
+        unsigned high = chain->extents.get_length();
+        while(high - low > 1){
+            unsigned mid = (low + high) / 2;
+            if(chain->extents[mid].index <= index){
+                low = mid;
+            } else {
+                high = mid;
+            }
+        }
 
-        if(!clusterChain) return nullptr;
+        size_t read = 0;
+        for(unsigned i = low; i < chain->extents.get_length() && read < size; i++){
+            ClusterExtent& extent = chain->extents[i];
+            if(index >= extent.index + extent.count){
+                continue;
+            }
 
-        uint8_t* buf = reinterpret_cast<uint8_t*>(kmalloc(clusterChain->get_length() * clusterSizeBytes));
-        void* _buf = buf;
+            // Read as much of the extent as is needed in one go
+            size_t count = static_cast<size_t>(extent.index + extent.count - index) * clusterSizeBytes - clusterOffset;
+            if(count > size - read){
+                count = size - read;
+            }
 
-        for(unsigned i = 0; i < clusterChain->get_length(); i++){
-            part->Read(ClusterToLBA(clusterChain->get_at(i)), clusterSizeBytes, buf);
+            uint64_t location = ClusterToLBA(extent.cluster + (index - extent.index)) * part->parentDisk->blocksize + clusterOffset;
+            if(int e = PageCache::Read(part, location, count, buffer + read)){
+                Log::Warning("[FAT32] Disk error (%d) reading cluster %u", e, extent.cluster + (index - extent.index));
+                return -EIO;
+            }
 
-            buf += clusterSizeBytes;
+            read += count;
+            index = extent.index + extent.count;
+            clusterOffset = 0;
         }
 
-        if(clusterCount)
-            *clusterCount = clusterChain->get_length();
+        return read;
+    }
+
+    int Fat32Volume::NextDirectoryEntry(ClusterChain* chain, DirectoryCursor& cursor, fat_entry_t& entry, char* name, fat_entry_t* clusterBuffer, uint32_t& clusterIndex){
+        uint32_t entriesPerCluster = clusterSizeBytes / sizeof(fat_entry_t);
+
+        fat_lfn_entry_t lfnEntries[maxLfnEntries]; // Copied as they may sit in the previous cluster
+        unsigned lfnCount = 0;
+
+        for(; cursor.position < chain->length * entriesPerCluster; cursor.position++){
+            uint32_t index = cursor.position / entriesPerCluster;
+            if(index != clusterIndex){
+                if(ReadChain(chain, static_cast<uint64_t>(index) * clusterSizeBytes, clusterSizeBytes, reinterpret_cast<uint8_t*>(clusterBuffer)) != clusterSizeBytes){
+                    clusterIndex = UINT32_MAX;
+                    return -EIO;
+                }
+                clusterIndex = index;
+            }
 
-        delete clusterChain;
+            fat_entry_t* dirEntry = &clusterBuffer[cursor.position % entriesPerCluster];
+            if(dirEntry->filename[0] == 0) break; // No Directory Entry at index
+            else if (dirEntry->filename[0] == 0xE5) {
+                lfnCount = 0;
+                continue; // Unused Entry
+            }
+            else if (dirEntry->attributes == 0x0F){ // Long File Name Entry
+                if(lfnCount < maxLfnEntries){
+                    lfnEntries[lfnCount++] = *reinterpret_cast<fat_lfn_entry_t*>(dirEntry);
+                }
+            } else if (dirEntry->attributes & 0x08 /*Volume ID*/){
+                lfnCount = 0;
+                continue;
+            } else {
+                memset(name, 0, NAME_MAX);
+                if(lfnCount){
+                    fat_lfn_entry_t* lfnPointers[maxLfnEntries];
+                    for(unsigned i = 0; i < lfnCount; i++){
+                        lfnPointers[i] = &lfnEntries[lfnCount - i - 1]; // Closest to the file first
+                    }
+
+                    GetLongFilename(name, lfnPointers, lfnCount);
+                } else {
+                    strncpy(name, (char*)dirEntry->filename, 8);
+                    while(strchr(name, ' ')) *strchr(name, ' ') = 0; // Remove Spaces
+                    if(strchr((char*)dirEntry->ext, ' ') != (char*)dirEntry->ext){
+                        strncpy(name + strlen(name), ".", 1);
+                        strncpy(name + strlen(name), (char*)dirEntry->ext, 3);
+                    }
+                }
 
-        return _buf;
+                entry = *dirEntry;
+                cursor.entry++;
+                cursor.position++;
+                return 1;
+            }
+        }
+
+        return 0;
     }
 
     ssize_t Fat32Volume::Read(Fat32Node* node, size_t offset, size_t size, uint8_t *buffer){
         if(!node->inode || node->flags & FS_NODE_DIRECTORY) return -1;
 
-        int count;
-        void* _buf = ReadClusterChain(node->inode, &count, size);
+        if(offset >= node->size) return 0;
+        if(offset + size > node->size) size = node->size - offset;
 
-        if(static_cast<unsigned>(count) * bootRecord->bpb.sectorsPerCluster * part->parentDisk->blocksize < size) return 0;
+        ClusterChain* chain = GetClusterChain(node);
+        if(!chain) return -EIO;
 
-        memcpy(buffer, _buf, size);
-        return size;
+        return ReadChain(chain, offset, size, buffer);
     }
 
     ssize_t Fat32Volume::Write(Fat32Node* node, size_t offset, size_t size, uint8_t *buffer){
-        return -EROFS;
-
-        List<uint32_t>* clusters = GetClusterChain(node->inode);
-        if(offset + size > clusters->get_length() * bootRecord->bpb.sectorsPerCluster * part->parentDisk->blocksize){
-            // TODO: Allocate clusters
-            Log::Info("[FAT32] Allocating Clusters");
-            
-        }
+        return -EROFS; // TODO: Allocate clusters
     }
 
     void Fat32Volume::Open(Fat32Node* node, uint32_t flags){
@@ -171,136 +268,88 @@ namespace fs::FAT32{
     }
 
     int Fat32Volume::ReadDir(Fat32Node* node, DirectoryEntry* dirent, uint32_t index){
-        unsigned lfnCount = 0;
-        unsigned entryCount = 0;
-
-        uint32_t cluster = node->inode;
-        int clusterCount = 0;
-        
-        fat_entry_t* dirEntries = (fat_entry_t*)ReadClusterChain(cluster, &clusterCount);
-
-        fat_entry_t* dirEntry;
-        int dirEntryIndex = -1;
-
-        fat_lfn_entry_t** lfnEntries;
-
-        for(unsigned i = 0; i < static_cast<unsigned>(clusterCount) * clusterSizeBytes; i++){
-            if(dirEntries[i].filename[0] == 0) return -1; // No Directory Entry at index
-            else if (dirEntries[i].filename[0] == 0xE5) {
-                lfnCount = 0;
-                continue; // Unused Entry
-            }
-            else if (dirEntries[i].attributes == 0x0F) lfnCount++; // Long File Name Entry
-            else if (dirEntries[i].attributes & 0x08 /*Volume ID*/){
-                lfnCount = 0;
-                continue;
-            } else {
-                if(entryCount == index){
-                    dirEntry = &dirEntries[i];
-                    dirEntryIndex = i;
-                    break;
-                }
-
-                entryCount++;
-                lfnCount = 0;
-            }
+        ClusterChain* chain = GetClusterChain(node);
+        if(!chain){
+            return -EIO;
         }
 
-        if(dirEntryIndex == -1){
-            return 0;
+        // Entries are asked for in order when listing a directory, carry on from the last one if we can
+        DirectoryCursor cursor;
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&node->chainLock);
+        if(node->readDirCursor.entry <= index){
+            cursor = node->readDirCursor;
         }
+        releaseLock(&node->chainLock);
+        if(intsEnabled) asm("sti");
 
-        lfnEntries = (fat_lfn_entry_t**)kmalloc(sizeof(fat_lfn_entry_t*) * lfnCount);
+        fat_entry_t* clusterBuffer = reinterpret_cast<fat_entry_t*>(kmalloc(clusterSizeBytes));
+        uint32_t clusterIndex = UINT32_MAX;
 
-        for(unsigned i = 0; i < lfnCount; i++){
-            fat_lfn_entry_t* lfnEntry = (fat_lfn_entry_t*)(&dirEntries[dirEntryIndex -  i - 1]);
+        fat_entry_t entry;
+        int ret;
+        while((ret = NextDirectoryEntry(chain, cursor, entry, dirent->name, clusterBuffer, clusterIndex)) > 0 && cursor.entry <= index);
 
-            lfnEntries[i] = lfnEntry; 
+        kfree(clusterBuffer);
+        if(ret <= 0){
+            return ret;
         }
 
-        if(lfnCount){
-            GetLongFilename(dirent->name, lfnEntries, lfnCount);
-        } else {
-            strncpy(dirent->name, (char*)dirEntry->filename, 8);
-            while(strchr(dirent->name, ' ')) *strchr(dirent->name, ' ') = 0; // Remove Spaces
-            if(strchr((char*)dirEntry->ext, ' ') != (char*)dirEntry->ext){
-                strncpy(dirent->name + strlen(dirent->name), ".", 1);
-                strncpy(dirent->name + strlen(dirent->name), (char*)dirEntry->ext, 3);
-            }
-        }
+        intsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&node->chainLock);
+        node->readDirCursor = cursor;
+        releaseLock(&node->chainLock);
+        if(intsEnabled) asm("sti");
 
-        if(dirEntry->attributes & FAT_ATTR_DIRECTORY) dirent->flags = FS_NODE_DIRECTORY;
+        if(entry.attributes & FAT_ATTR_DIRECTORY) dirent->flags = FS_NODE_DIRECTORY;
         else dirent->flags = FS_NODE_FILE;
 
         return 1;
     }
 
     FsNode* Fat32Volume::FindDir(Fat32Node* node, char* name){
-        unsigned lfnCount = 0;
-
-        uint32_t cluster = node->inode;
-        int clusterCount = 0;
-        
-        fat_entry_t* dirEntries = (fat_entry_t*)ReadClusterChain(cluster, &clusterCount);
-
-        List<int> foundEntries;
-        List<int> foundEntriesLfnCount;
-
-        fat_lfn_entry_t** lfnEntries;
-        Fat32Node* _node = nullptr;
+        ClusterChain* chain = GetClusterChain(node);
+        if(!chain){
+            return nullptr;
+        }
 
-        for(unsigned i = 0; i < static_cast<unsigned>(clusterCount) * clusterSizeBytes; i++){
-            if(dirEntries[i].filename[0] == 0) return nullptr; // No Directory Entry at index
-            else if (dirEntries[i].filename[0] == 0xE5) {
-                lfnCount = 0;
-                continue; // Unused Entry
+        fat_entry_t* clusterBuffer = reinterpret_cast<fat_entry_t*>(kmalloc(clusterSizeBytes));
+        uint32_t clusterIndex = UINT32_MAX;
+        char* _name = (char*)kmalloc(NAME_MAX);
+
+        // Stops at the match, so only the clusters up to it are read
+        DirectoryCursor cursor;
+        fat_entry_t entry;
+        bool found = false;
+        while(NextDirectoryEntry(chain, cursor, entry, _name, clusterBuffer, clusterIndex) > 0){
+            if(strcmp(_name, name) == 0){
+                found = true;
+                break;
             }
-            else if (dirEntries[i].attributes == 0x0F) lfnCount++; // Long File Name Entry
-            else if (dirEntries[i].attributes & 0x08 /*Volume ID*/){
-                lfnCount = 0;
-                continue;
-            } else {
-                char* _name = (char*)kmalloc(128);
-                if(lfnCount){
-                    lfnEntries = (fat_lfn_entry_t**)kmalloc(sizeof(fat_lfn_entry_t*) * lfnCount);
-                    
-                    for(unsigned k = 0; k < lfnCount; k++){
-                        fat_lfn_entry_t* lfnEntry = (fat_lfn_entry_t*)(&dirEntries[i -  k - 1]);
-
-                        lfnEntries[k] = lfnEntry; 
-                    }
+        }
 
-                    GetLongFilename(_name, lfnEntries, lfnCount);
+        kfree(_name);
+        kfree(clusterBuffer);
 
-                    kfree(lfnEntries);
-                } else {
-                    strncpy(_name, (char*)dirEntries[i].filename, 8);
-                    while(strchr(_name, ' ')) *strchr(_name, ' ') = 0; // Remove Spaces
-                    if(strchr((char*)dirEntries[i].ext, ' ') != (char*)dirEntries[i].ext){
-                        strncpy(_name + strlen(_name), ".", 1);
-                        strncpy(_name + strlen(_name), (char*)dirEntries[i].ext, 3);
-                    }
-                }
-
-                if(strcmp(_name, name) == 0){
-                    uint64_t clusterNum = (((uint32_t)dirEntries[i].highClusterNum) << 16) | dirEntries[i].lowClusterNum;
-                    if(clusterNum == bootRecord->ebr.rootClusterNum || clusterNum == 0) 
-                        return mountPoint; // Root Directory
-                    _node = new Fat32Node();
-                    _node->size = dirEntries[i].fileSize;
-                    _node->inode = clusterNum;
-                    if(dirEntries[i].attributes & FAT_ATTR_DIRECTORY) _node->flags = FS_NODE_DIRECTORY;
-                    else _node->flags = FS_NODE_FILE;
-                    break;
-                }
-                lfnCount = 0;
-            }
+        if(!found){
+            return nullptr;
         }
 
-        if(_node){
-            _node->vol = this;
+        uint64_t clusterNum = (((uint32_t)entry.highClusterNum) << 16) | entry.lowClusterNum;
+        if(clusterNum == bootRecord->ebr.rootClusterNum || clusterNum == 0){
+            return mountPoint; // Root Directory
         }
 
+        Fat32Node* _node = new Fat32Node();
+        _node->size = entry.fileSize;
+        _node->inode = clusterNum;
+        _node->cacheLookups = true;
+        if(entry.attributes & FAT_ATTR_DIRECTORY) _node->flags = FS_NODE_DIRECTORY;
+        else _node->flags = FS_NODE_FILE;
+        _node->vol = this;
+
         return _node;
     }
 
@@ -1,6 +1,8 @@
 #include <fs/filesystem.h>
 
 #include <fs/fsvolume.h>
+#include <fs/pagecache.h>
+#include <fs/dentrycache.h>
 #include <logging.h>
 #include <errno.h>
 
@@ -372,7 +374,12 @@ namespace fs{
 
 		if((node->flags & FS_NODE_TYPE) == FS_NODE_SYMLINK) return Write(node->link, offset, size, buffer);
 
-        return node->Write(offset,size,buffer);
+        ssize_t written = node->Write(offset,size,buffer);
+		if(written > 0){
+			PageCache::UpdateFilePages(node, offset, written, buffer); // Keep memory mappings of the file coherent
+		}
+
+		return written;
     }
 
     fs_fd_t* Open(FsNode* node, uint32_t flags){
@@ -396,18 +403,41 @@ namespace fs{
         return node->Open(flags);
     }
 	
+	// Every change to a directory goes through here so the dentry cache can drop the name
+    int Create(FsNode* dir, DirectoryEntry* ent, uint32_t mode){
+		assert(dir);
+		assert(ent);
+
+		int ret = dir->Create(ent, mode);
+		DentryCache::Invalidate(dir, ent->name);
+		return ret;
+	}
+
+    int CreateDirectory(FsNode* dir, DirectoryEntry* ent, uint32_t mode){
+		assert(dir);
+		assert(ent);
+
+		int ret = dir->CreateDirectory(ent, mode);
+		DentryCache::Invalidate(dir, ent->name);
+		return ret;
+	}
+
     int Link(FsNode* dir, FsNode* link, DirectoryEntry* ent){
 		assert(dir);
 		assert(link);
 
-		return dir->Link(link, ent);
+		int ret = dir->Link(link, ent);
+		DentryCache::Invalidate(dir, ent->name);
+		return ret;
 	}
 
     int Unlink(FsNode* dir, DirectoryEntry* ent, bool unlinkDirectories){
 		assert(dir);
 		assert(ent);
 
-		return dir->Unlink(ent, unlinkDirectories);
+		int ret = dir->Unlink(ent, unlinkDirectories);
+		DentryCache::Invalidate(dir, ent->name);
+		return ret;
 	}
 
     void Close(FsNode* node){
@@ -435,8 +465,20 @@ namespace fs{
 		assert(node);
 
 		if((node->flags & FS_NODE_TYPE) == FS_NODE_SYMLINK) return FindDir(node->link, name);
-            
-		return node->FindDir(name);
+
+		if(!node->cacheLookups){
+			return node->FindDir(name);
+		}
+
+		FsNode* result;
+		uint64_t generation;
+		if(DentryCache::Lookup(node, name, result, generation)){
+			return result;
+		}
+
+		result = node->FindDir(name);
+		DentryCache::Insert(node, name, result, generation);
+		return result;
     }
 	
     ssize_t Read(fs_fd_t* handle, size_t size, uint8_t *buffer){
@@ -530,23 +572,23 @@ namespace fs{
 			assert(oldpathParent); // If this is null something went horribly wrong
 
 			if(newnode){
-				if(auto e = newpathParent->Unlink(&newpathDirent)){
+				if(auto e = fs::Unlink(newpathParent, &newpathDirent)){
 					return e; // Unlink error
 				}
 			}
 
-			if(auto e = newpathParent->Link(oldnode, &newpathDirent)){
+			if(auto e = fs::Link(newpathParent, oldnode, &newpathDirent)){
 				return e; // Link error
 			}
 			
-			if(auto e = oldpathParent->Unlink(&oldpathDirent)){
+			if(auto e = fs::Unlink(oldpathParent, &oldpathDirent)){
 				return e; // Unlink error
 			}
 		} else if((oldnode->flags & FS_NODE_TYPE) != FS_NODE_SYMLINK) { // Aight we have to copy it
 			FsNode* oldpathParent = fs::ResolveParent(oldpath, olddir);
 			assert(oldpathParent); // If this is null something went horribly wrong
 
-			if(auto e = newpathParent->Create(&newpathDirent, 0)){
+			if(auto e = fs::Create(newpathParent, &newpathDirent, 0)){
 				return e; // Create error
 			}
 
@@ -570,7 +612,7 @@ namespace fs{
 				return wret;
 			}
 			
-			if(auto e = oldpathParent->Unlink(&oldpathDirent)){
+			if(auto e = fs::Unlink(oldpathParent, &oldpathDirent)){
 				return e; // Unlink error
 			}
 		} else {
@@ -1,10 +1,13 @@
 #include <fs/filesystem.h>
+#include <fs/pagecache.h>
+#include <fs/dentrycache.h>
 
 #include <errno.h>
 #include <logging.h>
 
 FsNode::~FsNode(){
-    
+    PageCache::InvalidateFile(this);
+    DentryCache::InvalidateNode(this);
 }
 
 ssize_t FsNode::Read(size_t, size_t, uint8_t *){
@@ -82,6 +85,6 @@ void FsNode::Unwatch(FilesystemWatcher& watcher){
 }
 
 
-void FsNode::Sync(){
-    
+int FsNode::Sync(){
+    return 0;
 }
\ No newline at end of file
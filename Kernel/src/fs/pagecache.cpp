@@ -0,0 +1,836 @@
+#include <fs/pagecache.h>
+
+#include <blockqueue.h>
+#include <physicalallocator.h>
+#include <paging.h>
+#include <scheduler.h>
+#include <memory.h>
+#include <slab.h>
+#include <hash.h>
+#include <spin.h>
+#include <cpu.h>
+#include <string.h>
+#include <logging.h>
+
+// A thread waiting for a page to load, lives on the stack of the thread
+struct PageWaiter : public Scheduler::ThreadBlocker {
+    thread_t* thread = nullptr;
+    PageWaiter* next = nullptr;
+
+    // The cache lock is held whenever these are called
+    void Block(thread_t* th) final { thread = th; }
+    void Remove(thread_t*) final {} // Stays on the list until the page has loaded, see WaitForPage
+};
+
+namespace PageCache{
+    struct PageKey {
+        const void* owner; // Device or file
+        uint64_t index;
+
+        inline bool operator==(const PageKey& other) const {
+            return owner == other.owner && index == other.index;
+        }
+    };
+
+    inline unsigned hash(const PageKey& key){
+        return ::hash(static_cast<unsigned>(reinterpret_cast<uintptr_t>(key.owner) >> 4) ^ ::hash(static_cast<unsigned>(key.index ^ (key.index >> 32))));
+    }
+
+    ObjectCache<CachedPage> pageStructCache = ObjectCache<CachedPage>("cached-page");
+
+    lock_t cacheLock = 0; // Only ever held with interrupts disabled
+    HashMap<PageKey, CachedPage*>* pages = nullptr;
+    CachedPage* clockHand = nullptr; // Circular list of every cached page
+    CachedPage* spare = nullptr; // Pages out of the cache, linked through next. physical is 0 if the frame was reclaimed
+    unsigned long pageCount = 0;
+    unsigned long filePageCount = 0;
+
+    unsigned long maxPages = 0;
+    uint64_t lowWatermark = 0; // Pages are evicted rather than allocated below this many free blocks
+
+    inline bool AcquireCacheLock(){
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&cacheLock);
+        return intsEnabled;
+    }
+
+    inline void ReleaseCacheLock(bool intsEnabled){
+        releaseLock(&cacheLock);
+        if(intsEnabled) asm("sti");
+    }
+
+    inline CachedPage* Lookup(const void* owner, uint64_t index){
+        return pages->get({owner, index});
+    }
+
+    inline const void* Owner(CachedPage* page){
+        return page->node ? static_cast<const void*>(page->node) : static_cast<const void*>(page->device);
+    }
+
+    int SyncPages(PartitionDevice* device, uint64_t first, uint64_t last, bool files);
+
+    // Insert behind the hand so a new page is the last the hand reaches
+    void Insert(CachedPage* page){
+        pages->insert({Owner(page), page->index}, page);
+
+        if(!clockHand){
+            page->next = page->prev = page;
+            clockHand = page;
+        } else {
+            page->next = clockHand;
+            page->prev = clockHand->prev;
+            clockHand->prev->next = page;
+            clockHand->prev = page;
+        }
+
+        pageCount++;
+        if(page->node){
+            filePageCount++;
+        }
+    }
+
+    void Remove(CachedPage* page){
+        pages->remove({Owner(page), page->index});
+
+        if(page->next == page){
+            clockHand = nullptr;
+        } else {
+            page->prev->next = page->next;
+            page->next->prev = page->prev;
+
+            if(clockHand == page){
+                clockHand = page->next;
+            }
+        }
+
+        page->next = page->prev = nullptr;
+        pageCount--;
+        if(page->node){
+            filePageCount--;
+        }
+    }
+
+    // Wake every thread waiting for the page to load, the cache lock must be held
+    inline void WakeWaiters(CachedPage* page){
+        while(PageWaiter* waiter = page->waiters){
+            page->waiters = waiter->next;
+            Scheduler::UnblockThread(waiter->thread);
+        }
+    }
+
+    inline void PutSpare(CachedPage* page){
+        page->next = spare;
+        spare = page;
+    }
+
+    // Put a page that is out of the cache back on the spare list
+    // If its frame is mapped by a process the process is left with the frame
+    void Discard(CachedPage* page){
+        if(page->physical && Memory::IsPhysicalMemoryBlockShared(page->physical)){
+            Memory::FreePhysicalMemoryBlock(page->physical); // Drop our reference
+            page->physical = 0;
+        }
+
+        PutSpare(page);
+    }
+
+    inline void Evict(CachedPage* page){
+        Remove(page);
+        Discard(page);
+    }
+
+    // Sweep the clock hand until it finds a clean, unreferenced page that has not been accessed since it last passed
+    // Returns nullptr if there is none
+    CachedPage* TakeVictim(){
+        for(unsigned long i = 0; clockHand && i < pageCount * 2; i++){
+            CachedPage* page = clockHand;
+            clockHand = clockHand->next;
+
+            if(page->refCount || page->dirty || page->state != PageUptodate){
+                continue;
+            }
+
+            if(page->node && Memory::IsPhysicalMemoryBlockShared(page->physical)){
+                continue; // Mapped into a process
+            }
+
+            if(page->referenced){
+                page->referenced = false; // Second chance
+                continue;
+            }
+
+            Remove(page);
+            return page;
+        }
+
+        return nullptr;
+    }
+
+    // Get a page out of the cache with a frame mapped to it, evicting one if the cache is full or memory is low
+    CachedPage* AllocatePage(){
+        CachedPage* page = nullptr;
+        for(int attempt = 0; !page; attempt++){
+            bool intsEnabled = AcquireCacheLock();
+            bool full = pageCount >= maxPages;
+            if(full || Memory::FreePhysicalBlocks() < lowWatermark){
+                page = TakeVictim();
+            }
+
+            if(!page && spare && !(full && !attempt)){
+                page = spare;
+                spare = spare->next;
+            }
+            ReleaseCacheLock(intsEnabled);
+
+            if(!page && full && !attempt){
+                SyncPages(nullptr, 0, UINT64_MAX, false); // Every page is dirty or in use, write back and try again
+                continue;
+            }
+
+            if(!page){
+                page = pageStructCache.New();
+            }
+        }
+
+        if(!page->physical){
+            bool remap = page->data; // Other CPUs may have the mapping of the reclaimed frame cached
+            if(!page->data){
+                page->data = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(1));
+            }
+
+            page->physical = Memory::AllocatePhysicalMemoryBlock();
+            Memory::KernelMapVirtualMemory4K(page->physical, reinterpret_cast<uintptr_t>(page->data), 1);
+
+            if(remap){
+                Memory::FlushOtherTLBs(CheckInterrupts());
+            }
+        }
+
+        page->device = nullptr;
+        page->node = nullptr;
+        page->state = PageLoading;
+        page->refCount = 1;
+        page->referenced = true;
+        page->dirty = false;
+        page->waiters = nullptr;
+        page->next = page->prev = nullptr;
+        return page;
+    }
+
+    // Read in count consecutive pages of the same device in one request
+    int ReadPages(CachedPage** pages, unsigned count){
+        PartitionDevice* device = pages[0]->device;
+        uint64_t offset = pages[0]->index * PAGECACHE_PAGE_SIZE;
+        uint64_t size = count * PAGECACHE_PAGE_SIZE;
+        if(offset + size > device->GetSize()){
+            size = device->GetSize() - offset; // Last page of the device is partial
+        }
+
+        uint8_t* buffer = count > 1 ? reinterpret_cast<uint8_t*>(kmalloc(count * PAGECACHE_PAGE_SIZE)) : pages[0]->data;
+        int error = device->Read(offset / device->parentDisk->blocksize, size, buffer);
+
+        if(!error){
+            memset(buffer + size, 0, count * PAGECACHE_PAGE_SIZE - size);
+
+            for(unsigned i = 0; count > 1 && i < count; i++){
+                memcpy(pages[i]->data, buffer + i * PAGECACHE_PAGE_SIZE, PAGECACHE_PAGE_SIZE);
+            }
+        }
+
+        if(count > 1){
+            kfree(buffer);
+        }
+
+        return error;
+    }
+
+    // Start writing back count consecutive pages of the same device in one request, held in plug
+    // Pages of files are written straight away through the filesystem, request is complete on return
+    // If request.buffer is not the data of the first page it was allocated and has to be freed once complete
+    void WritePages(CachedPage** pages, unsigned count, BlockRequest& request, BlockPlug& plug){
+        if(FsNode* node = pages[0]->node){
+            request.buffer = pages[0]->data;
+            request.status = 0;
+            request.done = true;
+
+            for(unsigned i = 0; i < count; i++){
+                uint64_t offset = pages[i]->index * PAGECACHE_PAGE_SIZE;
+                if(offset >= node->size){
+                    break; // The file has been truncated
+                }
+
+                size_t size = node->size - offset;
+                if(size > PAGECACHE_PAGE_SIZE){
+                    size = PAGECACHE_PAGE_SIZE;
+                }
+
+                if(node->Write(offset, size, pages[i]->data) < 0){
+                    request.status = 1;
+                    break;
+                }
+            }
+
+            return;
+        }
+
+        PartitionDevice* device = pages[0]->device;
+        uint64_t offset = pages[0]->index * PAGECACHE_PAGE_SIZE;
+        uint64_t size = count * PAGECACHE_PAGE_SIZE;
+        if(offset + size > device->GetSize()){
+            size = device->GetSize() - offset;
+        }
+
+        uint8_t* buffer = pages[0]->data;
+        if(count > 1){
+            buffer = reinterpret_cast<uint8_t*>(kmalloc(count * PAGECACHE_PAGE_SIZE));
+            for(unsigned i = 0; i < count; i++){
+                memcpy(buffer + i * PAGECACHE_PAGE_SIZE, pages[i]->data, PAGECACHE_PAGE_SIZE);
+            }
+        }
+
+        request = BlockRequest(offset / device->parentDisk->blocksize, size, buffer, true);
+        device->Submit(&request, &plug);
+    }
+
+    CachedPage* WaitForPage(CachedPage* page){
+        if(__atomic_load_n(&page->state, __ATOMIC_ACQUIRE) == PageLoading){
+            PageWaiter waiter;
+
+            bool intsEnabled = AcquireCacheLock();
+            if(page->state == PageLoading){
+                waiter.next = page->waiters;
+                page->waiters = &waiter;
+
+                // The loader takes the waiter off the list when it changes the state, both under the cache lock
+                do {
+                    Scheduler::BlockCurrentThreadLocked(waiter, cacheLock);
+                    AcquireCacheLock();
+                } while(page->state == PageLoading);
+            }
+            ReleaseCacheLock(intsEnabled);
+        }
+
+        if(page->state == PageError){
+            ReleasePage(page);
+            return nullptr;
+        }
+
+        return page;
+    }
+
+    // If read is not set a missing page is zeroed rather than read in, for callers overwriting the whole page
+    // wanted is the amount of pages from index the caller is about to read, all of them are read in on a miss
+    CachedPage* GetPage(PartitionDevice* device, uint64_t index, bool read, uint64_t wanted){
+        uint64_t devicePages = (device->GetSize() + PAGECACHE_PAGE_SIZE - 1) / PAGECACHE_PAGE_SIZE;
+        if(index >= devicePages){
+            return nullptr;
+        }
+
+        bool intsEnabled = AcquireCacheLock();
+        CachedPage* page = Lookup(device, index);
+        if(page){
+            page->refCount++;
+            page->referenced = true;
+            ReleaseCacheLock(intsEnabled);
+
+            return WaitForPage(page);
+        }
+
+        // Double the readahead window each time a reader misses where the last window ended
+        unsigned window = 1;
+        if(read){
+            if(index == device->nextReadaheadPage && device->readaheadPages){
+                window = device->readaheadPages * 2;
+            }
+
+            if(window < wanted){
+                window = wanted;
+            }
+
+            if(window > PAGECACHE_MAX_READAHEAD){
+                window = PAGECACHE_MAX_READAHEAD;
+            }
+
+            if(window > devicePages - index){
+                window = devicePages - index;
+            }
+
+            device->readaheadPages = window;
+            device->nextReadaheadPage = index + window;
+        }
+        ReleaseCacheLock(intsEnabled);
+
+        CachedPage* newPages[PAGECACHE_MAX_READAHEAD];
+        for(unsigned i = 0; i < window; i++){
+            newPages[i] = AllocatePage();
+        }
+
+        unsigned count = 0;
+        intsEnabled = AcquireCacheLock();
+        if((page = Lookup(device, index))){ // Someone else read it in whilst the lock was dropped
+            page->refCount++;
+            page->referenced = true;
+        } else {
+            for(; count < window; count++){
+                if(count && Lookup(device, index + count)){
+                    break; // Stop the window at pages that are already cached
+                }
+
+                newPages[count]->device = device;
+                newPages[count]->index = index + count;
+                Insert(newPages[count]);
+            }
+
+            page = newPages[0];
+        }
+
+        for(unsigned i = count; i < window; i++){
+            PutSpare(newPages[i]);
+        }
+        ReleaseCacheLock(intsEnabled);
+
+        if(!count){
+            return WaitForPage(page);
+        }
+
+        int error = 0;
+        if(read){
+            error = ReadPages(newPages, count);
+        } else {
+            memset(page->data, 0, PAGECACHE_PAGE_SIZE);
+        }
+
+        intsEnabled = AcquireCacheLock();
+        for(unsigned i = 0; i < count; i++){
+            CachedPage* p = newPages[i];
+            if(error){
+                Remove(p);
+            }
+
+            __atomic_store_n(&p->state, error ? PageError : PageUptodate, __ATOMIC_RELEASE);
+            WakeWaiters(p);
+
+            if(i && !--p->refCount && error){ // Only the page asked for stays referenced
+                PutSpare(p);
+            }
+        }
+        ReleaseCacheLock(intsEnabled);
+
+        if(error){
+            ReleasePage(page);
+            return nullptr;
+        }
+
+        return page;
+    }
+
+    CachedPage* GetPage(PartitionDevice* device, uint64_t index){
+        return GetPage(device, index, true, 1);
+    }
+
+    void ReleasePage(CachedPage* page){
+        bool intsEnabled = AcquireCacheLock();
+        assert(page->refCount > 0);
+
+        if(!--page->refCount && page->state == PageError){
+            Discard(page);
+        }
+        ReleaseCacheLock(intsEnabled);
+    }
+
+    void MarkDirty(CachedPage* page){
+        bool intsEnabled = AcquireCacheLock();
+        page->dirty = true;
+        page->referenced = true;
+        ReleaseCacheLock(intsEnabled);
+    }
+
+    CachedPage* GetFilePage(FsNode* node, uint64_t index){
+        bool intsEnabled = AcquireCacheLock();
+        CachedPage* page = Lookup(node, index);
+        if(page){
+            page->refCount++;
+            page->referenced = true;
+            ReleaseCacheLock(intsEnabled);
+
+            return WaitForPage(page);
+        }
+        ReleaseCacheLock(intsEnabled);
+
+        CachedPage* newPage = AllocatePage();
+
+        intsEnabled = AcquireCacheLock();
+        if((page = Lookup(node, index))){ // Someone else read it in whilst the lock was dropped
+            page->refCount++;
+            page->referenced = true;
+            PutSpare(newPage);
+            ReleaseCacheLock(intsEnabled);
+
+            return WaitForPage(page);
+        }
+
+        page = newPage;
+        page->node = node;
+        page->index = index;
+        Insert(page);
+        ReleaseCacheLock(intsEnabled);
+
+        // Anything past the end of the file reads as zeroes
+        memset(page->data, 0, PAGECACHE_PAGE_SIZE);
+
+        bool error = false;
+        uint64_t offset = index * PAGECACHE_PAGE_SIZE;
+        if(offset < node->size){
+            size_t size = node->size - offset;
+            if(size > PAGECACHE_PAGE_SIZE){
+                size = PAGECACHE_PAGE_SIZE;
+            }
+
+            error = node->Read(offset, size, page->data) < 0;
+        }
+
+        intsEnabled = AcquireCacheLock();
+        if(error){
+            Remove(page);
+        }
+
+        __atomic_store_n(&page->state, error ? PageError : PageUptodate, __ATOMIC_RELEASE);
+        WakeWaiters(page);
+        ReleaseCacheLock(intsEnabled);
+
+        if(error){
+            ReleasePage(page);
+            return nullptr;
+        }
+
+        return page;
+    }
+
+    CachedPage* TryGetFilePage(FsNode* node, uint64_t index){
+        bool intsEnabled = AcquireCacheLock();
+        CachedPage* page = Lookup(node, index);
+        if(page && page->state == PageUptodate){
+            page->refCount++;
+            page->referenced = true;
+        } else {
+            page = nullptr;
+        }
+        ReleaseCacheLock(intsEnabled);
+
+        return page;
+    }
+
+    void UpdateFilePages(FsNode* node, uint64_t offset, size_t size, const void* buffer){
+        if(!filePageCount){
+            return; // Nothing is mapped, don't bother taking the lock
+        }
+
+        const uint8_t* in = reinterpret_cast<const uint8_t*>(buffer);
+        while(size){
+            size_t pageOffset = offset % PAGECACHE_PAGE_SIZE;
+            size_t count = PAGECACHE_PAGE_SIZE - pageOffset;
+            if(count > size){
+                count = size;
+            }
+
+            bool intsEnabled = AcquireCacheLock();
+            CachedPage* page = Lookup(node, offset / PAGECACHE_PAGE_SIZE);
+            if(page){
+                page->refCount++;
+            }
+            ReleaseCacheLock(intsEnabled);
+
+            if(page && (page = WaitForPage(page))){
+                memcpy(page->data + pageOffset, in, count);
+                ReleasePage(page);
+            }
+
+            in += count;
+            offset += count;
+            size -= count;
+        }
+    }
+
+    void InvalidateFile(FsNode* node){
+        bool intsEnabled = AcquireCacheLock();
+        CachedPage* page = clockHand;
+        for(unsigned long i = filePageCount ? pageCount : 0; i; i--){
+            CachedPage* next = page->next;
+            if(page->node == node){
+                if(page->refCount){
+                    Remove(page);
+                    page->state = PageError; // Discarded once the last reference is released
+                    WakeWaiters(page);
+                } else {
+                    Evict(page);
+                }
+            }
+
+            page = next;
+        }
+        ReleaseCacheLock(intsEnabled);
+    }
+
+    // Amount of pages from index (at most max and PAGECACHE_DIRECT_MAX) that are not cached
+    uint64_t UncachedPages(PartitionDevice* device, uint64_t index, uint64_t max){
+        if(max > PAGECACHE_DIRECT_MAX){
+            max = PAGECACHE_DIRECT_MAX;
+        }
+
+        uint64_t count = 0;
+        bool intsEnabled = AcquireCacheLock();
+        while(count < max && !Lookup(device, index + count)){
+            count++;
+        }
+        ReleaseCacheLock(intsEnabled);
+
+        return count;
+    }
+
+    int Read(PartitionDevice* device, uint64_t offset, size_t size, void* buffer){
+        if(offset + size > device->GetSize()){
+            return 2;
+        }
+
+        uint8_t* out = reinterpret_cast<uint8_t*>(buffer);
+        while(size){
+            size_t pageOffset = offset % PAGECACHE_PAGE_SIZE;
+            if(!pageOffset && size >= PAGECACHE_DIRECT_MIN * PAGECACHE_PAGE_SIZE){
+                uint64_t pages = UncachedPages(device, offset / PAGECACHE_PAGE_SIZE, size / PAGECACHE_PAGE_SIZE);
+                if(pages >= PAGECACHE_DIRECT_MIN){
+                    if(int e = device->Read(offset / device->parentDisk->blocksize, pages * PAGECACHE_PAGE_SIZE, out)){
+                        return e;
+                    }
+
+                    out += pages * PAGECACHE_PAGE_SIZE;
+                    offset += pages * PAGECACHE_PAGE_SIZE;
+                    size -= pages * PAGECACHE_PAGE_SIZE;
+                    continue;
+                }
+            }
+
+            size_t count = PAGECACHE_PAGE_SIZE - pageOffset;
+            if(count > size){
+                count = size;
+            }
+
+            CachedPage* page = GetPage(device, offset / PAGECACHE_PAGE_SIZE, true, (pageOffset + size + PAGECACHE_PAGE_SIZE - 1) / PAGECACHE_PAGE_SIZE);
+            if(!page){
+                return 1;
+            }
+
+            memcpy(out, page->data + pageOffset, count);
+            ReleasePage(page);
+
+            out += count;
+            offset += count;
+            size -= count;
+        }
+
+        return 0;
+    }
+
+    int Write(PartitionDevice* device, uint64_t offset, size_t size, const void* buffer){
+        if(offset + size > device->GetSize()){
+            return 2;
+        }
+
+        const uint8_t* in = reinterpret_cast<const uint8_t*>(buffer);
+        while(size){
+            size_t pageOffset = offset % PAGECACHE_PAGE_SIZE;
+            size_t count = PAGECACHE_PAGE_SIZE - pageOffset;
+            if(count > size){
+                count = size;
+            }
+
+            // No need to read in a page that is being entirely overwritten
+            CachedPage* page = GetPage(device, offset / PAGECACHE_PAGE_SIZE, count < PAGECACHE_PAGE_SIZE, 1);
+            if(!page){
+                return 1;
+            }
+
+            memcpy(page->data + pageOffset, in, count);
+            MarkDirty(page);
+            ReleasePage(page);
+
+            in += count;
+            offset += count;
+            size -= count;
+        }
+
+        return 0;
+    }
+
+    // Write back dirty pages from first to last (inclusive), file pages are only written back if files is set
+    // Small ranges are looked up directly, otherwise the whole clock list is scanned
+    int SyncPages(PartitionDevice* device, uint64_t first, uint64_t last, bool files){
+        bool scan = !device || last - first >= PAGECACHE_MAX_PAGES;
+        int error = 0;
+
+        CachedPage* batch[PAGECACHE_SYNC_BATCH];
+        for(;;){
+            unsigned count = 0;
+
+            bool intsEnabled = AcquireCacheLock();
+            if(scan){
+                CachedPage* page = clockHand;
+                for(unsigned long i = 0; i < pageCount && count < PAGECACHE_SYNC_BATCH; i++, page = page->next){
+                    if(!page->dirty || (page->node && !files)){
+                        continue;
+                    }
+
+                    if(!device || (page->device == device && page->index >= first && page->index <= last)){
+                        batch[count++] = page;
+                    }
+                }
+            } else {
+                for(; first <= last && count < PAGECACHE_SYNC_BATCH; first++){
+                    CachedPage* page = Lookup(device, first);
+                    if(page && page->dirty){
+                        batch[count++] = page;
+                    }
+                }
+            }
+
+            for(unsigned i = 0; i < count; i++){
+                batch[i]->refCount++;
+                batch[i]->dirty = false; // Anything written from here on dirties the page again
+            }
+            ReleaseCacheLock(intsEnabled);
+
+            if(!count){
+                break;
+            }
+
+            BlockRequest requests[PAGECACHE_SYNC_BATCH];
+            unsigned runStart[PAGECACHE_SYNC_BATCH + 1];
+            unsigned runCount = 0;
+            {
+                BlockPlug plug; // Every run is queued at once when this goes out of scope, to be sorted as one batch
+                for(unsigned i = 0; i < count;){
+                    unsigned run = 1; // Pages next to each other on the device are written together
+                    while(i + run < count && Owner(batch[i + run]) == Owner(batch[i]) && batch[i + run]->index == batch[i]->index + run){
+                        run++;
+                    }
+
+                    runStart[runCount] = i;
+                    WritePages(batch + i, run, requests[runCount++], plug);
+                    i += run;
+                }
+            }
+            runStart[runCount] = count;
+
+            for(unsigned r = 0; r < runCount; r++){
+                int e = requests[r].Wait();
+                if(requests[r].buffer != batch[runStart[r]]->data){
+                    kfree(requests[r].buffer);
+                }
+
+                for(unsigned j = runStart[r]; j < runStart[r + 1]; j++){
+                    if(e){
+                        MarkDirty(batch[j]); // Try again next time
+                    }
+
+                    ReleasePage(batch[j]);
+                }
+
+                if(e){
+                    error = e;
+                }
+            }
+
+            if(error){
+                break; // The failed pages are still dirty and would be picked up again
+            }
+        }
+
+        if(error){
+            Log::Warning("[PageCache] Failed to write back pages of %s", device ? device->GetName() : "devices");
+        }
+
+        return error;
+    }
+
+    int Sync(PartitionDevice* device){
+        return SyncPages(device, 0, UINT64_MAX, !device);
+    }
+
+    int SyncRange(PartitionDevice* device, uint64_t offset, size_t size){
+        if(!size){
+            return 0;
+        }
+
+        return SyncPages(device, offset / PAGECACHE_PAGE_SIZE, (offset + size - 1) / PAGECACHE_PAGE_SIZE, false);
+    }
+
+    void Invalidate(PartitionDevice* device){
+        Sync(device);
+
+        bool intsEnabled = AcquireCacheLock();
+        CachedPage* page = clockHand;
+        for(unsigned long i = pageCount; i; i--){
+            CachedPage* next = page->next;
+            if((!device || page->device == device) && !page->refCount && !page->dirty && page->state == PageUptodate){
+                Evict(page);
+            }
+
+            page = next;
+        }
+
+        if(device){
+            device->nextReadaheadPage = 0;
+            device->readaheadPages = 0;
+        }
+        ReleaseCacheLock(intsEnabled);
+    }
+
+    size_t Reclaim(size_t count){
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+        if(acquireTestLock(&cacheLock)){
+            if(intsEnabled) asm("sti");
+            return 0; // The allocation was made with the cache locked
+        }
+
+        // Only the frames are freed, page structures and their virtual pages are kept so that no locks are needed
+        size_t freed = 0;
+        for(CachedPage* page = spare; page && freed < count; page = page->next){
+            if(page->physical){
+                Memory::FreePhysicalMemoryBlock(page->physical);
+                page->physical = 0;
+                freed++;
+            }
+        }
+
+        while(freed < count){
+            CachedPage* page = TakeVictim();
+            if(!page){
+                break;
+            }
+
+            Memory::FreePhysicalMemoryBlock(page->physical);
+            page->physical = 0;
+            PutSpare(page);
+            freed++;
+        }
+
+        ReleaseCacheLock(intsEnabled);
+        return freed;
+    }
+
+    void Initialize(){
+        uint64_t freeBlocks = Memory::FreePhysicalBlocks();
+
+        maxPages = freeBlocks / 2;
+        if(maxPages > PAGECACHE_MAX_PAGES){
+            maxPages = PAGECACHE_MAX_PAGES;
+        }
+        lowWatermark = freeBlocks / 16;
+
+        pages = new HashMap<PageKey, CachedPage*>(maxPages); // Sized up front so the table never grows with the lock held
+        Memory::RegisterReclaimer(Reclaim);
+
+        Log::Info("[PageCache] Caching up to %u pages", maxPages);
+    }
+}
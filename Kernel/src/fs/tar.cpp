@@ -71,6 +71,7 @@ namespace fs::tar{
         n->flags = TarTypeToFilesystemFlags(header->ustar.type);
         n->vol = this;
         n->volumeID = volumeID;
+        n->cacheLookups = true; // The ramdisk never changes
 
         char* name = header->ustar.name;
         char* _name = strtok(header->ustar.name, "/");
@@ -138,6 +139,7 @@ namespace fs::tar{
         volumeNode->size = size;
         volumeNode->vol = this;
         volumeNode->parent = 0;
+        volumeNode->cacheLookups = true;
 
         mountPoint = volumeNode;
         strcpy(mountPointDirent.name, name);
@@ -0,0 +1,263 @@
+#include <futex.h>
+
+#include <scheduler.h>
+#include <paging.h>
+#include <timer.h>
+#include <cpu.h>
+#include <errno.h>
+
+#define FUTEX_HASH_BITS 8
+#define FUTEX_HASH_SIZE (1 << FUTEX_HASH_BITS)
+
+namespace Futex{
+    struct Key {
+        uintptr_t address; // Physical address for shared futexes
+        address_space_t* addressSpace; // nullptr for shared futexes
+
+        inline bool operator==(const Key& other) const {
+            return address == other.address && addressSpace == other.addressSpace;
+        }
+    };
+
+    struct Bucket;
+
+    // A thread waiting on a futex, lives on the stack of the waiting thread
+    struct Waiter : public Scheduler::ThreadBlocker {
+        Key key;
+        thread_t* thread;
+        Bucket* volatile bucket; // Bucket the waiter is queued on, nullptr once woken
+
+        Waiter* next = nullptr;
+        Waiter* prev = nullptr;
+
+        Waiter(const Key& key, thread_t* thread, Bucket* bucket) : key(key), thread(thread), bucket(bucket) {}
+
+        // The bucket lock is held whenever these are called
+        void Block(thread_t*) final;
+        void Remove(thread_t*) final;
+    };
+
+    struct Bucket {
+        lock_t lock = 0; // Only ever held with interrupts disabled
+        Waiter* first = nullptr;
+        Waiter* last = nullptr;
+
+        void Enqueue(Waiter* waiter){
+            waiter->next = nullptr;
+            waiter->prev = last;
+
+            if(last){
+                last->next = waiter;
+            } else {
+                first = waiter;
+            }
+            last = waiter;
+        }
+
+        void Dequeue(Waiter* waiter){
+            if(waiter->prev){
+                waiter->prev->next = waiter->next;
+            } else {
+                first = waiter->next;
+            }
+
+            if(waiter->next){
+                waiter->next->prev = waiter->prev;
+            } else {
+                last = waiter->prev;
+            }
+        }
+    };
+
+    Bucket buckets[FUTEX_HASH_SIZE];
+
+    void Waiter::Block(thread_t*){
+        bucket->Enqueue(this);
+    }
+
+    void Waiter::Remove(thread_t*){
+        if(bucket){
+            bucket->Dequeue(this);
+            bucket = nullptr;
+        }
+    }
+
+    inline Key GetKey(int* futex){
+        uintptr_t address = reinterpret_cast<uintptr_t>(futex);
+        address_space_t* addressSpace = GetCurrentThread()->parent->addressSpace;
+
+        uint64_t entry = Memory::GetPageEntry(address, addressSpace);
+        if((entry & PAGE_PRESENT) && (entry & PAGE_SHARED)){
+            return {(entry & PAGE_FRAME) | (address & (PAGE_SIZE_4K - 1)), nullptr};
+        }
+
+        return {address, addressSpace};
+    }
+
+    inline Bucket* GetBucket(const Key& key){
+        uint64_t hash = (key.address >> 2) ^ (reinterpret_cast<uintptr_t>(key.addressSpace) >> 4);
+        return &buckets[(hash * 0x9E3779B97F4A7C15ULL) >> (64 - FUTEX_HASH_BITS)];
+    }
+
+    // Take the waiter off its queue and wake it, the bucket lock must be held
+    inline void WakeWaiter(Bucket* bucket, Waiter* waiter){
+        bucket->Dequeue(waiter);
+        Scheduler::UnblockThread(waiter->thread);
+
+        // The waiter can return as soon as this is cleared, so it must be the last access
+        __atomic_store_n(&waiter->bucket, nullptr, __ATOMIC_RELEASE);
+    }
+
+    // Take the waiter off whichever queue it is on (it may have been requeued), returns false if it had already been woken
+    // Interrupts must be disabled
+    bool Unqueue(Waiter& waiter){
+        for(;;){
+            Bucket* bucket = __atomic_load_n(&waiter.bucket, __ATOMIC_ACQUIRE);
+            if(!bucket){
+                return false;
+            }
+
+            acquireLock(&bucket->lock);
+            if(bucket == waiter.bucket){
+                bucket->Dequeue(&waiter);
+                waiter.bucket = nullptr;
+
+                releaseLock(&bucket->lock);
+                return true;
+            }
+            releaseLock(&bucket->lock);
+        }
+    }
+
+    long Wait(int* futex, int expected, uint64_t deadline){
+        // Read the value before taking the bucket lock so any fault on the page is handled first
+        if(__atomic_load_n(futex, __ATOMIC_ACQUIRE) != expected){
+            return -EAGAIN;
+        } else if(deadline && deadline <= Timer::GetSystemUptimeNs()){
+            return -ETIMEDOUT;
+        }
+
+        Key key = GetKey(futex);
+        Bucket* bucket = GetBucket(key);
+        Waiter waiter(key, GetCurrentThread(), bucket);
+
+        asm("cli");
+        acquireLock(&bucket->lock);
+
+        // Wakers change the value before waking, so checking it under the bucket lock cannot miss a wake up
+        if(__atomic_load_n(futex, __ATOMIC_ACQUIRE) != expected){
+            releaseLock(&bucket->lock);
+            asm("sti");
+            return -EAGAIN;
+        }
+
+        bool timedOut = false;
+        if(deadline){
+            timedOut = Timer::BlockCurrentThreadUntilLocked(deadline, waiter, bucket->lock);
+        } else {
+            Scheduler::BlockCurrentThreadLocked(waiter, bucket->lock);
+        }
+
+        asm("cli");
+        bool queued = Unqueue(waiter);
+        asm("sti");
+
+        if(!queued){
+            return 0;
+        }
+
+        return timedOut ? -ETIMEDOUT : -EINTR;
+    }
+
+    long Wake(int* futex, int count){
+        if(count <= 0){
+            return 0;
+        }
+
+        Key key = GetKey(futex);
+        Bucket* bucket = GetBucket(key);
+
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&bucket->lock);
+
+        long woken = 0;
+        Waiter* waiter = bucket->first;
+        while(waiter && woken < count){
+            Waiter* next = waiter->next;
+            if(waiter->key == key){
+                WakeWaiter(bucket, waiter);
+                woken++;
+            }
+            waiter = next;
+        }
+
+        releaseLock(&bucket->lock);
+        if(intsEnabled) asm("sti");
+
+        return woken;
+    }
+
+    long Requeue(int* futex, int wakeCount, int requeueCount, int* target, bool compare, int expected){
+        if(compare && __atomic_load_n(futex, __ATOMIC_ACQUIRE) != expected){
+            return -EAGAIN;
+        }
+
+        Key key = GetKey(futex);
+        Key targetKey = GetKey(target);
+        Bucket* bucket = GetBucket(key);
+        Bucket* targetBucket = GetBucket(targetKey);
+
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+
+        // Always lock buckets in the same order
+        if(bucket < targetBucket){
+            acquireLock(&bucket->lock);
+            acquireLock(&targetBucket->lock);
+        } else if(bucket > targetBucket){
+            acquireLock(&targetBucket->lock);
+            acquireLock(&bucket->lock);
+        } else {
+            acquireLock(&bucket->lock);
+        }
+
+        long result = 0;
+        if(compare && __atomic_load_n(futex, __ATOMIC_ACQUIRE) != expected){
+            result = -EAGAIN;
+        } else {
+            int woken = 0;
+            int requeued = 0;
+
+            Waiter* waiter = bucket->first;
+            while(waiter && (woken < wakeCount || requeued < requeueCount)){
+                Waiter* next = waiter->next;
+                if(waiter->key == key){
+                    if(woken < wakeCount){
+                        WakeWaiter(bucket, waiter);
+                        woken++;
+                    } else {
+                        waiter->key = targetKey;
+                        if(targetBucket != bucket){ // Otherwise the waiter can stay where it is
+                            bucket->Dequeue(waiter);
+                            targetBucket->Enqueue(waiter);
+                            waiter->bucket = targetBucket;
+                        }
+                        requeued++;
+                    }
+                }
+                waiter = next;
+            }
+
+            result = woken + requeued;
+        }
+
+        if(targetBucket != bucket){
+            releaseLock(&targetBucket->lock);
+        }
+        releaseLock(&bucket->lock);
+        if(intsEnabled) asm("sti");
+
+        return result;
+    }
+}
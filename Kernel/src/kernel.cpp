@@ -20,7 +20,13 @@
 #include <devicemanager.h>
 #include <gui.h>
 #include <fs/tar.h>
+#include <fs/ext2.h>
+#include <fs/pagecache.h>
+#include <fs/dentrycache.h>
+#include <blockqueue.h>
 #include <sharedmem.h>
+#include <slab.h>
+#include <benchmark.h>
 #include <net/net.h>
 #include <cpu.h>
 #include <lemon.h>
@@ -46,12 +52,18 @@ void KernelProcess(){
 	ATA::Init();
 	AHCI::Init();
 
+	fs::Ext2::StartFlusher();
+
 	if(progressBuffer)
 		Video::DrawBitmapImage(videoMode.width/2 + 24 * 2, videoMode.height/2 + 292/2 + 48, 24, 24, progressBuffer);
 
 	if(progressBuffer)
 		Video::DrawBitmapImage(videoMode.width/2 + 24 * 3, videoMode.height/2 + 292/2 + 48, 24, 24, progressBuffer);
 
+	if(HAL::runBenchmarks){
+		Benchmark::RunAll();
+	}
+
 	Log::Info("Loading Init Process...");
 	FsNode* initFsNode = nullptr;
 	char* argv[] = {"init.lef"};
@@ -72,10 +84,7 @@ void KernelProcess(){
 		envp[0] = "PATH=/initrd";
 	}
 
-	void* initElf = (void*)kmalloc(initFsNode->size);
-	fs::Read(initFsNode, 0, initFsNode->size, (uint8_t*)initElf);
-
-	process_t* initProc = Scheduler::CreateELFProcess(initElf, 1, argv, envc, envp);
+	process_t* initProc = Scheduler::CreateELFProcess(initFsNode, 1, argv, envc, envp);
 
 	strcpy(initProc->workingDir, "/");
 	strcpy(initProc->name, "Init");
@@ -90,7 +99,7 @@ void KernelProcess(){
 	Network::InitializeConnections();
 
 	for(;;) {
-		GetCPULocal()->currentThread->state = ThreadStateBlocked;
+		GetCurrentThread()->state = ThreadStateBlocked;
 		Scheduler::Yield();
 	}
 }
@@ -121,6 +130,11 @@ extern "C"
     Log::EnableBuffer();
 
 	DeviceManager::InitializeBasicDevices();
+	Slab::InitializeDevice();
+	Lock::InitializeDevice();
+	PageCache::Initialize();
+	DentryCache::Initialize();
+	BlockLayer::Initialize();
 
 	videoMode = Video::GetVideoMode();
 
@@ -3,10 +3,259 @@
 #include <scheduler.h>
 #include <timer.h>
 #include <cpu.h>
+#include <device.h>
+#include <memory.h>
+#include <string.h>
 #include <logging.h>
 
+namespace Lock{
+    lock_t classesLock = 0;
+    LockClass* classes = nullptr; // Every lock class that has been used
+
+    LockClass mutexClass("mutex");
+    LockClass readWriteClass("rwlock");
+}
+
+void LockClass::Register(){
+    bool intsEnabled = CheckInterrupts();
+    asm("cli");
+    acquireLock(&Lock::classesLock);
+
+    if(!registered){
+        next = Lock::classes;
+        __atomic_store_n(&Lock::classes, this, __ATOMIC_RELEASE);
+        registered = 1;
+    }
+
+    releaseLock(&Lock::classesLock);
+    if(intsEnabled) asm("sti");
+}
+
+void LockClass::RecordAcquire(unsigned long spinCount, unsigned long sleepCount){
+    if(!registered){
+        Register();
+    }
+
+    __atomic_fetch_add(&acquisitions, 1, __ATOMIC_RELAXED);
+    if(spinCount || sleepCount){
+        __atomic_fetch_add(&contended, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&spins, spinCount, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&sleeps, sleepCount, __ATOMIC_RELAXED);
+    }
+}
+
+void LockClass::RecordRelease(uint64_t heldSince){
+    uint64_t held = Timer::GetSystemUptimeNs() - heldSince;
+    __atomic_fetch_add(&holdTime, held, __ATOMIC_RELAXED);
+
+    uint64_t max = maxHoldTime;
+    while(held > max && !__atomic_compare_exchange_n(&maxHoldTime, &max, held, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+bool Mutex::TryAcquire(){
+    if(__sync_lock_test_and_set(&value, 1)){
+        return false;
+    }
+
+    owner = GetCurrentThread();
+    ownerCPU = GetCPULocal();
+    acquiredAt = Timer::GetSystemUptimeNs();
+
+    lockClass->RecordAcquire(0, 0);
+    return true;
+}
+
+void Mutex::Acquire(){
+    thread_t* thread = GetCurrentThread();
+
+    unsigned long spins = 0;
+    unsigned long sleeps = 0;
+    unsigned spinLimit = MUTEX_SPIN_LIMIT;
+
+    for(;;){
+        if(!value && !__sync_lock_test_and_set(&value, 1)){
+            break;
+        }
+
+        // Keep spinning whilst the owner is running, it is likely to release the lock
+        // before a sleep and wake up would complete. Nothing can sleep before the scheduler is running.
+        CPU* cpu = ownerCPU;
+        if(!thread || (spinLimit && (!cpu || cpu->currentThread == owner))){
+            spins++;
+            spinLimit--;
+            asm("pause");
+            continue;
+        }
+
+        asm("cli");
+        acquireLock(&waitLock);
+
+        // Release clears the value before checking for waiters, so either it sees us or we see the lock free
+        __atomic_add_fetch(&waiterCount, 1, __ATOMIC_SEQ_CST);
+        if(!__sync_lock_test_and_set(&value, 1)){
+            __atomic_sub_fetch(&waiterCount, 1, __ATOMIC_SEQ_CST);
+
+            releaseLock(&waitLock);
+            asm("sti");
+            break;
+        }
+
+        sleeps++;
+        Scheduler::BlockCurrentThreadLocked(waiters, waitLock);
+
+        asm("cli");
+        acquireLock(&waitLock);
+        if(waiters.blocked.remove(thread)){ // Woken by something other than Release
+            __atomic_sub_fetch(&waiterCount, 1, __ATOMIC_SEQ_CST);
+        }
+        releaseLock(&waitLock);
+        asm("sti");
+
+        spinLimit = MUTEX_SPIN_LIMIT;
+    }
+
+    owner = thread;
+    ownerCPU = GetCPULocal();
+    acquiredAt = Timer::GetSystemUptimeNs();
+
+    lockClass->RecordAcquire(spins, sleeps);
+}
+
+void Mutex::Release(){
+    assert(value);
+
+    lockClass->RecordRelease(acquiredAt);
+
+    owner = nullptr;
+    ownerCPU = nullptr;
+    __atomic_store_n(&value, 0, __ATOMIC_SEQ_CST);
+
+    if(__atomic_load_n(&waiterCount, __ATOMIC_SEQ_CST)){
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&waitLock);
+
+        if(waiters.blocked.get_length()){
+            __atomic_sub_fetch(&waiterCount, 1, __ATOMIC_SEQ_CST);
+            Scheduler::UnblockThread(waiters.blocked.remove_at(0));
+        }
+
+        releaseLock(&waitLock);
+        if(intsEnabled) asm("sti");
+    }
+}
+
+void ReadWriteLock::Sleep(Scheduler::GenericThreadBlocker& blocker, thread_t* current){
+    Scheduler::BlockCurrentThreadLocked(blocker, lock);
+
+    asm("cli");
+    acquireLock(&lock);
+
+    blocker.blocked.remove(current); // Still queued if woken by something other than a release
+}
+
+void ReadWriteLock::WakeWaiters(bool preferReaders){
+    if(readers.blocked.get_length() && (preferReaders || !writers.blocked.get_length())){
+        readGeneration++;
+        while(readers.blocked.get_length()){
+            activeReaders++;
+            Scheduler::UnblockThread(readers.blocked.remove_at(0));
+        }
+    } else if(writers.blocked.get_length()){
+        writer = writers.blocked.remove_at(0);
+        Scheduler::UnblockThread(writer);
+    }
+}
+
+void ReadWriteLock::AcquireRead(){
+    thread_t* thread = GetCurrentThread();
+    unsigned long sleeps = 0;
+
+    asm("cli");
+    acquireLock(&lock);
+
+    for(;;){
+        if(!writer && !writers.blocked.get_length()){ // Queue behind waiting writers so they are not starved
+            activeReaders++;
+            break;
+        }
+
+        unsigned generation = readGeneration;
+
+        sleeps++;
+        Sleep(readers, thread);
+
+        if(readGeneration != generation){
+            break; // A releasing writer handed the lock to every waiting reader, including us
+        }
+    }
+
+    releaseLock(&lock);
+    asm("sti");
+
+    lockClass->RecordAcquire(0, sleeps);
+}
+
+void ReadWriteLock::AcquireWrite(){
+    thread_t* thread = GetCurrentThread();
+    assert(thread);
+    unsigned long sleeps = 0;
+
+    asm("cli");
+    acquireLock(&lock);
+
+    for(;;){
+        if(!writer && !activeReaders && !writers.blocked.get_length()){
+            writer = thread;
+            break;
+        }
+
+        sleeps++;
+        Sleep(writers, thread);
+
+        if(writer == thread){
+            break; // Handed the lock on release
+        }
+    }
+
+    acquiredAt = Timer::GetSystemUptimeNs();
+
+    releaseLock(&lock);
+    asm("sti");
+
+    lockClass->RecordAcquire(0, sleeps);
+}
+
+void ReadWriteLock::ReleaseRead(){
+    bool intsEnabled = CheckInterrupts();
+    asm("cli");
+    acquireLock(&lock);
+
+    assert(activeReaders > 0);
+    if(!--activeReaders){
+        WakeWaiters(false);
+    }
+
+    releaseLock(&lock);
+    if(intsEnabled) asm("sti");
+}
+
+void ReadWriteLock::ReleaseWrite(){
+    lockClass->RecordRelease(acquiredAt);
+
+    bool intsEnabled = CheckInterrupts();
+    asm("cli");
+    acquireLock(&lock);
+
+    writer = nullptr;
+    WakeWaiters(true);
+
+    releaseLock(&lock);
+    if(intsEnabled) asm("sti");
+}
+
 void Semaphore::Wait(){
-    thread_t* thread = GetCPULocal()->currentThread;
+    thread_t* thread = GetCurrentThread();
 
     __sync_fetch_and_sub(&value, 1);
     while(value < 0 && thread->state != ThreadStateZombie) {
@@ -17,17 +266,117 @@ void Semaphore::Wait(){
     }
 }
 
-void Semaphore::WaitTimeout(long timeout){
+bool Semaphore::WaitTimeout(long timeout){
+    return WaitUntil(Timer::GetSystemUptimeNs() + timeout * 1000000);
+}
+
+bool Semaphore::WaitUntil(uint64_t deadline){
+    thread_t* thread = GetCurrentThread();
+
     __sync_fetch_and_sub(&value, 1);
-    if(value < 0){
-        thread_t* cThread = GetCPULocal()->currentThread;
-        acquireLock(&cThread->stateLock);
-        blocked.add_back(cThread);
-        if(value > 0){
-            releaseLock(&cThread->stateLock);
-            return;
-        }
-        releaseLock(&cThread->stateLock);
-        Timer::SleepCurrentThread(timeout); // TODO: Find a better way to do this
-    }
-}
\ No newline at end of file
+    if(value >= 0){
+        return false;
+    } else if(deadline <= Timer::GetSystemUptimeNs()){
+        __sync_fetch_and_add(&value, 1);
+        return true;
+    }
+
+    if(!Timer::BlockCurrentThreadUntil(deadline, *this, blockedLock) && thread->state != ThreadStateZombie){
+        return false; // Signal took us off the blocked list
+    }
+
+    // Timed out, unless Signal took us off the blocked list in the meantime
+    bool timedOut = false;
+    acquireLock(&blockedLock);
+    for(auto it = blocked.begin(); it != blocked.end(); it++){
+        if(*it == thread){
+            blocked.remove(it);
+            timedOut = true;
+            break;
+        }
+    }
+
+    if(timedOut){
+        __sync_fetch_and_add(&value, 1); // No longer waiting
+    }
+    releaseLock(&blockedLock);
+
+    return timedOut;
+}
+
+// Reports the contention statistics of every lock class, one class per line
+class LockStatDevice : public Device {
+    static void Append(char* buffer, size_t& pos, const char* str, unsigned width){
+        size_t len = strlen(str);
+        memcpy(buffer + pos, str, len);
+        pos += len;
+
+        do {
+            buffer[pos++] = ' ';
+        } while(len++ < width);
+    }
+
+    static void AppendNumber(char* buffer, size_t& pos, unsigned long num, unsigned width){
+        char str[24];
+        itoa(num, str, 10);
+        Append(buffer, pos, str, width);
+    }
+public:
+    LockStatDevice(const char* name) : Device(name, TypeGenericDevice){
+        flags = FS_NODE_FILE;
+    }
+
+    ssize_t Read(size_t offset, size_t size, uint8_t* buffer){
+        // Classes are only ever added to the front of the list and never removed so walk it without the lock
+        LockClass* classes = __atomic_load_n(&Lock::classes, __ATOMIC_ACQUIRE);
+
+        unsigned count = 0;
+        for(LockClass* c = classes; c; c = c->next){
+            count++;
+        }
+
+        size_t capacity = (count + 1) * 160;
+        char* info = (char*)kmalloc(capacity);
+        size_t pos = 0;
+
+        Append(info, pos, "# class", 16);
+        Append(info, pos, "acquired", 12);
+        Append(info, pos, "contended", 12);
+        Append(info, pos, "spins", 14);
+        Append(info, pos, "sleeps", 10);
+        Append(info, pos, "hold_us", 14);
+        Append(info, pos, "maxhold_us", 10);
+        info[pos - 1] = '\n';
+
+        for(LockClass* c = classes; c; c = c->next){
+            Append(info, pos, c->name, 16);
+            AppendNumber(info, pos, c->acquisitions, 12);
+            AppendNumber(info, pos, c->contended, 12);
+            AppendNumber(info, pos, c->spins, 14);
+            AppendNumber(info, pos, c->sleeps, 10);
+            AppendNumber(info, pos, c->holdTime / 1000, 14);
+            AppendNumber(info, pos, c->maxHoldTime / 1000, 10);
+            info[pos - 1] = '\n';
+        }
+
+        if(offset >= pos){
+            kfree(info);
+            return 0;
+        }
+
+        if(offset + size > pos){
+            size = pos - offset;
+        }
+
+        memcpy(buffer, info + offset, size);
+        kfree(info);
+
+        return size;
+    }
+};
+
+namespace Lock{
+    void InitializeDevice(){
+        DeviceManager::RegisterDevice(*(new LockStatDevice("lockstat")));
+    }
+}
@@ -4,6 +4,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <scheduler.h>
+#include <cpu.h>
 
 Socket* Socket::CreateSocket(int domain, int type, int protocol){
     if(type & SOCK_NONBLOCK) type &= ~SOCK_NONBLOCK;
@@ -160,6 +161,14 @@ void LocalSocket::DisconnectPeer(){
 void LocalSocket::OnDisconnect(){
     connected = false;
 
+    if(inbound){
+        inbound->Hangup(); // Wake anyone blocked on the peer
+    }
+
+    if(outbound){
+        outbound->Hangup();
+    }
+
     while(watching.get_length()){
         watching.remove_at(0)->Signal(); // Signal all watching on disconnect
     }
@@ -245,8 +254,8 @@ int LocalSocket::Connect(const sockaddr* addr, socklen_t addrlen){
         inbound = new PacketStream();
         outbound = new PacketStream();
     } else {
-        inbound = new DataStream(1024);
-        outbound = new DataStream(1024);
+        inbound = new DataStream(STREAM_MAX_BUFSIZE);
+        outbound = new DataStream(STREAM_MAX_BUFSIZE);
     } 
 
     role = ClientRole;
@@ -304,14 +313,25 @@ int64_t LocalSocket::ReceiveFrom(void* buffer, size_t len, int flags, sockaddr*
     if(inbound->Empty() && (flags & MSG_DONTWAIT)){
         return -EAGAIN;
     } else while(inbound->Empty()){
+        if(!connected){
+            return 0; // End of stream
+        } else if(GetCurrentThread()->state == ThreadStateZombie){
+            return -EINTR;
+        }
+
         inbound->Wait();
     }
 
     if(flags & MSG_PEEK){
         return inbound->Peek(buffer, len);
-    } else {
-        return inbound->Read(buffer, len);
     }
+
+    int64_t read = inbound->Read(buffer, len);
+    if(read >= 0){
+        __atomic_add_fetch(&received, type == StreamSocket ? read : 1, __ATOMIC_SEQ_CST); // Datagrams are read whole or not at all
+    }
+
+    return read;
 }
 
 int64_t LocalSocket::SendTo(void* buffer, size_t len, int flags, const sockaddr* src, socklen_t addrlen){
@@ -330,21 +350,182 @@ int64_t LocalSocket::SendTo(void* buffer, size_t len, int flags, const sockaddr*
         return -ENOTCONN;
     }
 
-    if(type == StreamSocket && (flags & MSG_DONTWAIT) && outbound->Pos() + len >= STREAM_MAX_BUFSIZE){
-        return -EAGAIN;
-    } else while(type == StreamSocket && outbound->Pos() + len >= STREAM_MAX_BUFSIZE)  {
-        Scheduler::Yield();
+    if(type != StreamSocket){
+        int64_t written = outbound->Write(buffer, len);
+        __atomic_add_fetch(&sent, 1, __ATOMIC_SEQ_CST);
+        SignalPeer();
+
+        return written;
+    }
+
+    // Stream sockets block whenever the buffer is full, unless MSG_DONTWAIT is set
+    size_t written = 0;
+    for(;;){
+        int64_t n = outbound->Write(reinterpret_cast<uint8_t*>(buffer) + written, len - written);
+        written += n;
+        __atomic_add_fetch(&sent, n, __ATOMIC_SEQ_CST);
+        SignalPeer();
+
+        if(written >= len || !connected || (flags & MSG_DONTWAIT) || GetCurrentThread()->state == ThreadStateZombie){
+            break;
+        }
+
+        outbound->WaitForSpace();
+    }
+
+    if(!written && len){
+        return connected ? -EAGAIN : -EPIPE;
     }
 
-    int64_t written = outbound->Write(buffer, len);
+    return written;
+}
 
+void LocalSocket::SignalPeer(){
     if(peer && peer->CanRead()){
         while(peer->watching.get_length()){
             peer->watching.remove_at(0)->Signal();
         }
     }
+}
 
-    return written;
+int LocalSocket::SendRights(fs_fd_t** fds, unsigned count){
+    LocalSocket* receiver = peer;
+    if(!receiver){
+        return -ENOTCONN;
+    }
+
+    PassedRights* r = new PassedRights;
+    r->fds = fds;
+    r->count = count;
+
+    bool intsEnabled = CheckInterrupts();
+    asm("cli");
+    acquireLock(&receiver->rightsLock);
+    r->position = sent; // Received along with the first byte (or message) sent after this
+    if(receiver->lastRights){
+        receiver->lastRights->next = r;
+    } else {
+        receiver->rights = r;
+    }
+    receiver->lastRights = r;
+    releaseLock(&receiver->rightsLock);
+    if(intsEnabled) asm("sti");
+
+    return 0;
+}
+
+bool LocalSocket::WithdrawRights(fs_fd_t** fds){
+    LocalSocket* receiver = peer;
+    if(!receiver){
+        return false; // Closed along with the peer
+    }
+
+    bool intsEnabled = CheckInterrupts();
+    asm("cli");
+    acquireLock(&receiver->rightsLock);
+
+    PassedRights* previous = nullptr;
+    PassedRights* r = receiver->rights;
+    while(r && r->fds != fds){
+        previous = r;
+        r = r->next;
+    }
+
+    // They cannot have been received as nothing they would be received with has been sent
+    bool withdrawn = r && r->position == sent;
+    if(withdrawn){
+        if(previous){
+            previous->next = r->next;
+        } else {
+            receiver->rights = r->next;
+        }
+
+        if(receiver->lastRights == r){
+            receiver->lastRights = previous;
+        }
+    }
+
+    releaseLock(&receiver->rightsLock);
+    if(intsEnabled) asm("sti");
+
+    if(withdrawn){
+        delete r;
+    }
+    return withdrawn;
+}
+
+LocalSocket::PassedRights* LocalSocket::TakeRights(uint64_t position){
+    bool intsEnabled = CheckInterrupts();
+    asm("cli");
+    acquireLock(&rightsLock);
+
+    PassedRights* r = rights;
+    if(r && r->position < position){
+        rights = r->next;
+        if(!rights){
+            lastRights = nullptr;
+        }
+    } else {
+        r = nullptr;
+    }
+
+    releaseLock(&rightsLock);
+    if(intsEnabled) asm("sti");
+
+    return r;
+}
+
+unsigned LocalSocket::ReceiveRights(uint64_t start, fs_fd_t** fds, unsigned max, bool& truncated){
+    unsigned taken = 0;
+    truncated = false;
+
+    while(PassedRights* r = TakeRights(received)){
+        for(unsigned i = 0; i < r->count; i++){
+            if(r->position < start){
+                fs::Close(r->fds[i]); // Nobody asked for them when their data was read
+            } else if(taken < max){
+                fds[taken++] = r->fds[i];
+            } else {
+                fs::Close(r->fds[i]);
+                truncated = true;
+            }
+        }
+
+        kfree(r->fds);
+        delete r;
+    }
+
+    return taken;
+}
+
+int LocalSocket::CreatePair(int type, int protocol, LocalSocket* sockets[2]){
+    if(type != StreamSocket && type != DatagramSocket){
+        return -EPROTONOSUPPORT;
+    }
+
+    LocalSocket* a = new LocalSocket(type, protocol);
+    LocalSocket* b = new LocalSocket(type, protocol);
+
+    if(type == DatagramSocket){
+        a->inbound = new PacketStream();
+        a->outbound = new PacketStream();
+    } else {
+        a->inbound = new DataStream(STREAM_MAX_BUFSIZE);
+        a->outbound = new DataStream(STREAM_MAX_BUFSIZE);
+    }
+
+    b->inbound = a->outbound;
+    b->outbound = a->inbound;
+
+    a->peer = b;
+    b->peer = a;
+    a->role = ClientRole;
+    b->role = ServerRole;
+    a->connected = b->connected = true;
+
+    sockets[0] = a;
+    sockets[1] = b;
+    return 0;
 }
 
 fs_fd_t* LocalSocket::Open(size_t flags){
@@ -360,11 +541,25 @@ fs_fd_t* LocalSocket::Open(size_t flags){
 }
 
 void LocalSocket::Close(){
+    if(handleCount && --handleCount){
+        return; // Still open elsewhere, duplicated or passed to another process
+    }
+
     if(peer){
         DisconnectPeer();
     }
 
-    Socket::Close();
+    // Nobody is left to receive them
+    while(PassedRights* r = TakeRights(UINT64_MAX)){
+        for(unsigned i = 0; i < r->count; i++){
+            fs::Close(r->fds[i]);
+        }
+
+        kfree(r->fds);
+        delete r;
+    }
+
+    // The socket itself is kept, a listening socket may still have it among its pending connections
 }
 
 void LocalSocket::Watch(FilesystemWatcher& watcher, int events){
@@ -372,11 +567,11 @@ void LocalSocket::Watch(FilesystemWatcher& watcher, int events){
         return;
     }
 
-    if(CanRead() | !IsConnected()){ // POLLHUP does not care if it is requested
+    if(!IsConnected() && !IsListening()){ // POLLHUP does not care if it is requested
         return;
     }
 
-    watching.add_back(&watcher);
+    watching.add_back(&watcher); // Even if already readable, so every new message or connection signals the watcher
 }
 
 void LocalSocket::Unwatch(FilesystemWatcher& watcher){
@@ -8,7 +8,7 @@
 #define DEFAULT_TABLE_SIZE 65535
 
 namespace Memory {
-    int* lock = 0;
+    lock_t lock = 0;
 
     shared_mem_t** table = nullptr;
     unsigned tableSize = 0;
@@ -42,7 +42,7 @@ namespace Memory {
     int CanModifySharedMemory(pid_t pid, uint64_t key){
         shared_mem_t* sMem = nullptr;
         if((sMem = GetSharedMemory(key))){
-            if((sMem->owner = pid)) return 1;
+            if(sMem->owner == pid) return 1;
         }
 
         return 0;
@@ -62,6 +62,7 @@ namespace Memory {
         sMem->pgCount = pgCount;
         sMem->pages = (uint64_t*)kmalloc(sMem->pgCount * sizeof(uint64_t*));
         sMem->mapCount = 0;
+        sMem->handleCount = 0;
 
         for(unsigned i = 0; i < sMem->pgCount; i++){
             sMem->pages[i] = Memory::AllocatePhysicalMemoryBlock();
@@ -86,7 +87,7 @@ namespace Memory {
             return nullptr; // Check for invalid key
         }
 
-        if(sMem->flags & SMEM_FLAGS_PRIVATE){ // Private Mapping
+        if((sMem->flags & SMEM_FLAGS_PRIVATE) && !(sMem->flags & SMEM_FLAGS_HANDLE)){ // Private Mapping, descriptors carry their own access rights
             if(proc->pid != sMem->owner && proc->pid != sMem->recipient){
                 releaseLock(&lock);
                 return nullptr; // Does not have access rights
@@ -101,12 +102,13 @@ namespace Memory {
         } else mapping = Memory::Allocate4KPages(sMem->pgCount, proc->addressSpace);
 
         for(unsigned i = 0; i < sMem->pgCount; i++){
-            Memory::MapVirtualMemory4K(sMem->pages[i], (uintptr_t)mapping + i * PAGE_SIZE_4K, 1, proc->addressSpace);
+            Memory::MapVirtualMemory4K(sMem->pages[i], (uintptr_t)mapping + i * PAGE_SIZE_4K, 1, PAGE_SHARED, proc->addressSpace);
         }
 
         mem_region_t mReg;
         mReg.base = (uintptr_t)mapping;
         mReg.pageCount = sMem->pgCount;
+        mReg.key = key;
         proc->sharedMemory.add_back(mReg);
         
         releaseLock(&lock);
@@ -120,11 +122,10 @@ namespace Memory {
         shared_mem_t* sMem = GetSharedMemory(key);
         
         if(!sMem) {
-            releaseLock(&lock);
             return; // Check for invalid key
         }
 
-        if(sMem->mapCount > 0){
+        if(sMem->mapCount > 0 || sMem->handleCount > 0){
             //Log::Error("Will not destroy active shared memory");
             return;
         }
@@ -140,4 +141,40 @@ namespace Memory {
 
         //releaseLock(&lock);
     }
-}
\ No newline at end of file
+
+    void ReleaseSharedMemoryMapping(uint64_t key){
+        acquireLock(&lock);
+
+        shared_mem_t* sMem = GetSharedMemory(key);
+        if(sMem){
+            sMem->mapCount--;
+            DestroySharedMemory(key); // Only once nothing refers to it
+        }
+
+        releaseLock(&lock);
+    }
+}
+
+SharedMemoryNode::SharedMemoryNode(uint64_t key, size_t size) : key(key){
+    flags = FS_NODE_SHAREDMEM;
+    this->size = size;
+
+    acquireLock(&Memory::lock);
+    Memory::GetSharedMemory(key)->handleCount++;
+    releaseLock(&Memory::lock);
+}
+
+void SharedMemoryNode::Close(){
+    if(handleCount && --handleCount){
+        return;
+    }
+
+    acquireLock(&Memory::lock);
+    if(shared_mem_t* sMem = Memory::GetSharedMemory(key)){
+        sMem->handleCount--;
+        Memory::DestroySharedMemory(key);
+    }
+    releaseLock(&Memory::lock);
+
+    delete this;
+}
@@ -0,0 +1,415 @@
+#include <slab.h>
+
+#include <device.h>
+#include <paging.h>
+#include <physicalallocator.h>
+#include <memory.h>
+#include <string.h>
+#include <assert.h>
+#include <cpu.h>
+
+#define SLAB_FREE_END 0xFFFF
+
+// Header at the start of every slab.
+// Free objects are tracked by index rather than by a pointer stored inside the object,
+// so constructed state is never overwritten whilst an object sits in the cache.
+struct SlabHeader {
+    SlabCache* cache;
+    SlabHeader* next;
+    SlabHeader* prev;
+    unsigned inUse; // Allocated objects, including ones held in magazines
+    uint16_t firstFree; // Index of the first free object, SLAB_FREE_END if there are none
+    uint16_t nextFree[]; // Index of the next free object after each free object
+};
+
+namespace Slab{
+    lock_t cachesLock = 0;
+    SlabCache* caches = nullptr; // Every cache that has been used
+    int cacheCount = 0;
+
+    bool cpuCachesEnabled = false;
+
+    SlabCache sizeCaches[SLAB_SIZE_CLASS_COUNT] = {
+        SlabCache("size-16", 16),
+        SlabCache("size-32", 32),
+        SlabCache("size-64", 64),
+        SlabCache("size-128", 128),
+        SlabCache("size-256", 256),
+        SlabCache("size-512", 512),
+        SlabCache("size-1024", 1024),
+    };
+
+    void EnableCPUCaches(){
+        cpuCachesEnabled = true;
+    }
+
+    inline SlabCache* SizeCache(size_t size){
+        for(unsigned i = 0; i < SLAB_SIZE_CLASS_COUNT; i++){
+            if(size <= (16U << i)){
+                return &sizeCaches[i];
+            }
+        }
+
+        return nullptr;
+    }
+
+    void* Allocate(size_t size){
+        if(SlabCache* cache = SizeCache(size)){
+            return cache->Allocate();
+        }
+
+        return kmalloc(size);
+    }
+
+    void Free(void* obj, size_t size){
+        if(SlabCache* cache = SizeCache(size)){
+            cache->Free(obj);
+        } else {
+            kfree(obj);
+        }
+    }
+
+    inline size_t HeaderSize(unsigned objectCount){
+        return (sizeof(SlabHeader) + objectCount * sizeof(uint16_t) + 15) & ~15UL;
+    }
+
+    inline void Push(SlabHeader*& head, SlabHeader* slab){
+        slab->prev = nullptr;
+        slab->next = head;
+        if(head){
+            head->prev = slab;
+        }
+        head = slab;
+    }
+
+    inline void Remove(SlabHeader*& head, SlabHeader* slab){
+        if(slab->prev){
+            slab->prev->next = slab->next;
+        } else {
+            head = slab->next;
+        }
+
+        if(slab->next){
+            slab->next->prev = slab->prev;
+        }
+    }
+}
+
+void SlabCache::Register(){
+    bool intsEnabled = CheckInterrupts();
+    asm("cli");
+    acquireLock(&Slab::cachesLock);
+
+    if(!pagesPerSlab){
+        // Use the smallest power of two amount of pages that fits enough objects
+        unsigned pages = 1;
+        unsigned count = 0;
+        for(;;){
+            size_t size = pages * PAGE_SIZE_4K;
+
+            count = (size - sizeof(SlabHeader)) / (objectSize + sizeof(uint16_t));
+            while(count && Slab::HeaderSize(count) + count * objectSize > size){
+                count--;
+            }
+
+            if(count >= SLAB_MIN_OBJECTS || pages >= SLAB_MAX_PAGES){
+                break;
+            }
+
+            pages *= 2;
+        }
+
+        assert(count); // Object is too large for a slab
+
+        objectsPerSlab = count < SLAB_FREE_END ? count : (SLAB_FREE_END - 1);
+        index = (Slab::cacheCount < SLAB_MAX_CACHES) ? Slab::cacheCount : -1;
+        Slab::cacheCount++;
+
+        nextCache = Slab::caches;
+        __atomic_store_n(&Slab::caches, this, __ATOMIC_RELEASE);
+
+        __atomic_store_n(&pagesPerSlab, pages, __ATOMIC_RELEASE); // The cache is ready to use once pagesPerSlab is set
+    }
+
+    releaseLock(&Slab::cachesLock);
+    if(intsEnabled) asm("sti");
+}
+
+// Create a new slab aligned to its size, so the slab of an object can be found by masking the address
+// Interrupts must be disabled and the cache lock must not be held
+SlabHeader* SlabCache::Grow(){
+    size_t size = pagesPerSlab * PAGE_SIZE_4K;
+
+    // Over allocate virtual address space and give back whatever is either side of the aligned slab
+    uintptr_t base = (uintptr_t)Memory::KernelAllocate4KPages(pagesPerSlab * 2 - 1);
+    uintptr_t end = base + (pagesPerSlab * 2 - 1) * PAGE_SIZE_4K;
+    uintptr_t address = (base + size - 1) & ~(size - 1);
+
+    if(address > base){
+        Memory::KernelFree4KPages((void*)base, (address - base) / PAGE_SIZE_4K);
+    }
+
+    if(end > address + size){
+        Memory::KernelFree4KPages((void*)(address + size), (end - address - size) / PAGE_SIZE_4K);
+    }
+
+    for(unsigned i = 0; i < pagesPerSlab; i++){
+        Memory::KernelMapVirtualMemory4K(Memory::AllocatePhysicalMemoryBlock(), address + i * PAGE_SIZE_4K, 1);
+    }
+
+    SlabHeader* slab = (SlabHeader*)address;
+    slab->cache = this;
+    slab->next = slab->prev = nullptr;
+    slab->inUse = 0;
+    slab->firstFree = 0;
+
+    for(unsigned i = 0; i < objectsPerSlab; i++){
+        slab->nextFree[i] = (i + 1 < objectsPerSlab) ? (i + 1) : SLAB_FREE_END;
+    }
+
+    return slab;
+}
+
+// Interrupts must be disabled and the cache lock must not be held
+void SlabCache::DestroySlab(SlabHeader* slab){
+    for(unsigned i = 0; i < pagesPerSlab; i++){
+        Memory::FreePhysicalMemoryBlock(Memory::VirtualToPhysicalAddress((uintptr_t)slab + i * PAGE_SIZE_4K));
+    }
+
+    Memory::KernelFree4KPages(slab, pagesPerSlab);
+}
+
+// Take a free object out of the slabs, nullptr if every slab is full
+// The cache lock must be held
+void* SlabCache::TakeObject(){
+    SlabHeader* slab = partial;
+    if(!slab){
+        if(!(slab = empty)){
+            return nullptr;
+        }
+
+        empty = nullptr;
+        Slab::Push(partial, slab);
+    }
+
+    unsigned i = slab->firstFree;
+    slab->firstFree = slab->nextFree[i];
+
+    if(++slab->inUse >= objectsPerSlab){
+        Slab::Remove(partial, slab);
+        Slab::Push(full, slab);
+    }
+
+    return (void*)((uintptr_t)slab + Slab::HeaderSize(objectsPerSlab) + i * objectSize);
+}
+
+// Give an object back to its slab, returns a slab that should be destroyed or nullptr
+// The cache lock must be held
+SlabHeader* SlabCache::PutObject(void* obj){
+    SlabHeader* slab = (SlabHeader*)((uintptr_t)obj & ~(pagesPerSlab * PAGE_SIZE_4K - 1));
+    assert(slab->cache == this);
+
+    unsigned i = ((uintptr_t)obj - (uintptr_t)slab - Slab::HeaderSize(objectsPerSlab)) / objectSize;
+    slab->nextFree[i] = slab->firstFree;
+    slab->firstFree = i;
+
+    if(slab->inUse-- >= objectsPerSlab){
+        Slab::Remove(full, slab);
+        Slab::Push(partial, slab);
+    }
+
+    if(slab->inUse){
+        return nullptr;
+    }
+
+    Slab::Remove(partial, slab);
+    if(!empty){ // Keep one empty slab around so a cache sitting on the boundary does not keep creating and destroying slabs
+        empty = slab;
+        return nullptr;
+    }
+
+    slabCount--;
+    return slab;
+}
+
+void* SlabCache::Allocate(){
+    if(!__atomic_load_n(&pagesPerSlab, __ATOMIC_ACQUIRE)){
+        Register();
+    }
+
+    bool intsEnabled = CheckInterrupts();
+    asm("cli");
+
+    SlabMagazine* magazine = nullptr;
+    if(index >= 0 && Slab::cpuCachesEnabled){
+        magazine = &GetCPULocal()->slabMagazines[index];
+    }
+
+    void* obj;
+    if(magazine && magazine->count){
+        obj = magazine->objects[--magazine->count];
+        __atomic_add_fetch(&magazineHits, 1, __ATOMIC_RELAXED);
+    } else {
+        acquireLock(&lock);
+        while(!(obj = TakeObject())){
+            releaseLock(&lock);
+            SlabHeader* slab = Grow();
+            acquireLock(&lock);
+
+            slabCount++;
+            Slab::Push(partial, slab);
+        }
+
+        // Refill the magazine whilst we have the lock
+        while(magazine && magazine->count < SLAB_MAGAZINE_BATCH){
+            void* next = TakeObject();
+            if(!next){
+                break;
+            }
+
+            magazine->objects[magazine->count++] = next;
+        }
+        releaseLock(&lock);
+    }
+
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&activeObjects, 1, __ATOMIC_RELAXED);
+
+    if(intsEnabled) asm("sti");
+    return obj;
+}
+
+void SlabCache::Free(void* obj){
+    if(!obj){
+        return;
+    }
+
+    bool intsEnabled = CheckInterrupts();
+    asm("cli");
+
+    SlabMagazine* magazine = nullptr;
+    if(index >= 0 && Slab::cpuCachesEnabled){
+        magazine = &GetCPULocal()->slabMagazines[index];
+    }
+
+    if(magazine){
+        if(magazine->count >= SLAB_MAGAZINE_SIZE){
+            SlabHeader* dead = nullptr; // Slabs to destroy once the lock is released
+
+            // Give the least recently freed objects back to the slabs
+            acquireLock(&lock);
+            for(unsigned i = 0; i < SLAB_MAGAZINE_BATCH; i++){
+                if(SlabHeader* slab = PutObject(magazine->objects[i])){
+                    Slab::Push(dead, slab);
+                }
+            }
+            releaseLock(&lock);
+
+            magazine->count -= SLAB_MAGAZINE_BATCH;
+            for(unsigned i = 0; i < magazine->count; i++){
+                magazine->objects[i] = magazine->objects[i + SLAB_MAGAZINE_BATCH];
+            }
+
+            while(dead){
+                SlabHeader* slab = dead;
+                dead = dead->next;
+                DestroySlab(slab);
+            }
+        }
+
+        magazine->objects[magazine->count++] = obj;
+    } else {
+        acquireLock(&lock);
+        SlabHeader* dead = PutObject(obj);
+        releaseLock(&lock);
+
+        if(dead){
+            DestroySlab(dead);
+        }
+    }
+
+    __atomic_sub_fetch(&activeObjects, 1, __ATOMIC_RELAXED);
+
+    if(intsEnabled) asm("sti");
+}
+
+// Reports the statistics of every slab cache, one cache per line
+class SlabInfoDevice : public Device {
+    static void Append(char* buffer, size_t& pos, const char* str, unsigned width){
+        size_t len = strlen(str);
+        memcpy(buffer + pos, str, len);
+        pos += len;
+
+        do {
+            buffer[pos++] = ' ';
+        } while(len++ < width);
+    }
+
+    static void AppendNumber(char* buffer, size_t& pos, unsigned long num, unsigned width){
+        char str[24];
+        itoa(num, str, 10);
+        Append(buffer, pos, str, width);
+    }
+public:
+    SlabInfoDevice(const char* name) : Device(name, TypeGenericDevice){
+        flags = FS_NODE_FILE;
+    }
+
+    ssize_t Read(size_t offset, size_t size, uint8_t* buffer){
+        // Caches are only ever added to the front of the list and never removed so walk it without the lock
+        SlabCache* caches = __atomic_load_n(&Slab::caches, __ATOMIC_ACQUIRE);
+
+        unsigned count = 0;
+        for(SlabCache* cache = caches; cache; cache = cache->nextCache){
+            count++;
+        }
+
+        size_t capacity = (count + 1) * 160;
+        char* info = (char*)kmalloc(capacity);
+        size_t pos = 0;
+
+        Append(info, pos, "# name", 16);
+        Append(info, pos, "objsize", 8);
+        Append(info, pos, "active", 10);
+        Append(info, pos, "total", 10);
+        Append(info, pos, "slabs", 8);
+        Append(info, pos, "perslab", 8);
+        Append(info, pos, "pages", 6);
+        Append(info, pos, "allocs", 12);
+        Append(info, pos, "cpuhits", 12);
+        info[pos - 1] = '\n';
+
+        for(SlabCache* cache = caches; cache; cache = cache->nextCache){
+            Append(info, pos, cache->name, 16);
+            AppendNumber(info, pos, cache->objectSize, 8);
+            AppendNumber(info, pos, cache->activeObjects, 10);
+            AppendNumber(info, pos, (unsigned long)cache->slabCount * cache->objectsPerSlab, 10);
+            AppendNumber(info, pos, cache->slabCount, 8);
+            AppendNumber(info, pos, cache->objectsPerSlab, 8);
+            AppendNumber(info, pos, cache->pagesPerSlab, 6);
+            AppendNumber(info, pos, cache->allocations, 12);
+            AppendNumber(info, pos, cache->magazineHits, 12);
+            info[pos - 1] = '\n';
+        }
+
+        if(offset >= pos){
+            kfree(info);
+            return 0;
+        }
+
+        if(offset + size > pos){
+            size = pos - offset;
+        }
+
+        memcpy(buffer, info + offset, size);
+        kfree(info);
+
+        return size;
+    }
+};
+
+namespace Slab{
+    void InitializeDevice(){
+        DeviceManager::RegisterDevice(*(new SlabInfoDevice("slabinfo")));
+    }
+}
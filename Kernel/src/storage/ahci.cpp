@@ -12,14 +12,23 @@ namespace AHCI{
 	uintptr_t ahciVirtualAddress;
 	hba_mem_t* ahciHBA;
 
-	Port* ports[32];
+	Port* ports[32] = {nullptr};
+	bool pollCompletions = false; // Set if there is no interrupt vector
 
 	PCIDevice* controllerPCIDevice;
 	uint8_t ahciClassCode = PCI_CLASS_STORAGE;
 	uint8_t ahciSubclass = PCI_SUBCLASS_SATA;
 	
     void InterruptHandler(regs64_t* r){
-        //Log::Info("[AHCI] Interrupt!");
+		uint32_t is = ahciHBA->is;
+
+		for(int i = 0; i < 32; i++){
+			if((is & (1U << i)) && ports[i]){
+				ports[i]->HandleInterrupt();
+			}
+		}
+
+		ahciHBA->is = is; // Clear after the ports, their status is what raised the interrupt
     }
 
 	int Init(){
@@ -42,7 +51,8 @@ namespace AHCI{
 
 		uint8_t irq = controllerPCIDevice->AllocateVector(PCIVectors::PCIVectorAny);
 		if(irq == 0xFF){
-			Log::Warning("[AHCI] Failed to allocate vector!");
+			Log::Warning("[AHCI] Failed to allocate vector, polling for completions");
+			pollCompletions = true;
 		}
 
 		Log::Info("[AHCI] Interrupt Vector: %x, Base Address: %x, Virtual Base Address: %x", irq, ahciBaseAddress, ahciVirtualAddress);
@@ -55,7 +65,9 @@ namespace AHCI{
 			Timer::Wait(1);
 		}
 
-		IDT::RegisterInterruptHandler(irq, InterruptHandler);
+		if(!pollCompletions){
+			IDT::RegisterInterruptHandler(irq, InterruptHandler);
+		}
 
 		/*ahciHBA->ghc = AHCI_GHC_ENABLE | 1; // Reset Controller
 		while(ahciHBA->ghc & 1){
@@ -68,6 +80,9 @@ namespace AHCI{
 		}*/
 
 		ahciHBA->is = 0xffffffff;
+		if(!pollCompletions){
+			ahciHBA->ghc |= AHCI_GHC_IE;
+		}
 
 		for(int i = 0; i < 32; i++){
 			if((pi >> i) & 1){
@@ -6,10 +6,16 @@
 #include <gpt.h>
 #include <ata.h>
 #include <timer.h>
-
-#define HBA_PxIS_TFES   (1 << 30)
+#include <scheduler.h>
+#include <assert.h>
+#include <cpu.h>
 
 namespace AHCI{
+    // Only the kernel heap is DMAed into directly, it is always mapped and can be translated
+    static inline bool IsKernelHeapAddress(uintptr_t addr){
+        return PML4_GET_INDEX(addr) == 511 && PDPT_GET_INDEX(addr) == 511;
+    }
+
 	Port::Port(int num, hba_port_t* portStructure, hba_mem_t* hbaMem){
         registers = portStructure;
 
@@ -45,7 +51,8 @@ namespace AHCI{
         fis->rfis.fis_type = FIS_TYPE_REG_D2H;
         fis->sdbfis[0] = FIS_TYPE_DEV_BITS;
 
-        for(int i = 0; i < 8 /*Support for 8 command slots*/; i++){
+        slotCount = ((hbaMem->cap >> 8) & 0x1F) + 1; // Number of command slots - 1
+        for(int i = 0; i < slotCount; i++){
             commandList[i].prdtl = 1;
 
             phys = Memory::AllocatePhysicalMemoryBlock();
@@ -54,6 +61,12 @@ namespace AHCI{
 
             commandTables[i] = (hba_cmd_tbl_t*)Memory::GetIOMapping(phys);
             memset(commandTables[i],0,PAGE_SIZE_4K);
+
+            // The PRDT lists every page so they do not have to be contiguous
+            bounceBuffers[i] = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(AHCI_BOUNCE_PAGES));
+            for(int j = 0; j < AHCI_BOUNCE_PAGES; j++){
+                Memory::KernelMapVirtualMemory4K(Memory::AllocatePhysicalMemoryBlock(), reinterpret_cast<uintptr_t>(bounceBuffers[i]) + j * PAGE_SIZE_4K, 1);
+            }
         }
 
         registers->sctl |= (SCTL_PORT_IPM_NOPART | SCTL_PORT_IPM_NOSLUM | SCTL_PORT_IPM_NODSLP);
@@ -62,8 +75,8 @@ namespace AHCI{
             registers->cmd &= ~HBA_PxCMD_ASP; // Disable aggressive slumber and partial
         }
 
-        registers->is = 0; // Clear interrupts
-        registers->ie = 1;
+        registers->is = 0xFFFFFFFF; // Clear interrupts
+        registers->ie = 0; // Enabled once the port is ready
         registers->fbs &= ~(0xFFFFF000U);
 
         registers->cmd |= HBA_PxCMD_POD;
@@ -131,13 +144,25 @@ namespace AHCI{
             return;
         }
 
-        bufPhys = Memory::AllocatePhysicalMemoryBlock();
-        bufVirt = Memory::KernelAllocate4KPages(1);
-        Memory::KernelMapVirtualMemory4K(bufPhys, (uintptr_t)bufVirt, 1);
+        startCMD(registers); // The command engine keeps running from here on
 
-        status = AHCIStatus::Active;
+        Identify(hbaMem->cap & AHCI_CAP_NCQ);
+
+        int usableSlots = slotCount;
+        if(ncq){
+            // Recovering from a failed queued command happens in the interrupt handler, whilst other slots may be in the middle of being set up
+            recoverySlot = --usableSlots;
+        }
+
+        queueDepth = usableSlots;
+        freeSlots = (usableSlots == AHCI_MAX_SLOTS) ? 0xFFFFFFFF : ((1U << usableSlots) - 1);
+        slotSemaphore.SetValue(usableSlots);
 
-        Identify();
+        ports[num] = this; // Reading the GPT below completes through the interrupt handler
+        registers->is = 0xFFFFFFFF;
+        registers->ie = HBA_PxIS_DHRS | HBA_PxIS_PSS | HBA_PxIS_DSS | HBA_PxIS_SDBS | HBA_PxIS_DPS | HBA_PxIS_ERROR;
+
+        status = AHCIStatus::Active;
 
         Log::Info("[AHCI] Port - SSTS: %x, SCTL: %x, SERR: %x, SACT: %x, Cmd/Status: %x, FBS: %x, IE: %x", registers->ssts, registers->sctl, registers->serr, registers->sact, registers->cmd, registers->fbs, registers->ie);
 
@@ -154,105 +179,162 @@ namespace AHCI{
         InitializePartitions();
     }
 
-    int Port::ReadDiskBlock(uint64_t lba, uint32_t count, void* _buffer){
-        uint64_t blockCount = ((count + 511) / 512);
-        uint8_t* buffer = reinterpret_cast<uint8_t*>(_buffer);
-        
-        while(blockCount >= 8 && count){
-            uint64_t size;
-            if(count < 512 * 8) size = count;
-            else size = 512 * 8;
 
-            if(!size) continue;
+    int Port::ReadDiskBlock(uint64_t lba, uint32_t count, void* buffer){
+        return Transfer(lba, count, reinterpret_cast<uint8_t*>(buffer), false);
+    }
+
+    int Port::WriteDiskBlock(uint64_t lba, uint32_t count, void* buffer){
+        return Transfer(lba, count, reinterpret_cast<uint8_t*>(buffer), true);
+    }
+
+    int Port::Transfer(uint64_t lba, uint32_t size, uint8_t* buffer, bool write){
+        while(size){
+            uint32_t chunk;
+            bool bounce = !IsKernelHeapAddress(reinterpret_cast<uintptr_t>(buffer)) || (reinterpret_cast<uintptr_t>(buffer) & 1) || size < 512;
+
+            if(bounce){
+                chunk = size;
+                if(chunk > AHCI_BOUNCE_PAGES * PAGE_SIZE_4K) chunk = AHCI_BOUNCE_PAGES * PAGE_SIZE_4K;
+            } else {
+                chunk = size & ~511U; // Any partial sector at the end goes through the bounce buffer
+                if(chunk > AHCI_MAX_TRANSFER_PAGES * PAGE_SIZE_4K) chunk = AHCI_MAX_TRANSFER_PAGES * PAGE_SIZE_4K;
+            }
 
-            if(Access(lba, 8, 0)){ // LBA, 2 blocks, read
-                return 1; // Error Reading Sectors
+            if(int e = Issue(lba, chunk, buffer, write, bounce)){
+                return e;
             }
 
-            memcpy(buffer, bufVirt, size);
-            buffer += size;
-            lba += 8;
-            blockCount -= 8;
-            count -= size;
+            buffer += chunk;
+            lba += (chunk + 511) / 512;
+            size -= chunk;
         }
 
-        while(blockCount >= 2 && count){
-            uint64_t size;
-            if(count < 512 * 2) size = count;
-            else size = 512 * 2;
+        return 0;
+    }
+
+    int Port::Issue(uint64_t lba, uint32_t size, uint8_t* buffer, bool write, bool bounce){
+        uint32_t blockCount = (size + 511) / 512;
+
+        slotSemaphore.Wait();
 
-            if(!size) continue;
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&portLock);
+        int slot = __builtin_ctz(freeSlots);
+        freeSlots &= ~(1U << slot);
+        releaseLock(&portLock);
+        if(intsEnabled) asm("sti");
 
-            if(Access(lba, 2, 0)){ // LBA, 2 blocks, read
-                return 1; // Error Reading Sectors
+        uint8_t* dmaBuffer = buffer;
+        if(bounce){
+            dmaBuffer = bounceBuffers[slot];
+
+            if(write){
+                memcpy(dmaBuffer, buffer, size);
+                if(size % 512){ // Do not write garbage after the end of the data
+                    memset(dmaBuffer + size, 0, blockCount * 512 - size);
+                }
             }
+        }
+
+        uint8_t command;
+        if(ncq){
+            command = write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED;
+        } else {
+            command = write ? ATA_CMD_WRITE_DMA_EX : ATA_CMD_READ_DMA_EX;
+        }
+        SetupCommand(slot, command, lba, blockCount, dmaBuffer, blockCount * 512, write);
+
+        Request request;
+        bool poll = pollCompletions || !intsEnabled; // Cannot block with interrupts disabled
+
+        asm("cli");
+        acquireLock(&portLock);
+        requests[slot] = &request;
+        activeSlots |= 1U << slot;
 
-            memcpy(buffer, bufVirt, size);
-            buffer += size;
-            lba += 2;
-            blockCount -= 2;
-            count -= size;
+        // Zeros have no effect, so only our bit is written in case another command completes meanwhile
+        if(ncq){
+            registers->sact = 1U << slot;
         }
+        registers->ci = 1U << slot;
 
-        while(blockCount-- && count){
-            uint64_t size;
-            if(count < 512) size = count;
-            else size = 512;
+        if(poll){
+            while(!request.done){
+                releaseLock(&portLock);
+                if(intsEnabled) asm("sti");
 
-            if(!size) continue;
+                Scheduler::Yield();
 
-            if(Access(lba, 1, 0)){ // LBA, 1 block, read
-                return 1; // Error Reading Sectors
+                asm("cli");
+                HandleInterrupt();
+                acquireLock(&portLock);
             }
+        } else {
+            while(!request.done){
+                Scheduler::BlockCurrentThreadLocked(request, portLock);
 
-            memcpy(buffer, bufVirt, size);
-            buffer += size;
-            lba++;
+                asm("cli");
+                acquireLock(&portLock);
+            }
         }
 
-        portLock.SetValue(1);
-        return 0;
-    }
+        requests[slot] = nullptr;
+        freeSlots |= 1U << slot;
+        releaseLock(&portLock);
+        if(intsEnabled) asm("sti");
 
-    
-    int Port::WriteDiskBlock(uint64_t lba, uint32_t count, void* _buffer){
-        uint64_t blockCount = ((count / 512 * 512) < count) ? ((count / 512) + 1) : (count / 512);
-        uint8_t* buffer = reinterpret_cast<uint8_t*>(_buffer);
+        if(bounce && !write && !request.status){
+            memcpy(buffer, dmaBuffer, size);
+        }
 
-        while(blockCount-- && count){
-            uint64_t size;
-            if(count < 512) size = count;
-            else size = 512;
+        slotSemaphore.Signal();
 
-            if(!size) continue;
+        if(request.status){
+            Log::Warning("[SATA] Disk Error (LBA: %x, Sectors: %d, Write? %Y)", lba, blockCount, write);
+        }
 
-            memcpy(bufVirt, buffer, size);
+        return request.status;
+    }
 
-            if(Access(lba, 1, 1)){ // LBA, 1 block, write
-                return 1; // Error Reading Sectors
+    int Port::BuildPRDT(hba_cmd_tbl_t* commandTable, uint8_t* buffer, uint32_t size){
+        int entry = -1;
+        uint64_t lastEnd = 0;
+
+        while(size){
+            uintptr_t virt = reinterpret_cast<uintptr_t>(buffer);
+            uint32_t length = PAGE_SIZE_4K - (virt & (PAGE_SIZE_4K - 1));
+            if(length > size) length = size;
+
+            uint64_t phys = Memory::VirtualToPhysicalAddress(virt) + (virt & (PAGE_SIZE_4K - 1));
+
+            if(entry >= 0 && phys == lastEnd && commandTable->prdt_entry[entry].dbc + 1 + length <= 0x400000){ // Physically contiguous with the last entry (up to 4MB each)
+                commandTable->prdt_entry[entry].dbc += length;
+            } else {
+                entry++;
+                assert(entry < AHCI_PRDT_ENTRIES);
+
+                hba_prdt_entry_t* prd = &commandTable->prdt_entry[entry];
+                prd->dba = phys & 0xFFFFFFFF;
+                prd->dbau = (phys >> 32) & 0xFFFFFFFF;
+                prd->rsv0 = 0;
+                prd->dbc = length - 1; // Byte count - 1, always even as the buffer is word aligned
+                prd->rsv1 = 0;
+                prd->i = 0;
             }
 
-            buffer += size;
-            lba++;
+            lastEnd = phys + length;
+            buffer += length;
+            size -= length;
         }
 
-        return 0;
+        return entry + 1;
     }
 
-    int Port::Access(uint64_t lba, uint32_t count, int write){
-        portLock.Wait();
-
-        registers->ie = 0xffffffff; 
-        registers->is = 0; 
-        int spin = 0;
-
-        int slot = FindCmdSlot();
-        if(slot == -1){
-            Log::Warning("[SATA] Could not find command slot!");
-            
-            portLock.Signal();
-            return 2;
-        }
+    void Port::SetupCommand(int slot, uint8_t command, uint64_t lba, uint16_t count, uint8_t* buffer, uint32_t size, bool write){
+        hba_cmd_tbl_t* commandTable = commandTables[slot];
+        memset(commandTable, 0, sizeof(hba_cmd_tbl_t) - sizeof(commandTable->prdt_entry)); // BuildPRDT fills in the entries that are used
 
         hba_cmd_header_t* commandHeader = &commandList[slot];
 
@@ -260,214 +342,197 @@ namespace AHCI{
 
         commandHeader->a = 0;
         commandHeader->w = write;
-        commandHeader->c = 1;
-        commandHeader->p = 1;
+        commandHeader->c = 0;
+        commandHeader->p = 0;
 
         commandHeader->prdbc = 0;
         commandHeader->pmp = 0;
+        commandHeader->prdtl = BuildPRDT(commandTable, buffer, size);
 
-        hba_cmd_tbl_t* commandTable = commandTables[slot];
-        memset(commandTable, 0, sizeof(hba_cmd_tbl_t));
-
-        commandTable->prdt_entry[0].dba = bufPhys & 0xFFFFFFFF;
-        commandTable->prdt_entry[0].dbau = (bufPhys >> 32) & 0xFFFFFFFF;
-        commandTable->prdt_entry[0].dbc = 512 * count - 1; // 512 bytes per sector
-        commandTable->prdt_entry[0].i = 1;
-
-        fis_reg_h2d_t* cmdfis = (fis_reg_h2d_t*)(commandTable->cfis); 
-        memset(commandTable->cfis, 0, sizeof(fis_reg_h2d_t));
+        fis_reg_h2d_t* cmdfis = (fis_reg_h2d_t*)(commandTable->cfis);
 
         cmdfis->fis_type = FIS_TYPE_REG_H2D;
         cmdfis->c = 1;  // Command
         cmdfis->pmport = 0; // Port multiplier
-
-        if(write){
-            cmdfis->command = ATA_CMD_WRITE_DMA_EX;
-        } else {
-            cmdfis->command = ATA_CMD_READ_DMA_EX;
-        }
+        cmdfis->command = command;
  
         cmdfis->lba0 = lba & 0xFF;
         cmdfis->lba1 = (lba >> 8) & 0xFF;
         cmdfis->lba2 = (lba >> 16) & 0xFF;
-        cmdfis->device = 1 << 6;
+        cmdfis->device = 1 << 6; // LBA mode
  
         cmdfis->lba3 = (lba >> 24) & 0xFF;
         cmdfis->lba4 = (lba >> 32) & 0xFF;
         cmdfis->lba5 = (lba >> 40) & 0xFF;
- 
-        cmdfis->countl = count & 0xff;
-        cmdfis->counth = count >> 8;
+
+        if(command == ATA_CMD_READ_FPDMA_QUEUED || command == ATA_CMD_WRITE_FPDMA_QUEUED){
+            // Queued commands take the sector count in the features register and the tag in the count register
+            cmdfis->featurel = count & 0xFF;
+            cmdfis->featureh = count >> 8;
+            cmdfis->countl = slot << 3;
+            cmdfis->counth = 0;
+        } else {
+            cmdfis->countl = count & 0xFF;
+            cmdfis->counth = count >> 8;
+        }
 
         cmdfis->control = 0;
+    }
 
-        spin = 0xFFFFF;
-        while ((registers->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && spin) {
+    int Port::IssuePolled(int slot){
+        int spin = 1000000;
+        while((registers->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && spin){
             spin--;
         }
 
         if(spin <= 0){
             Log::Warning("[SATA] Port Hung");
-            
-            portLock.Signal();
             return 3;
         }
 
-        registers->ie = registers->is = 0xffffffff;
-
-        startCMD(registers);
-        registers->ci |= 1 << slot;
-
-        //Log::Info("SERR: %x, Slot: %x, PxCMD: %x, Int status: %x, Ci: %x, TFD: %x", registers->serr, slot, registers->cmd, registers->is, registers->ci, registers->tfd);
+        registers->is = 0xFFFFFFFF;
+        registers->ci = 1U << slot;
 
-        while(registers->ci & (1 << slot)) {
-            if (registers->is & HBA_PxIS_TFES)   // Task file error
-            {
+        int status = 0;
+        spin = 1000000;
+        while(registers->ci & (1U << slot)){
+            if(registers->is & HBA_PxIS_TFES){ // Task file error
                 Log::Warning("[SATA] Disk Error (SERR: %x)", registers->serr);
-                
-                stopCMD(registers);
-                portLock.Signal();
-                return 1;
+                status = 1;
+                break;
             }
-        }
 
-        spin = 0xFFFFF;
-        while ((registers->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && spin) {
-            spin--;
+            if(!--spin){
+                Log::Warning("[SATA] Command timed out");
+                status = 2;
+                break;
+            }
         }
 
-        stopCMD(registers);
-        
-        if(spin <= 0){
-            Log::Warning("[SATA] Port Hung");
-            
-            portLock.Signal();
-            return 3;
-        }
-        
-       // Log::Info("SERR: %x, Slot: %x, PxCMD: %x, Int status: %x, Ci: %x, TFD: %x", registers->serr, slot, registers->cmd, registers->is, registers->ci, registers->tfd);
-        
-        if (registers->is & HBA_PxIS_TFES) {
-            Log::Warning("[SATA] Disk Error (SERR: %x)", registers->serr);
-            
-            portLock.Signal();
-            return 1;
+        if(status){
+            // Take the command out of the slot
+            stopCMD(registers);
+            registers->serr = registers->serr;
+            registers->is = 0xFFFFFFFF;
+            startCMD(registers);
         }
 
-        portLock.Signal();
-        return 0;
+        return status;
     }
 
-    void Port::Identify(){
-
-        registers->ie = 0xffffffff; 
-        registers->is = 0; 
-        int spin = 0;
+    void Port::Complete(int slot, int status){
+        activeSlots &= ~(1U << slot);
 
-        registers->tfd = 0;
+        if(Request* request = requests[slot]){
+            request->status = status;
+            request->done = true;
 
-        int slot = FindCmdSlot();
-        if(slot == -1){
-            Log::Warning("[SATA] Could not find command slot!");
-            return ;
+            if(request->thread){
+                Scheduler::UnblockThread(request->thread);
+            }
         }
+    }
 
-        hba_cmd_header_t* commandHeader = &commandList[slot];
-
-        commandHeader->cfl = sizeof(fis_reg_h2d_t) / sizeof(uint32_t);
+    void Port::HandleInterrupt(){
+        acquireLock(&portLock);
 
-        commandHeader->a = 0;
-        commandHeader->w = 0;
-        commandHeader->c = 1;
-        commandHeader->p = 1;
+        uint32_t interruptStatus = registers->is;
+        registers->is = interruptStatus; // Write 1 to clear
 
-        commandHeader->prdbc = 0;
-        commandHeader->pmp = 0;
+        if(interruptStatus & HBA_PxIS_ERROR){
+            Log::Warning("[SATA] Port error (IS: %x, TFD: %x, SERR: %x, SACT: %x, CI: %x)", interruptStatus, registers->tfd, registers->serr, registers->sact, registers->ci);
 
-        hba_cmd_tbl_t* commandTable = commandTables[slot];
-        memset(commandTable, 0, sizeof(hba_cmd_tbl_t));
+            uint32_t outstanding = registers->ci | registers->sact;
+            int failed = ncq ? -1 : static_cast<int>((registers->cmd & HBA_PxCMD_CCS) >> 8); // Commands are carried out one at a time without NCQ
 
-        commandTable->prdt_entry[0].dba = bufPhys & 0xFFFFFFFF;
-        commandTable->prdt_entry[0].dbau = (bufPhys >> 32) & 0xFFFFFFFF;
-        commandTable->prdt_entry[0].dbc = 512 - 1; // 512 bytes per sector
-        commandTable->prdt_entry[0].i = 1;
+            // Stopping the command engine clears every outstanding command
+            stopCMD(registers);
+            registers->serr = registers->serr;
+            registers->is = 0xFFFFFFFF;
+            startCMD(registers);
 
-        fis_reg_h2d_t* cmdfis = (fis_reg_h2d_t*)(commandTable->cfis); 
-        memset(commandTable->cfis, 0, sizeof(fis_reg_h2d_t));
+            if(ncq){
+                failed = RecoverQueue();
+            }
 
-        cmdfis->fis_type = FIS_TYPE_REG_H2D;
-        cmdfis->c = 1;  // Command
-        cmdfis->pmport = 0; // Port multiplier
-        cmdfis->command = ATA_CMD_IDENTIFY;
- 
-        cmdfis->lba0 = 0;
-        cmdfis->lba1 = 0;
-        cmdfis->lba2 = 0;
-        cmdfis->device = 0;
- 
-        cmdfis->lba3 = 0;
-        cmdfis->lba4 = 0;
-        cmdfis->lba5 = 0;
- 
-        cmdfis->countl = 0;
-        cmdfis->counth = 0;
+            if(failed >= 0 && !(activeSlots & outstanding & (1U << failed))){
+                failed = -1; // Not a command we know of
+            }
 
-        cmdfis->control = 0;
+            // Only the command that failed gets an error (all of them if we do not know which), the rest are issued again.
+            // Their command tables are left as they were, and the error fails a command every time so this ends.
+            uint32_t requeue = 0;
+            for(int i = 0; i < slotCount; i++){
+                if(!(activeSlots & (1U << i))){
+                    continue;
+                }
+
+                if(!(outstanding & (1U << i))){
+                    Complete(i, 0); // Finished before the error
+                } else if(failed < 0 || failed == i){
+                    Complete(i, 1);
+                } else {
+                    requeue |= 1U << i;
+                }
+            }
 
-        while ((registers->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && spin < 1000000) {
-            spin++;
-        }
+            if(requeue){
+                if(ncq){
+                    registers->sact = requeue;
+                }
+                registers->ci = requeue;
+            }
+        } else {
+            uint32_t completed = activeSlots & ~(registers->ci | registers->sact);
+            while(completed){
+                int slot = __builtin_ctz(completed);
+                completed &= ~(1U << slot);
 
-        if(spin >= 1000000){
-            Log::Warning("[SATA] Port Hung");
-            return;
+                Complete(slot, 0);
+            }
         }
 
-        registers->ie = registers->is = 0xffffffff;
+        releaseLock(&portLock);
+    }
 
-        startCMD(registers);
-        registers->ci |= 1 << slot;
+    int Port::RecoverQueue(){
+        uint8_t* log = bounceBuffers[recoverySlot];
+        SetupCommand(recoverySlot, ATA_CMD_READ_LOG_EX, ATA_LOG_NCQ_ERROR, 1, log, 512, false);
 
-        //Log::Info("SERR: %x, Slot: %x, PxCMD: %x, Int status: %x, Ci: %x, TFD: %x", registers->serr, slot, registers->cmd, registers->is, registers->ci, registers->tfd);
+        int status = IssuePolled(recoverySlot);
+        registers->is = 0xFFFFFFFF;
 
-        while(registers->ci & (1 << slot)) {
-            if (registers->is & HBA_PxIS_TFES)   // Task file error
-            {
-                Log::Warning("[SATA] Disk Error (SERR: %x)", registers->serr);
-                stopCMD(registers);
-                return;
-            }
+        if(status){
+            Log::Warning("[SATA] Failed to read the NCQ error log");
+            return -1;
+        } else if(log[0] & ATA_LOG_NCQ_ERROR_NQ){
+            return -1;
         }
-        
-        stopCMD(registers);
 
-        spin = 0xFFFFF;
-        while ((registers->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && spin) {
-            spin--;
-        }
+        return log[0] & ATA_LOG_NCQ_ERROR_TAG;
+    }
 
-       // Log::Info("SERR: %x, Slot: %x, PxCMD: %x, Int status: %x, Ci: %x, TFD: %x", registers->serr, slot, registers->cmd, registers->is, registers->ci, registers->tfd);
-        
-        if (registers->is & HBA_PxIS_TFES) {
-            Log::Warning("[SATA] Disk Error (SERR: %x)", registers->serr);
-            stopCMD(registers);
+    void Port::Identify(bool hbaNCQ){
+        uint16_t* identify = reinterpret_cast<uint16_t*>(bounceBuffers[0]);
+        memset(identify, 0, 512);
+
+        SetupCommand(0, ATA_CMD_IDENTIFY, 0, 0, bounceBuffers[0], 512, false);
+        reinterpret_cast<fis_reg_h2d_t*>(commandTables[0]->cfis)->device = 0;
+
+        if(IssuePolled(0)){
+            Log::Warning("[SATA] Failed to identify drive");
             return;
         }
-        return;
-    }
 
-    int Port::FindCmdSlot(){
-        // If not set in SACT and CI, the slot is free
-        uint32_t slots = (registers->sact | registers->ci);
-        for (int i=0; i<8; i++)
-        {
-            if ((slots&1) == 0)
-                return i;
-            slots >>= 1;
+        if(hbaNCQ && (identify[76] & (1 << 8)) && slotCount > 1){ // Word 76 bit 8 is set if the drive supports NCQ, a slot is kept for recovery
+            ncq = true;
+
+            int queueDepth = (identify[75] & 0x1F) + 1;
+            if(queueDepth < slotCount){
+                slotCount = queueDepth;
+            }
         }
 
-        return -1;
+        Log::Info("[SATA] NCQ? %Y, Command slots: %d", ncq, slotCount);
     }
 }
-
-
@@ -0,0 +1,349 @@
+#include <blockqueue.h>
+
+#include <device.h>
+#include <timer.h>
+#include <cpu.h>
+#include <liballoc.h>
+#include <string.h>
+#include <logging.h>
+
+namespace BlockLayer{
+    lock_t queueListLock = 0;
+    BlockQueue* queues = nullptr;
+}
+
+int BlockRequest::Wait(){
+    if(!queue){
+        return status; // Never queued
+    }
+
+    return queue->Wait(this);
+}
+
+void BlockPlug::Unplug(){
+    while(requests){
+        // Queue every request for the same disk under one acquisition of its lock
+        BlockQueue* queue = requests->queue;
+
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&queue->queueLock);
+
+        BlockRequest** link = &requests;
+        while(*link){
+            BlockRequest* request = *link;
+            if(request->queue == queue){
+                *link = request->next;
+                queue->Insert(request);
+            } else {
+                link = &request->next;
+            }
+        }
+
+        releaseLock(&queue->queueLock);
+        if(intsEnabled) asm("sti");
+    }
+}
+
+BlockQueue::BlockQueue(DiskDevice* disk) : disk(disk){
+    memset(&stats, 0, sizeof(Statistics));
+
+    bool intsEnabled = CheckInterrupts();
+    asm("cli");
+    acquireLock(&BlockLayer::queueListLock);
+    nextQueue = BlockLayer::queues;
+    BlockLayer::queues = this;
+    releaseLock(&BlockLayer::queueListLock);
+    if(intsEnabled) asm("sti");
+}
+
+void BlockQueue::Submit(BlockRequest* request, BlockPlug* plug){
+    request->queue = this;
+    request->done = false;
+    request->status = 0;
+    request->submitted = Timer::GetSystemUptimeNs();
+    request->deadline = request->submitted + (request->write ? BLOCK_WRITE_EXPIRE : BLOCK_READ_EXPIRE);
+
+    if(plug){
+        request->next = plug->requests;
+        plug->requests = request;
+        return;
+    }
+
+    bool intsEnabled = CheckInterrupts();
+    asm("cli");
+    acquireLock(&queueLock);
+    Insert(request);
+    releaseLock(&queueLock);
+    if(intsEnabled) asm("sti");
+}
+
+int BlockQueue::Wait(BlockRequest* request){
+    bool intsEnabled = CheckInterrupts();
+    asm("cli");
+    acquireLock(&queueLock);
+
+    while(!request->done){
+        unsigned depth = disk->queueDepth ? disk->queueDepth : 1;
+
+        // Without interrupts we cannot sleep, so dispatch regardless of the depth and leave it to the driver
+        if(pending && (inFlight < depth || !intsEnabled)){
+            BlockRequest* batch = NextBatch();
+            inFlight++;
+
+            releaseLock(&queueLock);
+            if(intsEnabled) asm("sti");
+
+            Dispatch(batch); // Returns with the lock held
+            continue;
+        }
+
+        if(!intsEnabled){
+            releaseLock(&queueLock); // Our request is being dispatched by someone else
+            asm("pause");
+            acquireLock(&queueLock);
+            continue;
+        }
+
+        Scheduler::BlockCurrentThreadLocked(waiters, queueLock);
+
+        asm("cli");
+        acquireLock(&queueLock);
+    }
+
+    releaseLock(&queueLock);
+    if(intsEnabled) asm("sti");
+
+    return request->status;
+}
+
+int BlockQueue::Read(uint64_t lba, uint32_t size, void* buffer){
+    BlockRequest request(lba, size, buffer, false);
+
+    Submit(&request);
+    return Wait(&request);
+}
+
+int BlockQueue::Write(uint64_t lba, uint32_t size, void* buffer){
+    BlockRequest request(lba, size, buffer, true);
+
+    Submit(&request);
+    return Wait(&request);
+}
+
+BlockQueue::Statistics BlockQueue::GetStatistics(){
+    bool intsEnabled = CheckInterrupts();
+    asm("cli");
+    acquireLock(&queueLock);
+
+    Statistics s = stats;
+    s.pending = pendingCount;
+    s.inFlight = inFlight;
+
+    releaseLock(&queueLock);
+    if(intsEnabled) asm("sti");
+
+    return s;
+}
+
+void BlockQueue::Insert(BlockRequest* request){
+    BlockRequest** link = &pending;
+    while(*link && (*link)->lba <= request->lba){
+        link = &(*link)->next;
+    }
+
+    request->next = *link;
+    *link = request;
+    pendingCount++;
+
+    unsigned depth = pendingCount + inFlight;
+    stats.requests++;
+    stats.depthSum += depth;
+    if(depth > stats.maxDepth){
+        stats.maxDepth = depth;
+    }
+}
+
+BlockRequest* BlockQueue::NextBatch(){
+    uint64_t now = Timer::GetSystemUptimeNs();
+
+    BlockRequest** startLink = nullptr; // First request at or after the head
+    BlockRequest** expiredLink = nullptr; // Request furthest past its deadline
+    for(BlockRequest** link = &pending; *link; link = &(*link)->next){
+        BlockRequest* request = *link;
+
+        if(request->deadline <= now && (!expiredLink || request->deadline < (*expiredLink)->deadline)){
+            expiredLink = link;
+        }
+
+        if(!startLink && request->lba >= headPosition){
+            startLink = link;
+        }
+    }
+
+    if(expiredLink){
+        startLink = expiredLink;
+        stats.expired++;
+    } else if(!startLink){
+        startLink = &pending; // Back to the start of the disk
+    }
+
+    BlockRequest* start = *startLink;
+    BlockRequest* last = start;
+
+    unsigned count = 1;
+    uint32_t size = start->size;
+    uint64_t end = start->lba + (start->size + disk->blocksize - 1) / disk->blocksize;
+
+    // Requests ending part way into a block cannot be merged with the next
+    while(last->next && !(last->size % disk->blocksize) && last->next->write == start->write
+            && last->next->lba == end && size + last->next->size <= BLOCK_MAX_MERGE_SIZE){
+        last = last->next;
+
+        size += last->size;
+        end += (last->size + disk->blocksize - 1) / disk->blocksize;
+        count++;
+    }
+
+    *startLink = last->next;
+    last->next = nullptr;
+
+    pendingCount -= count;
+    headPosition = end;
+
+    stats.dispatched++;
+    stats.merged += count - 1;
+
+    return start;
+}
+
+void BlockQueue::Dispatch(BlockRequest* batch){
+    int status;
+    if(!batch->next){
+        status = batch->write ? disk->WriteDiskBlock(batch->lba, batch->size, batch->buffer) : disk->ReadDiskBlock(batch->lba, batch->size, batch->buffer);
+    } else {
+        uint32_t size = 0;
+        for(BlockRequest* request = batch; request; request = request->next){
+            size += request->size;
+        }
+
+        uint8_t* buffer = reinterpret_cast<uint8_t*>(kmalloc(size));
+
+        uint32_t offset = 0;
+        if(batch->write){
+            for(BlockRequest* request = batch; request; request = request->next){
+                memcpy(buffer + offset, request->buffer, request->size);
+                offset += request->size;
+            }
+
+            status = disk->WriteDiskBlock(batch->lba, size, buffer);
+        } else {
+            status = disk->ReadDiskBlock(batch->lba, size, buffer);
+
+            for(BlockRequest* request = batch; request && !status; request = request->next){
+                memcpy(request->buffer, buffer + offset, request->size);
+                offset += request->size;
+            }
+        }
+
+        kfree(buffer);
+    }
+
+    uint64_t now = Timer::GetSystemUptimeNs();
+    uint64_t totalLatency = 0;
+    uint64_t maxLatency = 0;
+    unsigned count = 0;
+
+    BlockRequest* request = batch;
+    while(request){
+        BlockRequest* next = request->next; // The request belongs to its waiter again once done is set
+
+        uint64_t latency = now - request->submitted;
+        totalLatency += latency;
+        count++;
+        if(latency > maxLatency){
+            maxLatency = latency;
+        }
+
+        request->status = status;
+        request->done = true;
+
+        request = next;
+    }
+
+    asm("cli");
+    acquireLock(&queueLock);
+
+    stats.completed += count;
+    stats.totalLatency += totalLatency;
+    if(maxLatency > stats.maxLatency){
+        stats.maxLatency = maxLatency;
+    }
+
+    inFlight--;
+    WakeWaiters();
+}
+
+void BlockQueue::WakeWaiters(){
+    while(waiters.blocked.get_length()){
+        Scheduler::UnblockThread(waiters.blocked.remove_at(0));
+    }
+}
+
+namespace BlockLayer{
+    // Reports the statistics of every disk, one line each
+    class BlockStatDevice : public Device{
+    public:
+        BlockStatDevice(const char* name) : Device(name, TypeGenericDevice){
+            flags = FS_NODE_FILE;
+        }
+
+        ssize_t Read(size_t offset, size_t size, uint8_t* buffer){
+            const char* names[] = {"requests", "merged", "dispatched", "expired", "pending", "in_flight", "queue_depth", "avg_depth", "max_depth", "avg_latency_us", "max_latency_us"};
+
+            char text[2048];
+            text[0] = 0;
+
+            bool intsEnabled = CheckInterrupts();
+            asm("cli");
+            acquireLock(&queueListLock);
+            BlockQueue* queue = queues;
+            releaseLock(&queueListLock);
+            if(intsEnabled) asm("sti");
+
+            for(; queue && strlen(text) < sizeof(text) - 384; queue = queue->nextQueue){ // Queues are never removed
+                BlockQueue::Statistics s = queue->GetStatistics();
+
+                uint64_t values[] = {s.requests, s.merged, s.dispatched, s.expired, s.pending, s.inFlight, queue->GetDisk()->queueDepth,
+                    s.requests ? s.depthSum / s.requests : 0, s.maxDepth, s.completed ? s.totalLatency / s.completed / 1000 : 0, s.maxLatency / 1000};
+
+                strcat(text, queue->GetDisk()->GetName());
+                strcat(text, ":");
+                for(unsigned i = 0; i < sizeof(values) / sizeof(uint64_t); i++){
+                    char number[24];
+                    strcat(text, " ");
+                    strcat(text, names[i]);
+                    strcat(text, " ");
+                    strcat(text, itoa(values[i], number, 10));
+                }
+                strcat(text, "\n");
+            }
+
+            size_t length = strlen(text);
+            if(offset >= length){
+                return 0;
+            }
+
+            if(offset + size > length){
+                size = length - offset;
+            }
+
+            memcpy(buffer, text + offset, size);
+            return size;
+        }
+    };
+
+    void Initialize(){
+        DeviceManager::RegisterDevice(*(new BlockStatDevice("blockstat")));
+    }
+}
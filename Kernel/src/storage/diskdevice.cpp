@@ -1,5 +1,6 @@
 #include <device.h>
 
+#include <blockqueue.h>
 #include <fs/fat32.h>
 #include <fs/ext2.h>
 #include <logging.h>
@@ -15,6 +16,8 @@ DiskDevice::DiskDevice() : Device(TypeDiskDevice){
     itoa(nextDeviceNumber++, buf + 2, 10);
 
     SetName(buf);
+
+    queue = new BlockQueue(this);
 }
 
 int DiskDevice::InitializePartitions(){
@@ -65,7 +68,7 @@ ssize_t DiskDevice::Read(size_t off, size_t size, uint8_t* buffer){
         return -EINVAL; // Block aligned reads only
     }
 
-    int e = ReadDiskBlock(off / blocksize, size, buffer);
+    int e = queue->Read(off / blocksize, size, buffer);
 
     if(e){
         return -EIO;
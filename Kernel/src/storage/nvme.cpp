@@ -1,9 +1,480 @@
+#include <nvme.h>
+
 #include <pci.h>
+#include <paging.h>
+#include <physicalallocator.h>
 #include <logging.h>
+#include <timer.h>
+#include <idt.h>
+#include <smp.h>
+#include <cpu.h>
+#include <gpt.h>
+#include <string.h>
+#include <assert.h>
+#include <devicemanager.h>
 
 namespace NVMe{
     char* deviceName = "Generic NVMe Controller";
 
+    PCIDevice* controllerPCIDevice = nullptr;
+    volatile Registers* registers = nullptr;
+    uintptr_t doorbellBase = 0;
+    unsigned doorbellStride = 4;
+
+    Queue* adminQueue = nullptr;
+    Queue* ioQueues[NVME_MAX_IO_QUEUES];
+    unsigned ioQueueCount = 0;
+    Queue* cpuQueues[256] = {nullptr}; // I/O queue used by each CPU, by APIC ID
+    bool msix = false; // Each queue has its own vector, delivered to the first CPU using it
+
+    unsigned maxTransferPages = NVME_MAX_TRANSFER_PAGES;
+
+    // Only the kernel heap is DMAed into directly, it is always mapped and can be translated
+    static inline bool IsKernelHeapAddress(uintptr_t addr){
+        return PML4_GET_INDEX(addr) == 511 && PDPT_GET_INDEX(addr) == 511;
+    }
+
+    Queue::Queue(uint16_t id, uint16_t depth, bool bounce) : id(id), depth(depth){
+        sqPhys = Memory::AllocatePhysicalMemoryBlock();
+        submissionQueue = reinterpret_cast<Command*>(Memory::GetIOMapping(sqPhys));
+        memset(submissionQueue, 0, PAGE_SIZE_4K);
+
+        cqPhys = Memory::AllocatePhysicalMemoryBlock();
+        completionQueue = reinterpret_cast<Completion*>(Memory::GetIOMapping(cqPhys));
+        memset((void*)completionQueue, 0, PAGE_SIZE_4K);
+
+        sqDoorbell = reinterpret_cast<uint32_t*>(doorbellBase + (2 * id) * doorbellStride);
+        cqDoorbell = reinterpret_cast<uint32_t*>(doorbellBase + (2 * id + 1) * doorbellStride);
+
+        int slotCount = depth - 1; // The queue is full when the tail is one behind the head
+        for(int i = 0; i < slotCount; i++){
+            prpListPhys[i] = Memory::AllocatePhysicalMemoryBlock();
+            prpLists[i] = reinterpret_cast<uint64_t*>(Memory::GetIOMapping(prpListPhys[i]));
+
+            if(bounce){
+                // Bounce buffers are listed page by page in the PRPs so they do not have to be contiguous
+                bounceBuffers[i] = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(NVME_BOUNCE_PAGES));
+                for(int j = 0; j < NVME_BOUNCE_PAGES; j++){
+                    Memory::KernelMapVirtualMemory4K(Memory::AllocatePhysicalMemoryBlock(), reinterpret_cast<uintptr_t>(bounceBuffers[i]) + j * PAGE_SIZE_4K, 1);
+                }
+            }
+
+            freeSlots |= 1U << i;
+        }
+
+        slotSemaphore.SetValue(slotCount);
+    }
+
+    int Queue::Submit(Command& cmd, uint8_t* buffer, uint32_t size, uint32_t* result){
+        int slot = AcquireSlot();
+
+        if(buffer){
+            BuildPRPs(slot, cmd, buffer, size);
+        }
+
+        int status = Issue(slot, cmd, result);
+        ReleaseSlot(slot);
+
+        return status;
+    }
+
+    int Queue::Transfer(uint32_t nsID, uint64_t lba, uint32_t blockSize, uint8_t* buffer, uint32_t size, bool write, bool bounce){
+        uint32_t blocks = (size + blockSize - 1) / blockSize;
+        int slot = AcquireSlot();
+
+        uint8_t* dmaBuffer = buffer;
+        uint32_t dmaSize = size;
+        if(bounce){
+            dmaBuffer = bounceBuffers[slot];
+            dmaSize = blocks * blockSize; // Whole blocks
+
+            if(write){
+                memcpy(dmaBuffer, buffer, size);
+                memset(dmaBuffer + size, 0, dmaSize - size); // Do not write garbage after the end of the data
+            }
+        }
+
+        Command cmd;
+        memset(&cmd, 0, sizeof(Command));
+        cmd.opcode = write ? NVME_IO_WRITE : NVME_IO_READ;
+        cmd.nsID = nsID;
+        cmd.cdw10 = lba & 0xFFFFFFFF;
+        cmd.cdw11 = lba >> 32;
+        cmd.cdw12 = (blocks - 1) & 0xFFFF; // Number of blocks (0's based)
+
+        BuildPRPs(slot, cmd, dmaBuffer, dmaSize);
+
+        int status = Issue(slot, cmd, nullptr);
+        if(bounce && !write && !status){
+            memcpy(buffer, dmaBuffer, size);
+        }
+
+        ReleaseSlot(slot);
+
+        if(status){
+            Log::Warning("[NVMe] Disk Error (Status: %x, LBA: %x, Blocks: %d, Write? %Y)", status, lba, blocks, write);
+        }
+
+        return status;
+    }
+
+    int Queue::AcquireSlot(){
+        slotSemaphore.Wait();
+
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&queueLock);
+        int slot = __builtin_ctz(freeSlots);
+        freeSlots &= ~(1U << slot);
+        releaseLock(&queueLock);
+        if(intsEnabled) asm("sti");
+
+        return slot;
+    }
+
+    void Queue::ReleaseSlot(int slot){
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&queueLock);
+        freeSlots |= 1U << slot;
+        releaseLock(&queueLock);
+        if(intsEnabled) asm("sti");
+
+        slotSemaphore.Signal();
+    }
+
+    int Queue::Issue(int slot, Command& cmd, uint32_t* result){
+        cmd.commandID = slot;
+
+        Request request;
+        bool intsEnabled = CheckInterrupts();
+        bool poll = polled || !intsEnabled; // Cannot block with interrupts disabled
+
+        asm("cli");
+        acquireLock(&queueLock);
+        requests[slot] = &request;
+
+        submissionQueue[sqTail] = cmd;
+        if(++sqTail >= depth){
+            sqTail = 0;
+        }
+
+        asm volatile("" ::: "memory"); // The entry has to be written before the controller is told about it
+        *sqDoorbell = sqTail;
+
+        while(!request.done){
+            if(poll){
+                releaseLock(&queueLock);
+                if(intsEnabled){
+                    asm("sti");
+                    Scheduler::Yield();
+                    asm("cli");
+                }
+
+                HandleInterrupt();
+                acquireLock(&queueLock);
+            } else {
+                Scheduler::BlockCurrentThreadLocked(request, queueLock);
+
+                asm("cli");
+                acquireLock(&queueLock);
+            }
+        }
+
+        requests[slot] = nullptr;
+        releaseLock(&queueLock);
+        if(intsEnabled) asm("sti");
+
+        if(result){
+            *result = request.result;
+        }
+
+        return request.status;
+    }
+
+    void Queue::BuildPRPs(int slot, Command& cmd, uint8_t* buffer, uint32_t size){
+        uintptr_t virt = reinterpret_cast<uintptr_t>(buffer);
+        uint32_t offset = virt & (PAGE_SIZE_4K - 1);
+
+        cmd.prp1 = Memory::VirtualToPhysicalAddress(virt) + offset;
+        cmd.prp2 = 0;
+
+        if(size <= PAGE_SIZE_4K - offset){
+            return;
+        }
+
+        // Every page after the first is page aligned
+        size -= PAGE_SIZE_4K - offset;
+        virt += PAGE_SIZE_4K - offset;
+
+        if(size <= PAGE_SIZE_4K){
+            cmd.prp2 = Memory::VirtualToPhysicalAddress(virt);
+            return;
+        }
+
+        unsigned entry = 0;
+        while(size){
+            assert(entry < PAGE_SIZE_4K / sizeof(uint64_t));
+            prpLists[slot][entry++] = Memory::VirtualToPhysicalAddress(virt);
+
+            virt += PAGE_SIZE_4K;
+            size -= (size > PAGE_SIZE_4K) ? PAGE_SIZE_4K : size;
+        }
+
+        cmd.prp2 = prpListPhys[slot];
+    }
+
+    void Queue::HandleInterrupt(){
+        acquireLock(&queueLock);
+
+        bool consumed = false;
+        while((completionQueue[cqHead].status & NVME_STATUS_PHASE) == phase){
+            volatile Completion& completion = completionQueue[cqHead];
+
+            uint16_t slot = completion.commandID;
+            if(slot < depth && requests[slot]){
+                Request* request = requests[slot];
+                request->status = NVME_STATUS_CODE(completion.status);
+                request->result = completion.result;
+                request->done = true;
+
+                if(request->thread){
+                    Scheduler::UnblockThread(request->thread);
+                }
+            } else {
+                Log::Warning("[NVMe] Completion for unknown command %d on queue %d", slot, id);
+            }
+
+            if(++cqHead >= depth){
+                cqHead = 0;
+                phase ^= 1;
+            }
+
+            consumed = true;
+        }
+
+        if(consumed){
+            *cqDoorbell = cqHead;
+        }
+
+        releaseLock(&queueLock);
+    }
+
+    Namespace::Namespace(uint32_t nsID, IdentifyNamespace& identify) : DiskDevice(), nsID(nsID){
+        blocksize = 1 << identify.lbaFormats[identify.formattedLBASize & 0xF].lbaDataSize;
+        blockCount = identify.size;
+        queueDepth = ioQueueCount * (ioQueues[0]->depth - 1); // Every slot of every queue
+
+        Log::Info("[NVMe] Namespace %d - Blocks: %u, Block size: %d", nsID, blockCount, blocksize);
+
+        switch(GPT::Parse(this)){
+        case 0:
+            Log::Error("[NVMe] Disk has a corrupted or non-existant GPT. MBR disks are NOT supported.");
+            break;
+        case -1:
+            Log::Error("[NVMe] Disk Error while Parsing GPT for NVMe Namespace");
+            break;
+        }
+
+        Log::Info("[NVMe] Found %d partitions!", partitions.get_length());
+
+        InitializePartitions();
+    }
+
+    int Namespace::ReadDiskBlock(uint64_t lba, uint32_t count, void* buffer){
+        return Transfer(lba, count, reinterpret_cast<uint8_t*>(buffer), false);
+    }
+
+    int Namespace::WriteDiskBlock(uint64_t lba, uint32_t count, void* buffer){
+        return Transfer(lba, count, reinterpret_cast<uint8_t*>(buffer), true);
+    }
+
+    int Namespace::Transfer(uint64_t lba, uint32_t size, uint8_t* buffer, bool write){
+        Queue* queue = cpuQueues[GetCPULocal()->id]; // Any queue would do if we migrate, it only saves contention
+        if(!queue){
+            queue = ioQueues[0];
+        }
+
+        while(size){
+            uint32_t chunk;
+            bool bounce = !IsKernelHeapAddress(reinterpret_cast<uintptr_t>(buffer)) || (reinterpret_cast<uintptr_t>(buffer) & 3) || size < static_cast<uint32_t>(blocksize);
+
+            if(bounce){
+                chunk = size;
+                if(chunk > NVME_BOUNCE_PAGES * PAGE_SIZE_4K) chunk = NVME_BOUNCE_PAGES * PAGE_SIZE_4K;
+            } else {
+                chunk = size - (size % blocksize); // Any partial block at the end goes through the bounce buffer
+                if(chunk > maxTransferPages * PAGE_SIZE_4K) chunk = maxTransferPages * PAGE_SIZE_4K;
+            }
+
+            uint32_t blocks = (chunk + blocksize - 1) / blocksize;
+            if(lba + blocks > blockCount){
+                Log::Warning("[NVMe] Transfer past the end of namespace %d (LBA: %x)", nsID, lba);
+                return 1;
+            }
+
+            if(int e = queue->Transfer(nsID, lba, blocksize, buffer, chunk, write, bounce)){
+                return e;
+            }
+
+            buffer += chunk;
+            lba += blocks;
+            size -= chunk;
+        }
+
+        return 0;
+    }
+
+    void InterruptHandler(regs64_t* r){
+        if(msix){
+            if(Queue* queue = cpuQueues[GetCPULocal()->id]){
+                queue->HandleInterrupt();
+            }
+            return;
+        }
+
+        for(unsigned i = 0; i < ioQueueCount; i++){ // Every queue shares the one vector
+            ioQueues[i]->HandleInterrupt();
+        }
+    }
+
+    bool WaitReady(bool ready){
+        unsigned timeout = NVME_CAP_TO(registers->cap) * 500; // ms
+        if(!timeout) timeout = 500;
+
+        while(timeout--){
+            if(registers->csts & NVME_CSTS_CFS){
+                Log::Error("[NVMe] Controller fatal status!");
+                return false;
+            }
+
+            if(!!(registers->csts & NVME_CSTS_RDY) == ready){
+                return true;
+            }
+
+            Timer::Wait(1);
+        }
+
+        Log::Error("[NVMe] Timed out waiting for controller (CSTS: %x)", registers->csts);
+        return false;
+    }
+
+    int Identify(uint32_t cns, uint32_t nsID, void* buffer){
+        Command cmd;
+        memset(&cmd, 0, sizeof(Command));
+        cmd.opcode = NVME_ADMIN_IDENTIFY;
+        cmd.nsID = nsID;
+        cmd.cdw10 = cns;
+
+        return adminQueue->Submit(cmd, reinterpret_cast<uint8_t*>(buffer), PAGE_SIZE_4K);
+    }
+
+    // Create the completion queue then the submission queue of an I/O queue pair
+    int CreateIOQueue(Queue* queue, uint8_t vector, bool interrupts){
+        Command cmd;
+        memset(&cmd, 0, sizeof(Command));
+        cmd.opcode = NVME_ADMIN_CREATE_CQ;
+        cmd.prp1 = queue->CompletionQueuePhysical();
+        cmd.cdw10 = ((queue->depth - 1) << 16) | queue->id;
+        cmd.cdw11 = (vector << 16) | NVME_QUEUE_PHYS_CONTIG | (interrupts ? NVME_QUEUE_IRQ_ENABLED : 0);
+
+        if(int status = adminQueue->Submit(cmd)){
+            return status;
+        }
+
+        memset(&cmd, 0, sizeof(Command));
+        cmd.opcode = NVME_ADMIN_CREATE_SQ;
+        cmd.prp1 = queue->SubmissionQueuePhysical();
+        cmd.cdw10 = ((queue->depth - 1) << 16) | queue->id;
+        cmd.cdw11 = (queue->id << 16) | NVME_QUEUE_PHYS_CONTIG; // Completion queue ID
+
+        return adminQueue->Submit(cmd);
+    }
+
+    // Create up to one I/O queue per CPU, returns the amount created
+    unsigned CreateIOQueues(uint16_t depth){
+        unsigned count = SMP::processorCount;
+        if(count > NVME_MAX_IO_QUEUES) count = NVME_MAX_IO_QUEUES;
+
+        unsigned msixVectors = controllerPCIDevice->MSIXVectorCount();
+        if(msixVectors > 1){
+            msix = true;
+            if(count > msixVectors - 1) count = msixVectors - 1; // Vector 0 is the admin queue's, which is polled
+        }
+
+        Command cmd;
+        memset(&cmd, 0, sizeof(Command));
+        cmd.opcode = NVME_ADMIN_SET_FEATURES;
+        cmd.cdw10 = NVME_FEATURE_NUMBER_OF_QUEUES;
+        cmd.cdw11 = ((count - 1) << 16) | (count - 1);
+
+        uint32_t allocated;
+        if(adminQueue->Submit(cmd, nullptr, 0, &allocated)){
+            Log::Warning("[NVMe] Failed to set the number of queues, using one");
+            count = 1;
+        } else {
+            unsigned sqCount = (allocated & 0xFFFF) + 1;
+            unsigned cqCount = (allocated >> 16) + 1;
+
+            if(count > sqCount) count = sqCount;
+            if(count > cqCount) count = cqCount;
+        }
+
+        uint8_t sharedVector = 0xFF;
+        if(!msix){
+            sharedVector = controllerPCIDevice->AllocateVector(PCIVectors::PCIVectorAny);
+            if(sharedVector != 0xFF){
+                IDT::RegisterInterruptHandler(sharedVector, InterruptHandler);
+            }
+        }
+
+        // CPUs are spread over the queues in order of APIC ID, the first CPU using a queue receives its interrupts
+        uint8_t queueCPU[NVME_MAX_IO_QUEUES];
+        uint8_t cpuQueueIndex[256];
+        unsigned cpuCount = 0;
+        for(unsigned j = 0; j < 256; j++){
+            if(!SMP::cpus[j]){
+                continue;
+            }
+
+            if(cpuCount < count){
+                queueCPU[cpuCount] = j;
+            }
+            cpuQueueIndex[j] = cpuCount++ % count;
+        }
+
+        for(unsigned i = 0; i < count; i++){
+            Queue* queue = new Queue(i + 1, depth, true);
+            uint8_t cpu = (i < cpuCount) ? queueCPU[i] : 0;
+
+            bool interrupts = false;
+            if(msix){
+                uint8_t vector = controllerPCIDevice->AllocateMSIXVector(i + 1, cpu);
+                if(vector != 0xFF){
+                    IDT::RegisterInterruptHandler(vector, InterruptHandler);
+                    interrupts = true;
+                }
+            } else {
+                interrupts = sharedVector != 0xFF;
+            }
+
+            queue->polled = !interrupts;
+            if(int status = CreateIOQueue(queue, msix ? i + 1 : 0, interrupts)){
+                Log::Error("[NVMe] Failed to create I/O queue %d (Status: %x)", i + 1, status);
+                break; // CPUs without a queue use the first
+            }
+
+            ioQueues[ioQueueCount++] = queue;
+            for(unsigned j = 0; j < 256; j++){
+                if(SMP::cpus[j] && cpuQueueIndex[j] == i){
+                    cpuQueues[j] = queue;
+                }
+            }
+        }
+
+        return ioQueueCount;
+    }
+
     void Initialize(){
         if(!PCI::FindGenericDevice(PCI_CLASS_STORAGE, PCI_SUBCLASS_NVM)){
             Log::Warning("NVMe Controller Not Found!");
@@ -11,6 +482,91 @@ namespace NVMe{
         }
 
         Log::Info("Initializing NVMe Controller...");
-        
+
+        controllerPCIDevice = &PCI::GetGenericPCIDevice(PCI_CLASS_STORAGE, PCI_SUBCLASS_NVM);
+        controllerPCIDevice->SetCommand(controllerPCIDevice->GetCommand() | PCI_CMD_MEMORY_SPACE);
+        controllerPCIDevice->EnableBusMastering();
+
+        uintptr_t baseAddress = controllerPCIDevice->GetBaseAddressRegister(0);
+        uintptr_t virtualAddress = Memory::GetIOMapping(baseAddress);
+        if(virtualAddress == 0xffffffff){
+            Log::Error("[NVMe] Could not map registers (Base Address: %x)", baseAddress);
+            return;
+        }
+
+        registers = reinterpret_cast<Registers*>(virtualAddress);
+
+        uint64_t cap = registers->cap;
+        doorbellBase = virtualAddress + NVME_DOORBELL_BASE;
+        doorbellStride = 4 << NVME_CAP_DSTRD(cap);
+
+        Log::Info("[NVMe] Base Address: %x, Version: %x, Max Queue Entries: %d, Doorbell Stride: %d", baseAddress, registers->version, NVME_CAP_MQES(cap) + 1, doorbellStride);
+
+        if(!(cap & NVME_CAP_CSS_NVM) || NVME_CAP_MPSMIN(cap) > 0){
+            Log::Error("[NVMe] Controller does not support the NVM command set with 4K pages!");
+            return;
+        }
+
+        // Reset the controller
+        registers->cc = registers->cc & ~NVME_CC_EN;
+        if(!WaitReady(false)){
+            return;
+        }
+
+        uint16_t maxDepth = NVME_CAP_MQES(cap) + 1;
+        adminQueue = new Queue(0, maxDepth < NVME_ADMIN_QUEUE_DEPTH ? maxDepth : NVME_ADMIN_QUEUE_DEPTH, false);
+        registers->aqa = ((adminQueue->depth - 1) << 16) | (adminQueue->depth - 1);
+        registers->asq = adminQueue->SubmissionQueuePhysical();
+        registers->acq = adminQueue->CompletionQueuePhysical();
+
+        registers->cc = NVME_CC_CSS_NVM | NVME_CC_MPS(0) | NVME_CC_AMS_RR | NVME_CC_IOSQES(6) /* 64 bytes */ | NVME_CC_IOCQES(4) /* 16 bytes */ | NVME_CC_EN;
+        if(!WaitReady(true)){
+            return;
+        }
+
+        uint8_t* identify = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(1));
+        Memory::KernelMapVirtualMemory4K(Memory::AllocatePhysicalMemoryBlock(), reinterpret_cast<uintptr_t>(identify), 1);
+
+        if(int status = Identify(NVME_IDENTIFY_CONTROLLER, 0, identify)){
+            Log::Error("[NVMe] Failed to identify controller (Status: %x)", status);
+            return;
+        }
+
+        IdentifyController* controller = reinterpret_cast<IdentifyController*>(identify);
+        if(controller->mdts && (1U << controller->mdts) < maxTransferPages){
+            maxTransferPages = 1U << controller->mdts;
+        }
+
+        uint32_t namespaceCount = controller->namespaceCount;
+
+        char model[41];
+        memcpy(model, controller->modelNumber, 40);
+        model[40] = 0;
+        Log::Info("[NVMe] Model: %s, Namespaces: %d, Max Transfer: %dK", model, namespaceCount, maxTransferPages * 4);
+
+        if(!CreateIOQueues(maxDepth < NVME_IO_QUEUE_DEPTH ? maxDepth : NVME_IO_QUEUE_DEPTH)){
+            Log::Error("[NVMe] No I/O queues!");
+            return;
+        }
+
+        Log::Info("[NVMe] I/O queues: %d, MSI-X? %Y", ioQueueCount, msix);
+
+        if(namespaceCount > NVME_MAX_NAMESPACES){
+            namespaceCount = NVME_MAX_NAMESPACES;
+        }
+
+        for(uint32_t i = 1; i <= namespaceCount; i++){
+            if(Identify(NVME_IDENTIFY_NAMESPACE, i, identify)){
+                continue;
+            }
+
+            IdentifyNamespace* ns = reinterpret_cast<IdentifyNamespace*>(identify);
+            if(!ns->size){
+                continue; // Inactive
+            }
+
+            Namespace* device = new Namespace(i, *ns);
+            DeviceManager::RegisterDevice(*device);
+        }
     }
-}
\ No newline at end of file
+}
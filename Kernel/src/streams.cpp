@@ -3,6 +3,10 @@
 #include <assert.h>
 #include <logging.h>
 #include <timer.h>
+#include <cpu.h>
+#include <string.h>
+#include <paging.h>
+#include <physicalallocator.h>
 
 int64_t Stream::Read(void* buffer, size_t len){
     assert(!"Stream::Read called from base class");
@@ -35,94 +39,313 @@ Stream::~Stream(){
 }
 
 DataStream::DataStream(size_t bufSize){
-    bufferSize = bufSize;
-    bufferPos = 0;
+    capacity = 1;
+    while(capacity < bufSize){
+        capacity <<= 1;
+    }
 
-    buffer = reinterpret_cast<uint8_t*>(kmalloc(bufferSize));
+    buffer = reinterpret_cast<uint8_t*>(kmalloc(capacity));
 }
 
 DataStream::~DataStream(){
+    while(pageRuns){
+        FreePageRun(pageRuns);
+    }
+
     kfree(buffer);
 }
 
-int64_t DataStream::Read(void* data, size_t len){
-    acquireLock(&streamLock);
+void DataStream::CopyOut(void* data, size_t pos, size_t len){
+    size_t offset = pos & (capacity - 1);
+    size_t first = capacity - offset; // Bytes before wrapping around
+    if(first > len){
+        first = len;
+    }
 
-    if(len >= bufferPos) len = bufferPos;
+    memcpy(data, buffer + offset, first);
+    memcpy(reinterpret_cast<uint8_t*>(data) + first, buffer, len - first);
+}
 
-    if(!len) {
-        releaseLock(&streamLock);
-        return 0;
+DataStream::PageRun* DataStream::NextPageRun(PageRun* run){
+    bool intsEnabled = CheckInterrupts();
+    asm("cli");
+    acquireLock(&pageLock);
+    PageRun* next = run ? run->next : pageRuns;
+    releaseLock(&pageLock);
+    if(intsEnabled) asm("sti");
+
+    return next;
+}
+
+void DataStream::FreePageRun(PageRun* run){
+    bool intsEnabled = CheckInterrupts();
+    asm("cli");
+    acquireLock(&pageLock);
+    pageRuns = run->next; // Runs are always finished in order
+    if(lastPageRun == run){
+        lastPageRun = nullptr;
     }
+    lentPages -= run->count;
+    releaseLock(&pageLock);
+    if(intsEnabled) asm("sti");
 
-    memcpy(data, buffer, len);
-    
-    memcpy(buffer, buffer + len, bufferPos - len);
-    bufferPos -= len;
+    if(run->mapping){
+        Memory::KernelFree4KPages(run->mapping, run->count);
+    }
 
-    releaseLock(&streamLock);
-    
-    return len;
+    for(unsigned i = 0; i < run->count; i++){
+        Memory::FreePhysicalMemoryBlock(run->blocks[i]);
+    }
+
+    kfree(run->blocks);
+    delete run;
 }
 
-int64_t DataStream::Peek(void* data, size_t len){
-    acquireLock(&streamLock);
+unsigned DataStream::WritePages(void* data, unsigned count){
+    bool intsEnabled = CheckInterrupts();
+    asm("cli");
+    acquireLock(&pageLock);
+    unsigned room = DATASTREAM_MAX_LENT_PAGES - lentPages; // Only the reader frees pages up in the meantime
+    releaseLock(&pageLock);
+    if(intsEnabled) asm("sti");
+
+    if(count > room){
+        count = room;
+    }
 
-    if(len >= bufferPos) len = bufferPos;
+    if(count < DATASTREAM_LEND_MIN){
+        return 0;
+    }
+
+    PageRun* run = new PageRun;
+    run->blocks = reinterpret_cast<uint64_t*>(kmalloc(count * sizeof(uint64_t)));
+    run->count = count;
 
-    if(!len) {
-        releaseLock(&streamLock);
+    if(!Memory::LendPages(reinterpret_cast<uintptr_t>(data), count, run->blocks, Scheduler::GetCurrentProcess()->addressSpace)){
+        kfree(run->blocks);
+        delete run;
         return 0;
     }
 
-    memcpy(data, buffer, len);
+    run->position = writePos;
+
+    asm("cli");
+    acquireLock(&pageLock);
+    if(lastPageRun){
+        lastPageRun->next = run;
+    } else {
+        pageRuns = run;
+    }
+    lastPageRun = run;
+    lentPages += count;
+    // With the run, so the reader cannot take bytes off before they are counted
+    __atomic_add_fetch(&pageBytes, count * PAGE_SIZE_4K, __ATOMIC_SEQ_CST);
+    releaseLock(&pageLock);
+    if(intsEnabled) asm("sti");
+
+    return count;
+}
+
+size_t DataStream::ReadData(uint8_t* data, size_t len, bool peek){
+    size_t pos = readPos;
+    size_t done = 0;
+
+    PageRun* run = nullptr;
+    PageRun* previous = nullptr; // Last run passed whilst peeking
+    size_t runOffset = 0;
+
+    while(done < len){
+        // Any run before end was queued before the data at end was written, so load it before looking for runs
+        size_t end = __atomic_load_n(&writePos, __ATOMIC_SEQ_CST);
+        if(!run){
+            run = NextPageRun(previous);
+            runOffset = run ? run->offset : 0;
+        }
+
+        if(run && run->position == pos){
+            size_t runSize = run->count * PAGE_SIZE_4K;
+            size_t n = runSize - runOffset;
+            if(n > len - done){
+                n = len - done;
+            }
+
+            // Whole pages going to a page aligned buffer are mapped rather than copied
+            if(!peek && n >= PAGE_SIZE_4K && !(runOffset & (PAGE_SIZE_4K - 1)) && !(reinterpret_cast<uintptr_t>(data + done) & (PAGE_SIZE_4K - 1))
+                    && Memory::MapLentPages(reinterpret_cast<uintptr_t>(data + done), n / PAGE_SIZE_4K, run->blocks + runOffset / PAGE_SIZE_4K, Scheduler::GetCurrentProcess()->addressSpace)){
+                n &= ~(PAGE_SIZE_4K - 1ULL);
+            } else {
+                if(!run->mapping){
+                    run->mapping = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(run->count));
+                    for(unsigned i = 0; i < run->count; i++){
+                        Memory::KernelMapVirtualMemory4K(run->blocks[i], reinterpret_cast<uintptr_t>(run->mapping) + i * PAGE_SIZE_4K, 1);
+                    }
+                }
+
+                memcpy(data + done, run->mapping + runOffset, n);
+            }
+
+            done += n;
+            runOffset += n;
+            if(!peek){
+                run->offset = runOffset;
+                __atomic_sub_fetch(&pageBytes, n, __ATOMIC_SEQ_CST);
+            }
+
+            if(runOffset >= runSize){
+                if(peek){
+                    previous = run;
+                } else {
+                    FreePageRun(run);
+                }
+                run = nullptr;
+            }
+            continue;
+        }
+
+        if(run && run->position < end){
+            end = run->position; // Ring data after the run has to wait for it
+        }
+
+        size_t n = end - pos;
+        if(n > len - done){
+            n = len - done;
+        }
+
+        if(!n){
+            break;
+        }
+
+        CopyOut(data + done, pos, n);
+        pos += n;
+        done += n;
+
+        if(!peek){
+            __atomic_store_n(&readPos, pos, __ATOMIC_SEQ_CST); // Hand the space back to the writer
+        }
+    }
+
+    return done;
+}
+
+int64_t DataStream::Read(void* data, size_t len){
+    readLock.Acquire();
+    len = ReadData(reinterpret_cast<uint8_t*>(data), len, false);
+    readLock.Release();
 
-    releaseLock(&streamLock);
+    if(len){
+        Wake(writers, writerCount);
+    }
+    
+    return len;
+}
+
+int64_t DataStream::Peek(void* data, size_t len){
+    readLock.Acquire();
+    len = ReadData(reinterpret_cast<uint8_t*>(data), len, true);
+    readLock.Release();
     
     return len;
 }
 
 int64_t DataStream::Write(void* data, size_t len){
-    acquireLock(&streamLock);
-    if(bufferPos + len >= bufferSize){
-        void* oldBuffer = buffer;
+    writeLock.Acquire();
 
-        while(bufferPos + len >= bufferSize)
-            bufferSize *= 2;
+    if(len >= DATASTREAM_LEND_MIN * PAGE_SIZE_4K && !(reinterpret_cast<uintptr_t>(data) & (PAGE_SIZE_4K - 1))){
+        size_t pages = len / PAGE_SIZE_4K;
+        if(unsigned lent = WritePages(data, pages > DATASTREAM_MAX_LENT_PAGES ? DATASTREAM_MAX_LENT_PAGES : pages)){
+            writeLock.Release();
 
-        buffer = reinterpret_cast<uint8_t*>(kmalloc(bufferSize));
+            Wake(readers, readerCount);
+            return lent * PAGE_SIZE_4K;
+        }
+    } // Small, unaligned or kernel writes, or too many pages queued, are copied
 
-        memcpy(buffer, oldBuffer, bufferPos);
+    size_t space = capacity - RingUsed();
+    if(len > space) len = space;
 
-        kfree(oldBuffer);
+    size_t pos = writePos;
+    size_t offset = pos & (capacity - 1);
+    size_t first = capacity - offset;
+    if(first > len){
+        first = len;
     }
 
-    memcpy(buffer + bufferPos, data, len);
-    bufferPos += len;
+    memcpy(buffer + offset, data, first);
+    memcpy(buffer, reinterpret_cast<uint8_t*>(data) + first, len - first);
+    __atomic_store_n(&writePos, pos + len, __ATOMIC_SEQ_CST); // Publish the data to the reader
 
-    if(bufferPos > 0 && waiting.get_length() > 0) {
-        while(waiting.get_length()){
-            Scheduler::UnblockThread(waiting.remove_at(0));
-        }
-    }
+    writeLock.Release();
 
-    releaseLock(&streamLock);
+    if(len){
+        Wake(readers, readerCount);
+    }
 
     return len;
 }
 
 int64_t DataStream::Empty(){
-    return !bufferPos;
+    return !Available();
+}
+
+void DataStream::Block(Scheduler::GenericThreadBlocker& blocker, volatile unsigned& waiterCount, bool writer){
+    thread_t* thread = GetCurrentThread();
+    releaseLock(&thread->lock); // Blocked threads can still be killed
+
+    bool intsEnabled = CheckInterrupts();
+    asm("cli");
+    acquireLock(&waitLock);
+
+    // Counted before checking, so anyone changing a position after this point sees us and takes the wait lock
+    __atomic_add_fetch(&waiterCount, 1, __ATOMIC_SEQ_CST);
+    while(!hungUp && thread->state != ThreadStateZombie && (writer ? RingUsed() >= capacity : !Available())){
+        Scheduler::BlockCurrentThreadLocked(blocker, waitLock);
+
+        asm("cli");
+        acquireLock(&waitLock);
+    }
+    __atomic_sub_fetch(&waiterCount, 1, __ATOMIC_SEQ_CST);
+
+    releaseLock(&waitLock);
+    if(intsEnabled) asm("sti");
+}
+
+void DataStream::Wake(Scheduler::GenericThreadBlocker& blocker, volatile unsigned& waiterCount){
+    if(!__atomic_load_n(&waiterCount, __ATOMIC_SEQ_CST)){
+        return; // Nobody is blocked and anyone about to block will see the new position
+    }
+
+    bool intsEnabled = CheckInterrupts();
+    asm("cli");
+    acquireLock(&waitLock);
+    while(blocker.blocked.get_length()){
+        Scheduler::UnblockThread(blocker.blocked.remove_at(0));
+    }
+    releaseLock(&waitLock);
+    if(intsEnabled) asm("sti");
 }
 
 void DataStream::Wait(){
-    if(!Empty()) return;
-    
-    Scheduler::BlockCurrentThread(waiting, streamLock);
+    Block(readers, readerCount, false);
+}
 
-    while(Empty()){
-        Scheduler::Yield();
+void DataStream::WaitForSpace(){
+    Block(writers, writerCount, true);
+}
+
+void DataStream::Hangup(){
+    hungUp = true;
+
+    bool intsEnabled = CheckInterrupts();
+    asm("cli");
+    acquireLock(&waitLock);
+    while(readers.blocked.get_length()){
+        Scheduler::UnblockThread(readers.blocked.remove_at(0));
+    }
+    while(writers.blocked.get_length()){
+        Scheduler::UnblockThread(writers.blocked.remove_at(0));
     }
+    releaseLock(&waitLock);
+    if(intsEnabled) asm("sti");
 }
 
 int64_t PacketStream::Read(void* buffer, size_t len){
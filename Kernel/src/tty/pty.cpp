@@ -173,7 +173,7 @@ size_t PTY::Master_Read(char* buffer, size_t count){
 }
 
 size_t PTY::Slave_Read(char* buffer, size_t count){
-	thread_t* thread = GetCPULocal()->currentThread;
+	thread_t* thread = GetCurrentThread();
 
 	while(thread->state != ThreadStateZombie && IsCanonical() && !slave.lines) Scheduler::BlockCurrentThread(slaveBlocker);
 	while(thread->state != ThreadStateZombie && !IsCanonical() && !slave.bufferPos) Scheduler::BlockCurrentThread(slaveBlocker);
@@ -15,6 +15,7 @@
 #define LEMON_MESSAGE_PROTOCOL_WMEVENT 1
 #define LEMON_MESSAGE_PROTOCOL_WMCMD 2
 #define LEMON_MESSAGE_PROTOCOL_SHELLCMD 3
+#define LEMON_MESSAGE_PROTOCOL_RING 4 // Switch a connection to a MessageChannel, carries its shared memory key
 
 #include <stddef.h>
 
@@ -1,7 +1,9 @@
 #pragma once
 
 #include <core/message.h>
+#include <core/msgring.h>
 #include <string.h>
+#include <map>
 
 namespace Lemon{
     struct LemonMessageInfo {
@@ -20,32 +22,62 @@ namespace Lemon{
 
     class MessageClient : public MessageHandler{
         std::deque<std::shared_ptr<LemonMessage>> queue;
+        std::shared_ptr<LemonMessage> peeked; // Taken off the socket by Peek
         
         pollfd sock;
 
+        MessageChannel* channel = nullptr; // Set once messages go through shared memory
+        uint64_t channelKey = 0;
+        uint32_t nudgesRead = 0;
+
         std::vector<pollfd> GetFileDescriptors();
+        void SendRing(const void* msg, uint32_t length);
     public:
         MessageClient();
         ~MessageClient();
 
         void Connect(sockaddr_un& address, socklen_t len);
+        // Exchange messages with the server through a MessageChannel instead of the socket,
+        // which is then only used to wake whoever waits on it. Returns 0 on success, otherwise the socket is still used
+        int EnableRing();
 
         std::shared_ptr<LemonMessage> Poll();
         std::shared_ptr<LemonMessage> PollSync();
         void Wait();
         void Send(LemonMessage* msg);
         void Send(const Message& msg);
+
+        // Next message without copying it out, valid until Consume. Returns nullptr if there is none
+        const LemonMessage* Peek();
+        void Consume();
     };
 
     class MessageServer : public MessageHandler{
-        std::vector<pollfd> fds;
+        // Client that switched to a MessageChannel
+        struct RingClient {
+            MessageChannel* channel;
+            uint64_t key;
+            uint32_t nudgesRead = 0;
+            bool awake = true; // Checked on every Poll, otherwise only once the client nudges the socket
+        };
+
         std::deque<std::shared_ptr<LemonMessageInfo>> queue;
 
         pollfd sock;
+        int epollFd; // Watches the listening socket and every client
+
+        std::map<int, RingClient> rings; // By client descriptor
+        std::deque<int> awakeRings; // Taken in turn so one busy client cannot hold up the rest
 
         std::vector<pollfd> GetFileDescriptors();
+        void AcceptRing(int fd, uint64_t key);
+        void CloseRing(int fd);
+        std::shared_ptr<LemonMessageInfo> PollRings();
+        // Returns false if the client does not use a channel
+        bool SendRing(int fd, const void* msg, uint32_t length);
     public:
         MessageServer(sockaddr_un& address, socklen_t len);
+        ~MessageServer();
 
         std::shared_ptr<LemonMessageInfo> Poll();
         void Send(LemonMessage* msg, int fd);
@@ -53,8 +85,11 @@ namespace Lemon{
     };
 
     class MessageMultiplexer {
-        std::vector<MessageHandler*> handlers;
+        int epollFd; // The descriptors of every source are registered once in AddSource
     public:
+        MessageMultiplexer();
+        ~MessageMultiplexer();
+
         void AddSource(MessageHandler& handler);
         bool PollSync();
     };
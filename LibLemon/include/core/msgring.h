@@ -0,0 +1,66 @@
+#pragma once
+
+#include <core/message.h>
+
+#include <stdint.h>
+
+#define MESSAGE_RING_SIZE (128 * 1024) // Bytes of messages in each direction, a power of 2 that fits the largest message twice
+#define MESSAGE_RING_PADDING 0 // Magic of the filler before a message that would have wrapped around
+
+#define MESSAGE_CHANNEL_MAGIC 0x474E4952 // "RING"
+
+namespace Lemon{
+    enum {
+        MessageRingAwake, // The consumer looks at the ring again by itself
+        MessageRingFutex, // The consumer sleeps on the doorbell futex
+        MessageRingSocket, // The consumer waits for a byte on the socket (e.g. with poll)
+    };
+
+    // Single producer, single consumer queue of messages in shared memory.
+    // Messages are stored whole so the consumer reads them in place. The producer only wakes the consumer
+    // if it went to sleep (see Sleep and Notify), so a burst of messages costs at most one wake up.
+    struct MessageRing {
+        volatile uint32_t head; // Consumer position, free running
+        uint8_t rsvd0[60]; // head and tail on separate cache lines
+
+        volatile uint32_t tail; // Producer position
+        uint8_t rsvd1[60];
+
+        volatile int doorbell; // Futex, incremented whenever the consumer is woken through it
+        volatile int sleeping; // MessageRing*, set by the consumer and taken by the producer in Notify
+        volatile uint32_t nudges; // Bytes written to the socket by Notify
+        uint8_t rsvd2[52];
+
+        uint8_t buffer[MESSAGE_RING_SIZE];
+
+        void Initialize();
+
+        // Producer
+        // Copy in a message (header and data), returns false if there is no room
+        bool Write(const void* msg, uint32_t length);
+        // Wake the consumer if it is sleeping, sock is used if it waits on the socket
+        void Notify(int sock);
+
+        // Consumer
+        // Next message, which stays in place until Consume. Returns nullptr if the ring is empty
+        LemonMessage* Peek();
+        void Consume();
+        // Ask the producer to wake us by the given means on the next message
+        // Returns true if a message arrived in the meantime, in which case the caller should not sleep
+        bool Sleep(int how);
+        // Sleep on the doorbell until there is a message
+        void Wait();
+        // Read the bytes Notify wrote to the socket, nudgesRead is the amount read so far
+        void DrainNudges(int sock, uint32_t& nudgesRead);
+    };
+
+    // Shared memory between a MessageClient and a MessageServer, created by the client
+    struct MessageChannel {
+        uint32_t magic;
+        uint32_t ringSize;
+        uint8_t rsvd[56];
+
+        MessageRing toServer;
+        MessageRing toClient;
+    };
+}
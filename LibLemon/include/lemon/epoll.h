@@ -0,0 +1,30 @@
+#pragma once
+
+#ifndef __lemon__
+    #error "Lemon OS Only"
+#endif
+
+#include <stdint.h>
+
+#define EPOLLIN 0x01
+#define EPOLLOUT 0x02
+#define EPOLLPRI 0x04
+#define EPOLLHUP 0x08 // Always reported, whether requested or not
+#define EPOLLERR 0x10
+#define EPOLLONESHOT (1U << 30)
+#define EPOLLET (1U << 31)
+
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
+
+typedef struct lemon_epoll_event {
+    uint32_t events;
+    uint64_t data;
+} __attribute__((packed)) lemon_epoll_event_t;
+
+// These return a negative error code on failure
+int lemon_epoll_create();
+int lemon_epoll_ctl(int epfd, int op, int fd, lemon_epoll_event_t* event);
+// Wait up to timeout ms for an event, 0 returns immediately and -1 waits indefinitely
+int lemon_epoll_wait(int epfd, lemon_epoll_event_t* events, int maxEvents, long timeout);
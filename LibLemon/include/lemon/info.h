@@ -6,17 +6,26 @@
 
 #include <stdint.h>
 
+#define LEMON_SYSINFO_MAX_CPUS 64
+
+typedef struct {
+	uint32_t runnable; // Threads running or waiting to run on the CPU
+	uint32_t load; // Average number of runnable threads, 100 per thread
+	uint32_t utilisation; // Percentage of recent time spent running threads
+} lemon_cpu_load_t;
+
 typedef struct {
 	uint64_t totalMem;
 	uint64_t usedMem;
 	uint16_t cpuCount;
+	lemon_cpu_load_t cpuLoad[LEMON_SYSINFO_MAX_CPUS];
 } lemon_sysinfo_t;
 
 namespace Lemon{
 	/////////////////////////////
     /// \brief Get information about the system
     ///
-    /// Fill a lemon_sysinfo struct with information about memory and processor(s).
+    /// Fill a lemon_sysinfo struct with information about memory and processor(s), including the load on each processor.
     ///
     /// \return lemon_sysinfo_t
     /////////////////////////////
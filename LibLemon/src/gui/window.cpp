@@ -15,6 +15,7 @@ namespace Lemon::GUI{
         sockAddr.sun_family = AF_UNIX;
 
         msgClient.Connect(sockAddr, sizeof(sockaddr_un)); // Connect to Window Manager
+        msgClient.EnableRing(); // Events and commands go through shared memory if the window manager accepts it
 
         LemonMessage* createMsg = (LemonMessage*)malloc(sizeof(LemonMessage) + sizeof(WMCommand) + strlen(title));
     
@@ -174,11 +175,14 @@ namespace Lemon::GUI{
     }
     
     bool Window::PollEvent(LemonEvent& ev){
-        if(auto m = msgClient.Poll()){
-            if(m->protocol == LEMON_MESSAGE_PROTOCOL_WMEVENT){
-                ev = *((LemonEvent*)m->data);
-                return true;
+        if(const LemonMessage* m = msgClient.Peek()){ // Read in place, events are small and frequent
+            bool isEvent = m->protocol == LEMON_MESSAGE_PROTOCOL_WMEVENT;
+            if(isEvent){
+                ev = *((const LemonEvent*)m->data);
             }
+
+            msgClient.Consume();
+            return isEvent;
         }
 
         return false;
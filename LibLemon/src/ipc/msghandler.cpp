@@ -1,7 +1,10 @@
 #include <core/message.h>
 #include <core/msghandler.h>
+#include <core/sharedmem.h>
 #include <lemon/util.h>
+#include <lemon/epoll.h>
 
+#include <algorithm>
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -18,6 +21,11 @@ namespace Lemon {
     }
 
     MessageClient::~MessageClient(){
+        if(channel){
+            Lemon::UnmapSharedMemory(channel, channelKey);
+            Lemon::DestroySharedMemory(channelKey);
+        }
+
         close(sock.fd);
     }
 
@@ -40,6 +48,22 @@ namespace Lemon {
             close(sock.fd);
             assert(!e);
         }
+
+        epollFd = lemon_epoll_create();
+        assert(epollFd >= 0);
+
+        lemon_epoll_event_t ev = { .events = EPOLLIN, .data = static_cast<uint64_t>(sock.fd) };
+        e = lemon_epoll_ctl(epollFd, EPOLL_CTL_ADD, sock.fd, &ev);
+        assert(!e);
+    }
+
+    MessageServer::~MessageServer(){
+        for(auto& ring : rings){
+            Lemon::UnmapSharedMemory(ring.second.channel, ring.second.key);
+        }
+
+        close(epollFd);
+        close(sock.fd);
     }
 
     void MessageClient::Connect(sockaddr_un& address, socklen_t len){
@@ -52,41 +76,115 @@ namespace Lemon {
         }
     }
 
-    std::shared_ptr<LemonMessageInfo> MessageServer::Poll(){
-    retry:
-        int fd = 0;
-        while((fd = accept(sock.fd, nullptr, nullptr)) > 0){
-            fds.push_back({ .fd = fd, .events = POLLIN, .revents = 0 });
+    int MessageClient::EnableRing(){
+        if(channel){
+            return 0;
+        }
+
+        uint64_t key = Lemon::CreateSharedMemory(sizeof(MessageChannel), SMEM_FLAGS_SHARED);
+        MessageChannel* newChannel = key ? reinterpret_cast<MessageChannel*>(Lemon::MapSharedMemory(key)) : nullptr;
+        if(!newChannel){
+            if(key){
+                Lemon::DestroySharedMemory(key);
+            }
+            return -1;
+        }
+
+        newChannel->magic = MESSAGE_CHANNEL_MAGIC;
+        newChannel->ringSize = MESSAGE_RING_SIZE;
+        newChannel->toServer.Initialize();
+        newChannel->toClient.Initialize();
+
+        Send(Message(LEMON_MESSAGE_PROTOCOL_RING, key));
+
+        // Wait for the reply, keeping anything the server sent before it
+        std::deque<std::shared_ptr<LemonMessage>> early;
+        std::shared_ptr<LemonMessage> reply;
+        while(!reply){
+            std::shared_ptr<LemonMessage> m = Poll();
+            if(!m){
+                pollfd p = sock;
+                if(poll(&p, 1, -1) < 0 || (p.revents & POLLHUP)){
+                    break;
+                }
+                continue;
+            }
+
+            if(m->protocol == LEMON_MESSAGE_PROTOCOL_RING){
+                reply = m;
+            } else {
+                early.push_back(m);
+            }
+        }
+        queue.insert(queue.begin(), early.begin(), early.end());
+
+        if(!reply || reply->length < sizeof(int32_t) || *reinterpret_cast<int32_t*>(reply->data)){
+            Lemon::UnmapSharedMemory(newChannel, key);
+            Lemon::DestroySharedMemory(key);
+            return -1;
         }
 
+        channel = newChannel;
+        channelKey = key;
+        return 0;
+    }
+
+    std::shared_ptr<LemonMessageInfo> MessageServer::Poll(){
+    retry:
         if(queue.size() > 0){
             auto element = queue.front();
             queue.pop_front();
             return element;
         }
 
-        if(!fds.size()) {
-            return std::shared_ptr<LemonMessageInfo>(nullptr);
+        if(auto m = PollRings()){
+            return m;
         }
 
-        int evCount = poll(fds.data(), fds.size(), 0);
+        // Only clients with something to read (or that hung up) are reported,
+        // anything not handled this time is level triggered and reported again
+        lemon_epoll_event_t events[16];
+        int evCount = lemon_epoll_wait(epollFd, events, 16, 0);
         if(evCount > 0){
-            for(size_t i = 0; i < fds.size(); i++){
-                if(fds[i].revents & (POLLNVAL | POLLHUP)){
-                    int fd = fds[i].fd;
-                    fds.erase(fds.begin() + i);
+            for(int i = 0; i < evCount; i++){
+                int clientFd = static_cast<int>(events[i].data);
+
+                if(clientFd == sock.fd){
+                    int fd = 0;
+                    while((fd = accept(sock.fd, nullptr, nullptr)) > 0){
+                        lemon_epoll_event_t ev = { .events = EPOLLIN, .data = static_cast<uint64_t>(fd) };
+                        lemon_epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev);
+                    }
+                    continue;
+                }
+
+                auto ring = rings.find(clientFd);
+                if(ring != rings.end() && (!(events[i].events & EPOLLHUP) || ring->second.channel->toServer.Peek())){
+                    // Nothing but nudges come through the socket once a client uses a channel,
+                    // and the hangup is only handled once everything the client sent has been read
+                    ring->second.channel->toServer.DrainNudges(clientFd, ring->second.nudgesRead);
+                    if(!ring->second.awake){
+                        ring->second.awake = true;
+                        awakeRings.push_back(clientFd);
+                    }
+                    continue;
+                }
+
+                if(events[i].events & EPOLLHUP){
+                    lemon_epoll_ctl(epollFd, EPOLL_CTL_DEL, clientFd, nullptr);
+                    CloseRing(clientFd);
                     
                     std::shared_ptr<LemonMessageInfo> newMsg = std::shared_ptr<LemonMessageInfo>((LemonMessageInfo*)malloc(sizeof(LemonMessageInfo)));
                     newMsg->msg.protocol = 0; // Disconnected
-                    newMsg->clientFd = fd;
+                    newMsg->clientFd = clientFd;
 
                     return newMsg;
                 }
 
-                if(!(fds[i].revents & POLLIN)) continue; // We only care about POLLIN
+                if(!(events[i].events & EPOLLIN)) continue; // We only care about EPOLLIN
                 LemonMessage msg;
 
-                ssize_t len = recv(fds[i].fd, &msg, sizeof(LemonMessage), 0);
+                ssize_t len = recv(clientFd, &msg, sizeof(LemonMessage), 0);
                 if(len < static_cast<ssize_t>(sizeof(LemonMessage))){
                     printf("invalid length: %ld\n", len);
                     continue;
@@ -95,7 +193,7 @@ namespace Lemon {
                 if(msg.magic != LEMON_MESSAGE_MAGIC){
                     printf("Invalid magic: %x, discarding data.\n", msg.magic);
                     while(msg.magic != LEMON_MESSAGE_MAGIC && len >= static_cast<ssize_t>(sizeof(LemonMessage))){
-                        len = recv(fds[i].fd, &msg, sizeof(msg), MSG_DONTWAIT); // Discard everything until we find a message
+                        len = recv(clientFd, &msg, sizeof(msg), MSG_DONTWAIT); // Discard everything until we find a message
                     }
                 }
 
@@ -106,26 +204,129 @@ namespace Lemon {
                 
                 std::shared_ptr<LemonMessageInfo> newMsg((LemonMessageInfo*)malloc(sizeof(LemonMessageInfo) + msg.length));
                 newMsg->msg = msg;
-                newMsg->clientFd = fds[i].fd;
-                len = recv(fds[i].fd, newMsg->msg.data, msg.length, 0);
+                newMsg->clientFd = clientFd;
+                len = recv(clientFd, newMsg->msg.data, msg.length, 0);
 
                 if(len < msg.length){
                     printf("Warning: invalid message length %u. Only read %ld bytes\n", msg.length, len);
                     continue;
                 }
 
+                if(msg.protocol == LEMON_MESSAGE_PROTOCOL_RING && msg.length >= sizeof(uint64_t)){
+                    AcceptRing(clientFd, *reinterpret_cast<uint64_t*>(newMsg->msg.data));
+                    continue;
+                }
+
                 queue.push_back(newMsg);
             }
 
             // Check for new messages
-            if(queue.size() > 0)
+            if(queue.size() > 0 || awakeRings.size() > 0)
                 goto retry;
         }
 
         return std::shared_ptr<LemonMessageInfo>(nullptr);
     }
 
+    void MessageServer::AcceptRing(int fd, uint64_t key){
+        CloseRing(fd);
+
+        int32_t status = 0;
+        MessageChannel* channel = reinterpret_cast<MessageChannel*>(Lemon::MapSharedMemory(key));
+        if(!channel || channel->magic != MESSAGE_CHANNEL_MAGIC || channel->ringSize != MESSAGE_RING_SIZE){
+            if(channel){
+                Lemon::UnmapSharedMemory(channel, key);
+            }
+            status = -1;
+        }
+
+        Send(Message(LEMON_MESSAGE_PROTOCOL_RING, status), fd); // Still over the socket, everything after goes through the channel
+
+        if(!status){
+            rings.emplace(fd, RingClient{channel, key, 0, true});
+            awakeRings.push_back(fd);
+        }
+    }
+
+    void MessageServer::CloseRing(int fd){
+        auto ring = rings.find(fd);
+        if(ring == rings.end()){
+            return;
+        }
+
+        Lemon::UnmapSharedMemory(ring->second.channel, ring->second.key);
+        rings.erase(ring);
+
+        auto it = std::find(awakeRings.begin(), awakeRings.end(), fd);
+        if(it != awakeRings.end()){
+            awakeRings.erase(it);
+        }
+    }
+
+    std::shared_ptr<LemonMessageInfo> MessageServer::PollRings(){
+        while(awakeRings.size() > 0){
+            int fd = awakeRings.front();
+            RingClient& client = rings.at(fd);
+            MessageRing& ring = client.channel->toServer;
+
+            LemonMessage* msg = ring.Peek();
+            if(!msg && !ring.Sleep(MessageRingSocket)){
+                client.awake = false; // Until the client nudges the socket
+                awakeRings.pop_front();
+                continue;
+            } else if(!msg && !(msg = ring.Peek())){
+                continue;
+            }
+
+            std::shared_ptr<LemonMessageInfo> newMsg((LemonMessageInfo*)malloc(sizeof(LemonMessageInfo) + msg->length));
+            memcpy(&newMsg->msg, msg, sizeof(LemonMessage) + msg->length);
+            newMsg->clientFd = fd;
+            ring.Consume();
+
+            awakeRings.pop_front(); // One message at a time from each client
+            awakeRings.push_back(fd);
+
+            return newMsg;
+        }
+
+        return std::shared_ptr<LemonMessageInfo>(nullptr);
+    }
+
+    bool MessageServer::SendRing(int fd, const void* msg, uint32_t length){
+        auto ring = rings.find(fd);
+        if(ring == rings.end()){
+            return false;
+        }
+
+        MessageRing& toClient = ring->second.channel->toClient;
+        if(!toClient.Write(msg, length)){
+            printf("Warning: Client %d is not keeping up, dropped %u bytes\n", fd, length); // Same as a full socket
+        }
+        toClient.Notify(fd);
+
+        return true;
+    }
+
     std::shared_ptr<LemonMessage> MessageClient::Poll(){
+        if(peeked){
+            return std::move(peeked);
+        }
+
+        if(channel){
+            const LemonMessage* msg = Peek();
+            if(!msg){
+                return std::shared_ptr<LemonMessage>(nullptr);
+            } else if(peeked){
+                return std::move(peeked); // From the queue
+            }
+
+            std::shared_ptr<LemonMessage> newMsg((LemonMessage*)malloc(sizeof(LemonMessage) + msg->length));
+            memcpy(newMsg.get(), msg, sizeof(LemonMessage) + msg->length);
+            Consume();
+
+            return newMsg;
+        }
+
     retry:
         if(queue.size() > 0){
             auto element = queue.front();
@@ -183,6 +384,14 @@ namespace Lemon {
     }
 
     std::shared_ptr<LemonMessage> MessageClient::PollSync(){
+        if(channel){
+            std::shared_ptr<LemonMessage> m;
+            while(!(m = Poll())){
+                channel->toClient.Wait();
+            }
+            return m;
+        }
+
     retry:
         if(queue.size() > 0){
             auto element = queue.front();
@@ -230,10 +439,59 @@ namespace Lemon {
     }
 
     void MessageClient::Wait(){
+        if(channel){
+            if(!Peek()){
+                channel->toClient.Wait();
+            }
+            return;
+        }
+
         char c;
         recv(sock.fd, &c, 0, MSG_PEEK);
     }
 
+    const LemonMessage* MessageClient::Peek(){
+        if(!peeked && queue.size() > 0){
+            peeked = queue.front();
+            queue.pop_front();
+        }
+
+        if(peeked){
+            return peeked.get();
+        } else if(!channel){
+            peeked = Poll();
+            return peeked.get();
+        }
+
+        MessageRing& ring = channel->toClient;
+        ring.DrainNudges(sock.fd, nudgesRead);
+
+        if(LemonMessage* msg = ring.Peek()){
+            return msg;
+        } else if(ring.Sleep(MessageRingSocket)){ // The caller may go on to poll the socket
+            return ring.Peek();
+        }
+
+        return nullptr;
+    }
+
+    void MessageClient::Consume(){
+        if(peeked){
+            peeked.reset();
+        } else if(channel){
+            channel->toClient.Consume();
+        }
+    }
+
+    void MessageClient::SendRing(const void* msg, uint32_t length){
+        while(!channel->toServer.Write(msg, length)){
+            channel->toServer.Notify(sock.fd);
+            Lemon::Yield(); // Wait for the server to make room
+        }
+
+        channel->toServer.Notify(sock.fd);
+    }
+
     void MessageServer::Send(LemonMessage* msg, int fd){
         if(fd < 0) {
             printf("Invalid fd: %i\n", fd);
@@ -242,6 +500,10 @@ namespace Lemon {
 
         msg->magic = LEMON_MESSAGE_MAGIC;
 
+        if(SendRing(fd, msg, msg->length + sizeof(LemonMessage))){
+            return;
+        }
+
         ssize_t sent = send(fd, msg, msg->length + sizeof(LemonMessage), MSG_DONTWAIT);
 
         if(sent <= 0){
@@ -257,6 +519,10 @@ namespace Lemon {
             return;
         }
 
+        if(SendRing(fd, msg.data(), msg.length())){
+            return;
+        }
+
         ssize_t sent = send(fd, msg.data(), msg.length(), MSG_DONTWAIT);
 
         if(sent < 0){
@@ -269,6 +535,11 @@ namespace Lemon {
     void MessageClient::Send(LemonMessage* msg){
         msg->magic = LEMON_MESSAGE_MAGIC;
 
+        if(channel){
+            SendRing(msg, msg->length + sizeof(LemonMessage));
+            return;
+        }
+
         ssize_t sent = send(sock.fd, msg, msg->length + sizeof(LemonMessage), 0);
 
         if(sent <= 0){
@@ -279,6 +550,11 @@ namespace Lemon {
     }
 
     void MessageClient::Send(const Message& msg){
+        if(channel){
+            SendRing(msg.data(), msg.length());
+            return;
+        }
+
         ssize_t sent = send(sock.fd, msg.data(), msg.length(), 0);
 
         if(sent <= 0){
@@ -289,9 +565,9 @@ namespace Lemon {
     }
 
     std::vector<pollfd> MessageServer::GetFileDescriptors(){
-        std::vector<pollfd> rfds = fds;
-        rfds.push_back(sock);
-        return rfds;
+        std::vector<pollfd> v;
+        v.push_back({ .fd = epollFd, .events = POLLIN, .revents = 0 }); // Readable whilst any client or connection is pending
+        return v;
     }
 
     std::vector<pollfd> MessageClient::GetFileDescriptors(){
@@ -300,23 +576,25 @@ namespace Lemon {
         return v;
     }
 
-    void MessageMultiplexer::AddSource(MessageHandler& handler){
-        handlers.push_back(&handler);
+    MessageMultiplexer::MessageMultiplexer(){
+        epollFd = lemon_epoll_create();
+        assert(epollFd >= 0);
     }
 
-    bool MessageMultiplexer::PollSync(){
-        std::vector<pollfd> fds;
+    MessageMultiplexer::~MessageMultiplexer(){
+        close(epollFd);
+    }
 
-        for(MessageHandler* h : handlers){
-            for(pollfd& f : h->GetFileDescriptors()){
-                f.events |= POLLIN;
-                fds.push_back(f);
-            }
+    void MessageMultiplexer::AddSource(MessageHandler& handler){
+        for(pollfd& f : handler.GetFileDescriptors()){
+            lemon_epoll_event_t ev = { .events = static_cast<uint32_t>(f.events | POLLIN), .data = static_cast<uint64_t>(f.fd) };
+            lemon_epoll_ctl(epollFd, EPOLL_CTL_ADD, f.fd, &ev);
         }
+    }
 
-        int evCount = 0;
-        
-        evCount = poll(fds.data(), fds.size(), -1);
+    bool MessageMultiplexer::PollSync(){
+        lemon_epoll_event_t ev;
+        int evCount = lemon_epoll_wait(epollFd, &ev, 1, -1); // Level triggered, the sources are polled by the caller
 
         if(evCount > 0){
             return true;
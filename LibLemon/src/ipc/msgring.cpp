@@ -0,0 +1,127 @@
+#include <core/msgring.h>
+
+#include <lemon/syscall.h>
+
+#include <string.h>
+#include <sys/socket.h>
+
+namespace Lemon{
+    static inline uint32_t RecordSize(uint32_t length){
+        return (length + 7) & ~7U; // Keep headers aligned
+    }
+
+    void MessageRing::Initialize(){
+        head = tail = 0;
+        doorbell = 0;
+        sleeping = MessageRingAwake;
+        nudges = 0;
+    }
+
+    bool MessageRing::Write(const void* msg, uint32_t length){
+        uint32_t size = RecordSize(length);
+        uint32_t position = tail;
+        uint32_t offset = position & (MESSAGE_RING_SIZE - 1);
+        uint32_t contiguous = MESSAGE_RING_SIZE - offset;
+
+        uint32_t needed = (size > contiguous) ? (size + contiguous) : size;
+        if(MESSAGE_RING_SIZE - (position - __atomic_load_n(&head, __ATOMIC_ACQUIRE)) < needed){
+            return false;
+        }
+
+        if(size > contiguous){
+            reinterpret_cast<LemonMessage*>(&buffer[offset])->magic = MESSAGE_RING_PADDING;
+            position += contiguous;
+            offset = 0;
+        }
+
+        memcpy(&buffer[offset], msg, length);
+        reinterpret_cast<LemonMessage*>(&buffer[offset])->magic = LEMON_MESSAGE_MAGIC;
+
+        __atomic_store_n(&tail, position + size, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    void MessageRing::Notify(int sock){
+        // Order the tail store in Write before the load of sleeping, pairs with the store and Peek in Sleep
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        if(__atomic_load_n(&sleeping, __ATOMIC_SEQ_CST) == MessageRingAwake){
+            return; // Avoid taking the cache line for writing on every message
+        }
+
+        int how = __atomic_exchange_n(&sleeping, MessageRingAwake, __ATOMIC_SEQ_CST);
+        if(how == MessageRingFutex){
+            __atomic_add_fetch(&doorbell, 1, __ATOMIC_SEQ_CST);
+            syscall(SYS_FUTEX_WAKE, &doorbell, 0, 0, 0, 0);
+        } else if(how == MessageRingSocket){
+            char c = 0;
+            if(send(sock, &c, 1, MSG_DONTWAIT) == 1){
+                __atomic_add_fetch(&nudges, 1, __ATOMIC_RELEASE); // Only once the byte can be read
+            }
+        }
+    }
+
+    LemonMessage* MessageRing::Peek(){
+        uint32_t position = head;
+        if(position == __atomic_load_n(&tail, __ATOMIC_ACQUIRE)){
+            return nullptr;
+        }
+
+        LemonMessage* msg = reinterpret_cast<LemonMessage*>(&buffer[position & (MESSAGE_RING_SIZE - 1)]);
+        if(msg->magic == MESSAGE_RING_PADDING){
+            position += MESSAGE_RING_SIZE - (position & (MESSAGE_RING_SIZE - 1));
+            __atomic_store_n(&head, position, __ATOMIC_RELEASE);
+
+            if(position == __atomic_load_n(&tail, __ATOMIC_ACQUIRE)){
+                return nullptr;
+            }
+
+            msg = reinterpret_cast<LemonMessage*>(buffer);
+        }
+
+        uint32_t size = RecordSize(sizeof(LemonMessage) + msg->length);
+        if(msg->magic != LEMON_MESSAGE_MAGIC || (position & (MESSAGE_RING_SIZE - 1)) + size > MESSAGE_RING_SIZE
+                || __atomic_load_n(&tail, __ATOMIC_ACQUIRE) - position < size){
+            __atomic_store_n(&head, __atomic_load_n(&tail, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE); // Garbage, a misbehaving producer only loses its own messages
+            return nullptr;
+        }
+
+        return msg;
+    }
+
+    void MessageRing::Consume(){
+        if(LemonMessage* msg = Peek()){
+            __atomic_store_n(&head, head + RecordSize(sizeof(LemonMessage) + msg->length), __ATOMIC_RELEASE);
+        }
+    }
+
+    bool MessageRing::Sleep(int how){
+        __atomic_store_n(&sleeping, how, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST); // Pairs with the fence in Notify
+
+        return Peek(); // The producer may have written before it could see that we are sleeping
+    }
+
+    void MessageRing::Wait(){
+        int bell = __atomic_load_n(&doorbell, __ATOMIC_ACQUIRE);
+        if(Sleep(MessageRingFutex)){
+            return;
+        }
+
+        syscall(SYS_FUTEX_WAIT, &doorbell, bell, 0, 0, 0); // Returns straight away if the doorbell has rung since
+    }
+
+    void MessageRing::DrainNudges(int sock, uint32_t& nudgesRead){
+        uint32_t pending = __atomic_load_n(&nudges, __ATOMIC_ACQUIRE) - nudgesRead;
+        while(pending){
+            char buf[32];
+            ssize_t len = recv(sock, buf, pending < sizeof(buf) ? pending : sizeof(buf), MSG_DONTWAIT);
+            if(len <= 0){
+                break;
+            }
+
+            nudgesRead += len;
+            pending -= len;
+        }
+    }
+}
@@ -0,0 +1,21 @@
+#include <lemon/syscall.h>
+#include <lemon/epoll.h>
+
+// Not yet in the system syscall header
+#ifndef SYS_EPOLL_CREATE
+    #define SYS_EPOLL_CREATE 80
+    #define SYS_EPOLL_CTL 81
+    #define SYS_EPOLL_WAIT 82
+#endif
+
+int lemon_epoll_create(){
+    return syscall(SYS_EPOLL_CREATE, 0, 0, 0, 0, 0);
+}
+
+int lemon_epoll_ctl(int epfd, int op, int fd, lemon_epoll_event_t* event){
+    return syscall(SYS_EPOLL_CTL, epfd, op, fd, (uintptr_t)event, 0);
+}
+
+int lemon_epoll_wait(int epfd, lemon_epoll_event_t* events, int maxEvents, long timeout){
+    return syscall(SYS_EPOLL_WAIT, epfd, (uintptr_t)events, maxEvents, timeout, 0);
+}